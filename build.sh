@@ -1,6 +1,6 @@
 SRC=$(dirname "$(readlink -f "$0")")/
 #PRE=$HOME/buildroot/host/bin/x86_64-buildroot-linux-gnu-
-OPT="-O2 -fno-plt"
+OPT="-O2 -fno-plt -fno-omit-frame-pointer"
 EOPT=-fno-pie
 STD="-std=c11"
 CC=gcc
@@ -18,6 +18,17 @@ ${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic -fPIC   ${SRC}src/pchecker_getti
 ${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic -fPIC   ${SRC}src/pchecker_heap.c  -ldl $LDATOMIC -shared -o libpchecker_heap.so $LDOPT
 ${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic -fPIC   ${SRC}src/pchecker_heap_glibc.c  -ldl $LDATOMIC -shared -o libpchecker_heap-glibc.so $LDOPT
 ${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic -fPIC   ${SRC}src/pchecker_heap_musl.c  -ldl $LDATOMIC -shared -o libpchecker_heap-musl.so $LDOPT
+${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic -fPIC   ${SRC}src/pchecker_sleep.c  -ldl $LDATOMIC -shared -o libpchecker_sleep.so $LDOPT
+${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic -fPIC   ${SRC}src/pchecker_mmap.c  -ldl $LDATOMIC -shared -o libpchecker_mmap.so $LDOPT
+${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic -fPIC   ${SRC}src/pchecker_stdio.c  -ldl $LDATOMIC -shared -o libpchecker_stdio.so $LDOPT
+${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic -fPIC   ${SRC}src/pchecker_dl.c  -ldl $LDATOMIC -shared -o libpchecker_dl.so $LDOPT
+${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic -fPIC -fexceptions ${SRC}src/pchecker_throw.c  -ldl $LDATOMIC -shared -o libpchecker_throw.so $LDOPT
+${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic -fPIC -DPCHECKER_COMBINED ${SRC}src/pchecker_all.c ${SRC}src/pchecker_heap.c ${SRC}src/pchecker_gettime.c ${SRC}src/pchecker_mmap.c ${SRC}src/pchecker_sleep.c ${SRC}src/pchecker_stdio.c -ldl $LDATOMIC -shared -o libpchecker_all.so $LDOPT
+
+${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic -I${SRC}src ${SRC}tools/pchecker_analyze.c -o pchecker_analyze $LDOPT
+${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic -I${SRC}src ${SRC}tools/pchecker_vclock.c -o pchecker_vclock $LDOPT
+${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic -I${SRC}src ${SRC}tools/pchecker_replay.c -o pchecker_replay $LDOPT
 
 ${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic -fPIC   ${SRC}test/pchecker_wrapper.c -shared -o libtestpchecker_wrapper.so $LDOPT
-${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic $EOPT ${SRC}test/testpchecker.c -no-pie -L. -ltestpchecker_wrapper -o testpchecker $LDOPT
+cp ${SRC}test/testpchecker.supp .
+${PRE}$CC -g2 $OPT $STD -Wall -Wextra -pedantic $EOPT -I${SRC}src ${SRC}test/testpchecker.c -no-pie -pthread -L. -ltestpchecker_wrapper -ldl -o testpchecker $LDOPT
@@ -44,6 +44,14 @@ typedef char assert_functionpointersize[(sizeof(void *) == sizeof(void (*)())) ?
         __asm__ __volatile__("" ::: "memory"); \
     } while (0)
 
+/* the checkers are preloaded and always part of the static TLS block,
+ * accessing variables must never allocate (__tls_get_addr might) */
+#define VAR_TLS __thread __attribute__((tls_model("initial-exec")))
+
+/* the address the interposed function returns to,
+ * only meaningful if used directly in the interposed function */
+#define PCHECKER_CALLSITE() __builtin_return_address(0)
+
 #else /* if __GNUC__ */
 #include <stdlib.h>
 #include <string.h>
@@ -52,6 +60,8 @@ typedef char assert_functionpointersize[(sizeof(void *) == sizeof(void (*)())) ?
 
 #define MEM_BARRIER()
 
+#define PCHECKER_CALLSITE() ((void *)0)
+
 #endif /* if __GNUC__ */
 
 #ifndef EINVAL
@@ -60,11 +70,35 @@ typedef char assert_functionpointersize[(sizeof(void *) == sizeof(void (*)())) ?
 #if !defined(FUN_INLINE)
 #define FUN_INLINE
 #endif
+#if !defined(VAR_TLS)
+#if __STDC_VERSION__ >= 201112L
+#define VAR_TLS _Thread_local
+#elif __cplusplus >= 201103L
+#define VAR_TLS thread_local
+#else
+#define VAR_TLS /* no thread local storage, shared by all threads */
+#endif
+#endif
 #if !defined(DSO_PUBLIC)
 #define DSO_PUBLIC
 #define DSO_HIDDEN
 #endif
 
+/* PCHECKER_COMBINED links several checkers into one DSO (pchecker_all.c).
+ * The definitions every checker carries in the headers are weak there,
+ * the linker keeps one of each. The function tables and resolve states go
+ * to one section, so the data the interposers read sits in a few adjacent
+ * cache lines instead of a page per checker DSO. */
+#if defined(PCHECKER_COMBINED) && __GNUC__
+#define DSO_SHARED __attribute__((weak))
+#define VAR_SHARED_HIDDEN __attribute__((weak, visibility("hidden")))
+#define VAR_TABLE __attribute__((section("pchecker_tables"), aligned(64)))
+#else
+#define DSO_SHARED
+#define VAR_SHARED_HIDDEN static
+#define VAR_TABLE
+#endif
+
 /* silence type warnings and be pedantically C conform */
 #define COPY_PF(r, t, p)                       \
     {                                          \
@@ -81,6 +115,11 @@ typedef char assert_functionpointersize[(sizeof(void *) == sizeof(void (*)())) ?
 #define VAR_ATOMIC_FLAG atomic_flag
 #define VAR_ATOMIC_FLAG_TESTSET(v) atomic_flag_test_and_set(&v)
 #define VAR_ATOMIC_FLAG_CLEAR(v) atomic_flag_clear(&v)
+#define VAR_ATOMIC_LOAD(v) atomic_load_explicit(&(v), memory_order_acquire)
+#define VAR_ATOMIC_STORE(v, n) atomic_store_explicit(&(v), n, memory_order_release)
+#define VAR_ATOMIC_FETCH_ADD(v, n) atomic_fetch_add_explicit(&(v), n, memory_order_relaxed)
+#define VAR_ATOMIC_EXCHANGE(v, n) atomic_exchange(&(v), n)
+#define VAR_ATOMIC_CAS(v, pE, n) atomic_compare_exchange_weak(&(v), pE, n)
 
 #elif __cplusplus >= 201103L
 #include <atomic>
@@ -88,6 +127,11 @@ typedef char assert_functionpointersize[(sizeof(void *) == sizeof(void (*)())) ?
 #define VAR_ATOMIC_FLAG std::atomic_flag
 #define VAR_ATOMIC_FLAG_TESTSET(v) std::atomic_flag_test_and_set(&v)
 #define VAR_ATOMIC_FLAG_CLEAR(v) std::atomic_flag_clear(&v)
+#define VAR_ATOMIC_LOAD(v) std::atomic_load_explicit(&(v), std::memory_order_acquire)
+#define VAR_ATOMIC_STORE(v, n) std::atomic_store_explicit(&(v), n, std::memory_order_release)
+#define VAR_ATOMIC_FETCH_ADD(v, n) std::atomic_fetch_add_explicit(&(v), n, std::memory_order_relaxed)
+#define VAR_ATOMIC_EXCHANGE(v, n) std::atomic_exchange(&(v), n)
+#define VAR_ATOMIC_CAS(v, pE, n) std::atomic_compare_exchange_weak(&(v), pE, n)
 
 #else
 /* the compiler will not create cpu memory barrier instructions,
@@ -111,6 +155,15 @@ static FUN_INLINE void v_atomic_flag_clear(volatile int *v)
 
 #define VAR_ATOMIC_FLAG_TESTSET(v) v_atomic_flag_test_and_set(&v)
 #define VAR_ATOMIC_FLAG_CLEAR(v) v_atomic_flag_clear(&v)
+
+#if __GNUC__
+#define VAR_ATOMIC_LOAD(v) __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define VAR_ATOMIC_STORE(v, n) __atomic_store_n(&(v), n, __ATOMIC_RELEASE)
+#define VAR_ATOMIC_FETCH_ADD(v, n) __atomic_fetch_add(&(v), n, __ATOMIC_RELAXED)
+#define VAR_ATOMIC_EXCHANGE(v, n) __atomic_exchange_n(&(v), n, __ATOMIC_SEQ_CST)
+#define VAR_ATOMIC_CAS(v, pE, n) \
+    __atomic_compare_exchange_n(&(v), pE, n, 1, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#endif
 #endif
 
 #ifdef __cplusplus
@@ -124,9 +177,32 @@ static struct resolve_state {
     VAR_ATOMIC(int) alldone;
     VAR_ATOMIC(int) state;
     VAR_ATOMIC_FLAG lock;
-
-    pf_checkassert_t pf_checkassert;
-} s_ResolveState;
+} s_ResolveState VAR_TABLE;
+
+/* the assert hook, a combined DSO looks it up once for all checkers */
+struct assert_hook {
+    pf_checkassert_t pf;
+    int found;
+};
+VAR_SHARED_HIDDEN struct assert_hook pchecker_assert_hook VAR_TABLE;
+
+/* a checker linked into the combined DSO lists its table in the section
+ * pchecker_checkers, the names are in the order of the table */
+struct pchecker_checker {
+    const char *const *pNames;
+    pf_void_t *pTable;
+    unsigned count;
+    struct resolve_state *pState;
+};
+#if defined(PCHECKER_COMBINED) && __GNUC__
+#define PCHECKER_REGISTER(table)                                                           \
+    static const struct pchecker_checker s_Checker                                         \
+        __attribute__((section("pchecker_checkers"), used, aligned(sizeof(void *)))) = {     \
+            &s_FunctionNames, (pf_void_t *)&(table), sizeof(table) / sizeof(pf_void_t), \
+            &s_ResolveState}
+#else
+#define PCHECKER_REGISTER(table) struct pchecker_checker
+#endif
 
 static FUN_INLINE int initIsDone()
 {
@@ -140,16 +216,21 @@ static FUN_INLINE void setInitIsDone()
     MEM_BARRIER();
 }
 
-static FUN_INLINE int setState(int set)
+static FUN_INLINE int setStateOf(struct resolve_state *pState, int set)
 {
     /* at least prevent the compiler from reordering */
     MEM_BARRIER();
     if (set) {
-        s_ResolveState.state = set;
+        pState->state = set;
         MEM_BARRIER();
         return set;
     }
-    return s_ResolveState.state;
+    return pState->state;
+}
+
+static FUN_INLINE int setState(int set)
+{
+    return setStateOf(&s_ResolveState, set);
 }
 
 static FUN_INLINE int resolveIsDone()
@@ -183,23 +264,50 @@ static int getassert_function(int state)
     void *pf;
 
     if (state == 0) {
-        s_ResolveState.pf_checkassert = &noCheck;
+        if (!pchecker_assert_hook.pf)
+            pchecker_assert_hook.pf = &noCheck;
         return 0;
     }
+    if (pchecker_assert_hook.found)
+        return 1;
     pf = dlsym(RTLD_DEFAULT, PCHECKER_CHECKASSERT_NAME);
     if (pf) {
-        COPY_PF(s_ResolveState.pf_checkassert, pf_checkassert_t, pf);
+        COPY_PF(pchecker_assert_hook.pf, pf_checkassert_t, pf);
+        pchecker_assert_hook.found = 1;
         return 1;
     }
 
     return 0;
 }
 
-static FUN_INLINE void callAssertFunction(int check)
+/* nesting depth of pchecker_rt_enter() for the current thread.
+ * The symbol is public, the dynamic linker binds all checker DSOs to the
+ * definition in the first one loaded, so they share one counter. */
+DSO_PUBLIC DSO_SHARED VAR_TLS unsigned pchecker_rt_depth;
+
+DSO_PUBLIC void pchecker_rt_enter(void);
+DSO_PUBLIC void pchecker_rt_leave(void);
+
+DSO_SHARED void pchecker_rt_enter(void)
+{
+    ++pchecker_rt_depth;
+}
+
+DSO_SHARED void pchecker_rt_leave(void)
+{
+    if (pchecker_rt_depth)
+        --pchecker_rt_depth;
+}
+
+/* returns nonzero if called inside a section marked with pchecker_rt_enter(),
+ * the caller should report the call */
+static FUN_INLINE int callAssertFunction(int check)
 {
-    pf_checkassert_t pf = s_ResolveState.pf_checkassert;
+    int inSection = pchecker_rt_depth != 0;
+    pf_checkassert_t pf = pchecker_assert_hook.pf;
     if (!check || pf)
         (*pf)();
+    return inSection;
 }
 
 #ifdef __cplusplus
@@ -0,0 +1,70 @@
+/*
+ * the heap, gettime, mmap, sleep and stdio checkers in one DSO.
+ *
+ * The checkers are compiled with PCHECKER_COMBINED and linked together
+ * with this file, which has to come first (see build.sh). Each checker
+ * lists its function table in the section pchecker_checkers, the
+ * constructor below resolves all of them in one pass before the
+ * constructors of the checkers run, those then find the work done.
+ *
+ * The definitions every checker carries (RT sections, scheduling cache,
+ * thread registry, assert hook) exist once, the tables and resolve states
+ * are adjacent in the section pchecker_tables and the thread local
+ * variables of all checkers are in the one static TLS block of this DSO.
+ *
+ * The dl checker is not part of it, it interposes the loader functions the
+ * resolve pass uses. Preload libpchecker_dl.so in addition if needed.
+ */
+
+#define PCHECKER_NAME "all"
+
+#include "pchecker.h"
+
+enum {
+    eMaxTableSize = 32
+};
+
+extern const struct pchecker_checker __start_pchecker_checkers[] DSO_HIDDEN;
+extern const struct pchecker_checker __stop_pchecker_checkers[] DSO_HIDDEN;
+
+/* same priority as the constructors of the checkers, this file is linked
+ * first so its constructor runs before them */
+__attribute__((__constructor__(101))) static void callResolveAll()
+{
+    const struct pchecker_checker *p;
+    int found;
+
+    getassert_function(0);
+    found = getassert_function(1);
+
+    for (p = __start_pchecker_checkers; p < __stop_pchecker_checkers; ++p) {
+        pf_void_t table[eMaxTableSize];
+        const char *pName = *p->pNames;
+        unsigned index;
+
+        if (p->count > eMaxTableSize || setStateOf(p->pState, 0) != 0)
+            continue;
+
+        for (index = 0; index < p->count && *pName != '\0'; ++index) {
+            void *pf = getdelegate_function(pName);
+            if (!pf)
+                break;
+            FUN_MEMCPY(&table[index], &pf, sizeof(pf_void_t));
+
+            while (*pName++ != '\0')
+                ;
+        }
+        /* something missing, the checker tries itself */
+        if (index != p->count)
+            continue;
+
+        /* the heap checker might resolve lazily meanwhile */
+        if (VAR_ATOMIC_FLAG_TESTSET(p->pState->lock))
+            continue;
+        if (setStateOf(p->pState, 0) == 0) {
+            FUN_MEMCPY(p->pTable, table, sizeof(pf_void_t) * p->count);
+            setStateOf(p->pState, found ? 128 : 3);
+        }
+        VAR_ATOMIC_FLAG_CLEAR(p->pState->lock);
+    }
+}
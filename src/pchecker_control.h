@@ -0,0 +1,280 @@
+/*
+ * control socket for changing a checker while the process runs.
+ *
+ * With PCHECKER_CONTROL set to a path prefix each checker DSO listens on
+ * the Unix domain socket <prefix>.<checker>.<pid> (mode 0600), served by
+ * a helper thread at SCHED_OTHER, one connection at a time. Commands are
+ * lines of text, every reply ends with a line "ok" or "error: ...":
+ *
+ *     status              the functions and whether they are checked
+ *     disable <func|all>  no more checks of the function
+ *     enable <func|all>   check it again
+ *     reset               clear the counters (thread table, samples)
+ *     dump                write the current reports to the connection
+ *     sample <ms>         heap checkers: footprint sampling interval
+ *
+ * e.g. echo "disable malloc" | socat - UNIX-CONNECT:/tmp/ctl.heap.4711
+ *
+ * The enabled state is a bit per function in one word that changes
+ * rarely, checkCall loads it before the assert hook. Calls of disabled
+ * functions are still forwarded, counted and traced.
+ */
+
+#ifndef PCHECKER_CONTROL_H
+#define PCHECKER_CONTROL_H
+
+#include "pchecker_util.h"
+#include "pchecker_helper.h"
+#include "pchecker_trace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+    PCHECKER_AF_UNIX = 1,
+    PCHECKER_SOCK_STREAM = 1,
+    PCHECKER_SOCK_CLOEXEC = 02000000
+};
+
+struct pchecker_sockaddr_un {
+    unsigned short family;
+    char path[108];
+};
+
+/* checker specific commands, returns 0 if cmd is not known and < 0 after
+ * writing an error. Also called with "dump" and "reset" after the common part */
+typedef int (*pf_control_command_t)(struct pchecker_out *o, const char *cmd, const char *arg);
+
+static struct control_state {
+    const char *names;
+    unsigned count;
+    pf_control_command_t pfCommand;
+    int fd;
+    VAR_ATOMIC(uint64_t) unchecked; /* bit per function index */
+    struct pchecker_sockaddr_un addr;
+} s_Control;
+
+/* read on every checked call */
+static FUN_INLINE int controlIsUnchecked(unsigned func)
+{
+    return func < 64 && (VAR_ATOMIC_LOAD(s_Control.unchecked) >> func & 1);
+}
+
+static FUN_INLINE void controlWarn(const char *what)
+{
+    struct pchecker_out o;
+    outInit(&o, 2);
+    outStr(&o, "pchecker(" PCHECKER_NAME "): ");
+    outStr(&o, what);
+    outChar(&o, '\n');
+    outFlush(&o);
+}
+
+static FUN_INLINE void controlError(struct pchecker_out *o, const char *what, const char *arg)
+{
+    outStr(o, "error: ");
+    outStr(o, what);
+    if (arg && *arg) {
+        outStr(o, " '");
+        outStr(o, arg);
+        outChar(o, '\'');
+    }
+    outChar(o, '\n');
+}
+
+static FUN_INLINE void controlStatus(struct pchecker_out *o)
+{
+    uint64_t unchecked = VAR_ATOMIC_LOAD(s_Control.unchecked);
+    unsigned i;
+
+    outStr(o, "checker " PCHECKER_NAME ", pid ");
+    outUDec(o, (uint64_t)sysGetPid(), 0);
+    outChar(o, '\n');
+    for (i = 0; i < s_Control.count; ++i) {
+        const char *name = pcheckerNameAt(s_Control.names, i);
+        outStr(o, "  ");
+        outStrCol(o, name, 24);
+        outStr(o, i < 64 && (unchecked >> i & 1) ? "disabled\n" : "enabled\n");
+    }
+}
+
+/* returns 0 if there is no such function */
+static FUN_INLINE int controlSetChecked(const char *name, int checked)
+{
+    uint64_t mask = 0, cur;
+    unsigned i;
+
+    for (i = 0; i < s_Control.count && i < 64; ++i) {
+        if (pcheckerStrEq(name, "all") || pcheckerStrEq(name, pcheckerNameAt(s_Control.names, i)))
+            mask |= (uint64_t)1 << i;
+    }
+    if (!mask)
+        return 0;
+    cur = VAR_ATOMIC_LOAD(s_Control.unchecked);
+    while (!VAR_ATOMIC_CAS(s_Control.unchecked, &cur, checked ? cur & ~mask : cur | mask))
+        ;
+    return 1;
+}
+
+static FUN_INLINE void controlCommand(struct pchecker_out *o, char *line)
+{
+    char *cmd, *arg, *p;
+    int r;
+
+    for (cmd = line; *cmd == ' ' || *cmd == '\t'; ++cmd)
+        ;
+    for (p = cmd; *p && *p != ' ' && *p != '\t'; ++p)
+        ;
+    for (arg = p; *arg == ' ' || *arg == '\t'; ++arg)
+        ;
+    *p = '\0';
+    for (p = arg; *p && *p != ' ' && *p != '\t' && *p != '\r'; ++p)
+        ;
+    *p = '\0';
+    if (!*cmd)
+        return;
+
+    if (pcheckerStrEq(cmd, "status"))
+        controlStatus(o);
+    else if (pcheckerStrEq(cmd, "enable") || pcheckerStrEq(cmd, "disable")) {
+        if (!controlSetChecked(arg, cmd[0] == 'e')) {
+            controlError(o, "no such function", arg);
+            return;
+        }
+    }
+    else if (pcheckerStrEq(cmd, "reset")) {
+        threadsReset();
+        if (s_Control.pfCommand)
+            (*s_Control.pfCommand)(o, cmd, arg);
+    }
+    else if (pcheckerStrEq(cmd, "dump")) {
+        if (s_ThreadsRegistered)
+            threadsWrite(o);
+        if (s_Control.pfCommand)
+            (*s_Control.pfCommand)(o, cmd, arg);
+    }
+    else {
+        r = s_Control.pfCommand ? (*s_Control.pfCommand)(o, cmd, arg) : 0;
+        if (!r)
+            controlError(o, "unknown command", cmd);
+        if (r <= 0)
+            return;
+    }
+    outStr(o, "ok\n");
+}
+
+/* serve one connection until it is closed */
+static FUN_INLINE void controlServe(int fd)
+{
+    struct pchecker_out o;
+    char buf[512];
+    unsigned used = 0;
+
+    outInit(&o, fd);
+    for (;;) {
+        long r = sysRead(fd, buf + used, sizeof(buf) - 1 - used);
+        unsigned start = 0, i;
+
+        if (r <= 0)
+            break;
+        used += (unsigned)r;
+        for (i = 0; i < used; ++i) {
+            if (buf[i] != '\n')
+                continue;
+            buf[i] = '\0';
+            controlCommand(&o, buf + start);
+            outFlush(&o);
+            start = i + 1;
+        }
+        if (start) {
+            used -= start;
+            FUN_MEMCPY(buf, buf + start, used);
+        }
+        else if (used == sizeof(buf) - 1) {
+            controlError(&o, "line too long", NULL);
+            outFlush(&o);
+            used = 0;
+        }
+    }
+    sysClose(fd);
+}
+
+static void *controlRun(void *pArg)
+{
+    (void)pArg;
+
+    pcheckerHelperSetup("pchk-control", PCHECKER_SCHED_OTHER);
+    for (;;) {
+        int fd = (int)syscall(SYS_accept4, s_Control.fd, NULL, NULL, PCHECKER_SOCK_CLOEXEC);
+        if (fd >= 0)
+            controlServe(fd);
+    }
+    return NULL;
+}
+
+/* call from the constructor, pfCommand may be NULL */
+static FUN_INLINE void controlInit(const char *names, pf_control_command_t pfCommand)
+{
+    const char *prefix = pcheckerEnv("PCHECKER_CONTROL");
+    const char *pName;
+    char *path = s_Control.addr.path;
+    unsigned pos;
+    int fd;
+
+    if (!prefix)
+        return;
+
+    pos = appendStr(path, sizeof(s_Control.addr.path), 0, prefix);
+    pos = appendStr(path, sizeof(s_Control.addr.path), pos, ".");
+    pos = appendStr(path, sizeof(s_Control.addr.path), pos, PCHECKER_NAME);
+    pos = appendStr(path, sizeof(s_Control.addr.path), pos, ".");
+    pos = appendUDec(path, sizeof(s_Control.addr.path), pos, (uint64_t)sysGetPid());
+    if (pos + 1 >= sizeof(s_Control.addr.path)) {
+        controlWarn("control socket path too long");
+        path[0] = '\0';
+        return;
+    }
+    s_Control.addr.family = PCHECKER_AF_UNIX;
+    s_Control.names = names;
+    for (pName = names; *pName; ++s_Control.count)
+        pName += pcheckerStrLen(pName) + 1;
+    s_Control.pfCommand = pfCommand;
+
+    fd = (int)syscall(SYS_socket, PCHECKER_AF_UNIX, PCHECKER_SOCK_STREAM | PCHECKER_SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        controlWarn("cannot create the control socket");
+        path[0] = '\0';
+        return;
+    }
+    /* a socket left over from a process with the same pid */
+    syscall(SYS_unlinkat, AT_FDCWD, path, 0);
+    /* nobody can connect before listen, so restrict access first */
+    if (syscall(SYS_bind, fd, &s_Control.addr, sizeof(s_Control.addr)) != 0 ||
+        syscall(SYS_fchmodat, AT_FDCWD, path, 0600, 0) != 0 || syscall(SYS_listen, fd, 4) != 0) {
+        sysClose(fd);
+        controlWarn("cannot bind the control socket");
+        path[0] = '\0';
+        return;
+    }
+    s_Control.fd = fd;
+    if (pcheckerStartHelper(&controlRun, NULL) != 0) {
+        controlWarn("cannot start the control thread");
+        sysClose(fd);
+        syscall(SYS_unlinkat, AT_FDCWD, path, 0);
+        path[0] = '\0';
+    }
+}
+
+/* call from the destructor */
+static FUN_INLINE void controlFinish()
+{
+    if (s_Control.addr.path[0])
+        syscall(SYS_unlinkat, AT_FDCWD, s_Control.addr.path, 0);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,597 @@
+/*
+ * this checker interposes the dynamic loader functions dlopen, dlclose,
+ * dlsym and, on glibc, dlmopen and dlvsym. They take the loader lock,
+ * allocate, map files and run constructors; a plugin loaded lazily on
+ * an RT path stalls it for milliseconds.
+ *
+ * Calls are checked like the heap functions, every call is timed. Calls
+ * from RT threads or critical sections are logged with thread, duration,
+ * callsite and the file or symbol name (the first PCHECKER_DL_LOG ones).
+ * The summary is written at exit to stderr or PCHECKER_DL_REPORT.
+ *
+ * The checker cannot use dlsym to find the real functions, it would
+ * find itself. They are looked up in the objects loaded after this one
+ * with pchecker_elfsym.h instead. Some results of the loader depend on
+ * the calling object, which would be this checker when forwarding:
+ *  - dlsym(RTLD_NEXT) and dlvsym(RTLD_NEXT) are answered by the same
+ *    lookup, starting after the calling object (objects opened with
+ *    RTLD_LOCAL are searched as well, no dlerror message is set),
+ *  - glibc searches a bare file name for dlopen in the DT_RPATH of the
+ *    caller, or in LD_LIBRARY_PATH and then its DT_RUNPATH, these
+ *    directories are tried here in the same order before forwarding,
+ *  - glibc expands $ORIGIN in a file name with '/' to the directory of
+ *    the caller, that is done here as well.
+ * Calls from objects in a namespace of dlmopen are forwarded from this
+ * checker and load into the base namespace.
+ * dladdr, dlinfo, dlerror and dl_iterate_phdr are not interposed, they
+ * are used by the checkers themselves for reports.
+ */
+
+#define PCHECKER_NAME "dl"
+
+#include "pchecker.h"
+#include "pchecker_trace.h"
+#include "pchecker_violation.h"
+#include "pchecker_elfsym.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef __GLIBC__
+#include <sys/auxv.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PCHECKER_DL_LOG
+#define PCHECKER_DL_LOG 128
+#endif
+
+#define PCHECKER_DL_NAME 48
+
+typedef void *(*pf_dlopen_t)(const char *file, int mode);
+typedef int (*pf_dlclose_t)(void *handle);
+typedef void *(*pf_dlsym_t)(void *handle, const char *name);
+typedef void *(*pf_dlmopen_t)(long lmid, const char *file, int mode);
+typedef void *(*pf_dlvsym_t)(void *handle, const char *name, const char *version);
+typedef char *(*pf_dlerror_t)(void);
+
+DSO_PUBLIC void *dlopen(const char *file, int mode);
+DSO_PUBLIC int dlclose(void *handle);
+DSO_PUBLIC void *dlsym(void *handle, const char *name);
+#ifdef __GLIBC__
+DSO_PUBLIC void *dlmopen(Lmid_t lmid, const char *file, int mode);
+DSO_PUBLIC void *dlvsym(void *handle, const char *name, const char *version);
+#endif
+
+static struct function_table {
+    pf_dlopen_t pf_dlopen;
+    pf_dlclose_t pf_dlclose;
+    pf_dlsym_t pf_dlsym;
+    pf_dlmopen_t pf_dlmopen;
+    pf_dlvsym_t pf_dlvsym;
+} s_ResolvedFunctions VAR_TABLE;
+
+enum EFunctionIndex {
+    eDlopen,
+    eDlclose,
+    eDlsym,
+    eDlmopen, /* glibc only, optional from here */
+    eDlvsym,
+    eCount
+};
+
+/* clang-format off */
+static const char *const s_FunctionNames =
+    "dlopen\0"
+    "dlclose\0"
+    "dlsym\0"
+    "dlmopen\0"
+    "dlvsym\0";
+/* clang-format on */
+
+/* set while the checker itself calls the loader, those calls
+ * (dlsym for the assert hook and suppressions) are forwarded unchecked */
+static VAR_TLS int s_DlNested;
+
+static pf_dlerror_t s_pfDlerror;
+
+static int tryResolve()
+{
+    int state = setState(0);
+
+    ++s_DlNested;
+    if (state == 0) {
+        getassert_function(0);
+        state = setState(1);
+    }
+
+    if (state <= 2) {
+        int countresolved = 0, func = 0;
+        const char *pName = s_FunctionNames;
+
+        pf_void_t *pFTable = (pf_void_t *)&s_ResolvedFunctions.pf_dlopen;
+
+        while (*pName != '\0') {
+            /* RTLD_NEXT as seen from this object */
+            void *pf = pcheckerElfSymbol(pName, NULL, &s_ResolvedFunctions);
+            if (pf)
+                FUN_MEMCPY(pFTable, &pf, sizeof(*pFTable));
+
+            countresolved += pf || func >= eDlmopen ? 1 : 0;
+
+            while (*pName++ != '\0')
+                ;
+            ++pFTable;
+            ++func;
+        }
+        if (!s_pfDlerror) {
+            void *pf = pcheckerElfSymbol("dlerror", NULL, &s_ResolvedFunctions);
+            if (pf)
+                COPY_PF(s_pfDlerror, pf_dlerror_t, pf);
+        }
+
+        if (countresolved == sizeof(s_ResolvedFunctions) / sizeof(pf_void_t))
+            state = setState(3);
+    }
+
+    if (state >= 2) {
+        if (getassert_function(1) && state == 3)
+            state = setResolveIsDone();
+    }
+    --s_DlNested;
+
+    return state;
+}
+
+struct dl_function {
+    VAR_ATOMIC(uint64_t) calls;
+    VAR_ATOMIC(uint64_t) rtCalls;
+    VAR_ATOMIC(uint64_t) ns;
+    VAR_ATOMIC(uint64_t) maxNs;
+};
+
+struct dl_log_entry {
+    int tid;
+    unsigned func;
+    uint64_t ns;
+    const void *callsite;
+    char name[PCHECKER_DL_NAME];
+};
+
+static struct dl_state {
+    struct dl_function functions[eCount];
+    VAR_ATOMIC(unsigned) logged;
+    struct dl_log_entry log[PCHECKER_DL_LOG];
+} s_Dl;
+
+static FUN_INLINE void dlRecord(enum EFunctionIndex func, uint64_t start, int rt, const char *name,
+                                const void *callsite)
+{
+    struct dl_function *p = &s_Dl.functions[func];
+    uint64_t ns = pcheckerTicksToNs(pcheckerTicks() - start);
+    uint64_t maxNs = VAR_ATOMIC_LOAD(p->maxNs);
+
+    VAR_ATOMIC_FETCH_ADD(p->calls, 1);
+    VAR_ATOMIC_FETCH_ADD(p->ns, ns);
+    while (ns > maxNs && !VAR_ATOMIC_CAS(p->maxNs, &maxNs, ns))
+        ;
+    if (rt) {
+        unsigned index = VAR_ATOMIC_FETCH_ADD(s_Dl.logged, 1);
+
+        VAR_ATOMIC_FETCH_ADD(p->rtCalls, 1);
+        if (index < PCHECKER_DL_LOG) {
+            struct dl_log_entry *pEntry = &s_Dl.log[index];
+            unsigned i = 0;
+
+            pEntry->tid = pcheckerGetTid();
+            pEntry->func = func;
+            pEntry->ns = ns;
+            pEntry->callsite = callsite;
+            /* keep the end of long paths */
+            if (name) {
+                unsigned len = pcheckerStrLen(name);
+                if (len >= PCHECKER_DL_NAME)
+                    name += len - (PCHECKER_DL_NAME - 1);
+                for (; name[i]; ++i)
+                    pEntry->name[i] = name[i];
+            }
+            pEntry->name[i] = '\0';
+        }
+    }
+}
+
+static int controlDump(struct pchecker_out *o, const char *cmd, const char *arg);
+
+__attribute__((__constructor__(101))) static void callResolve()
+{
+    ++s_DlNested;
+    if (!initIsDone())
+        tryResolve();
+    setInitIsDone();
+
+    unwindInit();
+    violationInit();
+    traceOpen(PCHECKER_NAME, s_FunctionNames);
+    threadsInit(PCHECKER_NAME, s_FunctionNames);
+    controlInit(s_FunctionNames, &controlDump);
+    --s_DlNested;
+}
+
+static void writeReport(struct pchecker_out *o)
+{
+    unsigned i, logged = VAR_ATOMIC_LOAD(s_Dl.logged);
+
+    outStr(o, "\ndynamic loader calls\n");
+    outStr(o, "function       calls    total us      max us        RT\n");
+    for (i = 0; i < eCount; ++i) {
+        const struct dl_function *p = &s_Dl.functions[i];
+        if (!VAR_ATOMIC_LOAD(p->calls))
+            continue;
+        outStrCol(o, pcheckerNameAt(s_FunctionNames, i), 10);
+        outUDec(o, VAR_ATOMIC_LOAD(p->calls), 10);
+        outUDec(o, VAR_ATOMIC_LOAD(p->ns) / 1000u, 12);
+        outUDec(o, VAR_ATOMIC_LOAD(p->maxNs) / 1000u, 12);
+        outUDec(o, VAR_ATOMIC_LOAD(p->rtCalls), 10);
+        outChar(o, '\n');
+    }
+
+    if (logged) {
+        outStr(o, "\ncalls from RT threads or critical sections\n");
+        outStr(o, "     tid  function       us  name / callsite\n");
+        for (i = 0; i < logged && i < PCHECKER_DL_LOG; ++i) {
+            const struct dl_log_entry *p = &s_Dl.log[i];
+            outSDec(o, p->tid, 8);
+            outStr(o, "  ");
+            outStrCol(o, pcheckerNameAt(s_FunctionNames, p->func), 10);
+            outUDec(o, p->ns / 1000u, 7);
+            outStr(o, "  ");
+            outStr(o, p->name[0] ? p->name : "-");
+            outStr(o, "  ");
+            outSymbol(o, p->callsite);
+            outChar(o, '\n');
+        }
+        if (logged > PCHECKER_DL_LOG) {
+            outStr(o, "not logged: ");
+            outUDec(o, logged - PCHECKER_DL_LOG, 0);
+            outChar(o, '\n');
+        }
+    }
+    outFlush(o);
+}
+
+/* the report on the control socket */
+static int controlDump(struct pchecker_out *o, const char *cmd, const char *arg)
+{
+    (void)arg;
+    if (!pcheckerStrEq(cmd, "dump"))
+        return 0;
+    ++s_DlNested;
+    writeReport(o);
+    --s_DlNested;
+    return 1;
+}
+
+__attribute__((__destructor__(101))) static void callFinish()
+{
+    const char *path = pcheckerEnv("PCHECKER_DL_REPORT");
+    struct pchecker_out o;
+    uint64_t calls = 0;
+    unsigned i;
+    int fd = 2;
+
+    traceClose();
+    threadsFinish();
+    controlFinish();
+
+    for (i = 0; i < eCount; ++i)
+        calls += VAR_ATOMIC_LOAD(s_Dl.functions[i].calls);
+    if (!calls)
+        return;
+    ++s_DlNested;
+    if (path)
+        fd = sysOpen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        outInit(&o, fd);
+        writeReport(&o);
+        if (fd != 2)
+            sysClose(fd);
+    }
+    --s_DlNested;
+}
+
+/* returns 1 if the call comes from an RT thread or critical section and
+ * is checked there, calls of the checker itself are not checked or
+ * recorded (returns -1) */
+static FUN_INLINE int initAndCheck(enum EFunctionIndex func, const void *callsite)
+{
+    if (s_DlNested)
+        return -1;
+    if (unlikely(!initIsDone())) {
+        tryResolve();
+    }
+
+    checkCall(1, func, callsite);
+    return isCheckedRt(func, callsite);
+}
+
+#ifdef __GLIBC__
+/* the directory part of the object name, into buf */
+static FUN_INLINE unsigned dlOrigin(const struct pchecker_elf_object *o, char *buf, unsigned size)
+{
+    unsigned len = 0, i;
+
+    if (o->name[0]) {
+        for (len = 0; o->name[len] && len < size; ++len)
+            buf[len] = o->name[len];
+    }
+    else {
+        long r = syscall(SYS_readlinkat, AT_FDCWD, "/proc/self/exe", buf, size);
+        len = r > 0 ? (unsigned)r : 0;
+    }
+    if (len >= size)
+        return 0;
+    for (i = len; i > 0 && buf[i - 1] != '/'; --i)
+        ;
+    return i > 1 ? i - 1 : i;
+}
+
+/* length of prefix if [s, end) starts with it, else 0 */
+static FUN_INLINE unsigned dlPrefix(const char *s, const char *end, const char *prefix)
+{
+    unsigned i;
+
+    for (i = 0; prefix[i]; ++i) {
+        if (s + i >= end || s[i] != prefix[i])
+            return 0;
+    }
+    return i;
+}
+
+/* length of $ORIGIN or ${ORIGIN} if [s, end) starts with it, else 0 */
+static FUN_INLINE unsigned dlOriginToken(const char *s, const char *end)
+{
+    unsigned n = dlPrefix(s, end, "${ORIGIN}");
+    char c;
+
+    if (n)
+        return n;
+    n = dlPrefix(s, end, "$ORIGIN");
+    c = n && s + n < end ? s[n] : '\0';
+    /* $ORIGIN_DIR is another variable */
+    if (c == '_' || (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z'))
+        return 0;
+    return n;
+}
+
+/* one directory of a search path with $ORIGIN expanded, 0 if unusable */
+static FUN_INLINE unsigned dlSearchDir(const struct pchecker_elf_object *o, const char *dir, const char *end,
+                                       char *buf, unsigned size)
+{
+    unsigned len = 0, n = dlOriginToken(dir, end);
+
+    if (n) {
+        len = dlOrigin(o, buf, size);
+        if (!len)
+            return 0;
+        dir += n;
+    }
+    for (; dir < end; ++dir) {
+        /* $LIB and $PLATFORM are not supported */
+        if (*dir == '$' || len + 1 >= size)
+            return 0;
+        buf[len++] = *dir;
+    }
+    return len;
+}
+
+/* a file name with '/' and every $ORIGIN expanded to the directory of o,
+ * into buf. Returns 0 if there is nothing to expand or it does not fit. */
+static FUN_INLINE int dlExpandOrigin(const struct pchecker_elf_object *o, const char *file, char *buf,
+                                     unsigned size)
+{
+    const char *end = file + pcheckerStrLen(file);
+    unsigned len = 0, originLen = 0, n;
+    char origin[512];
+
+    while (file < end) {
+        n = dlOriginToken(file, end);
+        if (n) {
+            if (!originLen)
+                originLen = dlOrigin(o, origin, sizeof(origin));
+            if (!originLen || len + originLen >= size)
+                return 0;
+            FUN_MEMCPY(buf + len, origin, originLen);
+            len += originLen;
+            file += n;
+        }
+        else {
+            if (len + 1 >= size)
+                return 0;
+            buf[len++] = *file++;
+        }
+    }
+    buf[len] = '\0';
+    return originLen != 0;
+}
+
+/* dlopen file in the directories of paths, $ORIGIN is the directory of o.
+ * Returns the handle of the first one that loads, NULL if none did. */
+static void *dlopenPaths(const struct pchecker_elf_object *o, const char *paths, const char *file, int mode)
+{
+    unsigned fileLen = pcheckerStrLen(file);
+    char buf[1024];
+
+    while (*paths) {
+        const char *end = paths;
+        unsigned len;
+
+        while (*end && *end != ':')
+            ++end;
+        len = dlSearchDir(o, paths, end, buf, sizeof(buf));
+        if (len && len + 1 + fileLen < sizeof(buf)) {
+            buf[len++] = '/';
+            FUN_MEMCPY(buf + len, file, fileLen + 1);
+            if (syscall(SYS_faccessat, AT_FDCWD, buf, F_OK, 0) == 0) {
+                void *handle = (*s_ResolvedFunctions.pf_dlopen)(buf, mode);
+                if (handle)
+                    return handle;
+                if (s_pfDlerror)
+                    (*s_pfDlerror)();
+            }
+        }
+        paths = *end ? end + 1 : end;
+    }
+    return NULL;
+}
+
+/* glibc resolves file relative to the calling object, forwarded that would
+ * be this checker: $ORIGIN in a path with '/' is the directory of the
+ * caller, and a name without '/' is searched in its DT_RPATH or, after
+ * LD_LIBRARY_PATH, its DT_RUNPATH. Returns 1 with the result in *pHandle
+ * if the call was done on behalf of the caller, 0 to forward unchanged. */
+static int dlopenCaller(const char *file, int mode, const void *callsite, void **pHandle)
+{
+    struct pchecker_elf_object o;
+    const char *p;
+    char buf[1024];
+    int slash = 0;
+
+    if (!file)
+        return 0;
+    for (p = file; *p; ++p)
+        slash |= *p == '/';
+    if (!pcheckerElfObjectAt(callsite, &o))
+        return 0;
+
+    if (slash) {
+        if (!dlExpandOrigin(&o, file, buf, sizeof(buf)))
+            return 0;
+        *pHandle = (*s_ResolvedFunctions.pf_dlopen)(buf, mode);
+        return 1;
+    }
+    if (!o.runpath && !o.rpath)
+        return 0;
+
+    /* loaded libraries are found by name, don't load a second copy */
+    *pHandle = (*s_ResolvedFunctions.pf_dlopen)(file, mode | RTLD_NOLOAD);
+    if (*pHandle)
+        return 1;
+    if (s_pfDlerror)
+        (*s_pfDlerror)(); /* clear the error of the probe */
+
+    if (!o.runpath) {
+        *pHandle = dlopenPaths(&o, o.rpath, file, mode);
+        return *pHandle != NULL;
+    }
+    /* the loader read LD_LIBRARY_PATH at startup, ignored for setuid
+     * programs, its $ORIGIN is the directory of the executable */
+    p = getauxval(AT_SECURE) ? NULL : pcheckerEnv("LD_LIBRARY_PATH");
+    if (p) {
+        struct pchecker_elf_object exe = o;
+
+        exe.name = "";
+        *pHandle = dlopenPaths(&exe, p, file, mode);
+        if (*pHandle)
+            return 1;
+    }
+    *pHandle = dlopenPaths(&o, o.runpath, file, mode);
+    return *pHandle != NULL;
+}
+#endif
+
+void *dlopen(const char *file, int mode)
+{
+    struct pchecker_trace_record *pTrace;
+    const void *callsite = PCHECKER_CALLSITE();
+    int rt = initAndCheck(eDlopen, callsite);
+    uint64_t start = pcheckerTicks();
+    void *r = NULL;
+
+    pTrace = traceBegin(eDlopen, traceArgPtr(file), (uint64_t)mode, 0, callsite);
+#ifdef __GLIBC__
+    if (rt < 0 || !dlopenCaller(file, mode, callsite, &r))
+#endif
+        r = (*s_ResolvedFunctions.pf_dlopen)(file, mode);
+    traceEnd(pTrace, traceArgPtr(r));
+    if (rt >= 0)
+        dlRecord(eDlopen, start, rt, file, callsite);
+    return r;
+}
+
+int dlclose(void *handle)
+{
+    struct pchecker_trace_record *pTrace;
+    const void *callsite = PCHECKER_CALLSITE();
+    int rt = initAndCheck(eDlclose, callsite);
+    uint64_t start = pcheckerTicks();
+    int r;
+
+    pTrace = traceBegin(eDlclose, traceArgPtr(handle), 0, 0, callsite);
+    r = (*s_ResolvedFunctions.pf_dlclose)(handle);
+    traceEnd(pTrace, (uint64_t)r);
+    if (rt >= 0)
+        dlRecord(eDlclose, start, rt, NULL, callsite);
+    return r;
+}
+
+void *dlsym(void *handle, const char *name)
+{
+    struct pchecker_trace_record *pTrace;
+    const void *callsite = PCHECKER_CALLSITE();
+    int rt = initAndCheck(eDlsym, callsite);
+    uint64_t start = pcheckerTicks();
+    void *r;
+
+    pTrace = traceBegin(eDlsym, traceArgPtr(handle), 0, 0, callsite);
+    if (handle == RTLD_NEXT || !s_ResolvedFunctions.pf_dlsym)
+        r = pcheckerElfSymbol(name, NULL, handle == RTLD_NEXT ? callsite : NULL);
+    else
+        r = (*s_ResolvedFunctions.pf_dlsym)(handle, name);
+    traceEnd(pTrace, traceArgPtr(r));
+    if (rt >= 0)
+        dlRecord(eDlsym, start, rt, name, callsite);
+    return r;
+}
+
+#ifdef __GLIBC__
+void *dlmopen(Lmid_t lmid, const char *file, int mode)
+{
+    struct pchecker_trace_record *pTrace;
+    const void *callsite = PCHECKER_CALLSITE();
+    int rt = initAndCheck(eDlmopen, callsite);
+    uint64_t start = pcheckerTicks();
+    void *r;
+
+    pTrace = traceBegin(eDlmopen, traceArgPtr(file), (uint64_t)mode, (uint64_t)lmid, callsite);
+    r = (*s_ResolvedFunctions.pf_dlmopen)(lmid, file, mode);
+    traceEnd(pTrace, traceArgPtr(r));
+    if (rt >= 0)
+        dlRecord(eDlmopen, start, rt, file, callsite);
+    return r;
+}
+
+void *dlvsym(void *handle, const char *name, const char *version)
+{
+    struct pchecker_trace_record *pTrace;
+    const void *callsite = PCHECKER_CALLSITE();
+    int rt = initAndCheck(eDlvsym, callsite);
+    uint64_t start = pcheckerTicks();
+    void *r;
+
+    pTrace = traceBegin(eDlvsym, traceArgPtr(handle), 0, 0, callsite);
+    if (handle == RTLD_NEXT)
+        r = pcheckerElfSymbol(name, version, callsite);
+    else
+        r = (*s_ResolvedFunctions.pf_dlvsym)(handle, name, version);
+    traceEnd(pTrace, traceArgPtr(r));
+    if (rt >= 0)
+        dlRecord(eDlvsym, start, rt, name, callsite);
+    return r;
+}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,395 @@
+/*
+ * symbol lookup in the loaded objects without dlsym: dl_iterate_phdr
+ * walks the link map, the names are looked up in the DT_GNU_HASH (or
+ * DT_HASH) table and DT_SYMTAB of each object directly.
+ *
+ * This is for checkers that interpose the dynamic loader itself, or
+ * must not call into it, like the heap checker as dlsym allocates. It
+ * neither allocates nor calls back into the loader except for
+ * dl_iterate_phdr, which only takes a read lock.
+ * Symbol versions are honoured: without a version the default one is
+ * returned, hidden versions only if asked for. GNU indirect functions
+ * are resolved by calling their resolver.
+ */
+
+#ifndef PCHECKER_ELFSYM_H
+#define PCHECKER_ELFSYM_H
+
+#include "pchecker_util.h"
+#include <link.h>
+#include <sys/auxv.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the parts of the dynamic section needed for lookups */
+struct pchecker_elf_object {
+    ElfW(Addr) base;
+    const char *name; /* "" for the executable */
+    const ElfW(Phdr) *phdr;
+    unsigned phnum;
+    const ElfW(Sym) *symtab;
+    const char *strtab;
+    const uint32_t *gnuHash;
+    const uint32_t *hash;
+    const ElfW(Versym) *versym;
+    const ElfW(Verdef) *verdef;
+    const char *runpath; /* NULL if not set */
+    const char *rpath;
+};
+
+typedef void *(*pf_elf_ifunc_t)(unsigned long hwcap);
+
+/* glibc relocates the pointers in the dynamic section of most objects,
+ * musl and the vdso leave them relative to the load address */
+static FUN_INLINE const void *elfDynPtr(const struct pchecker_elf_object *o, ElfW(Addr) ptr)
+{
+    return (const void *)(ptr < o->base ? o->base + ptr : ptr);
+}
+
+static FUN_INLINE int elfObjectInit(struct pchecker_elf_object *o, const struct dl_phdr_info *info)
+{
+    const ElfW(Dyn) *pDyn = NULL;
+    ElfW(Addr) runpath = 0, rpath = 0;
+    unsigned i;
+
+    o->symtab = NULL;
+    o->strtab = NULL;
+    o->gnuHash = NULL;
+    o->hash = NULL;
+    o->versym = NULL;
+    o->verdef = NULL;
+    o->runpath = NULL;
+    o->rpath = NULL;
+    o->base = info->dlpi_addr;
+    o->name = info->dlpi_name ? info->dlpi_name : "";
+    o->phdr = info->dlpi_phdr;
+    o->phnum = info->dlpi_phnum;
+    for (i = 0; i < o->phnum; ++i) {
+        if (o->phdr[i].p_type == PT_DYNAMIC)
+            pDyn = (const ElfW(Dyn) *)(o->base + o->phdr[i].p_vaddr);
+    }
+    if (!pDyn)
+        return 0;
+
+    for (; pDyn->d_tag != DT_NULL; ++pDyn) {
+        switch (pDyn->d_tag) {
+        case DT_SYMTAB:
+            o->symtab = (const ElfW(Sym) *)elfDynPtr(o, pDyn->d_un.d_ptr);
+            break;
+        case DT_STRTAB:
+            o->strtab = (const char *)elfDynPtr(o, pDyn->d_un.d_ptr);
+            break;
+        case DT_GNU_HASH:
+            o->gnuHash = (const uint32_t *)elfDynPtr(o, pDyn->d_un.d_ptr);
+            break;
+        case DT_HASH:
+            o->hash = (const uint32_t *)elfDynPtr(o, pDyn->d_un.d_ptr);
+            break;
+        case DT_VERSYM:
+            o->versym = (const ElfW(Versym) *)elfDynPtr(o, pDyn->d_un.d_ptr);
+            break;
+        case DT_VERDEF:
+            o->verdef = (const ElfW(Verdef) *)elfDynPtr(o, pDyn->d_un.d_ptr);
+            break;
+        case DT_RUNPATH:
+            runpath = pDyn->d_un.d_val + 1;
+            break;
+        case DT_RPATH:
+            rpath = pDyn->d_un.d_val + 1;
+            break;
+        default:
+            break;
+        }
+    }
+    if (!o->symtab || !o->strtab || (!o->gnuHash && !o->hash))
+        return 0;
+    if (runpath)
+        o->runpath = o->strtab + runpath - 1;
+    if (rpath)
+        o->rpath = o->strtab + rpath - 1;
+    return 1;
+}
+
+static FUN_INLINE int elfContains(const struct dl_phdr_info *info, const void *addr)
+{
+    ElfW(Addr) a = (ElfW(Addr))addr;
+    unsigned i;
+
+    for (i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) *p = &info->dlpi_phdr[i];
+        if (p->p_type == PT_LOAD && a - (info->dlpi_addr + p->p_vaddr) < p->p_memsz)
+            return 1;
+    }
+    return 0;
+}
+
+/* version index of a version name in the object, 0 if not defined */
+static FUN_INLINE unsigned elfVersionIndex(const struct pchecker_elf_object *o, const char *version)
+{
+    const ElfW(Verdef) *pDef = o->verdef;
+
+    while (pDef) {
+        const ElfW(Verdaux) *pAux = (const ElfW(Verdaux) *)((const char *)pDef + pDef->vd_aux);
+        if (!(pDef->vd_flags & VER_FLG_BASE) && pcheckerStrEq(o->strtab + pAux->vda_name, version))
+            return pDef->vd_ndx;
+        if (!pDef->vd_next)
+            break;
+        pDef = (const ElfW(Verdef) *)((const char *)pDef + pDef->vd_next);
+    }
+    return 0;
+}
+
+/* a definition that can be bound to, with the wanted version (0 for the default) */
+static FUN_INLINE int elfMatch(const struct pchecker_elf_object *o, uint32_t index, const char *name, unsigned version)
+{
+    const ElfW(Sym) *pSym = &o->symtab[index];
+    /* ELF32_ST_BIND and ELF64_ST_BIND are the same */
+    unsigned bind = ELF64_ST_BIND(pSym->st_info), type = ELF64_ST_TYPE(pSym->st_info);
+
+    if (pSym->st_shndx == SHN_UNDEF || (bind != STB_GLOBAL && bind != STB_WEAK) ||
+        (type != STT_FUNC && type != STT_GNU_IFUNC && type != STT_OBJECT && type != STT_TLS && type != STT_NOTYPE))
+        return 0;
+    if (!pcheckerStrEq(o->strtab + pSym->st_name, name))
+        return 0;
+    if (o->versym) {
+        unsigned v = o->versym[index];
+        if (version ? (v & 0x7fff) != version : (v & 0x8000) || v == 0)
+            return 0;
+    }
+    return 1;
+}
+
+static FUN_INLINE uint32_t elfGnuHash(const char *name)
+{
+    uint32_t h = 5381;
+
+    while (*name)
+        h = h * 33 + (unsigned char)*name++;
+    return h;
+}
+
+static FUN_INLINE uint32_t elfSysvHash(const char *name)
+{
+    uint32_t h = 0, g;
+
+    while (*name) {
+        h = (h << 4) + (unsigned char)*name++;
+        g = h & 0xf0000000u;
+        if (g)
+            h ^= g >> 24;
+        h &= ~g;
+    }
+    return h;
+}
+
+/* symbol table index of a definition, 0 if there is none */
+static FUN_INLINE uint32_t elfLookup(const struct pchecker_elf_object *o, const char *name, unsigned version)
+{
+    if (o->gnuHash) {
+        const uint32_t *ht = o->gnuHash;
+        uint32_t nBuckets = ht[0], symOffset = ht[1], bloomSize = ht[2], bloomShift = ht[3];
+        const ElfW(Addr) *pBloom = (const ElfW(Addr) *)(ht + 4);
+        const uint32_t *pBuckets = (const uint32_t *)(pBloom + bloomSize);
+        const uint32_t *pChain = pBuckets + nBuckets;
+        const unsigned bits = sizeof(ElfW(Addr)) * 8;
+        uint32_t h = elfGnuHash(name), i;
+        ElfW(Addr) word, mask;
+
+        if (!nBuckets || !bloomSize)
+            return 0;
+        word = pBloom[(h / bits) & (bloomSize - 1)];
+        mask = ((ElfW(Addr))1 << (h % bits)) | ((ElfW(Addr))1 << ((h >> bloomShift) % bits));
+        if ((word & mask) != mask)
+            return 0;
+        i = pBuckets[h % nBuckets];
+        if (i < symOffset)
+            return 0;
+        /* the versions of a name are next to each other in the chain */
+        for (;; ++i) {
+            uint32_t ch = pChain[i - symOffset];
+            if ((h | 1) == (ch | 1) && elfMatch(o, i, name, version))
+                return i;
+            if (ch & 1)
+                return 0;
+        }
+    }
+    else {
+        const uint32_t *ht = o->hash;
+        uint32_t nBuckets = ht[0], h = elfSysvHash(name), i;
+        const uint32_t *pChain = ht + 2 + nBuckets;
+
+        for (i = ht[2 + h % nBuckets]; i; i = pChain[i]) {
+            if (elfMatch(o, i, name, version))
+                return i;
+        }
+        return 0;
+    }
+}
+
+/* address of the symbol, resolves indirect functions */
+static FUN_INLINE void *elfAddress(const struct pchecker_elf_object *o, uint32_t index)
+{
+    const ElfW(Sym) *pSym = &o->symtab[index];
+    void *addr = (void *)(o->base + pSym->st_value);
+
+    if (ELF64_ST_TYPE(pSym->st_info) == STT_GNU_IFUNC) {
+        pf_elf_ifunc_t pfResolve;
+        COPY_PF(pfResolve, pf_elf_ifunc_t, addr);
+        addr = (*pfResolve)(getauxval(AT_HWCAP));
+    }
+    return addr;
+}
+
+struct elfsym_search {
+    const char *name;
+    const char *version; /* NULL for the default version */
+    const void *after;   /* skip the objects up to the one containing it */
+    void *result;
+};
+
+static int elfSearchObject(struct dl_phdr_info *info, size_t size, void *pCtx)
+{
+    struct elfsym_search *pSearch = (struct elfsym_search *)pCtx;
+    struct pchecker_elf_object o;
+    unsigned version = 0;
+    uint32_t index;
+    (void)size;
+
+    if (pSearch->after) {
+        if (elfContains(info, pSearch->after))
+            pSearch->after = NULL;
+        return 0;
+    }
+    if (!elfObjectInit(&o, info))
+        return 0;
+    if (pSearch->version) {
+        version = elfVersionIndex(&o, pSearch->version);
+        if (!version)
+            return 0;
+    }
+    index = elfLookup(&o, pSearch->name, version);
+    if (!index)
+        return 0;
+    pSearch->result = elfAddress(&o, index);
+    return 1;
+}
+
+/* first definition of name in load order, like dlsym(RTLD_DEFAULT) or,
+ * with after set to an address in the calling object, dlsym(RTLD_NEXT).
+ * Objects opened with RTLD_LOCAL are searched as well. */
+static FUN_INLINE void *pcheckerElfSymbol(const char *name, const char *version, const void *after)
+{
+    struct elfsym_search search;
+
+    search.name = name;
+    search.version = version;
+    search.after = after;
+    search.result = NULL;
+    dl_iterate_phdr(&elfSearchObject, &search);
+    if (search.after) {
+        /* not in any object (generated code), search everything */
+        search.after = NULL;
+        dl_iterate_phdr(&elfSearchObject, &search);
+    }
+    return search.result;
+}
+
+struct elfsym_batch {
+    const char *names;
+    pf_void_t *pTable;
+    unsigned count;
+    unsigned found;
+    uint64_t done;     /* bit per name */
+    const void *after; /* skip the objects up to the one containing it */
+};
+
+static int elfSearchBatch(struct dl_phdr_info *info, size_t size, void *pCtx)
+{
+    struct elfsym_batch *pBatch = (struct elfsym_batch *)pCtx;
+    struct pchecker_elf_object o;
+    const char *pName = pBatch->names;
+    unsigned i;
+    (void)size;
+
+    if (pBatch->after) {
+        if (elfContains(info, pBatch->after))
+            pBatch->after = NULL;
+        return 0;
+    }
+    if (!elfObjectInit(&o, info))
+        return 0;
+    for (i = 0; i < pBatch->count; ++i, pName += pcheckerStrLen(pName) + 1) {
+        uint32_t index;
+        void *pf;
+
+        if (pBatch->done >> i & 1)
+            continue;
+        index = elfLookup(&o, pName, 0);
+        if (!index)
+            continue;
+        pf = elfAddress(&o, index);
+        FUN_MEMCPY(&pBatch->pTable[i], &pf, sizeof(pf_void_t));
+        pBatch->done |= (uint64_t)1 << i;
+        ++pBatch->found;
+    }
+    return pBatch->found == pBatch->count;
+}
+
+/* the default versions of up to 64 names ("calloc\0malloc\0") in one walk
+ * over the loaded objects, like dlsym(RTLD_NEXT) for each with after in the
+ * calling object. Writes the ones found to pTable, returns their number */
+static FUN_INLINE unsigned pcheckerElfSymbols(const char *names, pf_void_t *pTable, unsigned count,
+                                              const void *after)
+{
+    struct elfsym_batch batch;
+
+    batch.names = names;
+    batch.pTable = pTable;
+    batch.count = count < 64 ? count : 64;
+    batch.found = 0;
+    batch.done = 0;
+    batch.after = after;
+    dl_iterate_phdr(&elfSearchBatch, &batch);
+    if (batch.after) {
+        batch.after = NULL;
+        dl_iterate_phdr(&elfSearchBatch, &batch);
+    }
+    return batch.found;
+}
+
+struct elfsym_find {
+    const void *addr;
+    struct pchecker_elf_object *o;
+    int found;
+};
+
+static int elfFindObject(struct dl_phdr_info *info, size_t size, void *pCtx)
+{
+    struct elfsym_find *pFind = (struct elfsym_find *)pCtx;
+    (void)size;
+
+    if (!elfContains(info, pFind->addr))
+        return 0;
+    pFind->found = elfObjectInit(pFind->o, info);
+    return 1;
+}
+
+/* the object containing addr, returns 0 if there is none with a symbol table */
+static FUN_INLINE int pcheckerElfObjectAt(const void *addr, struct pchecker_elf_object *o)
+{
+    struct elfsym_find find;
+
+    find.addr = addr;
+    find.o = o;
+    find.found = 0;
+    dl_iterate_phdr(&elfFindObject, &find);
+    return find.found;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -6,10 +6,29 @@
  * but there ir no getcpu in glibc to interpose
  *
  * http://man7.org/linux/man-pages/man7/vdso.7.html
+ *
+ * With PCHECKER_VCLOCK set to a clock page created by pchecker_vclock,
+ * the functions return a scaled or advanced virtual time instead
+ * (see pchecker_vclock.h). Calls made inside libc are not affected.
+ *
+ * PCHECKER_GETTIME_TSC=1 serves CLOCK_MONOTONIC from a calibrated TSC
+ * instead of the kernel (see pchecker_tscclock.h).
+ *
+ * PCHECKER_GETTIME_PROFILE=1 counts the calls per clock id, thread and
+ * callsite, the hottest callsites are reported with their call rates at
+ * exit (to stderr or PCHECKER_GETTIME_REPORT).
  */
 
+#define PCHECKER_NAME "gettime"
+
 #include "pchecker.h"
+#include "pchecker_trace.h"
+#include "pchecker_violation.h"
+#include "pchecker_vclock.h"
+#include "pchecker_tscclock.h"
+#include <errno.h>
 #include <sys/types.h>
+#include <time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -58,7 +77,14 @@ static struct function_table {
 
     pf_gettimeofday_t pf_gettimeofday; /* libc */
     pf_time_t pf_time;                 /* libc */
-} s_ResolvedFunctions;
+} s_ResolvedFunctions VAR_TABLE;
+
+enum EFunctionIndex {
+    eClockGettime,
+    eGettimeofday,
+    eTime,
+    eCount
+};
 
 /* This wrapper does not pull in all dependencies except libdl and
  * indirectly libc,
@@ -86,6 +112,9 @@ static const char *const s_FunctionNames =
     "time\0";
 /* clang-format on */
 
+/* for the resolve pass of the combined DSO */
+PCHECKER_REGISTER(s_ResolvedFunctions);
+
 static int tryResolve()
 {
     int state = setState(0);
@@ -131,6 +160,503 @@ static int tryResolve()
     return state;
 }
 
+static struct vclock_state {
+    const struct pchecker_vclock_page *pPage;
+    struct pchecker_vclock_params params; /* loaded when the page was opened */
+    /* largest virtual CLOCK_MONOTONIC returned by this process */
+    VAR_ATOMIC(uint64_t) last;
+} s_VClock;
+
+/* the last parameters this thread loaded */
+static VAR_TLS struct pchecker_vclock_params s_VClockParams;
+static VAR_TLS int s_VClockHasParams;
+
+/* layout of struct timeval, <sys/time.h> has a conflicting
+ * prototype for gettimeofday in newer glibc versions */
+struct vclock_timeval {
+    time_t tv_sec;
+    suseconds_t tv_usec;
+};
+
+static void vclockOpen()
+{
+    const char *path = pcheckerEnv("PCHECKER_VCLOCK");
+    const struct pchecker_vclock_page *pPage;
+    struct pchecker_out o;
+    unsigned i = 0;
+    void *pMap;
+    int fd;
+
+    if (!path || s_VClock.pPage)
+        return;
+
+    fd = sysOpen(path, O_RDONLY | O_CLOEXEC, 0);
+    if (fd >= 0) {
+        /* held while the process runs, pchecker_vclock init checks it */
+        syscall(SYS_flock, fd, PCHECKER_LOCK_SH);
+        pMap = sysMmap(NULL, sizeof(*pPage), PCHECKER_PROT_READ, PCHECKER_MAP_SHARED, fd, 0);
+        if (pMap != PCHECKER_MAP_FAILED) {
+            pPage = (const struct pchecker_vclock_page *)pMap;
+            while (i < sizeof(pPage->magic) && pPage->magic[i] == PCHECKER_VCLOCK_MAGIC[i])
+                ++i;
+            if (i == sizeof(pPage->magic) && pPage->version == PCHECKER_VCLOCK_VERSION &&
+                pPage->size >= sizeof(*pPage)) {
+                /* a page left in an update by a killed writer has no
+                 * parameters to go on, pchecker_vclock repairs it */
+                for (i = 0; i < 100 && !vclockLoad(pPage, &s_VClock.params); ++i)
+                    pcheckerHelperSleepUntil(sysMonotonicNs() + 100000u);
+                if (i < 100) {
+                    s_VClock.pPage = pPage;
+                    return;
+                }
+            }
+            sysMunmap(pMap, sizeof(*pPage));
+        }
+        sysClose(fd);
+    }
+
+    outInit(&o, 2);
+    outStr(&o, "pchecker(" PCHECKER_NAME "): no usable virtual clock page '");
+    outStr(&o, path);
+    outStr(&o, "', using the real clocks\n");
+    outFlush(&o);
+}
+
+/* virtual CLOCK_MONOTONIC in ns, never decreasing across the threads of
+ * this process. During an update of the page, or while a killed writer
+ * left it inconsistent, the time is extrapolated from the parameters the
+ * thread loaded last (or the process when it opened the page). */
+static FUN_INLINE uint64_t vclockNow()
+{
+    struct pchecker_vclock_params params;
+    struct timespec ts;
+    uint64_t v, last;
+
+    (*s_ResolvedFunctions.pf_clock_gettime)(CLOCK_MONOTONIC, &ts);
+    if (vclockLoad(s_VClock.pPage, &params)) {
+        s_VClockParams = params;
+        s_VClockHasParams = 1;
+    }
+    else
+        params = s_VClockHasParams ? s_VClockParams : s_VClock.params;
+    v = vclockVirtual(&params, (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec);
+
+    last = VAR_ATOMIC_LOAD(s_VClock.last);
+    while (v > last) {
+        if (VAR_ATOMIC_CAS(s_VClock.last, &last, v))
+            return v;
+    }
+    return last;
+}
+
+/* returns 0 if the clock is not virtualized */
+static FUN_INLINE int vclockRead(clockid_t clock_id, int64_t *pNs)
+{
+    const struct pchecker_vclock_page *pPage = s_VClock.pPage;
+
+    if ((unsigned)clock_id >= PCHECKER_VCLOCK_CLOCKS || !(pPage->clockMask & (1u << clock_id)))
+        return 0;
+    *pNs = (int64_t)vclockNow() + pPage->clockOffset[clock_id];
+    return 1;
+}
+
+#ifndef PCHECKER_PROFILE_THREADS
+#define PCHECKER_PROFILE_THREADS 64
+#endif
+
+/* callsites per thread, power of two */
+#ifndef PCHECKER_PROFILE_SITES
+#define PCHECKER_PROFILE_SITES 256
+#endif
+
+/* callsites after merging all threads, power of two */
+#ifndef PCHECKER_PROFILE_MERGED
+#define PCHECKER_PROFILE_MERGED 4096
+#endif
+
+/* entries looked at before a callsite is dropped */
+#define PCHECKER_PROFILE_PROBES 16
+
+/* clock ids 0..11, then the slots for the other interfaces */
+enum EProfileSlot {
+    eSlotClocks = 12,
+    eSlotDynamic = eSlotClocks, /* negative clock ids: cpu clocks of other threads, posix clocks */
+    eSlotGettimeofday,
+    eSlotTime,
+    eSlotCount
+};
+
+struct profile_site {
+    const void *callsite;
+    unsigned slot;
+    uint64_t count;
+    uint64_t first; /* ticks */
+    uint64_t last;
+};
+
+struct profile_thread {
+    VAR_ATOMIC(int) tid; /* 0 never used, -1 while folding, -2 released */
+    uint64_t calls[eSlotCount];
+    uint64_t dropped; /* calls from callsites that did not fit */
+    struct profile_site sites[PCHECKER_PROFILE_SITES];
+};
+
+static struct profile_state {
+    int enabled;
+    uint64_t startTicks;
+    VAR_ATOMIC(unsigned) lostThreads;
+    VAR_ATOMIC(unsigned) released; /* records given back by exiting threads */
+    int hasKey;
+    pthread_key_t key; /* its destructor gives the record back */
+    pf_pthread_setspecific_t pf_setspecific;
+    /* held while exited threads are folded into merged */
+    VAR_ATOMIC_FLAG mergeLock;
+    unsigned exitedThreads;
+    uint64_t exitedCalls[eSlotCount];
+    uint64_t exitedDropped;
+    struct profile_thread threads[PCHECKER_PROFILE_THREADS];
+    struct profile_site merged[PCHECKER_PROFILE_MERGED];
+} s_Profile;
+
+static VAR_TLS struct profile_thread *s_pProfileThread;
+static VAR_TLS unsigned s_ProfileNoThread; /* released + 1 when no record was left */
+
+static FUN_INLINE unsigned profileSlot(clockid_t clock_id)
+{
+    if (clock_id < 0)
+        return eSlotDynamic;
+    return (unsigned)clock_id < eSlotClocks ? (unsigned)clock_id : eSlotDynamic;
+}
+
+static FUN_INLINE unsigned siteHash(const void *callsite, unsigned slot)
+{
+    uintptr_t k = (uintptr_t)callsite ^ slot;
+    return (unsigned)((k ^ (k >> 7) ^ (k >> 17)) * 0x9e3779b1u);
+}
+
+/* find or insert, returns NULL if no entry is free near the hash */
+static struct profile_site *findSite(struct profile_site *pSites, unsigned mask, const void *callsite, unsigned slot)
+{
+    unsigned i, h = siteHash(callsite, slot);
+
+    for (i = 0; i <= mask && i < PCHECKER_PROFILE_PROBES; ++i) {
+        struct profile_site *pSite = &pSites[(h + i) & mask];
+        if (pSite->callsite == callsite && pSite->slot == slot)
+            return pSite;
+        if (!pSite->callsite) {
+            pSite->callsite = callsite;
+            pSite->slot = slot;
+            return pSite;
+        }
+    }
+    return NULL;
+}
+
+static void profileMerge(struct profile_site *pSite, uint64_t *pDropped)
+{
+    struct profile_site *pMerged = findSite(s_Profile.merged, PCHECKER_PROFILE_MERGED - 1, pSite->callsite, pSite->slot);
+
+    if (!pMerged) {
+        *pDropped += pSite->count;
+        return;
+    }
+    if (!pMerged->count || pSite->first < pMerged->first)
+        pMerged->first = pSite->first;
+    if (pSite->last > pMerged->last)
+        pMerged->last = pSite->last;
+    pMerged->count += pSite->count;
+}
+
+/* the table of an exited thread goes into merged and the record is
+ * cleared. Returns 0 if the merge is busy and wait is 0. */
+static int profileFold(struct profile_thread *pThread, int wait)
+{
+    unsigned k;
+
+    while (VAR_ATOMIC_FLAG_TESTSET(s_Profile.mergeLock)) {
+        if (!wait)
+            return 0;
+        syscall(SYS_sched_yield);
+    }
+    ++s_Profile.exitedThreads;
+    s_Profile.exitedDropped += pThread->dropped;
+    for (k = 0; k < eSlotCount; ++k)
+        s_Profile.exitedCalls[k] += pThread->calls[k];
+    for (k = 0; k < PCHECKER_PROFILE_SITES; ++k) {
+        if (pThread->sites[k].count)
+            profileMerge(&pThread->sites[k], &s_Profile.exitedDropped);
+    }
+    VAR_ATOMIC_FLAG_CLEAR(s_Profile.mergeLock);
+
+    for (k = 0; k < eSlotCount; ++k)
+        pThread->calls[k] = 0;
+    for (k = 0; k < PCHECKER_PROFILE_SITES; ++k) {
+        pThread->sites[k].callsite = NULL;
+        pThread->sites[k].count = 0;
+    }
+    pThread->dropped = 0;
+    return 1;
+}
+
+/* key destructor, the exiting thread folds its own record and gives it
+ * back, threads that found no record look again */
+static void profileExit(void *pArg)
+{
+    struct profile_thread *pThread = (struct profile_thread *)pArg;
+    int tid = VAR_ATOMIC_LOAD(pThread->tid);
+
+    s_pProfileThread = NULL;
+    if (tid <= 0 || !VAR_ATOMIC_CAS(pThread->tid, &tid, -1))
+        return;
+    profileFold(pThread, 1);
+    VAR_ATOMIC_STORE(pThread->tid, -2);
+    /* later destructors don't take another record */
+    s_ProfileNoThread = VAR_ATOMIC_FETCH_ADD(s_Profile.released, 1) + 2;
+}
+
+static FUN_INLINE struct profile_thread *profileBind(struct profile_thread *pThread)
+{
+    s_pProfileThread = pThread;
+    if (s_Profile.hasKey)
+        (*s_Profile.pf_setspecific)(s_Profile.key, pThread);
+    return pThread;
+}
+
+/* the record of this thread. Once none was left the thread counts nothing
+ * until a record is given back, so the calls of a thread without record
+ * cost no more than a load. */
+static struct profile_thread *profileThread()
+{
+    struct profile_thread *pThread = s_pProfileThread;
+    unsigned released, i;
+    int tid, pid;
+
+    if (pThread)
+        return pThread;
+    released = VAR_ATOMIC_LOAD(s_Profile.released);
+    if (s_ProfileNoThread == released + 1)
+        return NULL;
+
+    tid = pcheckerGetTid();
+    for (i = 0; i < PCHECKER_PROFILE_THREADS; ++i) {
+        int expected = VAR_ATOMIC_LOAD(s_Profile.threads[i].tid);
+        if (expected != 0 && expected != -2)
+            continue;
+        if (VAR_ATOMIC_CAS(s_Profile.threads[i].tid, &expected, tid))
+            return profileBind(&s_Profile.threads[i]);
+    }
+    /* all taken, look for records of threads that are gone without
+     * running the key destructor */
+    pid = sysGetPid();
+    for (i = 0; i < PCHECKER_PROFILE_THREADS; ++i) {
+        int owner;
+        pThread = &s_Profile.threads[i];
+        owner = VAR_ATOMIC_LOAD(pThread->tid);
+        if (owner <= 0 || syscall(SYS_tgkill, pid, owner, 0) == 0 || errno != ESRCH)
+            continue;
+        /* -1 while folding, a thread for the same record backs off */
+        if (!VAR_ATOMIC_CAS(pThread->tid, &owner, -1))
+            continue;
+        if (profileFold(pThread, 0)) {
+            VAR_ATOMIC_STORE(pThread->tid, tid);
+            return profileBind(pThread);
+        }
+        VAR_ATOMIC_STORE(pThread->tid, owner);
+    }
+    if (!s_ProfileNoThread)
+        VAR_ATOMIC_FETCH_ADD(s_Profile.lostThreads, 1);
+    s_ProfileNoThread = released + 1;
+    return NULL;
+}
+
+/* per thread, so only plain increments */
+static void profileCall(unsigned slot, const void *callsite)
+{
+    struct profile_thread *pThread = profileThread();
+    struct profile_site *pSite;
+    uint64_t now;
+
+    if (!pThread)
+        return;
+    ++pThread->calls[slot];
+
+    pSite = findSite(pThread->sites, PCHECKER_PROFILE_SITES - 1, callsite, slot);
+    if (!pSite) {
+        ++pThread->dropped;
+        return;
+    }
+    now = pcheckerTicks();
+    if (!pSite->count++)
+        pSite->first = now;
+    pSite->last = now;
+}
+
+static const char *slotName(unsigned slot)
+{
+    static const char *const s_Names[eSlotCount] = {"CLOCK_REALTIME", "CLOCK_MONOTONIC", "CLOCK_PROCESS_CPUTIME_ID",
+        "CLOCK_THREAD_CPUTIME_ID", "CLOCK_MONOTONIC_RAW", "CLOCK_REALTIME_COARSE", "CLOCK_MONOTONIC_COARSE",
+        "CLOCK_BOOTTIME", "CLOCK_REALTIME_ALARM", "CLOCK_BOOTTIME_ALARM", "clock 10", "CLOCK_TAI", "dynamic clock",
+        "gettimeofday", "time"};
+    return s_Names[slot];
+}
+
+/* average cost of a call in ns, 0 if the clock is not supported */
+static uint64_t measureSlot(unsigned slot)
+{
+    enum { eRounds = 64 };
+    struct timespec ts;
+    struct vclock_timeval tv;
+    uint64_t t0, t1;
+    unsigned i;
+
+    if (slot == eSlotDynamic)
+        return 0;
+    if (slot < eSlotClocks && (*s_ResolvedFunctions.pf_clock_gettime)((clockid_t)slot, &ts) != 0)
+        return 0;
+
+    t0 = pcheckerTicks();
+    for (i = 0; i < eRounds; ++i) {
+        if (slot < eSlotClocks)
+            (*s_ResolvedFunctions.pf_clock_gettime)((clockid_t)slot, &ts);
+        else if (slot == eSlotGettimeofday)
+            (*s_ResolvedFunctions.pf_gettimeofday)((struct timeval *)(void *)&tv, NULL);
+        else
+            (*s_ResolvedFunctions.pf_time)(NULL);
+    }
+    t1 = pcheckerTicks();
+    return pcheckerTicksToNs(t1 - t0) / eRounds;
+}
+
+static FUN_INLINE uint64_t perSecond(uint64_t count, uint64_t ticks)
+{
+    double s = (double)ticks / (double)pcheckerTicksPerSec();
+    return s > 0.001 ? (uint64_t)((double)count / s) : 0;
+}
+
+static void writeProfile(struct pchecker_out *o)
+{
+    uint64_t totals[eSlotCount] = {0};
+    uint64_t now = pcheckerTicks();
+    uint64_t base, dropped;
+    unsigned i, k, top, count = 0;
+
+    /* kept, the merged table is reordered below */
+    while (VAR_ATOMIC_FLAG_TESTSET(s_Profile.mergeLock))
+        syscall(SYS_sched_yield);
+    dropped = s_Profile.exitedDropped;
+    for (k = 0; k < eSlotCount; ++k)
+        totals[k] = s_Profile.exitedCalls[k];
+    for (i = 0; i < PCHECKER_PROFILE_THREADS && VAR_ATOMIC_LOAD(s_Profile.threads[i].tid); ++i) {
+        struct profile_thread *pThread = &s_Profile.threads[i];
+        dropped += pThread->dropped;
+        for (k = 0; k < eSlotCount; ++k)
+            totals[k] += pThread->calls[k];
+        for (k = 0; k < PCHECKER_PROFILE_SITES; ++k) {
+            if (pThread->sites[k].count)
+                profileMerge(&pThread->sites[k], &dropped);
+        }
+    }
+
+    /* the vDSO handles a clock in a few ns, falling back to the system
+     * call costs several times the CLOCK_MONOTONIC read */
+    base = measureSlot(CLOCK_MONOTONIC);
+    outStr(o, "\nclock_gettime profile, per clock\n");
+    outStr(o, "clock                              calls     calls/s  ns/call\n");
+    for (k = 0; k < eSlotCount; ++k) {
+        uint64_t cost;
+        if (!totals[k])
+            continue;
+        cost = measureSlot(k);
+        outStrCol(o, slotName(k), 26);
+        outUDec(o, totals[k], 14);
+        outUDec(o, perSecond(totals[k], now - s_Profile.startTicks), 12);
+        outUDec(o, cost, 9);
+        if (k == eSlotDynamic || k == CLOCK_PROCESS_CPUTIME_ID || k == CLOCK_THREAD_CPUTIME_ID ||
+            (base && cost > 3 * base))
+            outStr(o, "  SYSCALL");
+        outChar(o, '\n');
+    }
+
+    outStr(o, "\nper thread\n");
+    outStr(o, "     tid         calls\n");
+    for (i = 0; i < PCHECKER_PROFILE_THREADS && VAR_ATOMIC_LOAD(s_Profile.threads[i].tid); ++i) {
+        uint64_t calls = 0;
+        if (VAR_ATOMIC_LOAD(s_Profile.threads[i].tid) < 0)
+            continue;
+        for (k = 0; k < eSlotCount; ++k)
+            calls += s_Profile.threads[i].calls[k];
+        outSDec(o, VAR_ATOMIC_LOAD(s_Profile.threads[i].tid), 8);
+        outUDec(o, calls, 14);
+        outChar(o, '\n');
+    }
+    if (s_Profile.exitedThreads) {
+        uint64_t calls = 0;
+        for (k = 0; k < eSlotCount; ++k)
+            calls += s_Profile.exitedCalls[k];
+        outStr(o, "  exited");
+        outUDec(o, calls, 14);
+        outStr(o, "  (");
+        outUDec(o, s_Profile.exitedThreads, 0);
+        outStr(o, " threads)\n");
+    }
+
+    /* selection of the hottest callsites, the merged table is not needed anymore */
+    for (i = 0; i < PCHECKER_PROFILE_MERGED; ++i) {
+        if (s_Profile.merged[i].count)
+            s_Profile.merged[count++] = s_Profile.merged[i];
+    }
+    top = (unsigned)pcheckerEnvUnsigned("PCHECKER_GETTIME_TOP", 20);
+    outStr(o, "\nhottest callsites\n");
+    outStr(o, "         calls     calls/s  clock                       callsite\n");
+    for (i = 0; i < top && i < count; ++i) {
+        struct profile_site tmp;
+        unsigned best = i;
+        for (k = i + 1; k < count; ++k) {
+            if (s_Profile.merged[k].count > s_Profile.merged[best].count)
+                best = k;
+        }
+        tmp = s_Profile.merged[i];
+        s_Profile.merged[i] = s_Profile.merged[best];
+        s_Profile.merged[best] = tmp;
+
+        outUDec(o, s_Profile.merged[i].count, 14);
+        outUDec(o, perSecond(s_Profile.merged[i].count, s_Profile.merged[i].last - s_Profile.merged[i].first), 12);
+        outPad(o, 0, 2);
+        outStrCol(o, slotName(s_Profile.merged[i].slot), 26);
+        outPad(o, 0, 2);
+        outSymbol(o, s_Profile.merged[i].callsite);
+        outChar(o, '\n');
+    }
+    if (dropped || VAR_ATOMIC_LOAD(s_Profile.lostThreads)) {
+        outStr(o, "not attributed: ");
+        outUDec(o, dropped, 0);
+        outStr(o, " calls, ");
+        outUDec(o, VAR_ATOMIC_LOAD(s_Profile.lostThreads), 0);
+        outStr(o, " threads\n");
+    }
+    outFlush(o);
+}
+
+static void profileFinish()
+{
+    const char *path = pcheckerEnv("PCHECKER_GETTIME_REPORT");
+    struct pchecker_out o;
+    int fd = 2;
+
+    if (!s_Profile.enabled || !VAR_ATOMIC_LOAD(s_Profile.threads[0].tid))
+        return;
+    /* the report itself must not be counted */
+    s_Profile.enabled = 0;
+    if (path)
+        fd = sysOpen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    outInit(&o, fd);
+    writeProfile(&o);
+    if (fd != 2)
+        sysClose(fd);
+}
+
 __attribute__((__constructor__(101))) static void callResolve()
 {
     /* ensure the resolve function gets called,
@@ -140,36 +666,113 @@ __attribute__((__constructor__(101))) static void callResolve()
     /* DSOs should all be loaded at this point,
      * so don't try again */
     setInitIsDone();
+
+    unwindInit();
+    violationInit();
+    vclockOpen();
+    tscClockInit();
+    traceOpen(PCHECKER_NAME, s_FunctionNames);
+    threadsInit(PCHECKER_NAME, s_FunctionNames);
+    controlInit(s_FunctionNames, NULL);
+
+    s_Profile.startTicks = pcheckerTicks();
+    s_Profile.enabled = pcheckerEnvUnsigned("PCHECKER_GETTIME_PROFILE", 0) != 0;
+    if (s_Profile.enabled) {
+        void *pfCreate = pcheckerLibcSymbol("pthread_key_create");
+        void *pfSet = pcheckerLibcSymbol("pthread_setspecific");
+        pf_pthread_key_create_t pfKeyCreate;
+
+        if (pfCreate && pfSet) {
+            COPY_PF(pfKeyCreate, pf_pthread_key_create_t, pfCreate);
+            COPY_PF(s_Profile.pf_setspecific, pf_pthread_setspecific_t, pfSet);
+            s_Profile.hasKey = (*pfKeyCreate)(&s_Profile.key, &profileExit) == 0;
+        }
+    }
 }
 
-static FUN_INLINE void initAndCheck()
+__attribute__((__destructor__(101))) static void callFinish()
+{
+    traceClose();
+    threadsFinish();
+    controlFinish();
+    profileFinish();
+    tscClockFinish();
+}
+
+static FUN_INLINE void initAndCheck(enum EFunctionIndex func, const void *callsite)
 {
     if (unlikely(!initIsDone())) {
         tryResolve();
     }
 
-    callAssertFunction(0);
+    checkCall(0, func, callsite);
 }
 
 int clock_gettime(clockid_t clock_id, struct timespec *tp)
 {
-    initAndCheck();
-
-    return (*s_ResolvedFunctions.pf_clock_gettime)(clock_id, tp);
+    struct pchecker_trace_record *pTrace;
+    int64_t ns;
+    int r;
+    initAndCheck(eClockGettime, PCHECKER_CALLSITE());
+
+    if (unlikely(s_Profile.enabled))
+        profileCall(profileSlot(clock_id), PCHECKER_CALLSITE());
+    pTrace = traceBegin(eClockGettime, (uint64_t)clock_id, traceArgPtr(tp), 0, PCHECKER_CALLSITE());
+    if ((unlikely(s_VClock.pPage) && vclockRead(clock_id, &ns)) || tscClockRead(clock_id, &ns)) {
+        tp->tv_sec = (time_t)(ns / 1000000000);
+        tp->tv_nsec = (long)(ns % 1000000000);
+        r = 0;
+    }
+    else
+        r = (*s_ResolvedFunctions.pf_clock_gettime)(clock_id, tp);
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
 }
 
 int gettimeofday(struct timeval *tv, struct timezone *tz)
 {
-    initAndCheck();
-
-    return (*s_ResolvedFunctions.pf_gettimeofday)(tv, tz);
+    struct pchecker_trace_record *pTrace;
+    int64_t ns;
+    int r;
+    initAndCheck(eGettimeofday, PCHECKER_CALLSITE());
+
+    if (unlikely(s_Profile.enabled))
+        profileCall(eSlotGettimeofday, PCHECKER_CALLSITE());
+    pTrace = traceBegin(eGettimeofday, traceArgPtr(tv), traceArgPtr(tz), 0, PCHECKER_CALLSITE());
+    if ((unlikely(s_VClock.pPage) && vclockRead(CLOCK_REALTIME, &ns)) || tscClockRead(CLOCK_REALTIME, &ns)) {
+        r = tz ? (*s_ResolvedFunctions.pf_gettimeofday)(NULL, tz) : 0;
+        if (tv) {
+            struct vclock_timeval v;
+            v.tv_sec = (time_t)(ns / 1000000000);
+            v.tv_usec = (suseconds_t)(ns % 1000000000 / 1000);
+            FUN_MEMCPY(tv, &v, sizeof(v));
+        }
+    }
+    else
+        r = (*s_ResolvedFunctions.pf_gettimeofday)(tv, tz);
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
 }
 
 time_t time(time_t *t)
 {
-    initAndCheck();
-
-    return (*s_ResolvedFunctions.pf_time)(t);
+    struct pchecker_trace_record *pTrace;
+    int64_t ns;
+    time_t r;
+    initAndCheck(eTime, PCHECKER_CALLSITE());
+
+    if (unlikely(s_Profile.enabled))
+        profileCall(eSlotTime, PCHECKER_CALLSITE());
+    pTrace = traceBegin(eTime, traceArgPtr(t), 0, 0, PCHECKER_CALLSITE());
+    if ((unlikely(s_VClock.pPage) && vclockRead(CLOCK_REALTIME, &ns)) || tscClockRead(CLOCK_REALTIME, &ns)) {
+        r = (time_t)(ns / 1000000000);
+        if (t)
+            *t = r;
+    }
+    else
+        r = (*s_ResolvedFunctions.pf_time)(t);
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
 }
 
 #ifdef __cplusplus
@@ -6,7 +6,18 @@
  * allocation (which would recursively call into the interposed functions).
  */
 
+#define PCHECKER_NAME "heap-musl"
+
 #include "pchecker.h"
+#include "pchecker_trace.h"
+#include "pchecker_violation.h"
+#include "pchecker_heapstat.h"
+#include "pchecker_heaptrack.h"
+#include "pchecker_heapdefer.h"
+#include "pchecker_heaprec.h"
+#include "pchecker_heapsnap.h"
+#include "pchecker_heapstart.h"
+#include "pchecker_heaphooks.h"
 
 /* Those functins are not available with musl (v1.20) */
 #define CHECKER_EXPORT_REALLOCARRAY 1
@@ -62,7 +73,7 @@ static struct function_table {
 #if CHECKER_EXPORT_PVALLOC == 1
     pf_pvalloc_t pf_pvalloc;
 #endif
-} s_ResolvedFunctions;
+} s_ResolvedFunctions VAR_TABLE;
 
 enum EFunctionIndex {
     eCalloc,
@@ -127,8 +138,9 @@ static int tryResolve(enum EFunctionIndex func)
     state = setState(0);
 
     if (state == 0) {
+        heapStartState(0);
         initTable();
-        state = setState(1);
+        state = heapStartState(setState(1));
     }
 
     if (state <= 1) {
@@ -160,7 +172,7 @@ static int tryResolve(enum EFunctionIndex func)
 
         if (countresolved == eLastBaseFunction) {
             FUN_MEMCPY(&s_ResolvedFunctions, &newfTable, sizeof(pFTable) * eLastBaseFunction);
-            state = setState(2);
+            state = heapStartState(setState(2));
         }
     }
 
@@ -191,7 +203,7 @@ static int tryResolve(enum EFunctionIndex func)
 
         if (countresolved > eLastBaseFunction) {
             FUN_MEMCPY(&s_ResolvedFunctions, &newfTable, sizeof(newfTable));
-            state = setState(3);
+            state = heapStartState(setState(3));
         }
     }
 
@@ -200,24 +212,25 @@ static int tryResolve(enum EFunctionIndex func)
      * completely done */
     if (state >= 2) {
         if (getassert_function(1) && state == 3)
-            state = setResolveIsDone();
+            state = heapStartState(setResolveIsDone());
     }
 
     releaseLock();
     return state;
 }
 
-static FUN_INLINE void initAndCheck(enum EFunctionIndex func)
+static FUN_INLINE void initAndCheck(enum EFunctionIndex func, const void *callsite)
 {
     if (unlikely(!initIsDone())) {
         tryResolve(func);
     }
 
-    callAssertFunction(1);
+    checkCall(1, func, callsite);
 }
 
 __attribute__((__constructor__(101))) static void callResolve()
 {
+    heapStartInit();
     /* ensure the resolve function gets called,
      * hopefully before threads are spawned */
     if (!initIsDone())
@@ -225,6 +238,30 @@ __attribute__((__constructor__(101))) static void callResolve()
     /* DSOs should all be loaded at this point,
      * so don't try again */
     setInitIsDone();
+
+    unwindInit();
+    violationInit();
+    traceOpen(PCHECKER_NAME, s_FunctionNames);
+    threadsInit(PCHECKER_NAME, s_FunctionNames);
+    heapStatInit();
+    heapTrackInit();
+    heapSnapInit();
+    heapRecInit();
+    heapDeferInit(s_ResolvedFunctions.pf_free);
+    controlInit(s_FunctionNames, &heapStatControl);
+    heapStartMark("constructor done", -1);
+}
+
+__attribute__((__destructor__(101))) static void callFinish()
+{
+    traceClose();
+    threadsFinish();
+    controlFinish();
+    heapStatFinish();
+    heapTrackFinish();
+    heapRecFinish();
+    heapDeferFinish();
+    heapStartFinish();
 }
 
 #define DO_INIT_NO_FALLBACK(e, n)                        \
@@ -233,78 +270,143 @@ __attribute__((__constructor__(101))) static void callResolve()
         int isInitDone = initIsDone();                   \
         pf = s_ResolvedFunctions.pf_##n;                 \
         if (unlikely(!isInitDone)) { \
+            heapStartEarly(0);                       \
             tryResolve(e);                           \
             pf = s_ResolvedFunctions.pf_##n;             \
             if (!pf)                          \
                 do_abort();                              \
         }                                                \
-        callAssertFunction(1);                           \
+        checkCall(1, e, PCHECKER_CALLSITE());            \
     } while (0)
 
 void *calloc(size_t nmemb, size_t size)
 {
+    struct pchecker_trace_record *pTrace;
+    void *r;
     DO_INIT_NO_FALLBACK(eCalloc, calloc);
 
-    return (*pf)(nmemb, size);
+    pTrace = traceBegin(eCalloc, nmemb, size, 0, PCHECKER_CALLSITE());
+    r = (*pf)(nmemb, size);
+    heapHooksCalloc(r, nmemb * size, PCHECKER_CALLSITE());
+    traceEnd(pTrace, traceArgPtr(r));
+    return r;
 }
 void *malloc(size_t size)
 {
+    struct pchecker_trace_record *pTrace;
+    void *r;
     DO_INIT_NO_FALLBACK(eMalloc, malloc);
 
-    return (*pf)(size);
+    pTrace = traceBegin(eMalloc, size, 0, 0, PCHECKER_CALLSITE());
+    r = (*pf)(size);
+    heapHooksAlloc(r, size, 0, PCHECKER_CALLSITE());
+    traceEnd(pTrace, traceArgPtr(r));
+    return r;
 }
 void free(void *ptr)
 {
+    struct pchecker_trace_record *pTrace;
     DO_INIT_NO_FALLBACK(eFree, free);
 
-    (*pf)(ptr);
+    pTrace = traceBegin(eFree, traceArgPtr(ptr), 0, 0, PCHECKER_CALLSITE());
+    if (!heapHooksFree(ptr, eFree, PCHECKER_CALLSITE()))
+        (*pf)(ptr);
+    traceEnd(pTrace, 0);
 }
 void *realloc(void *ptr, size_t size)
 {
+    struct pchecker_trace_record *pTrace;
+    struct heaphooks_realloc old;
+    void *r;
     DO_INIT_NO_FALLBACK(eRealloc, realloc);
 
-    return (*pf)(ptr, size);
+    pTrace = traceBegin(eRealloc, traceArgPtr(ptr), size, 0, PCHECKER_CALLSITE());
+    heapHooksReallocBegin(ptr, &old);
+    r = (*pf)(ptr, size);
+    heapHooksReallocEnd(ptr, &old, r, size, PCHECKER_CALLSITE());
+    traceEnd(pTrace, traceArgPtr(r));
+    return r;
 }
 
 #if CHECKER_EXPORT_REALLOCARRAY == 1
 void *reallocarray(void *ptr, size_t nmemb, size_t size)
 {
+    struct pchecker_trace_record *pTrace;
+    struct heaphooks_realloc old;
+    void *r;
     DO_INIT_NO_FALLBACK(eReallocArray, reallocarray);
 
-    return (*pf)(ptr, nmemb, size);
+    pTrace = traceBegin(eReallocArray, traceArgPtr(ptr), nmemb, size, PCHECKER_CALLSITE());
+    heapHooksReallocBegin(ptr, &old);
+    r = (*pf)(ptr, nmemb, size);
+    heapHooksReallocEnd(ptr, &old, r, heapHooksArraySize(nmemb, size), PCHECKER_CALLSITE());
+    traceEnd(pTrace, traceArgPtr(r));
+    return r;
 }
 #endif
 void *memalign(size_t alignment, size_t size)
 {
+    struct pchecker_trace_record *pTrace;
+    void *r;
     DO_INIT_NO_FALLBACK(eMemalign, memalign);
 
-    return (*pf)(alignment, size);
+    pTrace = traceBegin(eMemalign, alignment, size, 0, PCHECKER_CALLSITE());
+    r = (*pf)(alignment, size);
+    heapHooksAlloc(r, size, alignment, PCHECKER_CALLSITE());
+    traceEnd(pTrace, traceArgPtr(r));
+    return r;
 }
 int posix_memalign(void **memptr, size_t alignment, size_t size)
 {
+    struct pchecker_trace_record *pTrace;
+    int r;
     DO_INIT_NO_FALLBACK(ePosixMemalign, posix_memalign);
 
-    return (*pf)(memptr, alignment, size);
+    pTrace = traceBegin(ePosixMemalign, traceArgPtr(memptr), alignment, size, PCHECKER_CALLSITE());
+    r = (*pf)(memptr, alignment, size);
+    if (r == 0) {
+        heapHooksAlloc(*memptr, size, alignment, PCHECKER_CALLSITE());
+    }
+    traceEnd(pTrace, r == 0 ? traceArgPtr(*memptr) : 0);
+    return r;
 }
 void *aligned_alloc(size_t alignment, size_t size)
 {
+    struct pchecker_trace_record *pTrace;
+    void *r;
     DO_INIT_NO_FALLBACK(eAlignedAlloc, aligned_alloc);
 
-    return (*pf)(alignment, size);
+    pTrace = traceBegin(eAlignedAlloc, alignment, size, 0, PCHECKER_CALLSITE());
+    r = (*pf)(alignment, size);
+    heapHooksAlloc(r, size, alignment, PCHECKER_CALLSITE());
+    traceEnd(pTrace, traceArgPtr(r));
+    return r;
 }
 /* No static fallbacks for the remaining functions */
 void *valloc(size_t size)
 {
+    struct pchecker_trace_record *pTrace;
+    void *r;
     DO_INIT_NO_FALLBACK(eValloc, valloc);
 
-    return (*pf)(size);
+    pTrace = traceBegin(eValloc, size, 0, 0, PCHECKER_CALLSITE());
+    r = (*pf)(size);
+    heapHooksAlloc(r, size, 4096, PCHECKER_CALLSITE()); /* page aligned */
+    traceEnd(pTrace, traceArgPtr(r));
+    return r;
 }
 #if CHECKER_EXPORT_PVALLOC == 1
 void *pvalloc(size_t size)
 {
+    struct pchecker_trace_record *pTrace;
+    void *r;
     DO_INIT_NO_FALLBACK(ePValloc, pvalloc);
 
-    return (*pf)(size);
+    pTrace = traceBegin(ePValloc, size, 0, 0, PCHECKER_CALLSITE());
+    r = (*pf)(size);
+    heapHooksAlloc(r, size, 4096, PCHECKER_CALLSITE()); /* page aligned */
+    traceEnd(pTrace, traceArgPtr(r));
+    return r;
 }
 #endif
 
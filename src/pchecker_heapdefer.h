@@ -0,0 +1,320 @@
+/*
+ * deferred free of the heap checkers, for code that frees in RT threads.
+ *
+ * free can consolidate chunks and give memory back with munmap or by
+ * trimming the heap, which takes the mmap lock. With PCHECKER_HEAP_DEFER
+ * set to a period in ms (default off), free calls from RT threads and
+ * critical sections still get checked, but unless suppressed or disabled
+ * on the control socket, instead of the real free the block is pushed
+ * onto a lock-free list of the calling thread, and a helper thread frees
+ * the lists every period. The link is stored in the
+ * freed block itself, so the push never allocates.
+ *
+ * The depth of the lists and the time from the push to the real free are
+ * written at exit to stderr or PCHECKER_HEAP_DEFER_REPORT, on demand by
+ * pchecker_heap_defer_dump(fd), pchecker_heap_defer_depth() returns the
+ * blocks waiting. Threads beyond PCHECKER_HEAPDEFER_THREADS free directly.
+ * Once all slots are taken, the helper releases one slot per period whose
+ * thread has exited and whose list is empty, threads freeing directly try
+ * again after a release. A fork child frees its lists and stops deferring.
+ */
+
+#ifndef PCHECKER_HEAPDEFER_H
+#define PCHECKER_HEAPDEFER_H
+
+#include <errno.h>
+
+#include "pchecker_util.h"
+#include "pchecker_helper.h"
+#include "pchecker_violation.h"
+#include "pchecker_heapstat.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PCHECKER_HEAPDEFER_THREADS
+#define PCHECKER_HEAPDEFER_THREADS 64
+#endif
+
+typedef void (*pf_heapdefer_free_t)(void *ptr);
+
+struct heapdefer_thread {
+    VAR_ATOMIC(int) tid; /* 0 never used, -1 released */
+    VAR_ATOMIC(void *) head; /* single producer, taken whole by the helper */
+    VAR_ATOMIC(uint64_t) pushTicks; /* when head went from empty to non-empty */
+    VAR_ATOMIC(uint64_t) deferred;
+    VAR_ATOMIC(uint64_t) freed;
+};
+
+static struct heapdefer_state {
+    pf_heapdefer_free_t pf_free; /* set if deferring is enabled */
+    uint64_t periodNs;
+    VAR_ATOMIC_FLAG lock; /* held while collecting */
+    VAR_ATOMIC(unsigned) lostThreads;
+    VAR_ATOMIC(unsigned) released; /* slots released so far */
+    /* written by the holder of lock */
+    unsigned reapNext;
+    uint64_t exitedDeferred;
+    uint64_t batches;
+    uint64_t maxDepth;
+    uint64_t maxLatencyNs;
+    uint64_t sumLatencyNs;
+    struct heapdefer_thread threads[PCHECKER_HEAPDEFER_THREADS];
+} s_HeapDefer;
+
+static VAR_TLS struct heapdefer_thread *s_pHeapDeferThread;
+static VAR_TLS unsigned s_HeapDeferNoThread; /* released + 1 when no slot was left */
+
+DSO_PUBLIC void pchecker_heap_defer_dump(int fd);
+DSO_PUBLIC uint64_t pchecker_heap_defer_depth(void);
+
+static FUN_INLINE struct heapdefer_thread *heapDeferThread()
+{
+    struct heapdefer_thread *pThread = s_pHeapDeferThread;
+    unsigned released, i;
+    int tid;
+
+    if (pThread)
+        return pThread;
+    released = VAR_ATOMIC_LOAD(s_HeapDefer.released);
+    if (s_HeapDeferNoThread == released + 1)
+        return NULL;
+
+    tid = pcheckerGetTid();
+    for (i = 0; i < PCHECKER_HEAPDEFER_THREADS; ++i) {
+        int expected = VAR_ATOMIC_LOAD(s_HeapDefer.threads[i].tid);
+        if (expected > 0)
+            continue;
+        if (VAR_ATOMIC_CAS(s_HeapDefer.threads[i].tid, &expected, tid)) {
+            s_pHeapDeferThread = &s_HeapDefer.threads[i];
+            return s_pHeapDeferThread;
+        }
+    }
+    if (!s_HeapDeferNoThread)
+        VAR_ATOMIC_FETCH_ADD(s_HeapDefer.lostThreads, 1);
+    s_HeapDeferNoThread = released + 1;
+    return NULL;
+}
+
+/* call instead of the real free, returns 1 if the block was deferred */
+/* func is the index of free in the function table of the checker */
+static FUN_INLINE int heapDeferFree(void *ptr, unsigned func, const void *callsite)
+{
+    struct heapdefer_thread *pThread;
+    void *head;
+
+    if (!s_HeapDefer.pf_free || !ptr || !isCheckedRt(func, callsite))
+        return 0;
+    pThread = heapDeferThread();
+    if (!pThread)
+        return 0;
+
+    head = VAR_ATOMIC_LOAD(pThread->head);
+    do {
+        if (!head)
+            VAR_ATOMIC_STORE(pThread->pushTicks, pcheckerTicks());
+        FUN_MEMCPY(ptr, &head, sizeof(head));
+    } while (!VAR_ATOMIC_CAS(pThread->head, &head, ptr));
+    VAR_ATOMIC_FETCH_ADD(pThread->deferred, 1);
+    return 1;
+}
+
+static FUN_INLINE uint64_t heapDeferDepth()
+{
+    uint64_t deferred = 0, freed = 0;
+    unsigned i;
+
+    for (i = 0; i < PCHECKER_HEAPDEFER_THREADS && VAR_ATOMIC_LOAD(s_HeapDefer.threads[i].tid); ++i) {
+        freed += VAR_ATOMIC_LOAD(s_HeapDefer.threads[i].freed);
+        deferred += VAR_ATOMIC_LOAD(s_HeapDefer.threads[i].deferred);
+    }
+    return deferred - freed;
+}
+
+/* with all slots taken, release one slot of an exited thread with an empty
+ * list, holding lock. A released slot keeps the tid -1 so the lists stay
+ * dense, its counts move to exitedDeferred. */
+static FUN_INLINE void heapDeferReap()
+{
+    struct heapdefer_thread *p;
+    int tid;
+
+    if (VAR_ATOMIC_LOAD(s_HeapDefer.threads[PCHECKER_HEAPDEFER_THREADS - 1].tid) == 0)
+        return;
+    p = &s_HeapDefer.threads[s_HeapDefer.reapNext];
+    s_HeapDefer.reapNext = (s_HeapDefer.reapNext + 1) % PCHECKER_HEAPDEFER_THREADS;
+    tid = VAR_ATOMIC_LOAD(p->tid);
+    if (tid <= 0 || VAR_ATOMIC_LOAD(p->head) ||
+        syscall(SYS_tgkill, sysGetPid(), tid, 0) == 0 || errno != ESRCH)
+        return;
+    /* freed first, depth is rather overestimated in between */
+    s_HeapDefer.exitedDeferred += VAR_ATOMIC_LOAD(p->deferred);
+    VAR_ATOMIC_STORE(p->freed, 0);
+    VAR_ATOMIC_STORE(p->deferred, 0);
+    VAR_ATOMIC_STORE(p->tid, -1);
+    VAR_ATOMIC_FETCH_ADD(s_HeapDefer.released, 1);
+}
+
+/* free all lists, with wait == 0 only if no one else does */
+static FUN_INLINE void heapDeferCollect(int wait)
+{
+    uint64_t depth;
+    unsigned i;
+
+    while (VAR_ATOMIC_FLAG_TESTSET(s_HeapDefer.lock)) {
+        if (!wait)
+            return;
+        syscall(SYS_sched_yield);
+    }
+
+    depth = heapDeferDepth();
+    if (depth > s_HeapDefer.maxDepth)
+        s_HeapDefer.maxDepth = depth;
+
+    for (i = 0; i < PCHECKER_HEAPDEFER_THREADS && VAR_ATOMIC_LOAD(s_HeapDefer.threads[i].tid); ++i) {
+        struct heapdefer_thread *p = &s_HeapDefer.threads[i];
+        void *ptr = VAR_ATOMIC_EXCHANGE(p->head, (void *)NULL);
+        uint64_t ns, n = 0;
+
+        if (!ptr)
+            continue;
+        /* pushTicks can be a little newer if the thread pushed again
+         * in between, the latency is rather underestimated */
+        ns = pcheckerTicksToNs(pcheckerTicks() - VAR_ATOMIC_LOAD(p->pushTicks));
+        while (ptr) {
+            void *next;
+            FUN_MEMCPY(&next, ptr, sizeof(next));
+            (*s_HeapDefer.pf_free)(ptr);
+            ptr = next;
+            ++n;
+        }
+        VAR_ATOMIC_FETCH_ADD(p->freed, n);
+        ++s_HeapDefer.batches;
+        s_HeapDefer.sumLatencyNs += ns;
+        if (ns > s_HeapDefer.maxLatencyNs)
+            s_HeapDefer.maxLatencyNs = ns;
+    }
+    heapDeferReap();
+    VAR_ATOMIC_FLAG_CLEAR(s_HeapDefer.lock);
+}
+
+static void *heapDeferRun(void *pArg)
+{
+    uint64_t next = sysMonotonicNs();
+    (void)pArg;
+
+    /* not SCHED_IDLE, the lists grow as long as it does not run */
+    pcheckerHelperSetup("pchk-heapdefer", PCHECKER_SCHED_OTHER);
+    for (;;) {
+        next += s_HeapDefer.periodNs;
+        pcheckerHelperSleepUntil(next);
+        heapDeferCollect(0);
+    }
+    return NULL;
+}
+
+uint64_t pchecker_heap_defer_depth(void)
+{
+    return heapDeferDepth();
+}
+
+void pchecker_heap_defer_dump(int fd)
+{
+    struct pchecker_out o;
+    uint64_t batches = s_HeapDefer.batches;
+    unsigned i;
+
+    if (!s_HeapDefer.pf_free)
+        return;
+    outInit(&o, fd);
+    outStr(&o, "\ndeferred free, period ");
+    outUDec(&o, s_HeapDefer.periodNs / 1000000u, 0);
+    outStr(&o, " ms\n");
+    outStr(&o, "     tid  deferred     freed   waiting\n");
+    for (i = 0; i < PCHECKER_HEAPDEFER_THREADS && VAR_ATOMIC_LOAD(s_HeapDefer.threads[i].tid); ++i) {
+        const struct heapdefer_thread *p = &s_HeapDefer.threads[i];
+        uint64_t deferred = VAR_ATOMIC_LOAD(p->deferred), freed = VAR_ATOMIC_LOAD(p->freed);
+
+        if (VAR_ATOMIC_LOAD(p->tid) < 0)
+            continue;
+        outSDec(&o, VAR_ATOMIC_LOAD(p->tid), 8);
+        outUDec(&o, deferred, 10);
+        outUDec(&o, freed, 10);
+        outUDec(&o, deferred - freed, 10);
+        outChar(&o, '\n');
+    }
+    if (s_HeapDefer.exitedDeferred) {
+        outStr(&o, "  exited");
+        outUDec(&o, s_HeapDefer.exitedDeferred, 10);
+        outUDec(&o, s_HeapDefer.exitedDeferred, 10);
+        outUDec(&o, 0, 10);
+        outChar(&o, '\n');
+    }
+    outStr(&o, "max waiting ");
+    outUDec(&o, s_HeapDefer.maxDepth, 0);
+    outStr(&o, ", batches ");
+    outUDec(&o, batches, 0);
+    outStr(&o, ", latency us avg ");
+    outUDec(&o, batches ? s_HeapDefer.sumLatencyNs / batches / 1000u : 0, 0);
+    outStr(&o, " max ");
+    outUDec(&o, s_HeapDefer.maxLatencyNs / 1000u, 0);
+    outChar(&o, '\n');
+    if (VAR_ATOMIC_LOAD(s_HeapDefer.lostThreads)) {
+        outStr(&o, "threads freeing directly: ");
+        outUDec(&o, VAR_ATOMIC_LOAD(s_HeapDefer.lostThreads), 0);
+        outChar(&o, '\n');
+    }
+    outFlush(&o);
+}
+
+/* the child has no helper, free what the parent left and stop deferring */
+static void heapDeferForkChild()
+{
+    pcheckerResetTid();
+    if (!s_HeapDefer.pf_free)
+        return;
+    VAR_ATOMIC_FLAG_CLEAR(s_HeapDefer.lock);
+    heapDeferCollect(1);
+    s_HeapDefer.pf_free = NULL;
+}
+
+/* call from the constructor with the real free */
+static FUN_INLINE void heapDeferInit(pf_heapdefer_free_t pf)
+{
+    uint64_t ms = pcheckerEnvUnsigned("PCHECKER_HEAP_DEFER", 0);
+
+    if (!ms || !pf)
+        return;
+    s_HeapDefer.periodNs = ms * 1000000u;
+    if (pcheckerStartHelper(&heapDeferRun, NULL) != 0) {
+        heapStatWarn("cannot start the deferred free thread, freeing directly");
+        return;
+    }
+    s_HeapDefer.pf_free = pf;
+    pthread_atfork(NULL, NULL, &heapDeferForkChild);
+}
+
+/* call from the destructor, frees what is left */
+static FUN_INLINE void heapDeferFinish()
+{
+    const char *path = pcheckerEnv("PCHECKER_HEAP_DEFER_REPORT");
+    int fd = 2;
+
+    if (!s_HeapDefer.pf_free)
+        return;
+    heapDeferCollect(1);
+    if (path)
+        fd = sysOpen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    pchecker_heap_defer_dump(fd);
+    if (fd != 2)
+        sysClose(fd);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,87 @@
+/*
+ * the bookkeeping of the heap checkers around the real heap functions.
+ *
+ * heap, heap-glibc and heap-musl differ in how they find the functions of
+ * the allocator, the statistics, block tracking, recording, startup profile
+ * and deferred free they feed are the same. The interposed functions call
+ * these after the allocator returned, heapHooksFree before the block is
+ * released and heapHooksReallocBegin/End around the call. The call trace
+ * stays in the interposed functions, its arguments differ per function.
+ */
+
+#ifndef PCHECKER_HEAPHOOKS_H
+#define PCHECKER_HEAPHOOKS_H
+
+#include "pchecker_heapstat.h"
+#include "pchecker_heaptrack.h"
+#include "pchecker_heapdefer.h"
+#include "pchecker_heaprec.h"
+#include "pchecker_heapstart.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the old block, taken before the realloc */
+struct heaphooks_realloc {
+    size_t oldSize;
+    struct heaptrack_block block;
+};
+
+/* alignment 0 for the default */
+static FUN_INLINE void heapHooksAlloc(void *r, size_t size, size_t alignment, const void *callsite)
+{
+    heapStatAlloc(r);
+    heapTrackAlloc(r, size, callsite);
+    heapRecAlloc(r, size, alignment);
+    heapStartAlloc(size, callsite);
+}
+
+static FUN_INLINE void heapHooksCalloc(void *r, size_t size, const void *callsite)
+{
+    heapStatAlloc(r);
+    heapTrackAlloc(r, size, callsite);
+    heapRecCalloc(r, size);
+    heapStartAlloc(size, callsite);
+}
+
+/* func is the index of free in the function table of the checker,
+ * returns 1 if the block was deferred, else the caller frees it */
+static FUN_INLINE int heapHooksFree(void *ptr, unsigned func, const void *callsite)
+{
+    heapStatFree(ptr);
+    heapTrackFree(ptr, callsite);
+    heapRecFree(ptr);
+    return heapDeferFree(ptr, func, callsite);
+}
+
+static FUN_INLINE void heapHooksReallocBegin(void *ptr, struct heaphooks_realloc *pOld)
+{
+    pOld->oldSize = heapStatSize(ptr);
+    heapTrackReallocBegin(ptr, &pOld->block);
+}
+
+/* size 0 with a NULL result means the block was freed, else a NULL
+ * result leaves it alone */
+static FUN_INLINE void heapHooksReallocEnd(void *ptr, struct heaphooks_realloc *pOld, void *r, size_t size,
+                                           const void *callsite)
+{
+    heapStatRealloc(ptr, pOld->oldSize, r, size);
+    heapTrackReallocEnd(ptr, &pOld->block, r, size, callsite);
+    heapRecRealloc(ptr, r, size);
+    if (r)
+        heapStartAlloc(size, callsite);
+}
+
+/* the size for the hooks of reallocarray, saturated on overflow where
+ * reallocarray fails and keeps the block */
+static FUN_INLINE size_t heapHooksArraySize(size_t nmemb, size_t size)
+{
+    return nmemb && size > SIZE_MAX / nmemb ? SIZE_MAX : nmemb * size;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * recording of the heap operations for offline replay, see pchecker_replay.
+ *
+ * With PCHECKER_HEAP_RECORD set to a path prefix every allocation, free
+ * and realloc is written as a 40 byte record (operation, size, alignment,
+ * pointer, thread, TSC timestamp) to <prefix>.<checker>.<pid>, a shared
+ * mapping of the file like the binary call trace. Unlike the trace this
+ * is not a ring: a replay needs the operations from the start, so
+ * recording stops after PCHECKER_HEAP_RECORD_OPS records (default 4M).
+ * The file is sized for all of them up front, unused pages stay sparse.
+ */
+
+#ifndef PCHECKER_HEAPREC_H
+#define PCHECKER_HEAPREC_H
+
+#include "pchecker_util.h"
+#include "pchecker_traceformat.h"
+#include "pchecker_heapstat.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static struct heaprec_state {
+    struct pchecker_heaprec_header *pHeader;
+    struct pchecker_heaprec_record *pRecords;
+    uint64_t capacity;
+} s_HeapRec;
+
+static FUN_INLINE unsigned heapRecAlignLog2(size_t alignment)
+{
+    unsigned n = 0;
+
+    while (n < 63 && ((size_t)1 << n) < alignment)
+        ++n;
+    return n;
+}
+
+static FUN_INLINE void heapRecWrite(unsigned op, const void *ptr, const void *oldPtr, size_t size, size_t alignment)
+{
+    struct pchecker_heaprec_record *pRec;
+    uint64_t index;
+
+    if (!s_HeapRec.pRecords)
+        return;
+    index = VAR_ATOMIC_FETCH_ADD(s_HeapRec.pHeader->writeIndex, 1);
+    if (index >= s_HeapRec.capacity)
+        return;
+
+    pRec = &s_HeapRec.pRecords[index];
+    pRec->ptr = (uint64_t)(uintptr_t)ptr;
+    pRec->oldPtr = (uint64_t)(uintptr_t)oldPtr;
+    pRec->size = size;
+    pRec->tid = (uint32_t)pcheckerGetTid();
+    pRec->op = (uint8_t)op;
+    pRec->alignLog2 = (uint8_t)(alignment > sizeof(void *) * 2 ? heapRecAlignLog2(alignment) : 0);
+    pRec->reserved = 0;
+    MEM_BARRIER();
+    pRec->ticks = pcheckerTicks();
+}
+
+/* call after the allocation returned, alignment 0 for the default */
+static FUN_INLINE void heapRecAlloc(const void *ptr, size_t size, size_t alignment)
+{
+    if (ptr)
+        heapRecWrite(eHeapRecMalloc, ptr, NULL, size, alignment);
+}
+
+static FUN_INLINE void heapRecCalloc(const void *ptr, size_t size)
+{
+    if (ptr)
+        heapRecWrite(eHeapRecCalloc, ptr, NULL, size, 0);
+}
+
+/* call before the block is released */
+static FUN_INLINE void heapRecFree(const void *ptr)
+{
+    if (ptr)
+        heapRecWrite(eHeapRecFree, ptr, NULL, 0, 0);
+}
+
+/* call after realloc returned; a failed realloc leaves the block alone */
+static FUN_INLINE void heapRecRealloc(const void *oldPtr, const void *ptr, size_t size)
+{
+    if (ptr || !size)
+        heapRecWrite(eHeapRecRealloc, ptr, oldPtr, size, 0);
+}
+
+/* call from the constructor */
+static FUN_INLINE void heapRecInit()
+{
+    const char *prefix = pcheckerEnv("PCHECKER_HEAP_RECORD");
+    struct pchecker_heaprec_header *pHeader;
+    uint64_t size;
+    unsigned pos;
+    char path[512];
+    void *pMap;
+    int fd;
+
+    if (!prefix)
+        return;
+
+    s_HeapRec.capacity = pcheckerEnvUnsigned("PCHECKER_HEAP_RECORD_OPS", 4 * 1024 * 1024);
+    size = 4096 + s_HeapRec.capacity * sizeof(struct pchecker_heaprec_record);
+
+    pos = appendStr(path, sizeof(path), 0, prefix);
+    pos = appendStr(path, sizeof(path), pos, ".");
+    pos = appendStr(path, sizeof(path), pos, PCHECKER_NAME);
+    pos = appendStr(path, sizeof(path), pos, ".");
+    appendUDec(path, sizeof(path), pos, (uint64_t)sysGetPid());
+
+    fd = sysOpen(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        heapStatWarn("cannot create the heap recording");
+        return;
+    }
+    if (sysFtruncate(fd, (long)size) != 0) {
+        sysClose(fd);
+        heapStatWarn("cannot size the heap recording");
+        return;
+    }
+    pMap = sysMmap(NULL, (size_t)size, PCHECKER_PROT_READ | PCHECKER_PROT_WRITE, PCHECKER_MAP_SHARED, fd, 0);
+    sysClose(fd);
+    if (pMap == PCHECKER_MAP_FAILED) {
+        heapStatWarn("cannot map the heap recording");
+        return;
+    }
+
+    /* the file is new and zero filled */
+    pHeader = (struct pchecker_heaprec_header *)pMap;
+    FUN_MEMCPY(pHeader->magic, PCHECKER_HEAPREC_MAGIC, sizeof(pHeader->magic));
+    pHeader->version = PCHECKER_HEAPREC_VERSION;
+    pHeader->headerSize = sizeof(*pHeader);
+    pHeader->recordSize = sizeof(struct pchecker_heaprec_record);
+    pHeader->pid = sysGetPid();
+    pHeader->recordCapacity = s_HeapRec.capacity;
+    pHeader->recordOffset = 4096;
+    appendStr(pHeader->checker, sizeof(pHeader->checker), 0, PCHECKER_NAME);
+    pHeader->ticksPerSec = pcheckerTicksPerSec();
+    pHeader->startTicks = pcheckerTicks();
+    pHeader->startNs = sysMonotonicNs();
+
+    s_HeapRec.pRecords = (struct pchecker_heaprec_record *)((char *)pMap + pHeader->recordOffset);
+    s_HeapRec.pHeader = pHeader;
+}
+
+/* call from the destructor, the mapping stays for later frees */
+static FUN_INLINE void heapRecFinish()
+{
+    uint64_t written;
+    struct pchecker_out o;
+
+    if (!s_HeapRec.pHeader)
+        return;
+    written = VAR_ATOMIC_LOAD(s_HeapRec.pHeader->writeIndex);
+    if (written <= s_HeapRec.capacity)
+        return;
+    outInit(&o, 2);
+    outStr(&o, "pchecker(" PCHECKER_NAME "): heap recording full, ");
+    outUDec(&o, written - s_HeapRec.capacity, 0);
+    outStr(&o, " operations not recorded, raise PCHECKER_HEAP_RECORD_OPS\n");
+    outFlush(&o);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
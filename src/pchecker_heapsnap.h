@@ -0,0 +1,307 @@
+/*
+ * heap snapshots on a signal, for processes that cannot be stopped or
+ * attached to with a debugger.
+ *
+ * PCHECKER_HEAP_SNAPSHOT sets a path prefix, the heap checker then keeps
+ * every live block in the table of the analysis modes (see
+ * pchecker_heaptrack.h, PCHECKER_HEAP_ENTRIES sizes it) and installs a
+ * handler for PCHECKER_HEAP_SNAPSHOT_SIGNAL (a number or USR1, USR2,
+ * default USR2). The handler only counts the request and wakes a helper
+ * thread at SCHED_OTHER, which walks the table and writes
+ * <prefix>.<checker>.<pid>.<n>: the live bytes and blocks per size class,
+ * the top PCHECKER_HEAP_TOP callsites by live bytes and, unless
+ * PCHECKER_HEAP_SNAPSHOT_BLOCKS=0, every live block.
+ *
+ * Nothing is stopped, the table is read while the threads keep
+ * allocating. Blocks allocated or freed during the walk may be missed or
+ * counted, the snapshot is exact only for a heap at rest.
+ */
+
+#ifndef PCHECKER_HEAPSNAP_H
+#define PCHECKER_HEAPSNAP_H
+
+#include "pchecker_util.h"
+#include "pchecker_helper.h"
+#include "pchecker_heaptrack.h"
+
+#include <signal.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* size classes of the snapshot, powers of two up to 1 TiB */
+#define PCHECKER_HEAPSNAP_CLASSES 41
+
+enum {
+    PCHECKER_FUTEX_WAIT_PRIVATE = 128,
+    PCHECKER_FUTEX_WAKE_PRIVATE = 129
+};
+
+static struct heapsnap_state {
+    const char *prefix; /* set if enabled */
+    int signal;
+    int blocks;
+    VAR_ATOMIC(int) requests; /* futex word, counts the signals */
+    struct sigaction previous;
+    uint64_t startNs;
+    unsigned written;
+    /* used by the helper only */
+    uint64_t classBlocks[PCHECKER_HEAPSNAP_CLASSES];
+    uint64_t classBytes[PCHECKER_HEAPSNAP_CLASSES];
+    uint64_t siteBlocks[PCHECKER_HEAPTRACK_SITES + 1]; /* 0 for unknown */
+    uint64_t siteBytes[PCHECKER_HEAPTRACK_SITES + 1];
+    unsigned order[PCHECKER_HEAPTRACK_SITES + 1];
+} s_HeapSnap;
+
+static void heapSnapSignal(int sig, siginfo_t *pInfo, void *pContext)
+{
+    VAR_ATOMIC_FETCH_ADD(s_HeapSnap.requests, 1);
+    syscall(SYS_futex, &s_HeapSnap.requests, PCHECKER_FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+
+    /* someone else had the signal before us */
+    if (s_HeapSnap.previous.sa_flags & SA_SIGINFO)
+        (*s_HeapSnap.previous.sa_sigaction)(sig, pInfo, pContext);
+    else if (s_HeapSnap.previous.sa_handler != SIG_DFL && s_HeapSnap.previous.sa_handler != SIG_IGN)
+        (*s_HeapSnap.previous.sa_handler)(sig);
+}
+
+static FUN_INLINE unsigned heapSnapClass(uint64_t size)
+{
+    unsigned c = 0;
+
+    while (c < PCHECKER_HEAPSNAP_CLASSES - 1 && ((uint64_t)1 << c) < size)
+        ++c;
+    return c;
+}
+
+/* a consistent copy of a table entry, 0 if it is empty or changed meanwhile */
+static FUN_INLINE uintptr_t heapSnapEntry(const struct heaptrack_entry *pEntry, struct heaptrack_block *pBlock)
+{
+    uintptr_t key = VAR_ATOMIC_LOAD(pEntry->key);
+
+    if (key <= eTrackDeleted)
+        return 0;
+    FUN_MEMCPY(pBlock, &pEntry->block, sizeof(*pBlock));
+    MEM_BARRIER();
+    return VAR_ATOMIC_LOAD(pEntry->key) == key ? key : 0;
+}
+
+static FUN_INLINE const void *heapSnapCallsite(uint32_t site)
+{
+    return site ? (const void *)VAR_ATOMIC_LOAD(s_HeapTrack.sites[site - 1].callsite) : NULL;
+}
+
+static void heapSnapWrite(struct pchecker_out *o, unsigned top)
+{
+    struct heaptrack_entry *pEntries = s_HeapTrack.pEntries;
+    uint64_t i, blocks = 0, bytes = 0, startNs = sysMonotonicNs();
+    unsigned c, k, count = 0;
+
+    for (c = 0; c < PCHECKER_HEAPSNAP_CLASSES; ++c) {
+        s_HeapSnap.classBlocks[c] = 0;
+        s_HeapSnap.classBytes[c] = 0;
+    }
+    for (k = 0; k <= PCHECKER_HEAPTRACK_SITES; ++k) {
+        s_HeapSnap.siteBlocks[k] = 0;
+        s_HeapSnap.siteBytes[k] = 0;
+    }
+
+    outStr(o, "heap snapshot ");
+    outUDec(o, s_HeapSnap.written, 0);
+    outStr(o, " of pid ");
+    outUDec(o, (uint64_t)sysGetPid(), 0);
+    outStr(o, " after ");
+    outUDec(o, (startNs - s_HeapSnap.startNs) / 1000000u, 0);
+    outStr(o, " ms\n");
+
+    for (i = 0; i <= s_HeapTrack.mask; ++i) {
+        struct heaptrack_block block;
+        uintptr_t key = heapSnapEntry(&pEntries[i], &block);
+        uint32_t site = block.allocSite <= PCHECKER_HEAPTRACK_SITES ? block.allocSite : 0;
+
+        if (!key)
+            continue;
+        ++blocks;
+        bytes += block.size;
+        c = heapSnapClass(block.size);
+        ++s_HeapSnap.classBlocks[c];
+        s_HeapSnap.classBytes[c] += block.size;
+        ++s_HeapSnap.siteBlocks[site];
+        s_HeapSnap.siteBytes[site] += block.size;
+    }
+
+    outStr(o, "\nlive ");
+    outUDec(o, blocks, 0);
+    outStr(o, " blocks, ");
+    trackOutKiB(o, bytes, 0);
+    outStr(o, " KiB requested\n");
+
+    outStr(o, "\nsize classes\n   size <=      blocks         KiB\n");
+    for (c = 0; c < PCHECKER_HEAPSNAP_CLASSES; ++c) {
+        if (!s_HeapSnap.classBlocks[c])
+            continue;
+        outUDec(o, (uint64_t)1 << c, 10);
+        outUDec(o, s_HeapSnap.classBlocks[c], 12);
+        trackOutKiB(o, s_HeapSnap.classBytes[c], 12);
+        outChar(o, '\n');
+    }
+
+    /* top sites by live bytes, selection like trackSelect */
+    for (k = 0; k <= PCHECKER_HEAPTRACK_SITES; ++k) {
+        if (s_HeapSnap.siteBlocks[k])
+            s_HeapSnap.order[count++] = k;
+    }
+    outStr(o, "\ncallsites by live bytes\n    blocks         KiB   avg size  callsite\n");
+    for (c = 0; c < top && c < count; ++c) {
+        unsigned best = c, tmp, site;
+        for (k = c + 1; k < count; ++k) {
+            if (s_HeapSnap.siteBytes[s_HeapSnap.order[k]] > s_HeapSnap.siteBytes[s_HeapSnap.order[best]])
+                best = k;
+        }
+        tmp = s_HeapSnap.order[c];
+        s_HeapSnap.order[c] = s_HeapSnap.order[best];
+        s_HeapSnap.order[best] = tmp;
+
+        site = s_HeapSnap.order[c];
+        outUDec(o, s_HeapSnap.siteBlocks[site], 10);
+        trackOutKiB(o, s_HeapSnap.siteBytes[site], 12);
+        outUDec(o, s_HeapSnap.siteBytes[site] / s_HeapSnap.siteBlocks[site], 11);
+        outStr(o, "  ");
+        if (site)
+            outSymbol(o, heapSnapCallsite(site));
+        else
+            outChar(o, '?');
+        outChar(o, '\n');
+    }
+
+    if (VAR_ATOMIC_LOAD(s_HeapTrack.dropped) || VAR_ATOMIC_LOAD(s_HeapTrack.droppedSites)) {
+        outStr(o, "\nnot tracked since the start: ");
+        outUDec(o, VAR_ATOMIC_LOAD(s_HeapTrack.dropped), 0);
+        outStr(o, " blocks, ");
+        outUDec(o, VAR_ATOMIC_LOAD(s_HeapTrack.droppedSites), 0);
+        outStr(o, " callsites, raise PCHECKER_HEAP_ENTRIES\n");
+    }
+
+    /* a second walk, the blocks have changed meanwhile */
+    if (s_HeapSnap.blocks) {
+        outStr(o, "\nlive blocks\n        size  address  callsite\n");
+        for (i = 0; i <= s_HeapTrack.mask; ++i) {
+            struct heaptrack_block block;
+            uintptr_t key = heapSnapEntry(&pEntries[i], &block);
+
+            if (!key)
+                continue;
+            outUDec(o, block.size, 12);
+            outStr(o, "  ");
+            outPtr(o, (const void *)key);
+            outStr(o, "  ");
+            outPtr(o, heapSnapCallsite(block.allocSite <= PCHECKER_HEAPTRACK_SITES ? block.allocSite : 0));
+            outChar(o, '\n');
+        }
+    }
+    outStr(o, "written in ");
+    outUDec(o, (sysMonotonicNs() - startNs) / 1000000u, 0);
+    outStr(o, " ms\n");
+    outFlush(o);
+}
+
+static FUN_INLINE void heapSnapTake(unsigned top)
+{
+    struct pchecker_out o;
+    char path[512];
+    unsigned pos;
+    int fd;
+
+    pos = appendStr(path, sizeof(path), 0, s_HeapSnap.prefix);
+    pos = appendStr(path, sizeof(path), pos, "." PCHECKER_NAME ".");
+    pos = appendUDec(path, sizeof(path), pos, (uint64_t)sysGetPid());
+    pos = appendStr(path, sizeof(path), pos, ".");
+    appendUDec(path, sizeof(path), pos, s_HeapSnap.written);
+
+    fd = sysOpen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        heapTrackWarn("cannot write the heap snapshot", path);
+        return;
+    }
+    outInit(&o, fd);
+    heapSnapWrite(&o, top);
+    sysClose(fd);
+    ++s_HeapSnap.written;
+}
+
+static void *heapSnapRun(void *pArg)
+{
+    unsigned top = (unsigned)pcheckerEnvUnsigned("PCHECKER_HEAP_TOP", 20);
+    int handled = 0;
+    (void)pArg;
+
+    pcheckerHelperSetup("pchk-heapsnap", PCHECKER_SCHED_OTHER);
+    for (;;) {
+        int requests = VAR_ATOMIC_LOAD(s_HeapSnap.requests);
+        if (requests == handled) {
+            syscall(SYS_futex, &s_HeapSnap.requests, PCHECKER_FUTEX_WAIT_PRIVATE, requests, NULL, NULL, 0);
+            continue;
+        }
+        /* signals arriving while writing are served by one snapshot */
+        handled = requests;
+        heapSnapTake(top);
+    }
+    return NULL;
+}
+
+/* 0 if unknown */
+static FUN_INLINE int heapSnapParseSignal(const char *s)
+{
+    int sig;
+
+    if (!s)
+        return SIGUSR2;
+    if (s[0] == 'S' && s[1] == 'I' && s[2] == 'G')
+        s += 3;
+    if (pcheckerStrEq(s, "USR1"))
+        return SIGUSR1;
+    if (pcheckerStrEq(s, "USR2"))
+        return SIGUSR2;
+    for (sig = 0; *s >= '0' && *s <= '9'; ++s)
+        sig = sig * 10 + (*s - '0');
+    return *s ? 0 : sig;
+}
+
+/* call from the constructor, after heapTrackInit */
+static FUN_INLINE void heapSnapInit()
+{
+    const char *prefix = pcheckerEnv("PCHECKER_HEAP_SNAPSHOT");
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+    struct sigaction action = {0};
+#pragma GCC diagnostic pop
+
+    if (!prefix)
+        return;
+    s_HeapSnap.signal = heapSnapParseSignal(pcheckerEnv("PCHECKER_HEAP_SNAPSHOT_SIGNAL"));
+    if (s_HeapSnap.signal <= 0 || s_HeapSnap.signal >= 65) {
+        heapTrackWarn("unknown signal", pcheckerEnv("PCHECKER_HEAP_SNAPSHOT_SIGNAL"));
+        return;
+    }
+    s_HeapSnap.blocks = pcheckerEnvUnsigned("PCHECKER_HEAP_SNAPSHOT_BLOCKS", 1) != 0;
+    s_HeapSnap.startNs = sysMonotonicNs();
+    if (!trackStart(eTrackLive))
+        return;
+    s_HeapSnap.prefix = prefix;
+    if (pcheckerStartHelper(&heapSnapRun, NULL) != 0) {
+        heapTrackWarn("cannot start the heap snapshot thread for", prefix);
+        return;
+    }
+
+    action.sa_sigaction = &heapSnapSignal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(s_HeapSnap.signal, &action, &s_HeapSnap.previous);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
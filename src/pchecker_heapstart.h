@@ -0,0 +1,380 @@
+/*
+ * startup profile of the heap checkers.
+ *
+ * With PCHECKER_HEAP_STARTUP=1 the checker writes at exit (to stderr or
+ * PCHECKER_HEAP_STARTUP_REPORT) where the time and the allocations before
+ * main went:
+ *
+ *  - a timeline from the first heap call: every state of the symbol
+ *    resolution, the checker's constructor, __libc_start_main (the
+ *    constructors of the loaded objects are done) and main
+ *  - the heap calls before the checker's constructor, and how many of
+ *    them took the bootstrap path (heap-glibc: the __libc_* functions,
+ *    heap: waited for another thread resolving)
+ *  - the allocations before main by the object of the call site, in the
+ *    order of their first allocation, with the time of the first and the
+ *    last one and the call site allocating most.
+ *    This is mostly the constructors of the objects.
+ *
+ * The call site is the first frame outside libc, the loader and the C++
+ * runtime, so operator new and strdup name their caller. From the
+ * constructor on it is found with the unwinder, before that it is the
+ * return address of the heap call.
+ *
+ * Before main only the call sites are stored in a fixed table, they are
+ * resolved with dladdr at exit. Until the constructor has read the
+ * environment everything is recorded, afterwards the hot path costs one
+ * test of a flag.
+ *
+ * main is found by interposing __libc_start_main, which glibc and musl
+ * both have. It is called with the glibc arguments, musl takes one less.
+ */
+
+#ifndef PCHECKER_HEAPSTART_H
+#define PCHECKER_HEAPSTART_H
+
+#include "pchecker_util.h"
+#include "pchecker_unwind.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PCHECKER_HEAPSTART_SITES
+#define PCHECKER_HEAPSTART_SITES 4096 /* power of 2 */
+#endif
+#ifndef PCHECKER_HEAPSTART_OBJECTS
+#define PCHECKER_HEAPSTART_OBJECTS 256
+#endif
+#define PCHECKER_HEAPSTART_MARKS 32
+
+/* libc, the loader and the C++ runtime */
+#define PCHECKER_HEAPSTART_RUNTIME 3
+
+typedef int (*pf_main_t)(int argc, char **argv, char **envp);
+typedef int (*pf_libc_start_main_t)(pf_main_t pfMain, int argc, char **argv, void (*pfInit)(void),
+                                    void (*pfFini)(void), void (*pfRtldFini)(void), void *pStackEnd);
+
+DSO_PUBLIC int __libc_start_main(pf_main_t pfMain, int argc, char **argv, void (*pfInit)(void),
+                                 void (*pfFini)(void), void (*pfRtldFini)(void), void *pStackEnd);
+
+struct heapstart_mark {
+    uint64_t ticks;
+    const char *what;
+    int state; /* of the resolution, < 0 for other events */
+    int tid;
+};
+
+struct heapstart_site {
+    VAR_ATOMIC(uintptr_t) addr;
+    VAR_ATOMIC(uint64_t) count;
+    VAR_ATOMIC(uint64_t) bytes;
+    uint64_t firstTicks; /* written by the thread inserting the site */
+    uint64_t lastTicks;
+};
+
+static struct heapstart_state {
+    VAR_ATOMIC(int) stopped; /* at main, or in the constructor if not enabled */
+    int enabled;
+    pf_main_t pfMain;
+    VAR_ATOMIC(unsigned) markCount;
+    VAR_ATOMIC(uint64_t) early;    /* heap calls before the constructor */
+    VAR_ATOMIC(uint64_t) fallback; /* of those, took the bootstrap path */
+    VAR_ATOMIC(uint64_t) allocs;
+    VAR_ATOMIC(uint64_t) bytes;
+    VAR_ATOMIC(uint64_t) lostAllocs; /* table full */
+    const void *runtime[PCHECKER_HEAPSTART_RUNTIME]; /* an address in each object */
+    struct heapstart_mark marks[PCHECKER_HEAPSTART_MARKS];
+    struct heapstart_site sites[PCHECKER_HEAPSTART_SITES];
+} s_HeapStart;
+
+static FUN_INLINE void heapStartMark(const char *what, int state)
+{
+    unsigned i = VAR_ATOMIC_FETCH_ADD(s_HeapStart.markCount, 1);
+    struct heapstart_mark *p;
+
+    if (i >= PCHECKER_HEAPSTART_MARKS)
+        return;
+    p = &s_HeapStart.marks[i];
+    p->ticks = pcheckerTicks();
+    p->what = what;
+    p->state = state;
+    p->tid = pcheckerGetTid();
+}
+
+/* for the state transitions of tryResolve: state = heapStartState(setState(1)) */
+static FUN_INLINE int heapStartState(int state)
+{
+    heapStartMark(NULL, state);
+    return state;
+}
+
+/* a heap call before the constructor, fallback if it took the bootstrap path */
+static FUN_INLINE void heapStartEarly(int fallback)
+{
+    VAR_ATOMIC_FETCH_ADD(s_HeapStart.early, 1);
+    if (fallback)
+        VAR_ATOMIC_FETCH_ADD(s_HeapStart.fallback, 1);
+}
+
+static void heapStartRecord(size_t size, const void *callsite)
+{
+    uintptr_t addr = (uintptr_t)callsite;
+    unsigned h = (unsigned)((addr * 0x9e3779b97f4a7c15ull) >> 40), i;
+    uint64_t now = pcheckerTicks();
+
+    VAR_ATOMIC_FETCH_ADD(s_HeapStart.allocs, 1);
+    VAR_ATOMIC_FETCH_ADD(s_HeapStart.bytes, size);
+    for (i = 0; i < 16; ++i) {
+        struct heapstart_site *p = &s_HeapStart.sites[(h + i) & (PCHECKER_HEAPSTART_SITES - 1)];
+        uintptr_t cur = VAR_ATOMIC_LOAD(p->addr);
+
+        if (!cur) {
+            if (VAR_ATOMIC_CAS(p->addr, &cur, addr)) {
+                p->firstTicks = now;
+                cur = addr;
+            }
+        }
+        if (cur == addr) {
+            VAR_ATOMIC_FETCH_ADD(p->count, 1);
+            VAR_ATOMIC_FETCH_ADD(p->bytes, size);
+            p->lastTicks = now;
+            return;
+        }
+    }
+    VAR_ATOMIC_FETCH_ADD(s_HeapStart.lostAllocs, 1);
+}
+
+/* call from the allocating functions */
+static FUN_INLINE void heapStartAlloc(size_t size, const void *callsite)
+{
+    if (unlikely(!VAR_ATOMIC_LOAD(s_HeapStart.stopped)))
+        heapStartRecord(size, unwindFirstOutside(callsite, s_HeapStart.runtime, PCHECKER_HEAPSTART_RUNTIME));
+}
+
+static int heapStartMain(int argc, char **argv, char **envp)
+{
+    heapStartMark("main", -1);
+    VAR_ATOMIC_STORE(s_HeapStart.stopped, 1);
+    return (*s_HeapStart.pfMain)(argc, argv, envp);
+}
+
+int __libc_start_main(pf_main_t pfMain, int argc, char **argv, void (*pfInit)(void), void (*pfFini)(void),
+                      void (*pfRtldFini)(void), void *pStackEnd)
+{
+    void *pf = getdelegate_function("__libc_start_main");
+    pf_libc_start_main_t pfStart;
+
+    if (!pf)
+        FUN_TRAP();
+    COPY_PF(pfStart, pf_libc_start_main_t, pf);
+    if (s_HeapStart.enabled) {
+        heapStartMark("__libc_start_main", -1);
+        s_HeapStart.pfMain = pfMain;
+        pfMain = &heapStartMain;
+    }
+    return (*pfStart)(pfMain, argc, argv, pfInit, pfFini, pfRtldFini, pStackEnd);
+}
+
+/* call first in the constructor */
+static FUN_INLINE void heapStartInit()
+{
+    long (*pfInLibc)(long, ...) = &syscall;
+
+    heapStartMark("constructor", -1);
+    s_HeapStart.enabled = pcheckerEnvUnsigned("PCHECKER_HEAP_STARTUP", 0) != 0;
+    if (!s_HeapStart.enabled) {
+        VAR_ATOMIC_STORE(s_HeapStart.stopped, 1);
+        return;
+    }
+
+    /* a missing C++ runtime stays NULL. A static one is in the
+     * executable, whose frames are then all skipped and the return
+     * address of the heap call is kept */
+    COPY_PF(s_HeapStart.runtime[0], const void *, pfInLibc);
+    s_HeapStart.runtime[1] = getdelegate_function("__tls_get_addr");
+    s_HeapStart.runtime[2] = getdelegate_function("_Znwm");
+    unwindModules();
+}
+
+/* milliseconds with 3 decimals, right aligned */
+static FUN_INLINE void heapStartMs(struct pchecker_out *o, uint64_t ns, unsigned width)
+{
+    uint64_t us = ns / 1000u;
+
+    outUDec(o, us / 1000u, width > 4 ? width - 4 : 0);
+    outChar(o, '.');
+    outChar(o, (char)('0' + us / 100u % 10));
+    outChar(o, (char)('0' + us / 10u % 10));
+    outChar(o, (char)('0' + us % 10));
+}
+
+static FUN_INLINE const char *heapStartStateName(int state)
+{
+    switch (state) {
+    case 0:
+        return "resolve, started";
+    case 1:
+        return "resolve, table initialised";
+    case 2:
+        return "resolve, base functions found";
+    case 3:
+        return "resolve, all functions found";
+    default:
+        return state >= 128 ? "resolve done, assert hook found" : "resolve";
+    }
+}
+
+struct heapstart_object {
+    const void *base;
+    const char *name;
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t firstTicks;
+    uint64_t lastTicks;
+    unsigned sites;
+    const struct heapstart_site *pTop;
+};
+
+static struct heapstart_object s_HeapStartObjects[PCHECKER_HEAPSTART_OBJECTS];
+
+/* sums the sites by object, returns the number of objects */
+static FUN_INLINE unsigned heapStartObjects(uint64_t *pUnknown)
+{
+    unsigned n = 0, i, j;
+
+    *pUnknown = 0;
+    for (i = 0; i < PCHECKER_HEAPSTART_SITES; ++i) {
+        const struct heapstart_site *p = &s_HeapStart.sites[i];
+        uintptr_t addr = VAR_ATOMIC_LOAD(p->addr);
+        uint64_t count = VAR_ATOMIC_LOAD(p->count);
+        struct heapstart_object *pObj;
+        Dl_info info;
+
+        if (!addr)
+            continue;
+        if (!dladdr((const void *)addr, &info)) {
+            *pUnknown += count;
+            continue;
+        }
+        for (j = 0; j < n && s_HeapStartObjects[j].base != info.dli_fbase; ++j)
+            ;
+        if (j == n) {
+            if (n == PCHECKER_HEAPSTART_OBJECTS) {
+                *pUnknown += count;
+                continue;
+            }
+            pObj = &s_HeapStartObjects[n++];
+            pObj->base = info.dli_fbase;
+            pObj->name = info.dli_fname && *info.dli_fname ? info.dli_fname : "(executable)";
+            pObj->firstTicks = p->firstTicks;
+            pObj->pTop = p;
+        }
+        pObj = &s_HeapStartObjects[j];
+        pObj->count += count;
+        pObj->bytes += VAR_ATOMIC_LOAD(p->bytes);
+        ++pObj->sites;
+        if (p->firstTicks < pObj->firstTicks)
+            pObj->firstTicks = p->firstTicks;
+        if (p->lastTicks > pObj->lastTicks)
+            pObj->lastTicks = p->lastTicks;
+        if (count > VAR_ATOMIC_LOAD(pObj->pTop->count))
+            pObj->pTop = p;
+    }
+
+    /* by the first allocation, that is about the order of the constructors */
+    for (i = 1; i < n; ++i) {
+        struct heapstart_object t = s_HeapStartObjects[i];
+        for (j = i; j > 0 && s_HeapStartObjects[j - 1].firstTicks > t.firstTicks; --j)
+            s_HeapStartObjects[j] = s_HeapStartObjects[j - 1];
+        s_HeapStartObjects[j] = t;
+    }
+    return n;
+}
+
+static FUN_INLINE void heapStartWrite(struct pchecker_out *o)
+{
+    unsigned marks = VAR_ATOMIC_LOAD(s_HeapStart.markCount), i, n;
+    uint64_t t0, unknown;
+
+    if (marks > PCHECKER_HEAPSTART_MARKS)
+        marks = PCHECKER_HEAPSTART_MARKS;
+    t0 = marks ? s_HeapStart.marks[0].ticks : 0;
+
+    outStr(o, "\nheap startup (" PCHECKER_NAME ")\n");
+    outStr(o, "      ms      tid  event\n");
+    for (i = 0; i < marks; ++i) {
+        const struct heapstart_mark *p = &s_HeapStart.marks[i];
+        heapStartMs(o, pcheckerTicksToNs(p->ticks - t0), 8);
+        outSDec(o, p->tid, 9);
+        outStr(o, "  ");
+        outStr(o, p->what ? p->what : heapStartStateName(p->state));
+        if (!p->what) {
+            outStr(o, " (state ");
+            outSDec(o, p->state, 0);
+            outChar(o, ')');
+        }
+        outChar(o, '\n');
+    }
+
+    outStr(o, "heap calls before the constructor: ");
+    outUDec(o, VAR_ATOMIC_LOAD(s_HeapStart.early), 0);
+    outStr(o, ", bootstrap path: ");
+    outUDec(o, VAR_ATOMIC_LOAD(s_HeapStart.fallback), 0);
+    outStr(o, "\nallocations before main: ");
+    outUDec(o, VAR_ATOMIC_LOAD(s_HeapStart.allocs), 0);
+    outStr(o, ", bytes ");
+    outUDec(o, VAR_ATOMIC_LOAD(s_HeapStart.bytes), 0);
+    if (VAR_ATOMIC_LOAD(s_HeapStart.lostAllocs)) {
+        outStr(o, ", not attributed (table full) ");
+        outUDec(o, VAR_ATOMIC_LOAD(s_HeapStart.lostAllocs), 0);
+    }
+    outChar(o, '\n');
+
+    n = heapStartObjects(&unknown);
+    outStr(o, "first ms   last ms    allocs       bytes  sites  object, top call site\n");
+    for (i = 0; i < n; ++i) {
+        const struct heapstart_object *p = &s_HeapStartObjects[i];
+        heapStartMs(o, pcheckerTicksToNs(p->firstTicks - t0), 8);
+        heapStartMs(o, pcheckerTicksToNs(p->lastTicks - t0), 10);
+        outUDec(o, p->count, 10);
+        outUDec(o, p->bytes, 12);
+        outUDec(o, p->sites, 7);
+        outStr(o, "  ");
+        outStr(o, p->name);
+        outStr(o, ", ");
+        outSymbol(o, (const void *)VAR_ATOMIC_LOAD(p->pTop->addr));
+        outChar(o, '\n');
+    }
+    if (unknown) {
+        outStr(o, "allocations from unknown objects: ");
+        outUDec(o, unknown, 0);
+        outChar(o, '\n');
+    }
+    outFlush(o);
+}
+
+/* call from the destructor */
+static FUN_INLINE void heapStartFinish()
+{
+    const char *path = pcheckerEnv("PCHECKER_HEAP_STARTUP_REPORT");
+    struct pchecker_out o;
+    int fd = 2;
+
+    if (!s_HeapStart.enabled)
+        return;
+    if (path)
+        fd = sysOpen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    outInit(&o, fd);
+    heapStartWrite(&o);
+    if (fd != 2)
+        sysClose(fd);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,473 @@
+/*
+ * footprint sampler of the heap checkers, for watching fragmentation and
+ * arena growth over long runs.
+ *
+ * PCHECKER_HEAP_SAMPLE sets the interval in ms (default off). The
+ * interposers then count the live bytes (malloc_usable_size) and blocks
+ * per thread, and a helper thread at SCHED_IDLE records them together with
+ * the RSS into a ring of PCHECKER_HEAP_SAMPLES entries
+ * (default 4096) in a private mapping. When the ring is full every second
+ * sample is dropped and the interval doubles, so it always covers the
+ * whole run.
+ *
+ * The samples are written at exit to stderr or PCHECKER_HEAP_SAMPLE_REPORT,
+ * and on demand by pchecker_heap_sample_dump(fd), e.g. from gdb, or the
+ * control socket, which can also change the interval.
+ * Blocks allocated before the checker was initialized are not counted.
+ *
+ * PCHECKER_HEAP_SAMPLE_MALLINFO=1 adds the allocator statistics (mallinfo2
+ * or mallinfo, if the C library has them). Those take every arena lock, a
+ * preempted SCHED_IDLE sampler would block RT threads allocating meanwhile
+ * for as long as it does not run. The sampler runs at SCHED_OTHER then.
+ */
+
+#ifndef PCHECKER_HEAPSTAT_H
+#define PCHECKER_HEAPSTAT_H
+
+#include "pchecker_util.h"
+#include "pchecker_helper.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PCHECKER_HEAPSTAT_THREADS
+#define PCHECKER_HEAPSTAT_THREADS 64
+#endif
+
+#ifndef PCHECKER_HEAPSTAT_SAMPLES_MAX
+#define PCHECKER_HEAPSTAT_SAMPLES_MAX (1u << 20)
+#endif
+
+typedef size_t (*pf_malloc_usable_size_t)(void *ptr);
+
+/* layout of struct mallinfo2 and struct mallinfo of glibc */
+struct heapstat_mallinfo2 {
+    size_t arena, ordblks, smblks, hblks, hblkhd, usmblks, fsmblks, uordblks, fordblks, keepcost;
+};
+struct heapstat_mallinfo {
+    int arena, ordblks, smblks, hblks, hblkhd, usmblks, fsmblks, uordblks, fordblks, keepcost;
+};
+typedef struct heapstat_mallinfo2 (*pf_mallinfo2_t)(void);
+typedef struct heapstat_mallinfo (*pf_mallinfo_t)(void);
+
+struct heapstat_thread {
+    VAR_ATOMIC(int) tid;
+    int64_t bytes;
+    int64_t blocks;
+    uint64_t allocs;
+};
+
+struct heapstat_sample {
+    uint64_t ns; /* since the start */
+    uint64_t rss;
+    int64_t bytes; /* live, as counted by the interposers */
+    int64_t blocks;
+    uint64_t allocs; /* total */
+    /* from mallinfo */
+    uint64_t arena;
+    uint64_t mmapped;
+    uint64_t inuse;
+    uint64_t free_;
+    uint64_t chunks; /* free chunks */
+    uint64_t top; /* releasable by trimming */
+};
+
+static struct heapstat_state {
+    pf_malloc_usable_size_t pf_usable; /* set if sampling is enabled */
+    pf_mallinfo2_t pf_mallinfo2;
+    pf_mallinfo_t pf_mallinfo;
+    uint64_t startNs;
+    uint64_t intervalNs;
+    uint64_t pageSize;
+    unsigned capacity;
+    unsigned count;
+    VAR_ATOMIC_FLAG lock;
+    struct heapstat_sample *pSamples;
+
+    /* for threads without a record */
+    VAR_ATOMIC(int64_t) sharedBytes;
+    VAR_ATOMIC(int64_t) sharedBlocks;
+    VAR_ATOMIC(uint64_t) sharedAllocs;
+    struct heapstat_thread threads[PCHECKER_HEAPSTAT_THREADS];
+} s_HeapStat;
+
+static VAR_TLS struct heapstat_thread *s_pHeapStatThread;
+static VAR_TLS int s_HeapStatNoThread;
+
+DSO_PUBLIC void pchecker_heap_sample_dump(int fd);
+
+static FUN_INLINE struct heapstat_thread *heapStatThread()
+{
+    struct heapstat_thread *pThread = s_pHeapStatThread;
+    int tid;
+    unsigned i;
+
+    if (pThread || s_HeapStatNoThread)
+        return pThread;
+
+    tid = pcheckerGetTid();
+    for (i = 0; i < PCHECKER_HEAPSTAT_THREADS; ++i) {
+        int expected = 0;
+        if (VAR_ATOMIC_CAS(s_HeapStat.threads[i].tid, &expected, tid)) {
+            s_pHeapStatThread = &s_HeapStat.threads[i];
+            return s_pHeapStatThread;
+        }
+    }
+    s_HeapStatNoThread = 1;
+    return NULL;
+}
+
+static FUN_INLINE void heapStatAdd(int64_t bytes, int64_t blocks, uint64_t allocs)
+{
+    struct heapstat_thread *pThread = heapStatThread();
+
+    if (pThread) {
+        pThread->bytes += bytes;
+        pThread->blocks += blocks;
+        pThread->allocs += allocs;
+    }
+    else {
+        VAR_ATOMIC_FETCH_ADD(s_HeapStat.sharedBytes, bytes);
+        VAR_ATOMIC_FETCH_ADD(s_HeapStat.sharedBlocks, blocks);
+        VAR_ATOMIC_FETCH_ADD(s_HeapStat.sharedAllocs, allocs);
+    }
+}
+
+/* hooks for the interposers, they do nothing unless sampling is enabled */
+
+/* usable size of a block, call before realloc */
+static FUN_INLINE size_t heapStatSize(void *ptr)
+{
+    pf_malloc_usable_size_t pf = s_HeapStat.pf_usable;
+    return (unlikely(pf != NULL) && ptr) ? (*pf)(ptr) : 0;
+}
+
+static FUN_INLINE void heapStatAlloc(void *ptr)
+{
+    pf_malloc_usable_size_t pf = s_HeapStat.pf_usable;
+    if (unlikely(pf != NULL) && ptr)
+        heapStatAdd((int64_t)(*pf)(ptr), 1, 1);
+}
+
+/* call before free */
+static FUN_INLINE void heapStatFree(void *ptr)
+{
+    pf_malloc_usable_size_t pf = s_HeapStat.pf_usable;
+    if (unlikely(pf != NULL) && ptr)
+        heapStatAdd(-(int64_t)(*pf)(ptr), -1, 0);
+}
+
+static FUN_INLINE void heapStatRealloc(void *ptr, size_t oldSize, void *r, size_t size)
+{
+    pf_malloc_usable_size_t pf = s_HeapStat.pf_usable;
+
+    if (!pf)
+        return;
+    if (r)
+        heapStatAdd((int64_t)(*pf)(r) - (int64_t)oldSize, ptr ? 0 : 1, ptr ? 0 : 1);
+    else if (ptr && size == 0)
+        heapStatAdd(-(int64_t)oldSize, -1, 0); /* realloc(ptr, 0) freed the block */
+}
+
+/* sampling, on the helper thread and at exit */
+
+static FUN_INLINE uint64_t heapStatRss()
+{
+    char buf[128];
+    uint64_t v = 0;
+    unsigned n;
+    long r;
+    int fd = sysOpen("/proc/self/statm", O_RDONLY | O_CLOEXEC, 0);
+
+    if (fd < 0)
+        return 0;
+    r = sysRead(fd, buf, sizeof(buf) - 1);
+    sysClose(fd);
+    if (r <= 0)
+        return 0;
+    buf[r] = '\0';
+
+    /* size resident shared ... in pages */
+    n = pcheckerParseUnsigned(buf, &v);
+    if (!n || buf[n] != ' ' || !pcheckerParseUnsigned(buf + n + 1, &v))
+        return 0;
+    return v * s_HeapStat.pageSize;
+}
+
+static FUN_INLINE void heapStatCollect(struct heapstat_sample *pSample)
+{
+    const volatile struct heapstat_thread *p = s_HeapStat.threads;
+    unsigned i;
+
+    pSample->ns = sysMonotonicNs() - s_HeapStat.startNs;
+    pSample->rss = heapStatRss();
+    pSample->bytes = VAR_ATOMIC_LOAD(s_HeapStat.sharedBytes);
+    pSample->blocks = VAR_ATOMIC_LOAD(s_HeapStat.sharedBlocks);
+    pSample->allocs = VAR_ATOMIC_LOAD(s_HeapStat.sharedAllocs);
+    /* the counters are written without synchronization,
+     * the sums are approximate while other threads allocate */
+    for (i = 0; i < PCHECKER_HEAPSTAT_THREADS && VAR_ATOMIC_LOAD(s_HeapStat.threads[i].tid); ++i) {
+        pSample->bytes += p[i].bytes;
+        pSample->blocks += p[i].blocks;
+        pSample->allocs += p[i].allocs;
+    }
+
+    if (s_HeapStat.pf_mallinfo2) {
+        struct heapstat_mallinfo2 mi = (*s_HeapStat.pf_mallinfo2)();
+        pSample->arena = mi.arena;
+        pSample->mmapped = mi.hblkhd;
+        pSample->inuse = mi.uordblks;
+        pSample->free_ = mi.fordblks;
+        pSample->chunks = mi.ordblks;
+        pSample->top = mi.keepcost;
+    }
+    else if (s_HeapStat.pf_mallinfo) {
+        /* the fields wrap at 4GB */
+        struct heapstat_mallinfo mi = (*s_HeapStat.pf_mallinfo)();
+        pSample->arena = (unsigned)mi.arena;
+        pSample->mmapped = (unsigned)mi.hblkhd;
+        pSample->inuse = (unsigned)mi.uordblks;
+        pSample->free_ = (unsigned)mi.fordblks;
+        pSample->chunks = (unsigned)mi.ordblks;
+        pSample->top = (unsigned)mi.keepcost;
+    }
+    else {
+        pSample->arena = pSample->mmapped = pSample->inuse = 0;
+        pSample->free_ = pSample->chunks = pSample->top = 0;
+    }
+}
+
+static FUN_INLINE void heapStatLock()
+{
+    while (VAR_ATOMIC_FLAG_TESTSET(s_HeapStat.lock))
+        syscall(SYS_sched_yield);
+}
+
+static FUN_INLINE void heapStatUnlock()
+{
+    VAR_ATOMIC_FLAG_CLEAR(s_HeapStat.lock);
+}
+
+/* take a sample, called with the lock held */
+static FUN_INLINE void heapStatRecord()
+{
+    struct heapstat_sample *pSamples = s_HeapStat.pSamples;
+    unsigned i;
+
+    if (s_HeapStat.count == s_HeapStat.capacity) {
+        /* keep every second sample */
+        for (i = 1; 2 * i < s_HeapStat.count; ++i)
+            pSamples[i] = pSamples[2 * i];
+        s_HeapStat.count = i;
+        s_HeapStat.intervalNs *= 2;
+    }
+    heapStatCollect(&pSamples[s_HeapStat.count++]);
+}
+
+static void *heapStatRun(void *pArg)
+{
+    uint64_t next = s_HeapStat.startNs;
+    (void)pArg;
+
+    /* mallinfo holds the arena locks, it must not be preempted for long */
+    pcheckerHelperSetup("pchk-heapstat",
+        s_HeapStat.pf_mallinfo2 || s_HeapStat.pf_mallinfo ? PCHECKER_SCHED_OTHER : PCHECKER_SCHED_IDLE);
+    for (;;) {
+        uint64_t now;
+
+        heapStatLock();
+        heapStatRecord();
+        /* at SCHED_IDLE the thread starves on a busy system,
+         * skip the missed samples instead of catching up */
+        now = sysMonotonicNs();
+        do
+            next += s_HeapStat.intervalNs;
+        while (next <= now);
+        heapStatUnlock();
+        pcheckerHelperSleepUntil(next);
+    }
+    return NULL;
+}
+
+/* seconds with ms */
+static FUN_INLINE void heapStatOutTime(struct pchecker_out *o, uint64_t ns, unsigned width)
+{
+    uint64_t ms = ns / 1000000u;
+
+    outUDec(o, ms / 1000, width - 4);
+    outChar(o, '.');
+    outChar(o, (char)('0' + ms / 100 % 10));
+    outChar(o, (char)('0' + ms / 10 % 10));
+    outChar(o, (char)('0' + ms % 10));
+}
+
+static FUN_INLINE void heapStatWrite(struct pchecker_out *o)
+{
+    const struct heapstat_sample *pSamples = s_HeapStat.pSamples;
+    int withInfo = s_HeapStat.pf_mallinfo2 || s_HeapStat.pf_mallinfo;
+    uint64_t prevNs = 0, prevAllocs = 0;
+    unsigned i;
+
+    outStr(o, "\nheap footprint (KiB), interval ");
+    outUDec(o, s_HeapStat.intervalNs / 1000000u, 0);
+    outStr(o, " ms\n");
+    outStr(o, "     time s       rss      live    blocks  allocs/s");
+    if (withInfo)
+        outStr(o, "     arena      mmap     inuse      free  chunks       top");
+    outChar(o, '\n');
+
+    for (i = 0; i < s_HeapStat.count; ++i) {
+        const struct heapstat_sample *p = &pSamples[i];
+        uint64_t dt = p->ns - prevNs;
+
+        heapStatOutTime(o, p->ns, 11);
+        outUDec(o, p->rss / 1024, 10);
+        outSDec(o, p->bytes / 1024, 10);
+        outSDec(o, p->blocks, 10);
+        outUDec(o, dt ? (p->allocs - prevAllocs) * 1000000000u / dt : 0, 10);
+        if (withInfo) {
+            outUDec(o, p->arena / 1024, 10);
+            outUDec(o, p->mmapped / 1024, 10);
+            outUDec(o, p->inuse / 1024, 10);
+            outUDec(o, p->free_ / 1024, 10);
+            outUDec(o, p->chunks, 8);
+            outUDec(o, p->top / 1024, 10);
+        }
+        outChar(o, '\n');
+        prevNs = p->ns;
+        prevAllocs = p->allocs;
+    }
+    outFlush(o);
+}
+
+/* takes a current sample and writes the ring */
+void pchecker_heap_sample_dump(int fd)
+{
+    struct pchecker_out o;
+
+    if (!s_HeapStat.pSamples)
+        return;
+    outInit(&o, fd);
+    heapStatLock();
+    heapStatRecord();
+    heapStatWrite(&o);
+    heapStatUnlock();
+}
+
+/* commands of the control socket (see pchecker_control.h) */
+static int heapStatControl(struct pchecker_out *o, const char *cmd, const char *arg)
+{
+    uint64_t ms;
+
+    if (pcheckerStrEq(cmd, "dump")) {
+        outFlush(o);
+        pchecker_heap_sample_dump(o->fd);
+        return 1;
+    }
+    if (pcheckerStrEq(cmd, "reset")) {
+        if (s_HeapStat.pSamples) {
+            heapStatLock();
+            s_HeapStat.count = 0;
+            heapStatUnlock();
+        }
+        return 1;
+    }
+    if (!pcheckerStrEq(cmd, "sample"))
+        return 0;
+    if (!s_HeapStat.pSamples)
+        outStr(o, "error: heap sampling is off, start with PCHECKER_HEAP_SAMPLE\n");
+    else if (!pcheckerParseUnsigned(arg, &ms) || !ms)
+        outStr(o, "error: sample needs an interval in ms\n");
+    else {
+        /* the sampler picks it up after its next sample */
+        heapStatLock();
+        s_HeapStat.intervalNs = ms * 1000000u;
+        heapStatUnlock();
+        return 1;
+    }
+    /* handled, but without the final ok */
+    return -1;
+}
+
+static FUN_INLINE void heapStatWarn(const char *what)
+{
+    struct pchecker_out o;
+    outInit(&o, 2);
+    outStr(&o, "pchecker(" PCHECKER_NAME "): ");
+    outStr(&o, what);
+    outChar(&o, '\n');
+    outFlush(&o);
+}
+
+/* call from the constructor, after the symbols are resolved */
+static FUN_INLINE void heapStatInit()
+{
+    uint64_t ms = pcheckerEnvUnsigned("PCHECKER_HEAP_SAMPLE", 0);
+    uint64_t capacity = pcheckerEnvUnsigned("PCHECKER_HEAP_SAMPLES", 4096);
+    void *pf, *pfInfo;
+
+    if (!ms)
+        return;
+    if (capacity < 2)
+        capacity = 2;
+    if (capacity > PCHECKER_HEAPSTAT_SAMPLES_MAX)
+        capacity = PCHECKER_HEAPSTAT_SAMPLES_MAX;
+
+    pf = getdelegate_function("malloc_usable_size");
+    if (!pf) {
+        heapStatWarn("no malloc_usable_size, heap sampling disabled");
+        return;
+    }
+
+    s_HeapStat.pSamples = (struct heapstat_sample *)sysMmap(NULL, capacity * sizeof(struct heapstat_sample),
+        PCHECKER_PROT_READ | PCHECKER_PROT_WRITE, PCHECKER_MAP_PRIVATE | PCHECKER_MAP_ANONYMOUS, -1, 0);
+    if (s_HeapStat.pSamples == PCHECKER_MAP_FAILED) {
+        s_HeapStat.pSamples = NULL;
+        return;
+    }
+    s_HeapStat.capacity = (unsigned)capacity;
+    s_HeapStat.intervalNs = ms * 1000000u;
+    s_HeapStat.pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    s_HeapStat.startNs = sysMonotonicNs();
+    if (pcheckerEnvUnsigned("PCHECKER_HEAP_SAMPLE_MALLINFO", 0)) {
+        pfInfo = getdelegate_function("mallinfo2");
+        if (pfInfo) {
+            COPY_PF(s_HeapStat.pf_mallinfo2, pf_mallinfo2_t, pfInfo);
+        }
+        else {
+            pfInfo = getdelegate_function("mallinfo");
+            if (pfInfo)
+                COPY_PF(s_HeapStat.pf_mallinfo, pf_mallinfo_t, pfInfo);
+        }
+    }
+
+    /* start counting */
+    COPY_PF(s_HeapStat.pf_usable, pf_malloc_usable_size_t, pf);
+
+    if (pcheckerStartHelper(&heapStatRun, NULL) != 0)
+        heapStatWarn("cannot start the heap sampler thread, sampling at exit only");
+}
+
+/* call from the destructor */
+static FUN_INLINE void heapStatFinish()
+{
+    const char *path = pcheckerEnv("PCHECKER_HEAP_SAMPLE_REPORT");
+    int fd = 2;
+
+    if (!s_HeapStat.pSamples)
+        return;
+    if (path)
+        fd = sysOpen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    pchecker_heap_sample_dump(fd);
+    if (fd != 2)
+        sysClose(fd);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
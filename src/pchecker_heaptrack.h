@@ -0,0 +1,795 @@
+/*
+ * analysis modes of the heap checkers, tracking individual blocks.
+ *
+ * PCHECKER_HEAP_ANALYZE is a comma separated list of modes:
+ *
+ *   realloc   chains of realloc on the same block, per callsite of the
+ *             first realloc: growth pattern, bytes copied by moves, final
+ *             sizes. Sites with linear growth copy quadratically.
+ *   lifetime  pairs every allocation with its free, histograms of the
+ *             lifetime in ns and in allocations made meanwhile (by all
+ *             threads), per allocation callsite. Sites with many blocks
+ *             freed before PCHECKER_HEAP_SHORT (default 16) further
+ *             allocations are candidates for stack buffers or pools.
+ *   threads   frees (and moving reallocs) on another thread than the one
+ *             that allocated the block, per allocation and per free
+ *             callsite, and the producer/consumer pairs of threads.
+ *             In glibc those take the lock of the remote arena.
+ *
+ * The blocks are kept in a lock-free hash table keyed by the pointer
+ * (PCHECKER_HEAP_ENTRIES, default 256k), the callsites in an insert-only
+ * table, both in private mappings, so the analysis does not allocate on
+ * the heap it measures. Blocks not found in the table (allocated before
+ * the checker was initialized, or when the table was full) are ignored.
+ *
+ * The report is written at exit to stderr or PCHECKER_HEAP_ANALYZE_REPORT,
+ * PCHECKER_HEAP_TOP sets the number of callsites (default 20).
+ */
+
+#ifndef PCHECKER_HEAPTRACK_H
+#define PCHECKER_HEAPTRACK_H
+
+#include "pchecker_util.h"
+#include "pchecker_heapstat.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PCHECKER_HEAPTRACK_SITES
+#define PCHECKER_HEAPTRACK_SITES 4096
+#endif
+
+/* size of the table of (allocating thread, freeing thread, site) pairs,
+ * a power of 2 */
+#ifndef PCHECKER_HEAPTRACK_PAIRS
+#define PCHECKER_HEAPTRACK_PAIRS 1024
+#endif
+
+/* bound for the probe sequence in the block table */
+#ifndef PCHECKER_HEAPTRACK_PROBES
+#define PCHECKER_HEAPTRACK_PROBES 64
+#endif
+
+enum EHeapTrackMode {
+    eTrackRealloc = 1,
+    eTrackLifetime = 2,
+    eTrackThreads = 4,
+    eTrackLive = 8, /* for the heap snapshots, no report at exit */
+
+    /* modes that need every block in the table, not only reallocated ones */
+    eTrackAllBlocks = eTrackLifetime | eTrackThreads | eTrackLive
+};
+
+/* log4 buckets of the lifetime histograms */
+enum {
+    eTrackBuckets = 16
+};
+
+/* keys of the block table besides pointers */
+enum {
+    eTrackEmpty = 0,
+    eTrackDeleted = 1
+};
+
+/* what is known about a live block, only accessed by the thread owning
+ * the block (or the report at exit) */
+struct heaptrack_block {
+    uint64_t size; /* requested */
+    /* lifetime */
+    uint32_t allocSite; /* index + 1 of the site of the allocation, 0 if unknown */
+    uint64_t ticks;
+    uint64_t seq;
+    /* threads */
+    uint32_t tid; /* that allocated the block, 0 if unknown */
+    /* realloc chain */
+    uint32_t reallocSite; /* index + 1 of the site of the first realloc, 0 if none */
+    uint32_t reallocs;
+    uint32_t geometric; /* steps by at least 1.25 times */
+    uint32_t linear; /* steps by the same amount or less */
+    uint64_t delta; /* last growth */
+    uint64_t copied;
+};
+
+struct heaptrack_entry {
+    VAR_ATOMIC(uintptr_t) key;
+    struct heaptrack_block block;
+};
+
+struct heaptrack_site {
+    VAR_ATOMIC(uintptr_t) callsite;
+    /* realloc chains ending here */
+    VAR_ATOMIC(uint64_t) chains;
+    VAR_ATOMIC(uint64_t) reallocs;
+    VAR_ATOMIC(uint64_t) moved;
+    VAR_ATOMIC(uint64_t) copied;
+    VAR_ATOMIC(uint64_t) finalBytes;
+    VAR_ATOMIC(uint64_t) finalMax;
+    VAR_ATOMIC(uint64_t) chainMax;
+    VAR_ATOMIC(uint64_t) geometric;
+    VAR_ATOMIC(uint64_t) linear;
+    /* blocks allocated here */
+    VAR_ATOMIC(uint64_t) allocs;
+    VAR_ATOMIC(uint64_t) bytes;
+    VAR_ATOMIC(uint64_t) frees;
+    VAR_ATOMIC(uint64_t) short_;
+    uint64_t live; /* at exit */
+    VAR_ATOMIC(uint64_t) histNs[eTrackBuckets];
+    VAR_ATOMIC(uint64_t) histAllocs[eTrackBuckets];
+    VAR_ATOMIC(uint64_t) remoteFreed; /* by another thread */
+    /* frees at this callsite */
+    VAR_ATOMIC(uint64_t) freesAt;
+    VAR_ATOMIC(uint64_t) remoteAt;
+};
+
+/* blocks of a site, allocated on one thread and freed on another */
+struct heaptrack_pair {
+    VAR_ATOMIC(uint64_t) key; /* allocating tid, freeing tid, site */
+    VAR_ATOMIC(uint64_t) count;
+};
+
+static struct heaptrack_state {
+    unsigned modes;
+    pf_malloc_usable_size_t pf_usable;
+    struct heaptrack_entry *pEntries; /* set if any mode is enabled */
+    uint64_t mask;
+    VAR_ATOMIC(uint64_t) dropped; /* blocks not inserted */
+    VAR_ATOMIC(uint64_t) droppedSites;
+    VAR_ATOMIC(uint64_t) allocSeq;
+    uint64_t shortAllocs;
+    VAR_ATOMIC(uint64_t) droppedPairs;
+    struct heaptrack_site sites[PCHECKER_HEAPTRACK_SITES];
+    struct heaptrack_pair pairs[PCHECKER_HEAPTRACK_PAIRS];
+    unsigned order[PCHECKER_HEAPTRACK_SITES]; /* for the report */
+} s_HeapTrack;
+
+static FUN_INLINE void trackMax(VAR_ATOMIC(uint64_t) * pMax, uint64_t v)
+{
+    uint64_t cur = VAR_ATOMIC_LOAD(*pMax);
+    while (v > cur && !VAR_ATOMIC_CAS(*pMax, &cur, v))
+        ;
+}
+
+static FUN_INLINE uint64_t trackHash(uintptr_t k)
+{
+    uint64_t h = (uint64_t)(k >> 4) * 0x9e3779b97f4a7c15u;
+    return h ^ (h >> 29);
+}
+
+/* index + 1 of the site, 0 if the table is full */
+static FUN_INLINE uint32_t trackSite(const void *callsite)
+{
+    uintptr_t key = (uintptr_t)callsite;
+    unsigned i, h = (unsigned)trackHash(key);
+
+    for (i = 0; i < PCHECKER_HEAPTRACK_SITES; ++i) {
+        unsigned index = (h + i) & (PCHECKER_HEAPTRACK_SITES - 1);
+        struct heaptrack_site *pSite = &s_HeapTrack.sites[index];
+        uintptr_t cur = VAR_ATOMIC_LOAD(pSite->callsite);
+
+        if (cur == key)
+            return index + 1;
+        if (!cur) {
+            if (VAR_ATOMIC_CAS(pSite->callsite, &cur, key) || cur == key)
+                return index + 1;
+        }
+    }
+    VAR_ATOMIC_FETCH_ADD(s_HeapTrack.droppedSites, 1);
+    return 0;
+}
+
+static FUN_INLINE struct heaptrack_site *trackSiteAt(uint32_t site)
+{
+    return site ? &s_HeapTrack.sites[site - 1] : NULL;
+}
+
+/* a pointer is live only once, so there are no concurrent inserts of
+ * the same key. Deleted slots are reused */
+static FUN_INLINE void trackInsert(const void *ptr, const struct heaptrack_block *pBlock)
+{
+    uintptr_t key = (uintptr_t)ptr;
+    uint64_t i, h = trackHash(key);
+
+    for (i = 0; i < PCHECKER_HEAPTRACK_PROBES; ++i) {
+        struct heaptrack_entry *pEntry = &s_HeapTrack.pEntries[(h + i) & s_HeapTrack.mask];
+        uintptr_t cur = VAR_ATOMIC_LOAD(pEntry->key);
+
+        if ((cur == eTrackEmpty || cur == eTrackDeleted) && VAR_ATOMIC_CAS(pEntry->key, &cur, key)) {
+            pEntry->block = *pBlock;
+            return;
+        }
+    }
+    VAR_ATOMIC_FETCH_ADD(s_HeapTrack.dropped, 1);
+}
+
+/* remove the block, returns 0 if it is not in the table */
+static FUN_INLINE int trackRemove(const void *ptr, struct heaptrack_block *pBlock)
+{
+    uintptr_t key = (uintptr_t)ptr;
+    uint64_t i, h = trackHash(key);
+
+    for (i = 0; i < PCHECKER_HEAPTRACK_PROBES; ++i) {
+        struct heaptrack_entry *pEntry = &s_HeapTrack.pEntries[(h + i) & s_HeapTrack.mask];
+        uintptr_t cur = VAR_ATOMIC_LOAD(pEntry->key);
+
+        if (cur == key) {
+            *pBlock = pEntry->block;
+            VAR_ATOMIC_STORE(pEntry->key, (uintptr_t)eTrackDeleted);
+            return 1;
+        }
+        if (cur == eTrackEmpty)
+            break;
+    }
+    return 0;
+}
+
+static FUN_INLINE unsigned trackBucket(uint64_t v)
+{
+    unsigned b = 0;
+
+    while (v >= 4 && b < eTrackBuckets - 1) {
+        v >>= 2;
+        ++b;
+    }
+    return b;
+}
+
+static FUN_INLINE void trackBlockStart(struct heaptrack_block *pBlock, uint64_t size, const void *callsite)
+{
+    struct heaptrack_site *pSite;
+
+    pBlock->size = size;
+    if (!(s_HeapTrack.modes & eTrackAllBlocks))
+        return;
+    pBlock->allocSite = trackSite(callsite);
+    if (s_HeapTrack.modes & eTrackLifetime) {
+        pBlock->ticks = pcheckerTicks();
+        pBlock->seq = VAR_ATOMIC_FETCH_ADD(s_HeapTrack.allocSeq, 1);
+    }
+    if (s_HeapTrack.modes & eTrackThreads)
+        pBlock->tid = (uint32_t)pcheckerGetTid();
+    pSite = trackSiteAt(pBlock->allocSite);
+    if (pSite) {
+        VAR_ATOMIC_FETCH_ADD(pSite->allocs, 1);
+        VAR_ATOMIC_FETCH_ADD(pSite->bytes, size);
+    }
+}
+
+static FUN_INLINE void trackLifetimeEnd(const struct heaptrack_block *pBlock)
+{
+    struct heaptrack_site *pSite = trackSiteAt(pBlock->allocSite);
+    uint64_t ns, allocs;
+
+    if (!pSite || !(s_HeapTrack.modes & eTrackLifetime))
+        return;
+    ns = pcheckerTicksToNs(pcheckerTicks() - pBlock->ticks);
+    allocs = VAR_ATOMIC_LOAD(s_HeapTrack.allocSeq) - pBlock->seq - 1;
+    VAR_ATOMIC_FETCH_ADD(pSite->frees, 1);
+    VAR_ATOMIC_FETCH_ADD(pSite->histNs[trackBucket(ns)], 1);
+    VAR_ATOMIC_FETCH_ADD(pSite->histAllocs[trackBucket(allocs)], 1);
+    if (allocs < s_HeapTrack.shortAllocs)
+        VAR_ATOMIC_FETCH_ADD(pSite->short_, 1);
+}
+
+/* the chain of a block ends with its free */
+static FUN_INLINE void trackChainEnd(const struct heaptrack_block *pBlock)
+{
+    struct heaptrack_site *pSite = trackSiteAt(pBlock->reallocSite);
+
+    if (!pSite)
+        return;
+    VAR_ATOMIC_FETCH_ADD(pSite->chains, 1);
+    VAR_ATOMIC_FETCH_ADD(pSite->reallocs, pBlock->reallocs);
+    VAR_ATOMIC_FETCH_ADD(pSite->copied, pBlock->copied);
+    VAR_ATOMIC_FETCH_ADD(pSite->finalBytes, pBlock->size);
+    VAR_ATOMIC_FETCH_ADD(pSite->geometric, pBlock->geometric);
+    VAR_ATOMIC_FETCH_ADD(pSite->linear, pBlock->linear);
+    trackMax(&pSite->finalMax, pBlock->size);
+    trackMax(&pSite->chainMax, pBlock->reallocs);
+}
+
+static FUN_INLINE void trackPair(uint32_t allocTid, uint32_t freeTid, uint32_t site)
+{
+    /* thread ids have at most 22 bits (PID_MAX_LIMIT) */
+    uint64_t key = ((uint64_t)allocTid << 42) | ((uint64_t)(freeTid & 0x3fffff) << 20) | site;
+    unsigned i, h = (unsigned)trackHash((uintptr_t)key << 4);
+
+    for (i = 0; i < PCHECKER_HEAPTRACK_PAIRS; ++i) {
+        struct heaptrack_pair *pPair = &s_HeapTrack.pairs[(h + i) & (PCHECKER_HEAPTRACK_PAIRS - 1)];
+        uint64_t cur = VAR_ATOMIC_LOAD(pPair->key);
+
+        if (!cur && (VAR_ATOMIC_CAS(pPair->key, &cur, key) || cur == key)) {
+            VAR_ATOMIC_FETCH_ADD(pPair->count, 1);
+            return;
+        }
+        if (cur == key) {
+            VAR_ATOMIC_FETCH_ADD(pPair->count, 1);
+            return;
+        }
+    }
+    VAR_ATOMIC_FETCH_ADD(s_HeapTrack.droppedPairs, 1);
+}
+
+/* a free or a moving realloc of the block at callsite */
+static FUN_INLINE void trackRelease(const struct heaptrack_block *pBlock, const void *callsite)
+{
+    struct heaptrack_site *pSite, *pAllocSite;
+    uint32_t tid;
+
+    if (!(s_HeapTrack.modes & eTrackThreads) || !pBlock->tid)
+        return;
+    tid = (uint32_t)pcheckerGetTid();
+    pSite = trackSiteAt(trackSite(callsite));
+    if (pSite)
+        VAR_ATOMIC_FETCH_ADD(pSite->freesAt, 1);
+    if (tid == pBlock->tid)
+        return;
+
+    if (pSite)
+        VAR_ATOMIC_FETCH_ADD(pSite->remoteAt, 1);
+    pAllocSite = trackSiteAt(pBlock->allocSite);
+    if (pAllocSite)
+        VAR_ATOMIC_FETCH_ADD(pAllocSite->remoteFreed, 1);
+    trackPair(pBlock->tid, tid, pBlock->allocSite);
+}
+
+static FUN_INLINE void trackFreed(const struct heaptrack_block *pBlock, const void *callsite)
+{
+    trackChainEnd(pBlock);
+    trackLifetimeEnd(pBlock);
+    trackRelease(pBlock, callsite);
+}
+
+static FUN_INLINE void trackStep(struct heaptrack_block *pBlock, uint64_t size, int moved, const void *callsite)
+{
+    if (!pBlock->reallocSite)
+        pBlock->reallocSite = trackSite(callsite);
+    ++pBlock->reallocs;
+
+    if (moved) {
+        pBlock->copied += pBlock->size < size ? pBlock->size : size;
+        if (pBlock->reallocSite)
+            VAR_ATOMIC_FETCH_ADD(s_HeapTrack.sites[pBlock->reallocSite - 1].moved, 1);
+    }
+    if (size > pBlock->size) {
+        uint64_t delta = size - pBlock->size;
+        if (size >= pBlock->size + pBlock->size / 4)
+            ++pBlock->geometric;
+        else if (delta <= pBlock->delta)
+            ++pBlock->linear;
+        pBlock->delta = delta;
+    }
+    pBlock->size = size;
+}
+
+/* hooks for the interposers, they do nothing unless a mode is enabled */
+
+static FUN_INLINE void heapTrackAlloc(void *ptr, size_t size, const void *callsite)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+    struct heaptrack_block block = {0};
+#pragma GCC diagnostic pop
+
+    if (unlikely(s_HeapTrack.pEntries != NULL) && (s_HeapTrack.modes & eTrackAllBlocks) && ptr) {
+        trackBlockStart(&block, size, callsite);
+        trackInsert(ptr, &block);
+    }
+}
+
+/* call before free */
+static FUN_INLINE void heapTrackFree(void *ptr, const void *callsite)
+{
+    struct heaptrack_block block;
+
+    if (unlikely(s_HeapTrack.pEntries != NULL) && ptr && trackRemove(ptr, &block))
+        trackFreed(&block, callsite);
+}
+
+/* call before realloc, the block is taken out of the table
+ * as the real realloc might free it */
+static FUN_INLINE void heapTrackReallocBegin(void *ptr, struct heaptrack_block *pBlock)
+{
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+    static const struct heaptrack_block s_NoBlock = {0};
+#pragma GCC diagnostic pop
+
+    if (!s_HeapTrack.pEntries)
+        return;
+    if (ptr && trackRemove(ptr, pBlock))
+        return;
+    *pBlock = s_NoBlock;
+    if (ptr)
+        pBlock->size = (*s_HeapTrack.pf_usable)(ptr);
+}
+
+static FUN_INLINE void heapTrackReallocEnd(
+    void *ptr, struct heaptrack_block *pBlock, void *r, size_t size, const void *callsite)
+{
+    if (!s_HeapTrack.pEntries)
+        return;
+    if (!r) {
+        if (ptr && size == 0)
+            trackFreed(pBlock, callsite); /* realloc(ptr, 0) freed the block */
+        else if (ptr)
+            trackInsert(ptr, pBlock); /* failed, the block is unchanged */
+        return;
+    }
+    if (ptr && r != ptr && pBlock->tid) {
+        /* moved to the arena of this thread */
+        trackRelease(pBlock, callsite);
+        pBlock->tid = (uint32_t)pcheckerGetTid();
+    }
+    if (ptr)
+        trackStep(pBlock, size, r != ptr, callsite);
+    else
+        trackBlockStart(pBlock, size, callsite);
+    trackInsert(r, pBlock);
+}
+
+/* report */
+
+static FUN_INLINE void trackOutKiB(struct pchecker_out *o, uint64_t bytes, unsigned width)
+{
+    outUDec(o, (bytes + 1023) / 1024, width);
+}
+
+typedef uint64_t (*pf_track_rank_t)(const struct heaptrack_site *pSite);
+
+/* sort the top sites by rank into the order array, sites ranked 0 are left out */
+static unsigned trackSelect(pf_track_rank_t pfRank, unsigned top)
+{
+    unsigned *pOrder = s_HeapTrack.order;
+    unsigned i, k, count = 0;
+
+    for (i = 0; i < PCHECKER_HEAPTRACK_SITES; ++i) {
+        if ((*pfRank)(&s_HeapTrack.sites[i]))
+            pOrder[count++] = i;
+    }
+    for (i = 0; i < top && i < count; ++i) {
+        unsigned best = i, tmp;
+        for (k = i + 1; k < count; ++k) {
+            if ((*pfRank)(&s_HeapTrack.sites[pOrder[k]]) > (*pfRank)(&s_HeapTrack.sites[pOrder[best]]))
+                best = k;
+        }
+        tmp = pOrder[i];
+        pOrder[i] = pOrder[best];
+        pOrder[best] = tmp;
+    }
+    return i;
+}
+
+static uint64_t trackRankRealloc(const struct heaptrack_site *pSite)
+{
+    return VAR_ATOMIC_LOAD(pSite->chains) ? VAR_ATOMIC_LOAD(pSite->copied) + 1 : 0;
+}
+
+static void trackWriteRealloc(struct pchecker_out *o, unsigned top)
+{
+    unsigned i, count = trackSelect(&trackRankRealloc, top);
+
+    outStr(o, "\nrealloc chains per callsite of the first realloc, by bytes copied\n");
+    outStr(o, "    chains  reallocs     moved  copied KiB  final avg KiB  final max KiB  longest  growth     callsite\n");
+    for (i = 0; i < count; ++i) {
+        const struct heaptrack_site *p = &s_HeapTrack.sites[s_HeapTrack.order[i]];
+        uint64_t chains = VAR_ATOMIC_LOAD(p->chains);
+        uint64_t geometric = VAR_ATOMIC_LOAD(p->geometric);
+        uint64_t linear = VAR_ATOMIC_LOAD(p->linear);
+
+        outUDec(o, chains, 10);
+        outUDec(o, VAR_ATOMIC_LOAD(p->reallocs), 10);
+        outUDec(o, VAR_ATOMIC_LOAD(p->moved), 10);
+        trackOutKiB(o, VAR_ATOMIC_LOAD(p->copied), 12);
+        trackOutKiB(o, VAR_ATOMIC_LOAD(p->finalBytes) / chains, 15);
+        trackOutKiB(o, VAR_ATOMIC_LOAD(p->finalMax), 15);
+        outUDec(o, VAR_ATOMIC_LOAD(p->chainMax), 9);
+        outPad(o, 0, 2);
+        outStrCol(o, !geometric && !linear ? "-" : linear > geometric ? "linear" : "geometric", 11);
+        outSymbol(o, (const void *)VAR_ATOMIC_LOAD(p->callsite));
+        /* linear growth copies n^2 / 2 steps, geometric growth about the final size */
+        if (linear > geometric && VAR_ATOMIC_LOAD(p->copied) > 4 * VAR_ATOMIC_LOAD(p->finalBytes))
+            outStr(o, "  QUADRATIC");
+        outChar(o, '\n');
+    }
+    outFlush(o);
+}
+
+static uint64_t trackRankShort(const struct heaptrack_site *pSite)
+{
+    return VAR_ATOMIC_LOAD(pSite->allocs) ? VAR_ATOMIC_LOAD(pSite->short_) + 1 : 0;
+}
+
+/* upper bound of the bucket containing the median */
+static FUN_INLINE void trackOutMedian(struct pchecker_out *o, const VAR_ATOMIC(uint64_t) * pHist, uint64_t total)
+{
+    static const char *const s_Bounds[eTrackBuckets] = {"<4", "<16", "<64", "<256", "<1k", "<4k", "<16k", "<64k",
+        "<256k", "<1M", "<4M", "<16M", "<64M", "<256M", "<1G", ">=1G"};
+    uint64_t sum = 0;
+    unsigned b;
+
+    if (!total) {
+        outStrCol(o, "", 7);
+        outChar(o, '-');
+        return;
+    }
+    for (b = 0; b < eTrackBuckets - 1; ++b) {
+        sum += VAR_ATOMIC_LOAD(pHist[b]);
+        if (2 * sum >= total)
+            break;
+    }
+    outPad(o, pcheckerStrLen(s_Bounds[b]), 8);
+    outStr(o, s_Bounds[b]);
+}
+
+static FUN_INLINE void trackOutHist(struct pchecker_out *o, const char *name, const VAR_ATOMIC(uint64_t) * pHist)
+{
+    unsigned b;
+
+    outStr(o, "      ");
+    outStrCol(o, name, 8);
+    for (b = 0; b < eTrackBuckets; ++b)
+        outUDec(o, VAR_ATOMIC_LOAD(pHist[b]), 8);
+    outChar(o, '\n');
+}
+
+static void trackWriteLifetime(struct pchecker_out *o, unsigned top)
+{
+    unsigned i, count = trackSelect(&trackRankShort, top);
+
+    outStr(o, "\nallocation lifetime per callsite, by blocks freed after less than ");
+    outUDec(o, s_HeapTrack.shortAllocs, 0);
+    outStr(o, " allocations\n");
+    outStr(o, "    allocs     short  short %   avg size    freed      live  median ns  median allocs  callsite\n");
+    for (i = 0; i < count; ++i) {
+        const struct heaptrack_site *p = &s_HeapTrack.sites[s_HeapTrack.order[i]];
+        uint64_t allocs = VAR_ATOMIC_LOAD(p->allocs);
+        uint64_t frees = VAR_ATOMIC_LOAD(p->frees);
+        uint64_t shortCount = VAR_ATOMIC_LOAD(p->short_);
+
+        outUDec(o, allocs, 10);
+        outUDec(o, shortCount, 10);
+        outUDec(o, frees ? shortCount * 100 / frees : 0, 9);
+        outUDec(o, VAR_ATOMIC_LOAD(p->bytes) / allocs, 11);
+        outUDec(o, frees, 9);
+        outUDec(o, p->live, 10);
+        outPad(o, 0, 3);
+        trackOutMedian(o, p->histNs, frees);
+        outPad(o, 0, 7);
+        trackOutMedian(o, p->histAllocs, frees);
+        outStr(o, "  ");
+        outSymbol(o, (const void *)VAR_ATOMIC_LOAD(p->callsite));
+        outChar(o, '\n');
+    }
+
+    /* the histograms of the same sites */
+    outStr(o, "\nlifetime histograms, log4 buckets\n");
+    outStr(o, "                    <4     <16     <64    <256     <1k     <4k    <16k    <64k   <256k     <1M     <4M"
+              "    <16M    <64M   <256M     <1G    more\n");
+    for (i = 0; i < count; ++i) {
+        const struct heaptrack_site *p = &s_HeapTrack.sites[s_HeapTrack.order[i]];
+        outSymbol(o, (const void *)VAR_ATOMIC_LOAD(p->callsite));
+        outChar(o, '\n');
+        trackOutHist(o, "ns", p->histNs);
+        trackOutHist(o, "allocs", p->histAllocs);
+    }
+    outFlush(o);
+}
+
+static uint64_t trackRankRemoteFreed(const struct heaptrack_site *pSite)
+{
+    return VAR_ATOMIC_LOAD(pSite->remoteFreed);
+}
+
+static uint64_t trackRankRemoteAt(const struct heaptrack_site *pSite)
+{
+    return VAR_ATOMIC_LOAD(pSite->remoteAt);
+}
+
+static FUN_INLINE void trackOutShare(struct pchecker_out *o, uint64_t total, uint64_t remote)
+{
+    outUDec(o, total, 10);
+    outUDec(o, remote, 10);
+    outUDec(o, total ? remote * 100 / total : 0, 10);
+    outStr(o, "  ");
+}
+
+static void trackWriteThreads(struct pchecker_out *o, unsigned top)
+{
+    struct heaptrack_pair *pPairs = s_HeapTrack.pairs;
+    unsigned i, k, count = trackSelect(&trackRankRemoteFreed, top);
+
+    outStr(o, "\nblocks freed on another thread, per allocation callsite\n");
+    outStr(o, "    allocs    remote  remote %  callsite\n");
+    for (i = 0; i < count; ++i) {
+        const struct heaptrack_site *p = &s_HeapTrack.sites[s_HeapTrack.order[i]];
+        trackOutShare(o, VAR_ATOMIC_LOAD(p->allocs), VAR_ATOMIC_LOAD(p->remoteFreed));
+        outSymbol(o, (const void *)VAR_ATOMIC_LOAD(p->callsite));
+        outChar(o, '\n');
+    }
+
+    count = trackSelect(&trackRankRemoteAt, top);
+    outStr(o, "\nfrees of blocks from another thread, per free callsite\n");
+    outStr(o, "     frees    remote  remote %  callsite\n");
+    for (i = 0; i < count; ++i) {
+        const struct heaptrack_site *p = &s_HeapTrack.sites[s_HeapTrack.order[i]];
+        trackOutShare(o, VAR_ATOMIC_LOAD(p->freesAt), VAR_ATOMIC_LOAD(p->remoteAt));
+        outSymbol(o, (const void *)VAR_ATOMIC_LOAD(p->callsite));
+        outChar(o, '\n');
+    }
+
+    /* the pair table is not used anymore, sort it in place */
+    outStr(o, "\nproducer/consumer pairs\n");
+    outStr(o, "  alloc tid   free tid    blocks  allocation callsite\n");
+    for (i = 0; i < top && i < PCHECKER_HEAPTRACK_PAIRS; ++i) {
+        struct heaptrack_pair tmp;
+        uint64_t key;
+        unsigned best = i;
+
+        for (k = i + 1; k < PCHECKER_HEAPTRACK_PAIRS; ++k) {
+            if (VAR_ATOMIC_LOAD(pPairs[k].count) > VAR_ATOMIC_LOAD(pPairs[best].count))
+                best = k;
+        }
+        if (!VAR_ATOMIC_LOAD(pPairs[best].count))
+            break;
+        FUN_MEMCPY(&tmp, &pPairs[i], sizeof(tmp));
+        FUN_MEMCPY(&pPairs[i], &pPairs[best], sizeof(tmp));
+        FUN_MEMCPY(&pPairs[best], &tmp, sizeof(tmp));
+
+        key = VAR_ATOMIC_LOAD(pPairs[i].key);
+        outUDec(o, key >> 42, 11);
+        outUDec(o, (key >> 20) & 0x3fffff, 11);
+        outUDec(o, VAR_ATOMIC_LOAD(pPairs[i].count), 10);
+        outStr(o, "  ");
+        if (key & 0xfffff)
+            outSymbol(o, (const void *)VAR_ATOMIC_LOAD(s_HeapTrack.sites[(key & 0xfffff) - 1].callsite));
+        else
+            outChar(o, '?');
+        outChar(o, '\n');
+    }
+    outFlush(o);
+}
+
+static FUN_INLINE void heapTrackWarn(const char *what, const char *value)
+{
+    struct pchecker_out o;
+    outInit(&o, 2);
+    outStr(&o, "pchecker(" PCHECKER_NAME "): ");
+    outStr(&o, what);
+    outStr(&o, " '");
+    outStr(&o, value);
+    outStr(&o, "'\n");
+    outFlush(&o);
+}
+
+static FUN_INLINE unsigned trackParseModes(const char *s)
+{
+    static const char *const s_ModeNames = "realloc\0lifetime\0threads\0";
+    unsigned modes = 0;
+
+    while (*s) {
+        char word[32];
+        unsigned n = 0, bit;
+        const char *pName = s_ModeNames;
+
+        while (*s && *s != ',') {
+            if (n + 1 < sizeof(word))
+                word[n++] = *s;
+            ++s;
+        }
+        word[n] = '\0';
+        if (*s == ',')
+            ++s;
+        if (!n)
+            continue;
+
+        for (bit = 1; *pName; bit <<= 1, pName += pcheckerStrLen(pName) + 1) {
+            if (pcheckerStrEq(word, pName))
+                break;
+        }
+        if (*pName)
+            modes |= bit;
+        else
+            heapTrackWarn("unknown heap analysis", word);
+    }
+    return modes;
+}
+
+/* enable modes, the table is created by the first call. Returns 0 if
+ * the blocks cannot be tracked */
+static FUN_INLINE int trackStart(unsigned modes)
+{
+    uint64_t entries = pcheckerEnvUnsigned("PCHECKER_HEAP_ENTRIES", 256 * 1024);
+    uint64_t size = PCHECKER_HEAPTRACK_PROBES;
+    void *pf, *p;
+
+    s_HeapTrack.modes |= modes;
+    if (s_HeapTrack.pEntries)
+        return 1;
+
+    pf = getdelegate_function("malloc_usable_size");
+    if (!pf) {
+        heapTrackWarn("heap analysis needs", "malloc_usable_size");
+        return 0;
+    }
+    COPY_PF(s_HeapTrack.pf_usable, pf_malloc_usable_size_t, pf);
+    s_HeapTrack.shortAllocs = pcheckerEnvUnsigned("PCHECKER_HEAP_SHORT", 16);
+
+    while (size < entries)
+        size <<= 1;
+    p = sysMmap(NULL, size * sizeof(struct heaptrack_entry), PCHECKER_PROT_READ | PCHECKER_PROT_WRITE,
+        PCHECKER_MAP_PRIVATE | PCHECKER_MAP_ANONYMOUS, -1, 0);
+    if (p == PCHECKER_MAP_FAILED)
+        return 0;
+    s_HeapTrack.mask = size - 1;
+    /* start tracking */
+    s_HeapTrack.pEntries = (struct heaptrack_entry *)p;
+    return 1;
+}
+
+/* call from the constructor, after the symbols are resolved */
+static FUN_INLINE void heapTrackInit()
+{
+    const char *modes = pcheckerEnv("PCHECKER_HEAP_ANALYZE");
+    unsigned parsed;
+
+    if (!modes)
+        return;
+    parsed = trackParseModes(modes);
+    if (parsed)
+        trackStart(parsed);
+}
+
+/* call from the destructor */
+static FUN_INLINE void heapTrackFinish()
+{
+    const char *path = pcheckerEnv("PCHECKER_HEAP_ANALYZE_REPORT");
+    struct heaptrack_entry *pEntries = s_HeapTrack.pEntries;
+    struct pchecker_out o;
+    unsigned top;
+    uint64_t i;
+    int fd = 2;
+
+    if (!pEntries || !(s_HeapTrack.modes & ~(unsigned)eTrackLive))
+        return;
+
+    /* the chains of the live blocks end here */
+    for (i = 0; i <= s_HeapTrack.mask; ++i) {
+        struct heaptrack_site *pSite;
+        if (VAR_ATOMIC_LOAD(pEntries[i].key) <= eTrackDeleted)
+            continue;
+        trackChainEnd(&pEntries[i].block);
+        pSite = trackSiteAt(pEntries[i].block.allocSite);
+        if (pSite)
+            ++pSite->live;
+    }
+
+    if (path)
+        fd = sysOpen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    outInit(&o, fd);
+    top = (unsigned)pcheckerEnvUnsigned("PCHECKER_HEAP_TOP", 20);
+    if (s_HeapTrack.modes & eTrackRealloc)
+        trackWriteRealloc(&o, top);
+    if (s_HeapTrack.modes & eTrackLifetime)
+        trackWriteLifetime(&o, top);
+    if (s_HeapTrack.modes & eTrackThreads)
+        trackWriteThreads(&o, top);
+    if (VAR_ATOMIC_LOAD(s_HeapTrack.dropped) || VAR_ATOMIC_LOAD(s_HeapTrack.droppedSites)) {
+        outStr(&o, "not tracked: ");
+        outUDec(&o, VAR_ATOMIC_LOAD(s_HeapTrack.dropped), 0);
+        outStr(&o, " blocks, ");
+        outUDec(&o, VAR_ATOMIC_LOAD(s_HeapTrack.droppedSites), 0);
+        outStr(&o, " callsites\n");
+    }
+    outFlush(&o);
+    if (fd != 2)
+        sysClose(fd);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * helper threads of the checkers, for work that must not be done
+ * within the interposed calls (sampling, housekeeping).
+ *
+ * pthread_create is looked up at run time in the C library, the checkers
+ * don't link libpthread. Helpers start with the signals of the application
+ * blocked, so its handlers never run on them, and should lower themselves
+ * to SCHED_IDLE with pcheckerHelperSetup, or to SCHED_OTHER if they
+ * have to keep up with the application.
+ * After fork the child has no helpers.
+ */
+
+#ifndef PCHECKER_HELPER_H
+#define PCHECKER_HELPER_H
+
+#include "pchecker_util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int (*pf_pthread_create_t)(void *pThread, const void *pAttr, void *(*pfRun)(void *), void *pArg);
+
+enum {
+    PCHECKER_SIG_SETMASK = 2,
+    PCHECKER_SCHED_OTHER = 0,
+    PCHECKER_SCHED_IDLE = 5,
+    PCHECKER_PR_SET_NAME = 15,
+    PCHECKER_TIMER_ABSTIME = 1
+};
+
+/* run pfRun(pArg) on a new thread, returns 0 on success */
+static FUN_INLINE int pcheckerStartHelper(void *(*pfRun)(void *), void *pArg)
+{
+    /* the C libraries use the first realtime signals internally
+     * (cancellation, setxid broadcast), those must stay deliverable */
+    uint64_t all = ~((uint64_t)7 << 31), old;
+    uint64_t thread[2];
+    pf_pthread_create_t pfCreate;
+    void *pf = pcheckerLibcSymbol("pthread_create");
+    int r;
+
+    if (!pf)
+        return -1;
+    COPY_PF(pfCreate, pf_pthread_create_t, pf);
+
+    syscall(SYS_rt_sigprocmask, PCHECKER_SIG_SETMASK, &all, &old, sizeof(all));
+    r = (*pfCreate)(thread, NULL, pfRun, pArg);
+    syscall(SYS_rt_sigprocmask, PCHECKER_SIG_SETMASK, &old, NULL, sizeof(old));
+    return r;
+}
+
+/* call first on the helper thread, name is at most 15 characters,
+ * policy is PCHECKER_SCHED_IDLE or PCHECKER_SCHED_OTHER (the helper
+ * may inherit a realtime policy from the thread loading the checker) */
+static FUN_INLINE void pcheckerHelperSetup(const char *name, int policy)
+{
+    int priority = 0;
+
+    syscall(SYS_sched_setscheduler, 0, policy, &priority);
+    syscall(SYS_prctl, PCHECKER_PR_SET_NAME, name, 0, 0, 0);
+}
+
+/* sleep until CLOCK_MONOTONIC reaches ns */
+static FUN_INLINE void pcheckerHelperSleepUntil(uint64_t ns)
+{
+    struct pchecker_timespec ts;
+
+    ts.tv_sec = (long)(ns / 1000000000u);
+    ts.tv_nsec = (long)(ns % 1000000000u);
+    while (syscall(SYS_clock_nanosleep, PCHECKER_CLOCK_MONOTONIC, PCHECKER_TIMER_ABSTIME, &ts, NULL) != 0 &&
+           sysMonotonicNs() < ns)
+        ;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,373 @@
+/*
+ * this checker interposes the functions changing the address space:
+ * mmap, munmap, mprotect, madvise, brk, sbrk and mmap64 (called by
+ * programs built with _FILE_OFFSET_BITS=64, also on 64 bit glibc). All of
+ * them take the mmap lock of the process, which stalls page faults of
+ * every other thread.
+ *
+ * Calls are checked like the heap functions, and counted per thread
+ * with the bytes mapped and unmapped. The summary is written at exit
+ * to stderr or PCHECKER_MMAP_REPORT.
+ *
+ * The C libraries call the system calls directly from malloc, those
+ * calls are not seen here (the heap checkers catch the malloc instead).
+ */
+
+#define PCHECKER_NAME "mmap"
+
+#include "pchecker.h"
+#include "pchecker_trace.h"
+#include "pchecker_violation.h"
+
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PCHECKER_MMAP_THREADS
+#define PCHECKER_MMAP_THREADS 64
+#endif
+
+typedef void *(*pf_mmap_t)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+typedef int (*pf_munmap_t)(void *addr, size_t length);
+typedef int (*pf_mprotect_t)(void *addr, size_t len, int prot);
+typedef int (*pf_madvise_t)(void *addr, size_t length, int advice);
+typedef int (*pf_brk_t)(void *addr);
+typedef void *(*pf_sbrk_t)(intptr_t increment);
+typedef void *(*pf_mmap64_t)(void *addr, size_t length, int prot, int flags, int fd, int64_t offset);
+
+DSO_PUBLIC void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+DSO_PUBLIC int munmap(void *addr, size_t length);
+DSO_PUBLIC int mprotect(void *addr, size_t len, int prot);
+DSO_PUBLIC int madvise(void *addr, size_t length, int advice);
+DSO_PUBLIC int brk(void *addr);
+DSO_PUBLIC void *sbrk(intptr_t increment);
+DSO_PUBLIC void *mmap64(void *addr, size_t length, int prot, int flags, int fd, int64_t offset);
+
+static struct function_table {
+    pf_mmap_t pf_mmap;
+    pf_munmap_t pf_munmap;
+    pf_mprotect_t pf_mprotect;
+    pf_madvise_t pf_madvise;
+    pf_brk_t pf_brk;
+    pf_sbrk_t pf_sbrk;
+    pf_mmap64_t pf_mmap64;
+} s_ResolvedFunctions VAR_TABLE;
+
+enum EFunctionIndex {
+    eMmap,
+    eMunmap,
+    eMprotect,
+    eMadvise,
+    eBrk,
+    eSbrk,
+    eMmap64, /* not in musl since 1.2.4, optional */
+    eCount
+};
+
+/* clang-format off */
+static const char *const s_FunctionNames =
+    "mmap\0"
+    "munmap\0"
+    "mprotect\0"
+    "madvise\0"
+    "brk\0"
+    "sbrk\0"
+    "mmap64\0";
+/* clang-format on */
+
+/* for the resolve pass of the combined DSO */
+PCHECKER_REGISTER(s_ResolvedFunctions);
+
+static int tryResolve()
+{
+    int state = setState(0);
+
+    if (state == 0) {
+        getassert_function(0);
+        state = setState(1);
+    }
+
+    if (state <= 2) {
+        int countresolved = 0, func = 0;
+        const char *pName = s_FunctionNames;
+
+        pf_void_t *pFTable = (pf_void_t *)&s_ResolvedFunctions.pf_mmap;
+
+        while (*pName != '\0') {
+            void *pf;
+            pf = getdelegate_function(pName);
+            if (pf)
+                FUN_MEMCPY(pFTable, &pf, sizeof(*pFTable));
+
+            countresolved += pf || func >= eMmap64 ? 1 : 0;
+
+            while (*pName++ != '\0')
+                ;
+            ++pFTable;
+            ++func;
+        }
+        /* the same function where off_t has 64 bits */
+        if (!s_ResolvedFunctions.pf_mmap64 && sizeof(off_t) == sizeof(int64_t))
+            FUN_MEMCPY(&s_ResolvedFunctions.pf_mmap64, &s_ResolvedFunctions.pf_mmap, sizeof(pf_void_t));
+
+        if (countresolved == sizeof(s_ResolvedFunctions) / sizeof(pf_void_t))
+            state = setState(3);
+    }
+
+    if (state >= 2) {
+        if (getassert_function(1) && state == 3)
+            state = setResolveIsDone();
+    }
+
+    return state;
+}
+
+struct mmap_thread {
+    VAR_ATOMIC(int) tid;
+    uint32_t calls[eCount];
+    uint32_t rtCalls; /* from RT threads or critical sections */
+    uint64_t mapped;
+    uint64_t unmapped;
+    uint64_t protected_;
+    int64_t brk; /* growth of the program break by sbrk */
+};
+
+static struct mmap_state {
+    VAR_ATOMIC(unsigned) lostThreads;
+    struct mmap_thread threads[PCHECKER_MMAP_THREADS];
+} s_Mmap;
+
+static VAR_TLS struct mmap_thread *s_pThread;
+
+static struct mmap_thread *getThread()
+{
+    struct mmap_thread *pThread = s_pThread;
+    int tid;
+    unsigned i;
+
+    if (pThread)
+        return pThread;
+
+    tid = pcheckerGetTid();
+    for (i = 0; i < PCHECKER_MMAP_THREADS; ++i) {
+        int expected = 0;
+        if (VAR_ATOMIC_CAS(s_Mmap.threads[i].tid, &expected, tid)) {
+            s_pThread = &s_Mmap.threads[i];
+            return s_pThread;
+        }
+    }
+    VAR_ATOMIC_FETCH_ADD(s_Mmap.lostThreads, 1);
+    return NULL;
+}
+
+static FUN_INLINE struct mmap_thread *countCall(enum EFunctionIndex func, const void *callsite)
+{
+    struct mmap_thread *pThread = getThread();
+
+    if (pThread) {
+        ++pThread->calls[func];
+        if (isCheckedRt(func, callsite))
+            ++pThread->rtCalls;
+    }
+    return pThread;
+}
+
+static int controlDump(struct pchecker_out *o, const char *cmd, const char *arg);
+
+__attribute__((__constructor__(101))) static void callResolve()
+{
+    if (!initIsDone())
+        tryResolve();
+    setInitIsDone();
+
+    unwindInit();
+    violationInit();
+    traceOpen(PCHECKER_NAME, s_FunctionNames);
+    threadsInit(PCHECKER_NAME, s_FunctionNames);
+    controlInit(s_FunctionNames, &controlDump);
+}
+
+static void writeReport(struct pchecker_out *o)
+{
+    unsigned i;
+
+    outStr(o, "\naddress space changes, per thread (KiB)\n");
+    outStr(o, "     tid    mmap    mapped  munmap  unmapped  mprotect      KiB  madvise  brk  sbrk   brk KiB    RT\n");
+    for (i = 0; i < PCHECKER_MMAP_THREADS && VAR_ATOMIC_LOAD(s_Mmap.threads[i].tid); ++i) {
+        const struct mmap_thread *p = &s_Mmap.threads[i];
+        outSDec(o, VAR_ATOMIC_LOAD(p->tid), 8);
+        outUDec(o, p->calls[eMmap] + p->calls[eMmap64], 8);
+        outUDec(o, p->mapped / 1024, 10);
+        outUDec(o, p->calls[eMunmap], 8);
+        outUDec(o, p->unmapped / 1024, 10);
+        outUDec(o, p->calls[eMprotect], 10);
+        outUDec(o, p->protected_ / 1024, 9);
+        outUDec(o, p->calls[eMadvise], 9);
+        outUDec(o, p->calls[eBrk], 5);
+        outUDec(o, p->calls[eSbrk], 6);
+        outSDec(o, p->brk / 1024, 10);
+        outUDec(o, p->rtCalls, 6);
+        outChar(o, '\n');
+    }
+    if (VAR_ATOMIC_LOAD(s_Mmap.lostThreads)) {
+        outStr(o, "threads not recorded: ");
+        outUDec(o, VAR_ATOMIC_LOAD(s_Mmap.lostThreads), 0);
+        outChar(o, '\n');
+    }
+    outFlush(o);
+}
+
+/* the report on the control socket */
+static int controlDump(struct pchecker_out *o, const char *cmd, const char *arg)
+{
+    (void)arg;
+    if (!pcheckerStrEq(cmd, "dump"))
+        return 0;
+    writeReport(o);
+    return 1;
+}
+
+__attribute__((__destructor__(101))) static void callFinish()
+{
+    const char *path = pcheckerEnv("PCHECKER_MMAP_REPORT");
+    struct pchecker_out o;
+    int fd = 2;
+
+    traceClose();
+    threadsFinish();
+    controlFinish();
+
+    if (!VAR_ATOMIC_LOAD(s_Mmap.threads[0].tid))
+        return;
+    if (path)
+        fd = sysOpen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    outInit(&o, fd);
+    writeReport(&o);
+    if (fd != 2)
+        sysClose(fd);
+}
+
+static FUN_INLINE void initAndCheck(enum EFunctionIndex func, const void *callsite)
+{
+    if (unlikely(!initIsDone())) {
+        tryResolve();
+    }
+
+    checkCall(1, func, callsite);
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+    struct pchecker_trace_record *pTrace;
+    struct mmap_thread *pThread;
+    void *r;
+    initAndCheck(eMmap, PCHECKER_CALLSITE());
+
+    pThread = countCall(eMmap, PCHECKER_CALLSITE());
+    pTrace = traceBegin(eMmap, traceArgPtr(addr), (uint64_t)length, (uint64_t)flags, PCHECKER_CALLSITE());
+    r = (*s_ResolvedFunctions.pf_mmap)(addr, length, prot, flags, fd, offset);
+    if (pThread && r != PCHECKER_MAP_FAILED)
+        pThread->mapped += length;
+    traceEnd(pTrace, traceArgPtr(r));
+    return r;
+}
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd, int64_t offset)
+{
+    struct pchecker_trace_record *pTrace;
+    struct mmap_thread *pThread;
+    void *r;
+    initAndCheck(eMmap64, PCHECKER_CALLSITE());
+
+    pThread = countCall(eMmap64, PCHECKER_CALLSITE());
+    pTrace = traceBegin(eMmap64, traceArgPtr(addr), (uint64_t)length, (uint64_t)flags, PCHECKER_CALLSITE());
+    r = (*s_ResolvedFunctions.pf_mmap64)(addr, length, prot, flags, fd, offset);
+    if (pThread && r != PCHECKER_MAP_FAILED)
+        pThread->mapped += length;
+    traceEnd(pTrace, traceArgPtr(r));
+    return r;
+}
+
+int munmap(void *addr, size_t length)
+{
+    struct pchecker_trace_record *pTrace;
+    struct mmap_thread *pThread;
+    int r;
+    initAndCheck(eMunmap, PCHECKER_CALLSITE());
+
+    pThread = countCall(eMunmap, PCHECKER_CALLSITE());
+    pTrace = traceBegin(eMunmap, traceArgPtr(addr), (uint64_t)length, 0, PCHECKER_CALLSITE());
+    r = (*s_ResolvedFunctions.pf_munmap)(addr, length);
+    if (pThread && r == 0)
+        pThread->unmapped += length;
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+int mprotect(void *addr, size_t len, int prot)
+{
+    struct pchecker_trace_record *pTrace;
+    struct mmap_thread *pThread;
+    int r;
+    initAndCheck(eMprotect, PCHECKER_CALLSITE());
+
+    pThread = countCall(eMprotect, PCHECKER_CALLSITE());
+    pTrace = traceBegin(eMprotect, traceArgPtr(addr), (uint64_t)len, (uint64_t)prot, PCHECKER_CALLSITE());
+    r = (*s_ResolvedFunctions.pf_mprotect)(addr, len, prot);
+    if (pThread && r == 0)
+        pThread->protected_ += len;
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+int madvise(void *addr, size_t length, int advice)
+{
+    struct pchecker_trace_record *pTrace;
+    int r;
+    initAndCheck(eMadvise, PCHECKER_CALLSITE());
+
+    countCall(eMadvise, PCHECKER_CALLSITE());
+    pTrace = traceBegin(eMadvise, traceArgPtr(addr), (uint64_t)length, (uint64_t)advice, PCHECKER_CALLSITE());
+    r = (*s_ResolvedFunctions.pf_madvise)(addr, length, advice);
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+int brk(void *addr)
+{
+    struct pchecker_trace_record *pTrace;
+    int r;
+    initAndCheck(eBrk, PCHECKER_CALLSITE());
+
+    countCall(eBrk, PCHECKER_CALLSITE());
+    pTrace = traceBegin(eBrk, traceArgPtr(addr), 0, 0, PCHECKER_CALLSITE());
+    r = (*s_ResolvedFunctions.pf_brk)(addr);
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+void *sbrk(intptr_t increment)
+{
+    struct pchecker_trace_record *pTrace;
+    struct mmap_thread *pThread;
+    void *r;
+    initAndCheck(eSbrk, PCHECKER_CALLSITE());
+
+    pThread = countCall(eSbrk, PCHECKER_CALLSITE());
+    pTrace = traceBegin(eSbrk, (uint64_t)increment, 0, 0, PCHECKER_CALLSITE());
+    r = (*s_ResolvedFunctions.pf_sbrk)(increment);
+    if (pThread && r != (void *)-1)
+        pThread->brk += increment;
+    traceEnd(pTrace, traceArgPtr(r));
+    return r;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,43 @@
+/*
+ * marking latency critical sections without Xenomai.
+ *
+ * Every call to an interposed function between pchecker_rt_enter() and
+ * pchecker_rt_leave() is reported by the checkers. The sections nest
+ * and are per thread.
+ *
+ * The functions are provided by the checker DSOs and declared weak here,
+ * use the inline wrappers so the program runs without a preloaded checker.
+ */
+
+#ifndef PCHECKER_RT_H
+#define PCHECKER_RT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if __GNUC__
+void pchecker_rt_enter(void) __attribute__((__weak__));
+void pchecker_rt_leave(void) __attribute__((__weak__));
+
+static __inline__ void pcheckerRtEnter(void)
+{
+    if (&pchecker_rt_enter)
+        pchecker_rt_enter();
+}
+
+static __inline__ void pcheckerRtLeave(void)
+{
+    if (&pchecker_rt_leave)
+        pchecker_rt_leave();
+}
+#else
+#define pcheckerRtEnter()
+#define pcheckerRtLeave()
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
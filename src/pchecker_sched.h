@@ -0,0 +1,107 @@
+/*
+ * built-in replacement for cobalt_assert_nrt on PREEMPT_RT:
+ * threads scheduled with SCHED_FIFO, SCHED_RR or SCHED_DEADLINE are
+ * considered realtime.
+ *
+ * The policy is cached per thread. pthread_setschedparam and
+ * sched_setscheduler are interposed and bump a global generation,
+ * a thread whose cache is older queries its policy again with one
+ * system call. New threads start with an empty cache.
+ *
+ * Policy changes made without those functions (sched_setattr, chrt from
+ * another process) are not seen until the next change through them.
+ */
+
+#ifndef PCHECKER_SCHED_H
+#define PCHECKER_SCHED_H
+
+#include "pchecker_util.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum {
+    ePolicyFifo = 1,
+    ePolicyRR = 2,
+    ePolicyDeadline = 6,
+    ePolicyResetOnFork = 0x40000000
+};
+
+/* Both symbols are public, so all checker DSOs bind to the definitions
+ * of the first one loaded and share them.
+ * The cache holds the generation shifted by one and the RT bit,
+ * 0 means unknown. */
+DSO_PUBLIC DSO_SHARED VAR_ATOMIC(unsigned) pchecker_sched_generation;
+DSO_PUBLIC DSO_SHARED VAR_TLS unsigned pchecker_sched_cache;
+
+typedef int (*pf_pthread_setschedparam_t)(pthread_t thread, int policy, const struct sched_param *param);
+typedef int (*pf_sched_setscheduler_t)(pid_t pid, int policy, const struct sched_param *param);
+
+DSO_PUBLIC int pthread_setschedparam(pthread_t thread, int policy, const struct sched_param *param);
+DSO_PUBLIC int sched_setscheduler(pid_t pid, int policy, const struct sched_param *param);
+
+static FUN_INLINE int isRtPolicy(long policy)
+{
+    policy &= ~(long)ePolicyResetOnFork;
+    return policy == ePolicyFifo || policy == ePolicyRR || policy == ePolicyDeadline;
+}
+
+static FUN_INLINE int isRtScheduled()
+{
+    unsigned generation = VAR_ATOMIC_LOAD(pchecker_sched_generation) + 1;
+    unsigned cache = pchecker_sched_cache;
+
+    if (unlikely((cache >> 1) != (generation & (~0u >> 1)))) {
+        long policy = syscall(SYS_sched_getscheduler, 0);
+        cache = (generation << 1) | (policy >= 0 && isRtPolicy(policy) ? 1u : 0u);
+        pchecker_sched_cache = cache;
+    }
+    return (int)(cache & 1);
+}
+
+static FUN_INLINE void schedChanged()
+{
+    VAR_ATOMIC_FETCH_ADD(pchecker_sched_generation, 1);
+}
+
+DSO_SHARED int pthread_setschedparam(pthread_t thread, int policy, const struct sched_param *param)
+{
+    static pf_pthread_setschedparam_t s_pf;
+    int r;
+
+    if (unlikely(!s_pf)) {
+        void *pf = getdelegate_function("pthread_setschedparam");
+        if (!pf)
+            return EINVAL;
+        COPY_PF(s_pf, pf_pthread_setschedparam_t, pf);
+    }
+    r = (*s_pf)(thread, policy, param);
+    schedChanged();
+    return r;
+}
+
+DSO_SHARED int sched_setscheduler(pid_t pid, int policy, const struct sched_param *param)
+{
+    static pf_sched_setscheduler_t s_pf;
+    int r;
+
+    if (unlikely(!s_pf)) {
+        void *pf = getdelegate_function("sched_setscheduler");
+        if (!pf)
+            return -1;
+        COPY_PF(s_pf, pf_sched_setscheduler_t, pf);
+    }
+    r = (*s_pf)(pid, policy, param);
+    schedChanged();
+    return r;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
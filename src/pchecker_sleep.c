@@ -0,0 +1,608 @@
+/*
+ * this checker measures how late sleeping threads wake up, in the style of
+ * cyclictest but for the calls the application really makes.
+ *
+ * nanosleep, clock_nanosleep, usleep, sleep and reads from timerfds are
+ * interposed, the difference between the requested wakeup time and the
+ * return is collected in a histogram per thread (1us buckets).
+ * sched_yield is counted with the longest time spent in it.
+ *
+ * Relative sleeps in realtime threads (see pchecker_sched.h) or in
+ * critical sections are reported once per callsite, a periodic loop built
+ * on them drifts by the execution time of every cycle.
+ *
+ * The summary is written to stderr at exit, or to PCHECKER_SLEEP_REPORT.
+ * PCHECKER_SLEEP_HIST sets the histogram range in us (default 1000).
+ */
+
+#define PCHECKER_NAME "sleep"
+
+#include "pchecker.h"
+#include "pchecker_trace.h"
+#include "pchecker_violation.h"
+
+#include <sys/types.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PCHECKER_SLEEP_THREADS
+#define PCHECKER_SLEEP_THREADS 64
+#endif
+
+#ifndef PCHECKER_SLEEP_HIST_MAX
+#define PCHECKER_SLEEP_HIST_MAX 10000
+#endif
+
+/* timerfds with a number below are tracked */
+#ifndef PCHECKER_SLEEP_FDS
+#define PCHECKER_SLEEP_FDS 1024
+#endif
+
+#ifndef PCHECKER_SLEEP_CALLSITES
+#define PCHECKER_SLEEP_CALLSITES 256
+#endif
+
+typedef int (*pf_nanosleep_t)(const struct timespec *req, struct timespec *rem);
+typedef int (*pf_clock_nanosleep_t)(clockid_t clock_id, int flags, const struct timespec *req, struct timespec *rem);
+typedef int (*pf_usleep_t)(useconds_t usec);
+typedef unsigned (*pf_sleep_t)(unsigned seconds);
+typedef int (*pf_sched_yield_t)(void);
+typedef ssize_t (*pf_read_t)(int fd, void *buf, size_t count);
+typedef int (*pf_close_t)(int fd);
+typedef int (*pf_timerfd_create_t)(int clockid, int flags);
+typedef int (*pf_timerfd_settime_t)(
+    int fd, int flags, const struct itimerspec *new_value, struct itimerspec *old_value);
+typedef int (*pf_clock_gettime_t)(clockid_t clock_id, struct timespec *tp);
+
+DSO_PUBLIC int nanosleep(const struct timespec *req, struct timespec *rem);
+DSO_PUBLIC int clock_nanosleep(clockid_t clock_id, int flags, const struct timespec *req, struct timespec *rem);
+DSO_PUBLIC int usleep(useconds_t usec);
+DSO_PUBLIC unsigned sleep(unsigned seconds);
+DSO_PUBLIC int sched_yield(void);
+DSO_PUBLIC ssize_t read(int fd, void *buf, size_t count);
+DSO_PUBLIC int close(int fd);
+DSO_PUBLIC int timerfd_create(int clockid, int flags);
+DSO_PUBLIC int timerfd_settime(int fd, int flags, const struct itimerspec *new_value, struct itimerspec *old_value);
+
+static struct function_table {
+    pf_nanosleep_t pf_nanosleep;
+    pf_clock_nanosleep_t pf_clock_nanosleep;
+    pf_usleep_t pf_usleep;
+    pf_sleep_t pf_sleep;
+    pf_sched_yield_t pf_sched_yield;
+    pf_read_t pf_read;
+    pf_close_t pf_close;
+    pf_timerfd_create_t pf_timerfd_create;
+    pf_timerfd_settime_t pf_timerfd_settime;
+} s_ResolvedFunctions VAR_TABLE;
+
+enum EFunctionIndex {
+    eNanosleep,
+    eClockNanosleep,
+    eUsleep,
+    eSleep,
+    eSchedYield,
+    eRead,
+    eClose,
+    eTimerfdCreate,
+    eTimerfdSettime,
+    eCount
+};
+
+/* clang-format off */
+static const char *const s_FunctionNames =
+    "nanosleep\0"
+    "clock_nanosleep\0"
+    "usleep\0"
+    "sleep\0"
+    "sched_yield\0"
+    "read\0"
+    "close\0"
+    "timerfd_create\0"
+    "timerfd_settime\0";
+/* clang-format on */
+
+/* for the resolve pass of the combined DSO */
+PCHECKER_REGISTER(s_ResolvedFunctions);
+
+/* the functions are all in libc and none allocates,
+ * resolving them all in the constructor is enough */
+static int tryResolve()
+{
+    int state = setState(0);
+
+    if (state == 0) {
+        getassert_function(0);
+        state = setState(1);
+    }
+
+    if (state <= 2) {
+        int countresolved = 0;
+        const char *pName = s_FunctionNames;
+
+        pf_void_t *pFTable = (pf_void_t *)&s_ResolvedFunctions.pf_nanosleep;
+
+        while (*pName != '\0') {
+            void *pf;
+            pf = getdelegate_function(pName);
+            if (pf)
+                FUN_MEMCPY(pFTable, &pf, sizeof(*pFTable));
+
+            countresolved += pf ? 1 : 0;
+
+            while (*pName++ != '\0')
+                ;
+            ++pFTable;
+        }
+
+        if (countresolved == sizeof(s_ResolvedFunctions) / sizeof(pf_void_t))
+            state = setState(3);
+    }
+
+    if (state == 3)
+        state = setResolveIsDone();
+
+    return state;
+}
+
+struct sleep_thread {
+    VAR_ATOMIC(int) tid;
+
+    uint64_t count; /* sleeps with a latency */
+    uint64_t sum;   /* ns */
+    uint64_t min;
+    uint64_t max;
+    uint32_t calls[eCount];
+    uint32_t relativeRt; /* relative sleeps in RT context */
+    uint32_t overruns;   /* timerfd reads with more than one expiration */
+    uint64_t yieldMax;   /* ns */
+
+    uint32_t hist[PCHECKER_SLEEP_HIST_MAX + 1];
+};
+
+/* keyed by the fd number, which can be closed and reused without the
+ * interposed close (close_range, dup2, inside libc). Every read is
+ * verified with timerfd_gettime before it is attributed. */
+struct sleep_timerfd {
+    VAR_ATOMIC(int) created; /* by the interposed timerfd_create */
+    VAR_ATOMIC(int) active;
+    int clockId;
+    uint64_t interval; /* ns, 0 for one shot */
+    uint64_t expiry;   /* one shot: absolute ns in clockId */
+};
+
+static struct sleep_state {
+    pf_clock_gettime_t pf_clock_gettime;
+    unsigned histSize;
+    VAR_ATOMIC(unsigned) lostThreads;
+
+    struct sleep_thread threads[PCHECKER_SLEEP_THREADS];
+    struct sleep_timerfd fds[PCHECKER_SLEEP_FDS];
+    VAR_ATOMIC(uintptr_t) reported[PCHECKER_SLEEP_CALLSITES];
+} s_Sleep;
+
+static VAR_TLS struct sleep_thread *s_pThread;
+
+static FUN_INLINE uint64_t tsToNs(const struct timespec *ts)
+{
+    return (uint64_t)ts->tv_sec * 1000000000u + (uint64_t)ts->tv_nsec;
+}
+
+static FUN_INLINE uint64_t clockNs(clockid_t clock_id)
+{
+    struct timespec ts;
+    if ((*s_Sleep.pf_clock_gettime)(clock_id, &ts) != 0)
+        return 0;
+    return tsToNs(&ts);
+}
+
+static struct sleep_thread *getThread()
+{
+    struct sleep_thread *pThread = s_pThread;
+    int tid;
+    unsigned i;
+
+    if (pThread)
+        return pThread;
+
+    tid = pcheckerGetTid();
+    for (i = 0; i < PCHECKER_SLEEP_THREADS; ++i) {
+        int expected = 0;
+        if (VAR_ATOMIC_CAS(s_Sleep.threads[i].tid, &expected, tid)) {
+            pThread = &s_Sleep.threads[i];
+            pThread->min = ~(uint64_t)0;
+            s_pThread = pThread;
+            return pThread;
+        }
+    }
+    VAR_ATOMIC_FETCH_ADD(s_Sleep.lostThreads, 1);
+    return NULL;
+}
+
+static FUN_INLINE void countCall(enum EFunctionIndex func)
+{
+    struct sleep_thread *pThread = getThread();
+    if (pThread)
+        ++pThread->calls[func];
+}
+
+static FUN_INLINE void addLatency(int64_t latency)
+{
+    struct sleep_thread *pThread = getThread();
+    uint64_t l, bucket;
+
+    if (!pThread)
+        return;
+
+    l = latency > 0 ? (uint64_t)latency : 0;
+    ++pThread->count;
+    pThread->sum += l;
+    if (l < pThread->min)
+        pThread->min = l;
+    if (l > pThread->max)
+        pThread->max = l;
+    bucket = l / 1000;
+    ++pThread->hist[bucket < s_Sleep.histSize ? bucket : s_Sleep.histSize];
+}
+
+static void reportRelative(const void *callsite, const char *func)
+{
+    struct pchecker_out o;
+    uintptr_t key = (uintptr_t)callsite;
+    unsigned i, h = (unsigned)(key >> 4) % PCHECKER_SLEEP_CALLSITES;
+
+    /* report every callsite once */
+    for (i = 0; i < PCHECKER_SLEEP_CALLSITES; ++i) {
+        uintptr_t expected = 0;
+        unsigned slot = (h + i) % PCHECKER_SLEEP_CALLSITES;
+        if (VAR_ATOMIC_LOAD(s_Sleep.reported[slot]) == key)
+            return;
+        if (VAR_ATOMIC_CAS(s_Sleep.reported[slot], &expected, key))
+            break;
+        if (expected == key)
+            return;
+    }
+
+    outInit(&o, 2);
+    outStr(&o, "pchecker(" PCHECKER_NAME "): relative ");
+    outStr(&o, func);
+    outStr(&o, " in RT thread from ");
+    outSymbol(&o, callsite);
+    outStr(&o, ", periodic loops drift, use clock_nanosleep with TIMER_ABSTIME\n");
+    outFlush(&o);
+}
+
+static FUN_INLINE void checkRelative(enum EFunctionIndex func, const void *callsite)
+{
+    struct sleep_thread *pThread;
+
+    if (!isCheckedRt(func, callsite))
+        return;
+    pThread = getThread();
+    if (pThread)
+        ++pThread->relativeRt;
+    reportRelative(callsite, pcheckerNameAt(s_FunctionNames, func));
+}
+
+static FUN_INLINE void initCheck()
+{
+    if (unlikely(!initIsDone()))
+        tryResolve();
+}
+
+static int controlDump(struct pchecker_out *o, const char *cmd, const char *arg);
+
+__attribute__((__constructor__(101))) static void callResolve()
+{
+    void *pf;
+
+    if (!initIsDone())
+        tryResolve();
+    setInitIsDone();
+
+    /* not RTLD_NEXT, a gettime checker loaded later would check our calls */
+    pf = pcheckerLibcSymbol("clock_gettime");
+    COPY_PF(s_Sleep.pf_clock_gettime, pf_clock_gettime_t, pf);
+    s_Sleep.histSize = (unsigned)pcheckerEnvUnsigned("PCHECKER_SLEEP_HIST", 1000);
+    if (s_Sleep.histSize > PCHECKER_SLEEP_HIST_MAX)
+        s_Sleep.histSize = PCHECKER_SLEEP_HIST_MAX;
+
+    unwindInit();
+    violationInit();
+    traceOpen(PCHECKER_NAME, s_FunctionNames);
+    threadsInit(PCHECKER_NAME, s_FunctionNames);
+    controlInit(s_FunctionNames, &controlDump);
+}
+
+static void writeReport(struct pchecker_out *o)
+{
+    unsigned i, k, lost = VAR_ATOMIC_LOAD(s_Sleep.lostThreads);
+
+    outStr(o, "\nsleep latency (us), per thread\n");
+    outStr(o, "     tid       count    min      avg      max  relRT overrun  yields yieldmax\n");
+    for (i = 0; i < PCHECKER_SLEEP_THREADS; ++i) {
+        const struct sleep_thread *p = &s_Sleep.threads[i];
+        if (!VAR_ATOMIC_LOAD(p->tid))
+            break;
+        outSDec(o, VAR_ATOMIC_LOAD(p->tid), 8);
+        outUDec(o, p->count, 12);
+        outUDec(o, p->count ? p->min / 1000 : 0, 7);
+        outUDec(o, p->count ? p->sum / p->count / 1000 : 0, 9);
+        outUDec(o, p->max / 1000, 9);
+        outUDec(o, p->relativeRt, 7);
+        outUDec(o, p->overruns, 8);
+        outUDec(o, p->calls[eSchedYield], 8);
+        outUDec(o, p->yieldMax / 1000, 9);
+        outChar(o, '\n');
+    }
+
+    /* histogram with the non-empty buckets, one column per thread */
+    outStr(o, "\nhistogram, last bucket is overflow\n    us");
+    for (i = 0; i < PCHECKER_SLEEP_THREADS && VAR_ATOMIC_LOAD(s_Sleep.threads[i].tid); ++i)
+        outSDec(o, VAR_ATOMIC_LOAD(s_Sleep.threads[i].tid), 9);
+    outChar(o, '\n');
+    for (k = 0; k <= s_Sleep.histSize; ++k) {
+        int any = 0;
+        for (i = 0; i < PCHECKER_SLEEP_THREADS && VAR_ATOMIC_LOAD(s_Sleep.threads[i].tid); ++i)
+            any |= s_Sleep.threads[i].hist[k] != 0;
+        if (!any)
+            continue;
+        outUDec(o, k, 6);
+        for (i = 0; i < PCHECKER_SLEEP_THREADS && VAR_ATOMIC_LOAD(s_Sleep.threads[i].tid); ++i)
+            outUDec(o, s_Sleep.threads[i].hist[k], 9);
+        outChar(o, '\n');
+    }
+    if (lost) {
+        outStr(o, "threads not recorded: ");
+        outUDec(o, lost, 0);
+        outChar(o, '\n');
+    }
+    outFlush(o);
+}
+
+/* the report on the control socket */
+static int controlDump(struct pchecker_out *o, const char *cmd, const char *arg)
+{
+    (void)arg;
+    if (!pcheckerStrEq(cmd, "dump"))
+        return 0;
+    writeReport(o);
+    return 1;
+}
+
+__attribute__((__destructor__(101))) static void callFinish()
+{
+    const char *path = pcheckerEnv("PCHECKER_SLEEP_REPORT");
+    struct pchecker_out o;
+    int fd = 2;
+
+    traceClose();
+    threadsFinish();
+    controlFinish();
+
+    if (!VAR_ATOMIC_LOAD(s_Sleep.threads[0].tid))
+        return;
+    if (path)
+        fd = sysOpen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    outInit(&o, fd);
+    writeReport(&o);
+    if (fd != 2)
+        sysClose(fd);
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    struct pchecker_trace_record *pTrace;
+    uint64_t start;
+    int r;
+    initCheck();
+
+    countCall(eNanosleep);
+    checkRelative(eNanosleep, PCHECKER_CALLSITE());
+    threadsCount(eNanosleep);
+    pTrace = traceBegin(eNanosleep, traceArgPtr(req), traceArgPtr(rem), 0, PCHECKER_CALLSITE());
+    start = clockNs(CLOCK_MONOTONIC);
+    r = (*s_ResolvedFunctions.pf_nanosleep)(req, rem);
+    if (r == 0)
+        addLatency((int64_t)(clockNs(CLOCK_MONOTONIC) - start - tsToNs(req)));
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+int clock_nanosleep(clockid_t clock_id, int flags, const struct timespec *req, struct timespec *rem)
+{
+    struct pchecker_trace_record *pTrace;
+    uint64_t expected;
+    int r;
+    initCheck();
+
+    countCall(eClockNanosleep);
+    if (!(flags & TIMER_ABSTIME))
+        checkRelative(eClockNanosleep, PCHECKER_CALLSITE());
+    threadsCount(eClockNanosleep);
+    pTrace = traceBegin(eClockNanosleep, (uint64_t)clock_id, (uint64_t)flags, traceArgPtr(req), PCHECKER_CALLSITE());
+    expected = tsToNs(req);
+    if (!(flags & TIMER_ABSTIME))
+        expected += clockNs(clock_id);
+    r = (*s_ResolvedFunctions.pf_clock_nanosleep)(clock_id, flags, req, rem);
+    if (r == 0)
+        addLatency((int64_t)(clockNs(clock_id) - expected));
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+int usleep(useconds_t usec)
+{
+    struct pchecker_trace_record *pTrace;
+    uint64_t start;
+    int r;
+    initCheck();
+
+    countCall(eUsleep);
+    checkRelative(eUsleep, PCHECKER_CALLSITE());
+    threadsCount(eUsleep);
+    pTrace = traceBegin(eUsleep, (uint64_t)usec, 0, 0, PCHECKER_CALLSITE());
+    start = clockNs(CLOCK_MONOTONIC);
+    r = (*s_ResolvedFunctions.pf_usleep)(usec);
+    if (r == 0)
+        addLatency((int64_t)(clockNs(CLOCK_MONOTONIC) - start - (uint64_t)usec * 1000u));
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+unsigned sleep(unsigned seconds)
+{
+    struct pchecker_trace_record *pTrace;
+    uint64_t start;
+    unsigned r;
+    initCheck();
+
+    countCall(eSleep);
+    checkRelative(eSleep, PCHECKER_CALLSITE());
+    threadsCount(eSleep);
+    pTrace = traceBegin(eSleep, (uint64_t)seconds, 0, 0, PCHECKER_CALLSITE());
+    start = clockNs(CLOCK_MONOTONIC);
+    r = (*s_ResolvedFunctions.pf_sleep)(seconds);
+    if (r == 0)
+        addLatency((int64_t)(clockNs(CLOCK_MONOTONIC) - start - (uint64_t)seconds * 1000000000u));
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+int sched_yield(void)
+{
+    struct pchecker_trace_record *pTrace;
+    struct sleep_thread *pThread;
+    uint64_t start, d;
+    int r;
+    initCheck();
+
+    countCall(eSchedYield);
+    threadsCount(eSchedYield);
+    pTrace = traceBegin(eSchedYield, 0, 0, 0, PCHECKER_CALLSITE());
+    start = clockNs(CLOCK_MONOTONIC);
+    r = (*s_ResolvedFunctions.pf_sched_yield)();
+    d = clockNs(CLOCK_MONOTONIC) - start;
+    pThread = getThread();
+    if (pThread && d > pThread->yieldMax)
+        pThread->yieldMax = d;
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+static FUN_INLINE void timerfdForget(struct sleep_timerfd *pFd)
+{
+    VAR_ATOMIC_STORE(pFd->active, 0);
+    VAR_ATOMIC_STORE(pFd->created, 0);
+}
+
+/* latency of a timerfd expiration,
+ * returns 0 if the fd is no timerfd any more */
+static int timerfdExpired(struct sleep_timerfd *pFd, int fd, uint64_t expirations)
+{
+    struct sleep_thread *pThread;
+    struct itimerspec cur;
+    uint64_t now = clockNs(pFd->clockId);
+
+    if (syscall(SYS_timerfd_gettime, fd, &cur) != 0) {
+        timerfdForget(pFd);
+        return 0;
+    }
+
+    pThread = getThread();
+    if (pThread && expirations > 1)
+        ++pThread->overruns;
+
+    /* the expiration just handled was one interval
+     * before the next, which is remaining in the future */
+    if (pFd->interval)
+        addLatency((int64_t)(pFd->interval - tsToNs(&cur.it_value)));
+    else
+        addLatency((int64_t)(now - pFd->expiry));
+    return 1;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+    struct pchecker_trace_record *pTrace;
+    struct sleep_timerfd *pFd;
+    ssize_t r;
+
+    /* only reads from timerfds are of interest */
+    if ((unsigned)fd >= PCHECKER_SLEEP_FDS || !VAR_ATOMIC_LOAD(s_Sleep.fds[fd].active)) {
+        initCheck();
+        return (*s_ResolvedFunctions.pf_read)(fd, buf, count);
+    }
+    pFd = &s_Sleep.fds[fd];
+
+    threadsCount(eRead);
+    pTrace = traceBegin(eRead, (uint64_t)fd, traceArgPtr(buf), (uint64_t)count, PCHECKER_CALLSITE());
+    r = (*s_ResolvedFunctions.pf_read)(fd, buf, count);
+    if (r == (ssize_t)sizeof(uint64_t)) {
+        uint64_t expirations;
+        FUN_MEMCPY(&expirations, buf, sizeof(expirations));
+        if (timerfdExpired(pFd, fd, expirations))
+            countCall(eRead);
+    }
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+int close(int fd)
+{
+    initCheck();
+
+    if ((unsigned)fd < PCHECKER_SLEEP_FDS)
+        timerfdForget(&s_Sleep.fds[fd]);
+    return (*s_ResolvedFunctions.pf_close)(fd);
+}
+
+int timerfd_create(int clockid, int flags)
+{
+    int fd;
+    initCheck();
+
+    countCall(eTimerfdCreate);
+    fd = (*s_ResolvedFunctions.pf_timerfd_create)(clockid, flags);
+    if ((unsigned)fd < PCHECKER_SLEEP_FDS) {
+        s_Sleep.fds[fd].clockId = clockid;
+        s_Sleep.fds[fd].interval = 0;
+        s_Sleep.fds[fd].expiry = 0;
+        VAR_ATOMIC_STORE(s_Sleep.fds[fd].active, 0);
+        VAR_ATOMIC_STORE(s_Sleep.fds[fd].created, 1);
+    }
+    return fd;
+}
+
+int timerfd_settime(int fd, int flags, const struct itimerspec *new_value, struct itimerspec *old_value)
+{
+    int r;
+    initCheck();
+
+    countCall(eTimerfdSettime);
+    r = (*s_ResolvedFunctions.pf_timerfd_settime)(fd, flags, new_value, old_value);
+    /* the clock of fds created elsewhere is unknown, they are not tracked */
+    if (r == 0 && (unsigned)fd < PCHECKER_SLEEP_FDS && VAR_ATOMIC_LOAD(s_Sleep.fds[fd].created)) {
+        struct sleep_timerfd *pFd = &s_Sleep.fds[fd];
+        uint64_t value = tsToNs(&new_value->it_value);
+
+        pFd->interval = tsToNs(&new_value->it_interval);
+        pFd->expiry = value;
+        if (!(flags & TFD_TIMER_ABSTIME))
+            pFd->expiry += clockNs(pFd->clockId);
+        /* a zero value disarms the timer */
+        VAR_ATOMIC_STORE(pFd->active, value != 0);
+    }
+    return r;
+}
+
+#ifdef __cplusplus
+}
+#endif
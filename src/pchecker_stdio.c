@@ -0,0 +1,557 @@
+/*
+ * this checker interposes the stdio output functions: printf, fprintf,
+ * vprintf, vfprintf, puts, fputs, putchar, fputc, putc, fwrite and the
+ * fortified variants glibc uses with _FORTIFY_SOURCE. All of them take
+ * the lock of the stream, may allocate its buffer and block in write.
+ * Compilers turn printf calls into puts, putchar or fwrite, which is
+ * why those are interposed as well.
+ *
+ * Calls are checked like the heap functions and counted if they come
+ * from RT threads or critical sections. The summary is written at exit
+ * to stderr or PCHECKER_STDIO_REPORT.
+ *
+ * With PCHECKER_STDIO_DEFER=1 such calls on stdout and stderr are not
+ * reported but deferred: the output is formatted into a buffer on the
+ * stack of the caller and pushed to a lock-free queue, a helper thread
+ * writes it to the stream every PCHECKER_STDIO_PERIOD ms (default 10).
+ * The functions return as if all was written. Messages are cut at
+ * PCHECKER_STDIO_LINE bytes and dropped if the queue is full, both are
+ * counted. Deferred output can appear after output written later by
+ * other threads, or by the same thread after it left the RT section,
+ * the rest of the queue is written at exit.
+ */
+
+#define PCHECKER_NAME "stdio"
+
+#include "pchecker.h"
+#include "pchecker_trace.h"
+#include "pchecker_violation.h"
+#include "pchecker_helper.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PCHECKER_STDIO_SLOTS
+#define PCHECKER_STDIO_SLOTS 1024 /* power of two */
+#endif
+
+#ifndef PCHECKER_STDIO_LINE
+#define PCHECKER_STDIO_LINE 240
+#endif
+
+typedef int (*pf_printf_t)(const char *format, ...);
+typedef int (*pf_fprintf_t)(FILE *stream, const char *format, ...);
+typedef int (*pf_vprintf_t)(const char *format, va_list ap);
+typedef int (*pf_vfprintf_t)(FILE *stream, const char *format, va_list ap);
+typedef int (*pf_puts_t)(const char *s);
+typedef int (*pf_fputs_t)(const char *s, FILE *stream);
+typedef int (*pf_putchar_t)(int c);
+typedef int (*pf_fputc_t)(int c, FILE *stream);
+typedef size_t (*pf_fwrite_t)(const void *ptr, size_t size, size_t nmemb, FILE *stream);
+typedef int (*pf___printf_chk_t)(int flag, const char *format, ...);
+typedef int (*pf___fprintf_chk_t)(FILE *stream, int flag, const char *format, ...);
+typedef int (*pf___vprintf_chk_t)(int flag, const char *format, va_list ap);
+typedef int (*pf___vfprintf_chk_t)(FILE *stream, int flag, const char *format, va_list ap);
+
+DSO_PUBLIC int printf(const char *format, ...);
+DSO_PUBLIC int fprintf(FILE *stream, const char *format, ...);
+DSO_PUBLIC int vprintf(const char *format, va_list ap);
+DSO_PUBLIC int vfprintf(FILE *stream, const char *format, va_list ap);
+DSO_PUBLIC int puts(const char *s);
+DSO_PUBLIC int fputs(const char *s, FILE *stream);
+DSO_PUBLIC int putchar(int c);
+DSO_PUBLIC int fputc(int c, FILE *stream);
+DSO_PUBLIC int putc(int c, FILE *stream);
+DSO_PUBLIC size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream);
+DSO_PUBLIC int __printf_chk(int flag, const char *format, ...);
+DSO_PUBLIC int __fprintf_chk(FILE *stream, int flag, const char *format, ...);
+DSO_PUBLIC int __vprintf_chk(int flag, const char *format, va_list ap);
+DSO_PUBLIC int __vfprintf_chk(FILE *stream, int flag, const char *format, va_list ap);
+
+/* the variadic functions are forwarded to the va_list variants */
+static struct function_table {
+    pf_printf_t pf_printf;
+    pf_fprintf_t pf_fprintf;
+    pf_vprintf_t pf_vprintf;
+    pf_vfprintf_t pf_vfprintf;
+    pf_puts_t pf_puts;
+    pf_fputs_t pf_fputs;
+    pf_putchar_t pf_putchar;
+    pf_fputc_t pf_fputc;
+    pf_fputc_t pf_putc;
+    pf_fwrite_t pf_fwrite;
+    pf___printf_chk_t pf___printf_chk;
+    pf___fprintf_chk_t pf___fprintf_chk;
+    pf___vprintf_chk_t pf___vprintf_chk;
+    pf___vfprintf_chk_t pf___vfprintf_chk;
+} s_ResolvedFunctions VAR_TABLE;
+
+enum EFunctionIndex {
+    ePrintf,
+    eFprintf,
+    eVprintf,
+    eVfprintf,
+    ePuts,
+    eFputs,
+    ePutchar,
+    eFputc,
+    ePutc,
+    eFwrite,
+    ePrintfChk, /* glibc only, optional from here */
+    eFprintfChk,
+    eVprintfChk,
+    eVfprintfChk,
+    eCount
+};
+
+/* clang-format off */
+static const char *const s_FunctionNames =
+    "printf\0"
+    "fprintf\0"
+    "vprintf\0"
+    "vfprintf\0"
+    "puts\0"
+    "fputs\0"
+    "putchar\0"
+    "fputc\0"
+    "putc\0"
+    "fwrite\0"
+    "__printf_chk\0"
+    "__fprintf_chk\0"
+    "__vprintf_chk\0"
+    "__vfprintf_chk\0";
+/* clang-format on */
+
+/* for the resolve pass of the combined DSO */
+PCHECKER_REGISTER(s_ResolvedFunctions);
+
+static int tryResolve()
+{
+    int state = setState(0);
+
+    if (state == 0) {
+        getassert_function(0);
+        state = setState(1);
+    }
+
+    if (state <= 2) {
+        int countresolved = 0, func = 0;
+        const char *pName = s_FunctionNames;
+
+        pf_void_t *pFTable = (pf_void_t *)&s_ResolvedFunctions.pf_printf;
+
+        while (*pName != '\0') {
+            void *pf;
+            pf = getdelegate_function(pName);
+            if (pf)
+                FUN_MEMCPY(pFTable, &pf, sizeof(*pFTable));
+
+            /* musl has no fortified functions, nobody calls them there */
+            countresolved += pf || func >= ePrintfChk ? 1 : 0;
+
+            while (*pName++ != '\0')
+                ;
+            ++pFTable;
+            ++func;
+        }
+
+        if (countresolved == sizeof(s_ResolvedFunctions) / sizeof(pf_void_t))
+            state = setState(3);
+    }
+
+    if (state >= 2) {
+        if (getassert_function(1) && state == 3)
+            state = setResolveIsDone();
+    }
+
+    return state;
+}
+
+struct stdio_slot {
+    VAR_ATOMIC(uint64_t) seq; /* position + 1 when filled */
+    FILE *stream;
+    unsigned len;
+    char data[PCHECKER_STDIO_LINE];
+};
+
+static struct stdio_state {
+    unsigned defer;
+    unsigned periodMs;
+    VAR_ATOMIC(unsigned) rtCalls[eCount];
+    VAR_ATOMIC(uint64_t) deferred;
+    VAR_ATOMIC(uint64_t) dropped;
+    VAR_ATOMIC(uint64_t) truncated;
+    /* bounded multi-producer queue, the producers claim a position by
+     * CAS on tail, the slot is free for position p if seq == p */
+    VAR_ATOMIC(uint64_t) tail;
+    uint64_t head; /* only used by the holder of drainLock */
+    VAR_ATOMIC_FLAG drainLock;
+    struct stdio_slot slots[PCHECKER_STDIO_SLOTS];
+} s_Stdio;
+
+/* never blocks, drops the message if the queue is full */
+static void deferPush(FILE *stream, const char *data, size_t len, int newline)
+{
+    uint64_t pos = VAR_ATOMIC_LOAD(s_Stdio.tail);
+    struct stdio_slot *pSlot;
+
+    for (;;) {
+        int64_t diff;
+        pSlot = &s_Stdio.slots[pos & (PCHECKER_STDIO_SLOTS - 1)];
+        diff = (int64_t)(VAR_ATOMIC_LOAD(pSlot->seq) - pos);
+        if (diff == 0) {
+            if (VAR_ATOMIC_CAS(s_Stdio.tail, &pos, pos + 1))
+                break;
+        } else if (diff < 0) {
+            VAR_ATOMIC_FETCH_ADD(s_Stdio.dropped, 1);
+            return;
+        } else
+            pos = VAR_ATOMIC_LOAD(s_Stdio.tail);
+    }
+
+    if (len + (newline ? 1 : 0) > PCHECKER_STDIO_LINE) {
+        VAR_ATOMIC_FETCH_ADD(s_Stdio.truncated, 1);
+        len = PCHECKER_STDIO_LINE - (newline ? 1 : 0);
+    }
+    FUN_MEMCPY(pSlot->data, data, len);
+    if (newline)
+        pSlot->data[len++] = '\n';
+    pSlot->stream = stream;
+    pSlot->len = (unsigned)len;
+    VAR_ATOMIC_FETCH_ADD(s_Stdio.deferred, 1);
+    VAR_ATOMIC_STORE(pSlot->seq, pos + 1);
+}
+
+static int deferFormat(FILE *stream, const char *format, va_list ap)
+{
+    char buf[PCHECKER_STDIO_LINE + 1];
+    int r = vsnprintf(buf, sizeof(buf), format, ap);
+
+    if (r > 0)
+        deferPush(stream, buf, (size_t)r, 0);
+    return r;
+}
+
+/* write the queued messages, with wait == 0 only if no one else does */
+static void deferDrain(int wait)
+{
+    while (VAR_ATOMIC_FLAG_TESTSET(s_Stdio.drainLock)) {
+        if (!wait)
+            return;
+        syscall(SYS_sched_yield);
+    }
+
+    for (;;) {
+        struct stdio_slot *pSlot = &s_Stdio.slots[s_Stdio.head & (PCHECKER_STDIO_SLOTS - 1)];
+        if (VAR_ATOMIC_LOAD(pSlot->seq) != s_Stdio.head + 1)
+            break;
+        (*s_ResolvedFunctions.pf_fwrite)(pSlot->data, 1, pSlot->len, pSlot->stream);
+        VAR_ATOMIC_STORE(pSlot->seq, s_Stdio.head + PCHECKER_STDIO_SLOTS);
+        ++s_Stdio.head;
+    }
+    VAR_ATOMIC_FLAG_CLEAR(s_Stdio.drainLock);
+}
+
+static void *deferRun(void *pArg)
+{
+    uint64_t next = sysMonotonicNs();
+
+    (void)pArg;
+    pcheckerHelperSetup("pchk-stdio", PCHECKER_SCHED_OTHER);
+    for (;;) {
+        next += (uint64_t)s_Stdio.periodMs * 1000000u;
+        pcheckerHelperSleepUntil(next);
+        deferDrain(0);
+    }
+    return NULL;
+}
+
+static void deferInit()
+{
+    uint64_t i;
+
+    if (pcheckerEnvUnsigned("PCHECKER_STDIO_DEFER", 0) == 0 || !s_ResolvedFunctions.pf_fwrite)
+        return;
+    s_Stdio.periodMs = (unsigned)pcheckerEnvUnsigned("PCHECKER_STDIO_PERIOD", 10);
+    if (s_Stdio.periodMs == 0)
+        s_Stdio.periodMs = 1;
+    for (i = 0; i < PCHECKER_STDIO_SLOTS; ++i)
+        VAR_ATOMIC_STORE(s_Stdio.slots[i].seq, i);
+    if (pcheckerStartHelper(&deferRun, NULL) == 0)
+        s_Stdio.defer = 1;
+}
+
+static int controlDump(struct pchecker_out *o, const char *cmd, const char *arg);
+
+__attribute__((__constructor__(101))) static void callResolve()
+{
+    if (!initIsDone())
+        tryResolve();
+    setInitIsDone();
+
+    unwindInit();
+    violationInit();
+    traceOpen(PCHECKER_NAME, s_FunctionNames);
+    threadsInit(PCHECKER_NAME, s_FunctionNames);
+    controlInit(s_FunctionNames, &controlDump);
+    deferInit();
+}
+
+static void writeReport(struct pchecker_out *o)
+{
+    unsigned i;
+
+    outStr(o, "\nstdio calls from RT threads or critical sections\n");
+    for (i = 0; i < eCount; ++i) {
+        unsigned calls = VAR_ATOMIC_LOAD(s_Stdio.rtCalls[i]);
+        if (!calls)
+            continue;
+        outStrCol(o, pcheckerNameAt(s_FunctionNames, i), 16);
+        outUDec(o, calls, 10);
+        outChar(o, '\n');
+    }
+    if (s_Stdio.defer) {
+        outStr(o, "deferred ");
+        outUDec(o, VAR_ATOMIC_LOAD(s_Stdio.deferred), 0);
+        outStr(o, ", dropped ");
+        outUDec(o, VAR_ATOMIC_LOAD(s_Stdio.dropped), 0);
+        outStr(o, ", truncated ");
+        outUDec(o, VAR_ATOMIC_LOAD(s_Stdio.truncated), 0);
+        outChar(o, '\n');
+    }
+    outFlush(o);
+}
+
+/* the report on the control socket */
+static int controlDump(struct pchecker_out *o, const char *cmd, const char *arg)
+{
+    (void)arg;
+    if (!pcheckerStrEq(cmd, "dump"))
+        return 0;
+    writeReport(o);
+    return 1;
+}
+
+__attribute__((__destructor__(101))) static void callFinish()
+{
+    const char *path = pcheckerEnv("PCHECKER_STDIO_REPORT");
+    struct pchecker_out o;
+    unsigned i, calls = 0;
+    int fd = 2;
+
+    traceClose();
+    threadsFinish();
+    controlFinish();
+    if (s_Stdio.defer)
+        deferDrain(1);
+
+    for (i = 0; i < eCount; ++i)
+        calls += VAR_ATOMIC_LOAD(s_Stdio.rtCalls[i]);
+    if (!calls)
+        return;
+    if (path)
+        fd = sysOpen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    outInit(&o, fd);
+    writeReport(&o);
+    if (fd != 2)
+        sysClose(fd);
+}
+
+/* returns 1 if the call is deferred instead */
+static FUN_INLINE int initAndCheck(enum EFunctionIndex func, FILE *stream, const void *callsite)
+{
+    if (unlikely(!initIsDone())) {
+        tryResolve();
+    }
+
+    /* suppressed callsites and disabled functions are written directly */
+    if (isCheckedRt(func, callsite)) {
+        VAR_ATOMIC_FETCH_ADD(s_Stdio.rtCalls[func], 1);
+        if (s_Stdio.defer && (stream == stdout || stream == stderr)) {
+            threadsCount(func);
+            return 1;
+        }
+    }
+    checkCall(1, func, callsite);
+    return 0;
+}
+
+/* the printf family, flag < 0 for the unfortified functions */
+static int formatCall(enum EFunctionIndex func, FILE *stream, int flag, const char *format, va_list ap,
+                      const void *callsite)
+{
+    struct pchecker_trace_record *pTrace;
+    int r;
+
+    if (initAndCheck(func, stream, callsite))
+        return deferFormat(stream, format, ap);
+
+    pTrace = traceBegin(func, traceArgPtr(stream), 0, 0, callsite);
+    if (flag < 0)
+        r = (*s_ResolvedFunctions.pf_vfprintf)(stream, format, ap);
+    else
+        r = (*s_ResolvedFunctions.pf___vfprintf_chk)(stream, flag, format, ap);
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+static int charCall(enum EFunctionIndex func, int c, FILE *stream, const void *callsite)
+{
+    struct pchecker_trace_record *pTrace;
+    char ch = (char)c;
+    int r;
+
+    if (initAndCheck(func, stream, callsite)) {
+        deferPush(stream, &ch, 1, 0);
+        return (unsigned char)c;
+    }
+
+    pTrace = traceBegin(func, traceArgPtr(stream), (uint64_t)c, 0, callsite);
+    if (func == ePutchar)
+        r = (*s_ResolvedFunctions.pf_putchar)(c);
+    else if (func == ePutc)
+        r = (*s_ResolvedFunctions.pf_putc)(c, stream);
+    else
+        r = (*s_ResolvedFunctions.pf_fputc)(c, stream);
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+int printf(const char *format, ...)
+{
+    va_list ap;
+    int r;
+
+    va_start(ap, format);
+    r = formatCall(ePrintf, stdout, -1, format, ap, PCHECKER_CALLSITE());
+    va_end(ap);
+    return r;
+}
+
+int fprintf(FILE *stream, const char *format, ...)
+{
+    va_list ap;
+    int r;
+
+    va_start(ap, format);
+    r = formatCall(eFprintf, stream, -1, format, ap, PCHECKER_CALLSITE());
+    va_end(ap);
+    return r;
+}
+
+int vprintf(const char *format, va_list ap)
+{
+    return formatCall(eVprintf, stdout, -1, format, ap, PCHECKER_CALLSITE());
+}
+
+int vfprintf(FILE *stream, const char *format, va_list ap)
+{
+    return formatCall(eVfprintf, stream, -1, format, ap, PCHECKER_CALLSITE());
+}
+
+int __printf_chk(int flag, const char *format, ...)
+{
+    va_list ap;
+    int r;
+
+    va_start(ap, format);
+    r = formatCall(ePrintfChk, stdout, flag, format, ap, PCHECKER_CALLSITE());
+    va_end(ap);
+    return r;
+}
+
+int __fprintf_chk(FILE *stream, int flag, const char *format, ...)
+{
+    va_list ap;
+    int r;
+
+    va_start(ap, format);
+    r = formatCall(eFprintfChk, stream, flag, format, ap, PCHECKER_CALLSITE());
+    va_end(ap);
+    return r;
+}
+
+int __vprintf_chk(int flag, const char *format, va_list ap)
+{
+    return formatCall(eVprintfChk, stdout, flag, format, ap, PCHECKER_CALLSITE());
+}
+
+int __vfprintf_chk(FILE *stream, int flag, const char *format, va_list ap)
+{
+    return formatCall(eVfprintfChk, stream, flag, format, ap, PCHECKER_CALLSITE());
+}
+
+int puts(const char *s)
+{
+    struct pchecker_trace_record *pTrace;
+    int r;
+
+    if (initAndCheck(ePuts, stdout, PCHECKER_CALLSITE())) {
+        deferPush(stdout, s, pcheckerStrLen(s), 1);
+        return 1;
+    }
+
+    pTrace = traceBegin(ePuts, traceArgPtr(stdout), 0, 0, PCHECKER_CALLSITE());
+    r = (*s_ResolvedFunctions.pf_puts)(s);
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+int fputs(const char *s, FILE *stream)
+{
+    struct pchecker_trace_record *pTrace;
+    int r;
+
+    if (initAndCheck(eFputs, stream, PCHECKER_CALLSITE())) {
+        deferPush(stream, s, pcheckerStrLen(s), 0);
+        return 1;
+    }
+
+    pTrace = traceBegin(eFputs, traceArgPtr(stream), 0, 0, PCHECKER_CALLSITE());
+    r = (*s_ResolvedFunctions.pf_fputs)(s, stream);
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+int putchar(int c)
+{
+    return charCall(ePutchar, c, stdout, PCHECKER_CALLSITE());
+}
+
+int fputc(int c, FILE *stream)
+{
+    return charCall(eFputc, c, stream, PCHECKER_CALLSITE());
+}
+
+int putc(int c, FILE *stream)
+{
+    return charCall(ePutc, c, stream, PCHECKER_CALLSITE());
+}
+
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+    struct pchecker_trace_record *pTrace;
+    size_t r;
+
+    if (initAndCheck(eFwrite, stream, PCHECKER_CALLSITE())) {
+        deferPush(stream, (const char *)ptr, size * nmemb, 0);
+        return nmemb;
+    }
+
+    pTrace = traceBegin(eFwrite, traceArgPtr(stream), (uint64_t)(size * nmemb), 0, PCHECKER_CALLSITE());
+    r = (*s_ResolvedFunctions.pf_fwrite)(ptr, size, nmemb, stream);
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,516 @@
+/*
+ * per-thread summary of all checkers, enabled with PCHECKER_THREADS=1.
+ *
+ * pthread_create is interposed, each new thread gets a record from a
+ * preallocated pool before it starts: name, scheduling policy, CPU time,
+ * the calls per interposed function (counted as they are checked) and the
+ * reported violations. Threads not created through it (the main thread,
+ * threads started before the checkers) take a record on their first call.
+ *
+ * A thread specific key notices the exit, the record then keeps the
+ * last name, policy and CPU time. When the pool of PCHECKER_THREAD_RECORDS
+ * runs out the oldest exited record is added to a summary row and reused,
+ * so thread pools with churn don't need more memory. Records are taken
+ * and given back with a CAS on their state, an RT thread making its first
+ * call never waits for another thread; the lock only orders init and reset.
+ *
+ * The registry is public like the sched cache: all checker DSOs bind to
+ * the one of the first loaded, so each thread has one record with the
+ * functions of every checker. The table is written by the first checker
+ * destructor, to stderr or PCHECKER_THREADS_REPORT.
+ */
+
+#ifndef PCHECKER_THREADS_H
+#define PCHECKER_THREADS_H
+
+#include "pchecker_util.h"
+
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PCHECKER_THREAD_RECORDS
+#define PCHECKER_THREAD_RECORDS 64
+#endif
+
+#ifndef PCHECKER_THREAD_FUNCS
+#define PCHECKER_THREAD_FUNCS 96 /* of all checkers together */
+#endif
+
+#define PCHECKER_THREAD_CHECKERS 16
+
+enum {
+    eThreadFree,
+    eThreadRunning,
+    eThreadExited,
+    eThreadClaimed /* being reset by the thread that took it */
+};
+
+enum {
+    PCHECKER_PR_GET_NAME = 16,
+    PCHECKER_CLOCK_THREAD_CPUTIME = 3
+};
+
+struct pchecker_thread {
+    VAR_ATOMIC(int) state;
+    int tid;
+    uint64_t exitSeq;
+    void *(*pfStart)(void *);
+    void *pArg;
+    char name[16];
+    int policy;
+    int priority;
+    uint64_t cpuNs;
+    uint32_t violations;
+    uint32_t calls[PCHECKER_THREAD_FUNCS];
+};
+
+/* the summary row, added to by claiming threads concurrently */
+struct pchecker_thread_sum {
+    VAR_ATOMIC(uint64_t) cpuNs;
+    VAR_ATOMIC(uint32_t) violations;
+    VAR_ATOMIC(uint32_t) calls[PCHECKER_THREAD_FUNCS];
+};
+
+struct pchecker_thread_checker {
+    const char *name;
+    const char *functions;
+    unsigned base;
+    unsigned count;
+};
+
+typedef int (*pf_pthread_key_create_t)(pthread_key_t *pKey, void (*pfDestructor)(void *));
+typedef int (*pf_pthread_setspecific_t)(pthread_key_t key, const void *value);
+typedef int (*pf_pthread_create_real_t)(pthread_t *pThread, const pthread_attr_t *pAttr, void *(*pfRun)(void *),
+                                        void *pArg);
+
+struct pchecker_thread_registry {
+    VAR_ATOMIC(int) enabled;
+    VAR_ATOMIC(int) reported;
+    VAR_ATOMIC_FLAG lock;
+    int hasKey;
+    pthread_key_t key;
+    pf_pthread_setspecific_t pf_setspecific;
+    unsigned funcCount;
+    unsigned checkerCount;
+    struct pchecker_thread_checker checkers[PCHECKER_THREAD_CHECKERS];
+    VAR_ATOMIC(uint64_t) exitSeq;
+    VAR_ATOMIC(unsigned) folded; /* exited threads added to the summary row */
+    VAR_ATOMIC(unsigned) lost;   /* threads that found the pool full of running ones */
+    struct pchecker_thread_sum exited;
+    struct pchecker_thread discard; /* counts of threads without record */
+    struct pchecker_thread records[PCHECKER_THREAD_RECORDS];
+};
+
+DSO_PUBLIC DSO_SHARED struct pchecker_thread_registry pchecker_threads;
+DSO_PUBLIC DSO_SHARED VAR_TLS struct pchecker_thread *pchecker_thread_self;
+/* set while in pthread_create, the interposers of the other checkers
+ * are found as delegates and must not claim another record */
+DSO_PUBLIC DSO_SHARED VAR_TLS int pchecker_thread_creating;
+
+DSO_PUBLIC int pthread_create(pthread_t *pThread, const pthread_attr_t *pAttr, void *(*pfStart)(void *), void *pArg);
+
+/* where the functions of this checker start in calls[], set if enabled */
+static unsigned s_ThreadsBase;
+static int s_ThreadsRegistered;
+
+static FUN_INLINE void threadsLock()
+{
+    while (VAR_ATOMIC_FLAG_TESTSET(pchecker_threads.lock))
+        syscall(SYS_sched_yield);
+}
+
+static FUN_INLINE void threadsUnlock()
+{
+    VAR_ATOMIC_FLAG_CLEAR(pchecker_threads.lock);
+}
+
+/* add an exited record to the summary row */
+static FUN_INLINE void threadsFold(const struct pchecker_thread *p)
+{
+    struct pchecker_thread_sum *pSum = &pchecker_threads.exited;
+    unsigned i;
+
+    VAR_ATOMIC_FETCH_ADD(pSum->cpuNs, p->cpuNs);
+    VAR_ATOMIC_FETCH_ADD(pSum->violations, p->violations);
+    for (i = 0; i < PCHECKER_THREAD_FUNCS; ++i) {
+        if (p->calls[i])
+            VAR_ATOMIC_FETCH_ADD(pSum->calls[i], p->calls[i]);
+    }
+    VAR_ATOMIC_FETCH_ADD(pchecker_threads.folded, 1);
+}
+
+/* take p if it is in state from, then clear it */
+static FUN_INLINE int threadsTake(struct pchecker_thread *p, int from)
+{
+    int expected = from;
+    unsigned i;
+
+    if (!VAR_ATOMIC_CAS(p->state, &expected, eThreadClaimed))
+        return 0;
+    if (from == eThreadExited)
+        threadsFold(p);
+    p->tid = 0;
+    p->name[0] = '\0';
+    p->policy = 0;
+    p->priority = 0;
+    p->cpuNs = 0;
+    p->violations = 0;
+    for (i = 0; i < PCHECKER_THREAD_FUNCS; ++i)
+        p->calls[i] = 0;
+    VAR_ATOMIC_STORE(p->state, eThreadRunning);
+    return 1;
+}
+
+/* a free record, or the oldest exited one, NULL if all are running.
+ * Lock-free, with the tries bounded when others take the same records. */
+static struct pchecker_thread *threadsClaim()
+{
+    unsigned i, tries;
+
+    for (i = 0; i < PCHECKER_THREAD_RECORDS; ++i) {
+        struct pchecker_thread *p = &pchecker_threads.records[i];
+        if (VAR_ATOMIC_LOAD(p->state) == eThreadFree && threadsTake(p, eThreadFree))
+            return p;
+    }
+    for (tries = 0; tries < 8; ++tries) {
+        struct pchecker_thread *p = NULL;
+
+        for (i = 0; i < PCHECKER_THREAD_RECORDS; ++i) {
+            struct pchecker_thread *pRec = &pchecker_threads.records[i];
+            if (VAR_ATOMIC_LOAD(pRec->state) == eThreadExited && (!p || pRec->exitSeq < p->exitSeq))
+                p = pRec;
+        }
+        if (!p)
+            break;
+        if (threadsTake(p, eThreadExited))
+            return p;
+    }
+    VAR_ATOMIC_FETCH_ADD(pchecker_threads.lost, 1);
+    return NULL;
+}
+
+static FUN_INLINE uint64_t threadsCpuNs(int clockId)
+{
+    struct pchecker_timespec ts;
+
+    if (syscall(SYS_clock_gettime, clockId, &ts) != 0)
+        return 0;
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* tid 0 for the calling thread */
+static FUN_INLINE void threadsPolicy(struct pchecker_thread *p, int tid)
+{
+    int param[8] = {0}; /* struct sched_param */
+    long policy = syscall(SYS_sched_getscheduler, tid);
+
+    p->policy = policy >= 0 ? (int)policy : -1;
+    if (syscall(SYS_sched_getparam, tid, param) == 0)
+        p->priority = param[0];
+}
+
+/* key destructor, runs on the exiting thread */
+static void threadsExit(void *pArg)
+{
+    struct pchecker_thread *p = (struct pchecker_thread *)pArg;
+
+    syscall(SYS_prctl, PCHECKER_PR_GET_NAME, p->name, 0, 0, 0);
+    p->name[sizeof(p->name) - 1] = '\0';
+    threadsPolicy(p, 0);
+    p->cpuNs = threadsCpuNs(PCHECKER_CLOCK_THREAD_CPUTIME);
+
+    p->exitSeq = VAR_ATOMIC_FETCH_ADD(pchecker_threads.exitSeq, 1) + 1;
+    VAR_ATOMIC_STORE(p->state, eThreadExited);
+    /* later destructors may still call interposed functions */
+    pchecker_thread_self = &pchecker_threads.discard;
+}
+
+static FUN_INLINE void threadsBind(struct pchecker_thread *p)
+{
+    p->tid = pcheckerGetTid();
+    pchecker_thread_self = p;
+    if (pchecker_threads.hasKey)
+        (*pchecker_threads.pf_setspecific)(pchecker_threads.key, p);
+}
+
+static struct pchecker_thread *threadsClaimSelf()
+{
+    struct pchecker_thread *p;
+
+    /* set first, claiming may call interposed functions */
+    pchecker_thread_self = &pchecker_threads.discard;
+    p = threadsClaim();
+    if (p)
+        threadsBind(p);
+    return pchecker_thread_self;
+}
+
+/* count a call of function func of this checker, from checkCall */
+static FUN_INLINE void threadsCount(unsigned func)
+{
+    struct pchecker_thread *p;
+
+    if (!s_ThreadsRegistered)
+        return;
+    p = pchecker_thread_self;
+    if (unlikely(!p))
+        p = threadsClaimSelf();
+    if (s_ThreadsBase + func < PCHECKER_THREAD_FUNCS)
+        ++p->calls[s_ThreadsBase + func];
+}
+
+static FUN_INLINE void threadsViolation()
+{
+    if (s_ThreadsRegistered && pchecker_thread_self)
+        ++pchecker_thread_self->violations;
+}
+
+static void *threadsStart(void *pArg)
+{
+    struct pchecker_thread *p = (struct pchecker_thread *)pArg;
+
+    threadsBind(p);
+    return (*p->pfStart)(p->pArg);
+}
+
+DSO_SHARED int pthread_create(pthread_t *pThread, const pthread_attr_t *pAttr, void *(*pfStart)(void *), void *pArg)
+{
+    static pf_pthread_create_real_t s_pf;
+    struct pchecker_thread *p = NULL;
+    int r;
+
+    if (unlikely(!s_pf)) {
+        void *pf = getdelegate_function("pthread_create");
+        if (!pf)
+            return EINVAL;
+        COPY_PF(s_pf, pf_pthread_create_real_t, pf);
+    }
+    if (VAR_ATOMIC_LOAD(pchecker_threads.enabled) && !pchecker_thread_creating)
+        p = threadsClaim();
+    if (!p)
+        return (*s_pf)(pThread, pAttr, pfStart, pArg);
+
+    p->pfStart = pfStart;
+    p->pArg = pArg;
+    pchecker_thread_creating = 1;
+    r = (*s_pf)(pThread, pAttr, &threadsStart, p);
+    pchecker_thread_creating = 0;
+    if (r != 0)
+        VAR_ATOMIC_STORE(p->state, eThreadFree);
+    return r;
+}
+
+/* call from the constructor */
+static FUN_INLINE void threadsInit(const char *checker, const char *names)
+{
+    const char *pName;
+    unsigned count = 0;
+
+    if (!pcheckerEnvUnsigned("PCHECKER_THREADS", 0))
+        return;
+    for (pName = names; *pName; ++count)
+        pName += pcheckerStrLen(pName) + 1;
+
+    threadsLock();
+    if (!VAR_ATOMIC_LOAD(pchecker_threads.enabled)) {
+        void *pfCreate = pcheckerLibcSymbol("pthread_key_create");
+        void *pfSet = pcheckerLibcSymbol("pthread_setspecific");
+        pf_pthread_key_create_t pfKeyCreate;
+
+        if (pfCreate && pfSet) {
+            COPY_PF(pfKeyCreate, pf_pthread_key_create_t, pfCreate);
+            COPY_PF(pchecker_threads.pf_setspecific, pf_pthread_setspecific_t, pfSet);
+            pchecker_threads.hasKey = (*pfKeyCreate)(&pchecker_threads.key, &threadsExit) == 0;
+        }
+        VAR_ATOMIC_STORE(pchecker_threads.enabled, 1);
+    }
+    if (pchecker_threads.checkerCount < PCHECKER_THREAD_CHECKERS &&
+        pchecker_threads.funcCount + count <= PCHECKER_THREAD_FUNCS) {
+        struct pchecker_thread_checker *pChecker = &pchecker_threads.checkers[pchecker_threads.checkerCount++];
+
+        pChecker->name = checker;
+        pChecker->functions = names;
+        pChecker->base = pchecker_threads.funcCount;
+        pChecker->count = count;
+        pchecker_threads.funcCount += count;
+        s_ThreadsBase = pChecker->base;
+        s_ThreadsRegistered = 1;
+    }
+    threadsUnlock();
+}
+
+static FUN_INLINE const char *threadsPolicyName(int policy)
+{
+    switch (policy & ~0x40000000) {
+    case 0:
+        return "other";
+    case 1:
+        return "fifo";
+    case 2:
+        return "rr";
+    case 3:
+        return "batch";
+    case 5:
+        return "idle";
+    case 6:
+        return "deadline";
+    default:
+        return "?";
+    }
+}
+
+static FUN_INLINE unsigned threadsDigits(unsigned v)
+{
+    unsigned n = 1;
+
+    while (v >= 10) {
+        v /= 10;
+        ++n;
+    }
+    return n;
+}
+
+/* name and CPU time of a running thread, from /proc */
+static FUN_INLINE void threadsSample(struct pchecker_thread *p)
+{
+    char path[48] = "/proc/self/task/";
+    unsigned len = pcheckerStrLen(path), n = threadsDigits((unsigned)p->tid), v = (unsigned)p->tid;
+    int fd;
+
+    FUN_MEMCPY(path + len + n, "/comm", 6);
+    do {
+        path[len + --n] = (char)('0' + v % 10);
+        v /= 10;
+    } while (n);
+    fd = sysOpen(path, O_RDONLY | O_CLOEXEC, 0);
+    if (fd >= 0) {
+        long n = sysRead(fd, p->name, sizeof(p->name) - 1);
+        p->name[n > 0 ? n - 1 : 0] = '\0'; /* without the newline */
+        sysClose(fd);
+    }
+    threadsPolicy(p, p->tid);
+    /* per-thread CPU clock of another thread */
+    p->cpuNs = threadsCpuNs((int)(~(unsigned)p->tid << 3) | 6);
+}
+
+static FUN_INLINE void threadsWriteCalls(struct pchecker_out *o, const struct pchecker_thread *p)
+{
+    unsigned c, i;
+
+    for (c = 0; c < pchecker_threads.checkerCount; ++c) {
+        const struct pchecker_thread_checker *pChecker = &pchecker_threads.checkers[c];
+        for (i = 0; i < pChecker->count; ++i) {
+            uint32_t calls = p->calls[pChecker->base + i];
+            if (!calls)
+                continue;
+            outChar(o, ' ');
+            outStr(o, pChecker->name);
+            outChar(o, ':');
+            outStr(o, pcheckerNameAt(pChecker->functions, i));
+            outChar(o, '=');
+            outUDec(o, calls, 0);
+        }
+    }
+    outChar(o, '\n');
+}
+
+static FUN_INLINE void threadsWrite(struct pchecker_out *o)
+{
+    unsigned folded, i;
+
+    outStr(o, "\nthreads\n");
+    outStr(o, "     tid  state  name              policy  prio    cpu ms  violations  calls\n");
+    for (i = 0; i < PCHECKER_THREAD_RECORDS; ++i) {
+        struct pchecker_thread *p = &pchecker_threads.records[i];
+        int state = VAR_ATOMIC_LOAD(p->state);
+
+        if ((state != eThreadRunning && state != eThreadExited) || !p->tid)
+            continue;
+        if (state == eThreadRunning)
+            threadsSample(p);
+        outSDec(o, p->tid, 8);
+        outStr(o, state == eThreadRunning ? "  run    " : "  exit   ");
+        outStrCol(o, p->name, 16);
+        outStr(o, "  ");
+        outStrCol(o, threadsPolicyName(p->policy), 8);
+        outSDec(o, p->priority, 4);
+        outUDec(o, p->cpuNs / 1000000u, 10);
+        outUDec(o, p->violations, 12);
+        outStr(o, " ");
+        threadsWriteCalls(o, p);
+    }
+    folded = VAR_ATOMIC_LOAD(pchecker_threads.folded);
+    if (folded) {
+        const struct pchecker_thread_sum *pSum = &pchecker_threads.exited;
+        struct pchecker_thread sum;
+        struct pchecker_thread *p = &sum;
+
+        p->cpuNs = VAR_ATOMIC_LOAD(pSum->cpuNs);
+        p->violations = VAR_ATOMIC_LOAD(pSum->violations);
+        for (i = 0; i < PCHECKER_THREAD_FUNCS; ++i)
+            p->calls[i] = VAR_ATOMIC_LOAD(pSum->calls[i]);
+        outStr(o, "       -  exit   ");
+        outUDec(o, folded, 0);
+        outStr(o, " older threads");
+        outPad(o, threadsDigits(folded) + 14, 30);
+        outUDec(o, p->cpuNs / 1000000u, 10);
+        outUDec(o, p->violations, 12);
+        outStr(o, " ");
+        threadsWriteCalls(o, p);
+    }
+    if (VAR_ATOMIC_LOAD(pchecker_threads.lost)) {
+        outStr(o, "threads without record: ");
+        outUDec(o, VAR_ATOMIC_LOAD(pchecker_threads.lost), 0);
+        outChar(o, '\n');
+    }
+    outFlush(o);
+}
+
+/* clear the counts of all records, the threads keep theirs */
+static FUN_INLINE void threadsReset()
+{
+    struct pchecker_thread *p;
+    unsigned i, k;
+
+    threadsLock();
+    for (i = 0; i < PCHECKER_THREAD_RECORDS; ++i) {
+        p = &pchecker_threads.records[i];
+        p->violations = 0;
+        for (k = 0; k < PCHECKER_THREAD_FUNCS; ++k)
+            p->calls[k] = 0;
+    }
+    VAR_ATOMIC_STORE(pchecker_threads.exited.cpuNs, 0);
+    VAR_ATOMIC_STORE(pchecker_threads.exited.violations, 0);
+    for (k = 0; k < PCHECKER_THREAD_FUNCS; ++k)
+        VAR_ATOMIC_STORE(pchecker_threads.exited.calls[k], 0);
+    VAR_ATOMIC_STORE(pchecker_threads.folded, 0);
+    threadsUnlock();
+}
+
+/* call from the destructor, the first one writes the table */
+static FUN_INLINE void threadsFinish()
+{
+    const char *path = pcheckerEnv("PCHECKER_THREADS_REPORT");
+    struct pchecker_out o;
+    int fd = 2;
+
+    if (!s_ThreadsRegistered || VAR_ATOMIC_EXCHANGE(pchecker_threads.reported, 1))
+        return;
+    if (path)
+        fd = sysOpen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    outInit(&o, fd);
+    threadsWrite(&o);
+    if (fd != 2)
+        sysClose(fd);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
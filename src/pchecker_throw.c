@@ -0,0 +1,510 @@
+/*
+ * this checker interposes the C++ exception ABI: __cxa_allocate_exception,
+ * __cxa_throw and _Unwind_RaiseException. The exception is allocated from
+ * the heap, and the unwinder finds the frames of every object on the way
+ * with dl_iterate_phdr, which takes the loader lock. A throw in an RT loop
+ * waits for any thread loading a library.
+ *
+ * Throws are checked like the heap functions. Throws from RT threads or
+ * critical sections are logged with thread, type and throw site (the first
+ * PCHECKER_THROW_LOG ones). All throws are counted per type and per throw
+ * site, a hot site is an exception used for control flow. The summary is
+ * written at exit to stderr or PCHECKER_THROW_REPORT.
+ *
+ * _Unwind_RaiseException is checked only when not called by __cxa_throw,
+ * that is `throw;` (__cxa_rethrow, through _Unwind_Resume_or_Rethrow),
+ * std::rethrow_exception or code of other languages. The site of those is
+ * the first frame outside the C++ runtime and the unwinder library.
+ *
+ * The type names are kept mangled and demangled for the report with
+ * __cxa_demangle, if the C++ runtime has it.
+ */
+
+#define PCHECKER_NAME "throw"
+
+#include "pchecker.h"
+#include "pchecker_trace.h"
+#include "pchecker_violation.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PCHECKER_THROW_LOG
+#define PCHECKER_THROW_LOG 128
+#endif
+
+/* sizes of the hash tables, powers of 2 */
+#ifndef PCHECKER_THROW_TYPES
+#define PCHECKER_THROW_TYPES 256
+#endif
+
+#ifndef PCHECKER_THROW_SITES
+#define PCHECKER_THROW_SITES 1024
+#endif
+
+#define PCHECKER_THROW_NAME 64
+
+typedef void (*pf_dest_t)(void *obj);
+
+typedef void *(*pf_cxa_allocate_exception_t)(size_t size);
+typedef void (*pf_cxa_throw_t)(void *obj, void *tinfo, pf_dest_t dest) __attribute__((noreturn));
+typedef int (*pf_unwind_raiseexception_t)(void *exc);
+typedef char *(*pf_cxa_demangle_t)(const char *name, char *buf, size_t *len, int *status);
+
+DSO_PUBLIC void *__cxa_allocate_exception(size_t size);
+DSO_PUBLIC void __cxa_throw(void *obj, void *tinfo, pf_dest_t dest) __attribute__((noreturn));
+DSO_PUBLIC int _Unwind_RaiseException(void *exc);
+
+static struct function_table {
+    pf_cxa_allocate_exception_t pf_cxa_allocate_exception;
+    pf_cxa_throw_t pf_cxa_throw;
+    pf_unwind_raiseexception_t pf_unwind_raiseexception;
+} s_ResolvedFunctions VAR_TABLE;
+
+enum EFunctionIndex {
+    eAllocateException,
+    eThrow,
+    eRaiseException,
+    eCount
+};
+
+/* clang-format off */
+static const char *const s_FunctionNames =
+    "__cxa_allocate_exception\0"
+    "__cxa_throw\0"
+    "_Unwind_RaiseException\0";
+/* clang-format on */
+
+/* set by __cxa_throw, its call of _Unwind_RaiseException is not counted again */
+static VAR_TLS int s_ThrowPending;
+
+static int tryResolve()
+{
+    int state = setState(0);
+
+    if (state == 0) {
+        getassert_function(0);
+        state = setState(1);
+    }
+
+    /* a C program without the C++ runtime stays here,
+     * the interposers are not called then */
+    if (state <= 2) {
+        int countresolved = 0;
+        const char *pName = s_FunctionNames;
+
+        pf_void_t *pFTable = (pf_void_t *)&s_ResolvedFunctions.pf_cxa_allocate_exception;
+
+        while (*pName != '\0') {
+            void *pf;
+            pf = getdelegate_function(pName);
+            if (pf)
+                FUN_MEMCPY(pFTable, &pf, sizeof(*pFTable));
+
+            countresolved += pf ? 1 : 0;
+
+            while (*pName++ != '\0')
+                ;
+            ++pFTable;
+        }
+
+        if (countresolved == sizeof(s_ResolvedFunctions) / sizeof(pf_void_t))
+            state = setState(3);
+    }
+
+    if (state >= 2) {
+        if (getassert_function(1) && state == 3)
+            state = setResolveIsDone();
+    }
+
+    return state;
+}
+
+struct throw_type {
+    VAR_ATOMIC(uintptr_t) tinfo;
+    VAR_ATOMIC(uint64_t) count;
+    VAR_ATOMIC(uint64_t) rtCount;
+    char name[PCHECKER_THROW_NAME]; /* mangled */
+};
+
+struct throw_site {
+    VAR_ATOMIC(uintptr_t) addr;
+    VAR_ATOMIC(uint64_t) count;
+    VAR_ATOMIC(uint64_t) rtCount;
+    const struct throw_type *pType; /* of the first throw */
+};
+
+struct throw_log_entry {
+    int tid;
+    const void *callsite;
+    const struct throw_type *pType;
+};
+
+static struct throw_state {
+    VAR_ATOMIC(uint64_t) calls[eCount];
+    VAR_ATOMIC(uint64_t) allocated;
+    VAR_ATOMIC(uint64_t) lostThrows; /* tables full */
+    VAR_ATOMIC(unsigned) logged;
+    struct throw_log_entry log[PCHECKER_THROW_LOG];
+    struct throw_type types[PCHECKER_THROW_TYPES];
+    struct throw_site sites[PCHECKER_THROW_SITES];
+} s_Throw;
+
+static FUN_INLINE unsigned throwHash(uintptr_t key)
+{
+    return (unsigned)(((uint64_t)key * 0x9e3779b97f4a7c15ull) >> 40);
+}
+
+/* the mangled name of a std::type_info, after its vtable pointer */
+static FUN_INLINE const char *throwTypeName(const void *tinfo)
+{
+    const char *name;
+
+    FUN_MEMCPY(&name, (const char *)tinfo + sizeof(void *), sizeof(name));
+    /* libstdc++ marks types with internal linkage */
+    if (name && *name == '*')
+        ++name;
+    return name ? name : "";
+}
+
+static struct throw_type *throwType(const void *tinfo)
+{
+    uintptr_t key = (uintptr_t)tinfo;
+    unsigned h = throwHash(key), i;
+
+    for (i = 0; i < 16; ++i) {
+        struct throw_type *p = &s_Throw.types[(h + i) & (PCHECKER_THROW_TYPES - 1)];
+        uintptr_t cur = VAR_ATOMIC_LOAD(p->tinfo);
+
+        if (!cur) {
+            if (VAR_ATOMIC_CAS(p->tinfo, &cur, key)) {
+                /* copied, the object with the type_info might be unloaded before exit */
+                const char *name = throwTypeName(tinfo);
+                unsigned n;
+                for (n = 0; name[n] && n < PCHECKER_THROW_NAME - 1; ++n)
+                    p->name[n] = name[n];
+                p->name[n] = '\0';
+                return p;
+            }
+        }
+        if (cur == key)
+            return p;
+    }
+    return NULL;
+}
+
+static struct throw_site *throwSite(const void *callsite)
+{
+    uintptr_t key = (uintptr_t)callsite;
+    unsigned h = throwHash(key), i;
+
+    for (i = 0; i < 16; ++i) {
+        struct throw_site *p = &s_Throw.sites[(h + i) & (PCHECKER_THROW_SITES - 1)];
+        uintptr_t cur = VAR_ATOMIC_LOAD(p->addr);
+
+        if (!cur && VAR_ATOMIC_CAS(p->addr, &cur, key))
+            return p;
+        if (cur == key)
+            return p;
+    }
+    return NULL;
+}
+
+static void throwRecord(const void *tinfo, int rt, const void *callsite)
+{
+    /* no type for _Unwind_RaiseException */
+    struct throw_type *pType = tinfo ? throwType(tinfo) : NULL;
+    struct throw_site *pSite = throwSite(callsite);
+
+    if ((tinfo && !pType) || !pSite)
+        VAR_ATOMIC_FETCH_ADD(s_Throw.lostThrows, 1);
+    if (pType) {
+        VAR_ATOMIC_FETCH_ADD(pType->count, 1);
+        if (rt)
+            VAR_ATOMIC_FETCH_ADD(pType->rtCount, 1);
+    }
+    if (pSite) {
+        if (!pSite->pType)
+            pSite->pType = pType;
+        VAR_ATOMIC_FETCH_ADD(pSite->count, 1);
+        if (rt)
+            VAR_ATOMIC_FETCH_ADD(pSite->rtCount, 1);
+    }
+    if (rt) {
+        unsigned index = VAR_ATOMIC_FETCH_ADD(s_Throw.logged, 1);
+        if (index < PCHECKER_THROW_LOG) {
+            struct throw_log_entry *pEntry = &s_Throw.log[index];
+            pEntry->tid = pcheckerGetTid();
+            pEntry->callsite = callsite;
+            pEntry->pType = pType;
+        }
+    }
+}
+
+static int controlDump(struct pchecker_out *o, const char *cmd, const char *arg);
+
+__attribute__((__constructor__(101))) static void callResolve()
+{
+    if (!initIsDone())
+        tryResolve();
+    setInitIsDone();
+
+    unwindInit();
+    unwindModules();
+    violationInit();
+    traceOpen(PCHECKER_NAME, s_FunctionNames);
+    threadsInit(PCHECKER_NAME, s_FunctionNames);
+    controlInit(s_FunctionNames, &controlDump);
+}
+
+/* demangled if possible, only called for the report */
+static void outTypeName(struct pchecker_out *o, const struct throw_type *pType, pf_cxa_demangle_t pfDemangle)
+{
+    char *demangled = NULL;
+    int status = -1;
+
+    if (!pType) {
+        outStr(o, "-");
+        return;
+    }
+    if (pfDemangle)
+        demangled = (*pfDemangle)(pType->name, NULL, NULL, &status);
+    outStr(o, status == 0 && demangled ? demangled : pType->name);
+    free(demangled);
+}
+
+/* indices of the used entries of a table, by count descending */
+static unsigned throwSorted(unsigned *pIndex, unsigned size, int sites)
+{
+    unsigned n = 0, i, j;
+
+    for (i = 0; i < size; ++i) {
+        uint64_t count = sites ? VAR_ATOMIC_LOAD(s_Throw.sites[i].count) : VAR_ATOMIC_LOAD(s_Throw.types[i].count);
+        if (!count)
+            continue;
+        for (j = n; j > 0; --j) {
+            unsigned k = pIndex[j - 1];
+            if ((sites ? VAR_ATOMIC_LOAD(s_Throw.sites[k].count) : VAR_ATOMIC_LOAD(s_Throw.types[k].count)) >= count)
+                break;
+            pIndex[j] = k;
+        }
+        pIndex[j] = i;
+        ++n;
+    }
+    return n;
+}
+
+static void writeReport(struct pchecker_out *o)
+{
+    unsigned index[PCHECKER_THROW_SITES > PCHECKER_THROW_TYPES ? PCHECKER_THROW_SITES : PCHECKER_THROW_TYPES];
+    unsigned i, n, logged = VAR_ATOMIC_LOAD(s_Throw.logged);
+    pf_cxa_demangle_t pfDemangle = NULL;
+    void *pf = getdelegate_function("__cxa_demangle");
+
+    if (pf)
+        COPY_PF(pfDemangle, pf_cxa_demangle_t, pf);
+
+    outStr(o, "\nC++ exceptions\n");
+    outStr(o, "function                       calls\n");
+    for (i = 0; i < eCount; ++i) {
+        outStrCol(o, pcheckerNameAt(s_FunctionNames, i), 24);
+        outUDec(o, VAR_ATOMIC_LOAD(s_Throw.calls[i]), 12);
+        outChar(o, '\n');
+    }
+    outStr(o, "exception bytes allocated: ");
+    outUDec(o, VAR_ATOMIC_LOAD(s_Throw.allocated), 0);
+    outChar(o, '\n');
+
+    n = throwSorted(index, PCHECKER_THROW_TYPES, 0);
+    if (n) {
+        outStr(o, "\nthrows per type\n");
+        outStr(o, "    throws        RT  type\n");
+        for (i = 0; i < n; ++i) {
+            const struct throw_type *p = &s_Throw.types[index[i]];
+            outUDec(o, VAR_ATOMIC_LOAD(p->count), 10);
+            outUDec(o, VAR_ATOMIC_LOAD(p->rtCount), 10);
+            outStr(o, "  ");
+            outTypeName(o, p, pfDemangle);
+            outChar(o, '\n');
+        }
+    }
+
+    n = throwSorted(index, PCHECKER_THROW_SITES, 1);
+    if (n) {
+        outStr(o, "\nthrows per site\n");
+        outStr(o, "    throws        RT  type / throw site\n");
+        for (i = 0; i < n; ++i) {
+            const struct throw_site *p = &s_Throw.sites[index[i]];
+            outUDec(o, VAR_ATOMIC_LOAD(p->count), 10);
+            outUDec(o, VAR_ATOMIC_LOAD(p->rtCount), 10);
+            outStr(o, "  ");
+            outTypeName(o, p->pType, pfDemangle);
+            outStr(o, "  ");
+            outSymbol(o, (const void *)VAR_ATOMIC_LOAD(p->addr));
+            outChar(o, '\n');
+        }
+    }
+    if (VAR_ATOMIC_LOAD(s_Throw.lostThrows)) {
+        outStr(o, "throws not in the tables: ");
+        outUDec(o, VAR_ATOMIC_LOAD(s_Throw.lostThrows), 0);
+        outChar(o, '\n');
+    }
+
+    if (logged) {
+        outStr(o, "\nthrows from RT threads or critical sections\n");
+        outStr(o, "     tid  type / throw site\n");
+        for (i = 0; i < logged && i < PCHECKER_THROW_LOG; ++i) {
+            const struct throw_log_entry *p = &s_Throw.log[i];
+            outSDec(o, p->tid, 8);
+            outStr(o, "  ");
+            outTypeName(o, p->pType, pfDemangle);
+            outStr(o, "  ");
+            outSymbol(o, p->callsite);
+            outChar(o, '\n');
+        }
+        if (logged > PCHECKER_THROW_LOG) {
+            outStr(o, "not logged: ");
+            outUDec(o, logged - PCHECKER_THROW_LOG, 0);
+            outChar(o, '\n');
+        }
+    }
+    outFlush(o);
+}
+
+/* the report on the control socket */
+static int controlDump(struct pchecker_out *o, const char *cmd, const char *arg)
+{
+    (void)arg;
+    if (!pcheckerStrEq(cmd, "dump"))
+        return 0;
+    writeReport(o);
+    return 1;
+}
+
+__attribute__((__destructor__(101))) static void callFinish()
+{
+    const char *path = pcheckerEnv("PCHECKER_THROW_REPORT");
+    struct pchecker_out o;
+    uint64_t calls = 0;
+    unsigned i;
+    int fd = 2;
+
+    traceClose();
+    threadsFinish();
+    controlFinish();
+
+    for (i = 0; i < eCount; ++i)
+        calls += VAR_ATOMIC_LOAD(s_Throw.calls[i]);
+    if (!calls)
+        return;
+    if (path)
+        fd = sysOpen(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    outInit(&o, fd);
+    writeReport(&o);
+    if (fd != 2)
+        sysClose(fd);
+}
+
+static FUN_INLINE void initAndCount(enum EFunctionIndex func)
+{
+    if (unlikely(!initIsDone())) {
+        tryResolve();
+    }
+
+    VAR_ATOMIC_FETCH_ADD(s_Throw.calls[func], 1);
+}
+
+/* returns 1 if the call comes from an RT thread or critical section */
+static FUN_INLINE int initAndCheck(enum EFunctionIndex func, const void *callsite)
+{
+    initAndCount(func);
+    checkCall(1, func, callsite);
+    return isCheckedRt(func, callsite);
+}
+
+/* the C++ runtime might be loaded after the constructor, with a static
+ * libstdc++ only _Unwind_RaiseException is found */
+static FUN_INLINE void resolveFor(enum EFunctionIndex func)
+{
+    const pf_void_t *pFTable = (const pf_void_t *)&s_ResolvedFunctions.pf_cxa_allocate_exception;
+
+    if (unlikely(!pFTable[func])) {
+        tryResolve();
+        if (!pFTable[func])
+            FUN_TRAP();
+    }
+}
+
+void *__cxa_allocate_exception(size_t size)
+{
+    struct pchecker_trace_record *pTrace;
+    void *r;
+
+    /* the heap checkers see the allocation, only counted here */
+    initAndCount(eAllocateException);
+    threadsCount(eAllocateException);
+    VAR_ATOMIC_FETCH_ADD(s_Throw.allocated, size);
+    pTrace = traceBegin(eAllocateException, (uint64_t)size, 0, 0, PCHECKER_CALLSITE());
+    resolveFor(eAllocateException);
+    r = (*s_ResolvedFunctions.pf_cxa_allocate_exception)(size);
+    traceEnd(pTrace, traceArgPtr(r));
+    return r;
+}
+
+void __cxa_throw(void *obj, void *tinfo, pf_dest_t dest)
+{
+    struct pchecker_trace_record *pTrace;
+    int rt = initAndCheck(eThrow, PCHECKER_CALLSITE());
+
+    throwRecord(tinfo, rt, PCHECKER_CALLSITE());
+    /* does not return, the record ends before unwinding */
+    pTrace = traceBegin(eThrow, traceArgPtr(obj), traceArgPtr(tinfo), 0, PCHECKER_CALLSITE());
+    traceEnd(pTrace, 0);
+    resolveFor(eThrow);
+    s_ThrowPending = 1;
+    (*s_ResolvedFunctions.pf_cxa_throw)(obj, tinfo, dest);
+}
+
+int _Unwind_RaiseException(void *exc)
+{
+    struct pchecker_trace_record *pTrace;
+    int r;
+
+    if (s_ThrowPending) {
+        s_ThrowPending = 0;
+        initAndCount(eRaiseException);
+        pTrace = NULL;
+    }
+    else {
+        /* called by __cxa_rethrow, std::rethrow_exception or
+         * _Unwind_Resume_or_Rethrow, name the code above them */
+        const void *runtime[2];
+        const void *site;
+        int rt;
+
+        initAndCount(eRaiseException);
+        COPY_PF(runtime[0], const void *, s_ResolvedFunctions.pf_cxa_throw);
+        COPY_PF(runtime[1], const void *, s_ResolvedFunctions.pf_unwind_raiseexception);
+        site = unwindFirstOutside(PCHECKER_CALLSITE(), runtime, 2);
+        checkCall(1, eRaiseException, site);
+        rt = isCheckedRt(eRaiseException, site);
+        throwRecord(NULL, rt, site);
+        pTrace = traceBegin(eRaiseException, traceArgPtr(exc), 0, 0, site);
+    }
+    resolveFor(eRaiseException);
+    /* returns only if no handler was found or the unwinding failed */
+    r = (*s_ResolvedFunctions.pf_unwind_raiseexception)(exc);
+    traceEnd(pTrace, (uint64_t)r);
+    return r;
+}
+
+#ifdef __cplusplus
+}
+#endif
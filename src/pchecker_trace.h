@@ -0,0 +1,237 @@
+/*
+ * binary trace of the interposed calls, written into a shared mapping
+ * of a file. Enabled by setting PCHECKER_TRACE to a path prefix,
+ * each checker DSO writes to <prefix>.<checker>.<pid>.
+ *
+ * PCHECKER_TRACE_RECORDS sets the size of the ring (default 256k records),
+ * once it is full the oldest records are overwritten.
+ *
+ * Writing a record is a relaxed atomic increment and a few stores,
+ * no system calls and no locks. Use pchecker_analyze to read the file.
+ *
+ * A fork child writes to a file of its own.
+ *
+ * The stack is recorded up to PCHECKER_STACK_DEPTH frames
+ * (see pchecker_unwind.h), and at most PCHECKER_TRACE_FRAMES.
+ */
+
+#ifndef PCHECKER_TRACE_H
+#define PCHECKER_TRACE_H
+
+#include "pchecker_util.h"
+#include "pchecker_unwind.h"
+#include "pchecker_traceformat.h"
+#include "pchecker_threads.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static struct trace_state {
+    struct pchecker_trace_header *pHeader;
+    struct pchecker_trace_record *pRecords;
+    uint64_t mask;
+    uint64_t mapSize;
+    const char *checker; /* for reopening in a fork child */
+    const char *names;
+    int forkHandler;
+} s_Trace;
+
+static FUN_INLINE unsigned appendStr(char *dst, unsigned cap, unsigned pos, const char *s)
+{
+    while (*s && pos + 1 < cap)
+        dst[pos++] = *s++;
+    dst[pos] = '\0';
+    return pos;
+}
+
+static FUN_INLINE unsigned appendUDec(char *dst, unsigned cap, unsigned pos, uint64_t v)
+{
+    char tmp[24];
+    unsigned n = 0;
+
+    do {
+        tmp[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    while (n && pos + 1 < cap)
+        dst[pos++] = tmp[--n];
+    dst[pos] = '\0';
+    return pos;
+}
+
+/* copy /proc/self/maps into the trace, called on start and exit
+ * to catch DSOs loaded later */
+static FUN_INLINE void traceSnapshotMaps()
+{
+    struct pchecker_trace_header *pHeader = s_Trace.pHeader;
+    char *pMaps;
+    uint32_t size = 0;
+    int fd;
+
+    if (!pHeader)
+        return;
+
+    fd = sysOpen("/proc/self/maps", O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return;
+
+    pMaps = (char *)pHeader + pHeader->mapsOffset;
+    for (;;) {
+        long r = sysRead(fd, pMaps + size, pHeader->mapsCapacity - size);
+        if (r <= 0)
+            break;
+        size += (uint32_t)r;
+    }
+    sysClose(fd);
+
+    VAR_ATOMIC_STORE(pHeader->mapsSize, size);
+}
+
+static FUN_INLINE void traceOpen(const char *checker, const char *names);
+
+/* the child would write into the trace of the parent with the tid of the
+ * forking thread, it gets its own file for the new pid */
+static void traceForkChild()
+{
+    pcheckerResetTid();
+    if (!s_Trace.pHeader)
+        return;
+    sysMunmap(s_Trace.pHeader, (size_t)s_Trace.mapSize);
+    s_Trace.pRecords = NULL;
+    s_Trace.pHeader = NULL;
+    traceOpen(s_Trace.checker, s_Trace.names);
+}
+
+static FUN_INLINE void traceOpen(const char *checker, const char *names)
+{
+    const char *prefix = pcheckerEnv("PCHECKER_TRACE");
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+    struct pchecker_trace_header header = {{0}};
+#pragma GCC diagnostic pop
+    uint64_t records, size;
+    unsigned pos, namesSize;
+    char path[512];
+    void *pMap;
+    int fd;
+
+    if (!s_Trace.forkHandler) {
+        s_Trace.forkHandler = 1;
+        s_Trace.checker = checker;
+        s_Trace.names = names;
+        pthread_atfork(NULL, NULL, &traceForkChild);
+    }
+    if (!prefix || s_Trace.pHeader)
+        return;
+
+    records = pcheckerEnvUnsigned("PCHECKER_TRACE_RECORDS", 256 * 1024);
+    for (header.recordCapacity = 1024; header.recordCapacity < records;)
+        header.recordCapacity <<= 1;
+
+    namesSize = pcheckerNamesSize(names);
+
+    FUN_MEMCPY(header.magic, PCHECKER_TRACE_MAGIC, sizeof(header.magic));
+    header.version = PCHECKER_TRACE_VERSION;
+    header.headerSize = sizeof(header);
+    header.recordSize = sizeof(struct pchecker_trace_record);
+    header.frameCount = PCHECKER_TRACE_FRAMES;
+    header.namesOffset = sizeof(header);
+    header.namesSize = namesSize;
+    header.mapsOffset = (header.namesOffset + namesSize + 63) & ~(uint64_t)63;
+    header.mapsCapacity = 256 * 1024;
+    header.recordOffset = (header.mapsOffset + header.mapsCapacity + 4095) & ~(uint64_t)4095;
+    header.pid = sysGetPid();
+    appendStr(header.checker, sizeof(header.checker), 0, checker);
+    header.ticksPerSec = pcheckerTicksPerSec();
+    header.startTicks = pcheckerTicks();
+    header.startNs = sysMonotonicNs();
+
+    size = header.recordOffset + header.recordCapacity * sizeof(struct pchecker_trace_record);
+
+    pos = appendStr(path, sizeof(path), 0, prefix);
+    pos = appendStr(path, sizeof(path), pos, ".");
+    pos = appendStr(path, sizeof(path), pos, checker);
+    pos = appendStr(path, sizeof(path), pos, ".");
+    appendUDec(path, sizeof(path), pos, (uint64_t)header.pid);
+
+    fd = sysOpen(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    if (sysFtruncate(fd, (long)size) != 0) {
+        sysClose(fd);
+        return;
+    }
+    pMap = sysMmap(NULL, (size_t)size, PCHECKER_PROT_READ | PCHECKER_PROT_WRITE, PCHECKER_MAP_SHARED, fd, 0);
+    sysClose(fd);
+    if (pMap == PCHECKER_MAP_FAILED)
+        return;
+
+    FUN_MEMCPY(pMap, &header, sizeof(header));
+    FUN_MEMCPY((char *)pMap + header.namesOffset, names, namesSize);
+
+    s_Trace.mapSize = size;
+    s_Trace.mask = header.recordCapacity - 1;
+    s_Trace.pRecords = (struct pchecker_trace_record *)((char *)pMap + header.recordOffset);
+    s_Trace.pHeader = (struct pchecker_trace_header *)pMap;
+    traceSnapshotMaps();
+}
+
+static FUN_INLINE void traceClose()
+{
+    traceSnapshotMaps();
+}
+
+static FUN_INLINE uint64_t traceArgPtr(const void *p)
+{
+    return (uint64_t)(uintptr_t)p;
+}
+
+/* reserve and fill a record for a call, returns NULL if tracing is off */
+static FUN_INLINE struct pchecker_trace_record *traceBegin(
+    unsigned func, uint64_t a0, uint64_t a1, uint64_t a2, const void *callsite)
+{
+    struct pchecker_trace_record *pRec;
+    uint64_t index;
+    unsigned i, n = 1;
+    uintptr_t frames[PCHECKER_TRACE_FRAMES];
+
+    if (!s_Trace.pRecords)
+        return NULL;
+
+    frames[0] = (uintptr_t)callsite;
+    if (s_Unwind.depth > 1)
+        n = captureStack(frames, s_Unwind.depth < PCHECKER_TRACE_FRAMES ? s_Unwind.depth : PCHECKER_TRACE_FRAMES,
+            callsite, s_Unwind.useEhFrame);
+
+    index = VAR_ATOMIC_FETCH_ADD(s_Trace.pHeader->writeIndex, 1);
+    pRec = &s_Trace.pRecords[index & s_Trace.mask];
+
+    pRec->args[0] = a0;
+    pRec->args[1] = a1;
+    pRec->args[2] = a2;
+    pRec->result = 0;
+    pRec->tid = (uint32_t)pcheckerGetTid();
+    pRec->func = (uint16_t)func;
+    pRec->flags = 0;
+    for (i = 0; i < PCHECKER_TRACE_FRAMES; ++i)
+        pRec->frames[i] = i < n ? frames[i] : 0;
+    MEM_BARRIER();
+    pRec->ticks = pcheckerTicks();
+    return pRec;
+}
+
+static FUN_INLINE void traceEnd(struct pchecker_trace_record *pRec, uint64_t result)
+{
+    if (!pRec)
+        return;
+    pRec->result = result;
+    MEM_BARRIER();
+    pRec->flags |= eTraceDone;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
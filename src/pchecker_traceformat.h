@@ -0,0 +1,119 @@
+/*
+ * layout of the binary trace files written by the checkers,
+ * shared with the offline tools.
+ *
+ * A trace file is a header, the names of the interposed functions,
+ * a copy of /proc/self/maps and a ring of fixed-size records.
+ * The file is mapped shared, so anything written survives a crash
+ * or SIGKILL of the checked process.
+ */
+
+#ifndef PCHECKER_TRACEFORMAT_H
+#define PCHECKER_TRACEFORMAT_H
+
+#include <stdint.h>
+
+#ifndef VAR_ATOMIC
+#define VAR_ATOMIC(t) t
+#endif
+
+#define PCHECKER_TRACE_MAGIC "PCHKTRC1"
+#define PCHECKER_TRACE_VERSION 1
+
+/* return addresses stored per record */
+#ifndef PCHECKER_TRACE_FRAMES
+#define PCHECKER_TRACE_FRAMES 8
+#endif
+
+enum EPcheckerTraceFlags {
+    /* the interposed function returned, result is valid */
+    eTraceDone = 1
+};
+
+struct pchecker_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t recordSize;
+    uint32_t frameCount;
+    uint64_t recordCapacity; /* power of two */
+    uint64_t recordOffset;
+
+    uint64_t namesOffset; /* function names, '\0' separated */
+    uint32_t namesSize;
+    uint32_t mapsCapacity;
+    uint64_t mapsOffset; /* copy of /proc/self/maps */
+    VAR_ATOMIC(uint32_t) mapsSize;
+    int32_t pid;
+
+    char checker[32];
+
+    /* relation of the record timestamps to CLOCK_MONOTONIC */
+    uint64_t ticksPerSec;
+    uint64_t startTicks;
+    uint64_t startNs;
+
+    /* total count of records written, the ring holds the last ones */
+    VAR_ATOMIC(uint64_t) writeIndex;
+};
+
+struct pchecker_trace_record {
+    uint64_t ticks; /* 0 if unused */
+    uint64_t args[3];
+    uint64_t result;
+    uint32_t tid;
+    uint16_t func; /* index into the function names */
+    uint16_t flags;
+    uint64_t frames[PCHECKER_TRACE_FRAMES]; /* callsite first, 0 terminated */
+};
+
+/*
+ * heap operation recording of the heap checkers (PCHECKER_HEAP_RECORD),
+ * read by pchecker_replay. A header and an array of records in the order
+ * they were reserved, recording stops when it is full.
+ * Allocations are reserved after the call returned and frees before the
+ * block is released, so the order of the records is consistent for each
+ * address across threads, except for the old block of a moving realloc.
+ */
+
+#define PCHECKER_HEAPREC_MAGIC "PCHKHRC1"
+#define PCHECKER_HEAPREC_VERSION 1
+
+enum EPcheckerHeapRecOp {
+    eHeapRecMalloc = 1, /* size and alignLog2 */
+    eHeapRecCalloc,
+    eHeapRecFree,
+    eHeapRecRealloc /* oldPtr, may be NULL, size 0 frees */
+};
+
+struct pchecker_heaprec_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint32_t recordSize;
+    int32_t pid;
+    uint64_t recordCapacity;
+    uint64_t recordOffset;
+
+    char checker[32];
+
+    uint64_t ticksPerSec;
+    uint64_t startTicks;
+    uint64_t startNs;
+
+    /* count of records reserved, those beyond the capacity are lost */
+    VAR_ATOMIC(uint64_t) writeIndex;
+};
+
+struct pchecker_heaprec_record {
+    uint64_t ticks; /* written last, 0 if incomplete */
+    uint64_t ptr;   /* result, or the block freed */
+    uint64_t oldPtr;
+    uint64_t size;
+    uint32_t tid;
+    uint8_t op;
+    uint8_t alignLog2; /* 0 for the default alignment */
+    uint16_t reserved;
+};
+
+#endif
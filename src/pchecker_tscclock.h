@@ -0,0 +1,355 @@
+/*
+ * CLOCK_MONOTONIC from the TSC, for targets where the vDSO is disabled
+ * or falls back to the system call and clock_gettime costs microseconds.
+ *
+ * PCHECKER_GETTIME_TSC=1 serves CLOCK_MONOTONIC, =2 also CLOCK_REALTIME
+ * (and gettimeofday, time) as CLOCK_MONOTONIC plus an offset. It is only
+ * enabled on x86 with an invariant TSC that the kernel lists as usable
+ * clocksource, so the counters of all CPUs are synchronized.
+ *
+ * A helper thread at SCHED_OTHER calibrates the TSC against the kernel
+ * clock (50 ms, until then the kernel serves all calls) and re-syncs every
+ * PCHECKER_GETTIME_TSC_SYNC ms (default 1000). The conversion is
+ *
+ *     nsBase + (tsc - tscBase) * mult
+ *
+ * re-anchored on every sync at the current value, so the clock never
+ * steps back: a difference to the kernel is slewed away within the next
+ * period by at most 500 ppm, larger forward differences are stepped.
+ * The parameters are kept twice, the helper fills the copy not in use and
+ * then switches the sequence counter to it, so readers never wait for the
+ * helper (which they may have preempted) and retry only if a switch
+ * happened while they read. A reader still using the old parameters
+ * after the anchor can be a few ns ahead of one using the new ones, the
+ * result is clamped against the largest value returned by the process.
+ *
+ * After fork the child has no helper and keeps the last calibration.
+ */
+
+#ifndef PCHECKER_TSCCLOCK_H
+#define PCHECKER_TSCCLOCK_H
+
+#include "pchecker_util.h"
+#include "pchecker_helper.h"
+#include "pchecker_vclock.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the largest slew, parts per million */
+#ifndef PCHECKER_TSCCLOCK_PPM
+#define PCHECKER_TSCCLOCK_PPM 500
+#endif
+
+enum {
+    PCHECKER_CLOCK_REALTIME = 0
+};
+
+struct tscclock_params {
+    uint64_t tscBase;
+    uint64_t nsBase;    /* CLOCK_MONOTONIC at tscBase */
+    uint64_t mult;      /* ns per tick, 32 fractional bits */
+    int64_t realOffset; /* CLOCK_REALTIME - CLOCK_MONOTONIC */
+};
+
+static struct tscclock_state {
+    unsigned clockMask; /* set once calibrated */
+    unsigned wantMask;
+    uint32_t seq; /* params[seq & 1] is in use */
+    struct tscclock_params params[2];
+    uint64_t last; /* largest CLOCK_MONOTONIC returned by this process */
+
+    /* on the helper thread */
+    uint64_t periodNs;
+    uint64_t tsc0; /* first calibration sample */
+    uint64_t ns0;
+    uint64_t rate; /* long-term ns per tick, 32 fractional bits */
+    uint64_t syncs;
+    uint64_t steps;
+    uint64_t maxErrorNs;
+} s_TscClock;
+
+static FUN_INLINE uint64_t tscRead()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t t;
+
+    /* not earlier than the loads before, not later than the ones after */
+    __asm__ __volatile__("lfence" ::: "memory");
+    t = __builtin_ia32_rdtsc();
+    __asm__ __volatile__("lfence" ::: "memory");
+    return t;
+#else
+    return 0;
+#endif
+}
+
+/* CLOCK_MONOTONIC in ns, never decreasing across the threads of this
+ * process, with the offset to CLOCK_REALTIME */
+static FUN_INLINE uint64_t tscClockNow(int64_t *pRealOffset)
+{
+    const struct tscclock_params *pParams;
+    struct tscclock_params p;
+    uint64_t tsc, ns, last;
+    uint32_t seq;
+
+    do {
+        seq = __atomic_load_n(&s_TscClock.seq, __ATOMIC_ACQUIRE);
+        pParams = &s_TscClock.params[seq & 1];
+        p.tscBase = __atomic_load_n(&pParams->tscBase, __ATOMIC_RELAXED);
+        p.nsBase = __atomic_load_n(&pParams->nsBase, __ATOMIC_RELAXED);
+        p.mult = __atomic_load_n(&pParams->mult, __ATOMIC_RELAXED);
+        p.realOffset = __atomic_load_n(&pParams->realOffset, __ATOMIC_RELAXED);
+        tsc = tscRead();
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&s_TscClock.seq, __ATOMIC_RELAXED) != seq);
+
+    *pRealOffset = p.realOffset;
+    ns = p.nsBase + vclockScale(tsc > p.tscBase ? tsc - p.tscBase : 0, p.mult);
+    last = __atomic_load_n(&s_TscClock.last, __ATOMIC_RELAXED);
+    while (ns > last) {
+        if (__atomic_compare_exchange_n(&s_TscClock.last, &last, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return ns;
+    }
+    return last;
+}
+
+/* returns 0 if the clock is not served from the TSC */
+static FUN_INLINE int tscClockRead(clockid_t clock_id, int64_t *pNs)
+{
+    int64_t realOffset;
+    uint64_t ns;
+
+    if ((unsigned)clock_id >= 32 || !(__atomic_load_n(&s_TscClock.clockMask, __ATOMIC_RELAXED) >> clock_id & 1))
+        return 0;
+    ns = tscClockNow(&realOffset);
+    *pNs = (int64_t)ns + (clock_id == PCHECKER_CLOCK_REALTIME ? realOffset : 0);
+    return 1;
+}
+
+static FUN_INLINE uint64_t tscClockKernelNs(int clockId)
+{
+    struct pchecker_timespec ts;
+
+    if (syscall(SYS_clock_gettime, clockId, &ts) != 0)
+        return 0;
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* a TSC value and the kernel CLOCK_MONOTONIC at the same moment,
+ * the tightest bracket of a few tries */
+static FUN_INLINE void tscClockSample(uint64_t *pTsc, uint64_t *pNs)
+{
+    uint64_t best = ~(uint64_t)0;
+    unsigned i;
+
+    *pTsc = 0;
+    *pNs = 0;
+    for (i = 0; i < 8; ++i) {
+        uint64_t t0 = tscRead();
+        uint64_t ns = tscClockKernelNs(PCHECKER_CLOCK_MONOTONIC);
+        uint64_t t1 = tscRead();
+        if (t1 - t0 < best) {
+            best = t1 - t0;
+            *pTsc = t0 + (t1 - t0) / 2;
+            *pNs = ns;
+        }
+    }
+}
+
+static FUN_INLINE int64_t tscClockRealOffset()
+{
+    uint64_t m0 = tscClockKernelNs(PCHECKER_CLOCK_MONOTONIC);
+    uint64_t r = tscClockKernelNs(PCHECKER_CLOCK_REALTIME);
+    uint64_t m1 = tscClockKernelNs(PCHECKER_CLOCK_MONOTONIC);
+
+    return (int64_t)(r - (m0 + (m1 - m0) / 2));
+}
+
+static FUN_INLINE uint64_t tscClockRate(uint64_t dNs, uint64_t dTsc)
+{
+    return (uint64_t)((double)dNs / (double)dTsc * 4294967296.0);
+}
+
+/* fill the copy not in use and switch to it */
+static FUN_INLINE void tscClockPublish(const struct tscclock_params *p)
+{
+    uint32_t seq = s_TscClock.seq + 1;
+    struct tscclock_params *pParams = &s_TscClock.params[seq & 1];
+
+    __atomic_store_n(&pParams->tscBase, p->tscBase, __ATOMIC_RELAXED);
+    __atomic_store_n(&pParams->nsBase, p->nsBase, __ATOMIC_RELAXED);
+    __atomic_store_n(&pParams->mult, p->mult, __ATOMIC_RELAXED);
+    __atomic_store_n(&pParams->realOffset, p->realOffset, __ATOMIC_RELAXED);
+    __atomic_store_n(&s_TscClock.seq, seq, __ATOMIC_RELEASE);
+}
+
+/* re-anchor at the current value and slew towards the kernel clock */
+static FUN_INLINE void tscClockSync()
+{
+    const struct tscclock_params *pOld = &s_TscClock.params[s_TscClock.seq & 1];
+    struct tscclock_params p;
+    uint64_t tsc, ns, now, limit = s_TscClock.periodNs / 1000000u * PCHECKER_TSCCLOCK_PPM;
+    int64_t error, realOffset;
+    double adjust;
+
+    tscClockSample(&tsc, &ns);
+    realOffset = tscClockRealOffset();
+    s_TscClock.rate = tscClockRate(ns - s_TscClock.ns0, tsc - s_TscClock.tsc0);
+
+    p.tscBase = tscRead();
+    now = pOld->nsBase + vclockScale(p.tscBase - pOld->tscBase, pOld->mult);
+    /* the kernel time at the anchor */
+    ns += vclockScale(p.tscBase - tsc, s_TscClock.rate);
+    error = (int64_t)(ns - now);
+
+    ++s_TscClock.syncs;
+    if ((uint64_t)(error < 0 ? -error : error) > s_TscClock.maxErrorNs)
+        s_TscClock.maxErrorNs = (uint64_t)(error < 0 ? -error : error);
+
+    p.nsBase = now;
+    p.realOffset = realOffset;
+    if (error > (int64_t)limit) {
+        /* forward differences larger than a period of slewing are
+         * stepped, e.g. after a suspend */
+        p.nsBase = ns;
+        ++s_TscClock.steps;
+        error = 0;
+    }
+    adjust = (double)error / (double)s_TscClock.periodNs;
+    if (adjust > PCHECKER_TSCCLOCK_PPM / 1e6)
+        adjust = PCHECKER_TSCCLOCK_PPM / 1e6;
+    if (adjust < -PCHECKER_TSCCLOCK_PPM / 1e6)
+        adjust = -PCHECKER_TSCCLOCK_PPM / 1e6;
+    p.mult = (uint64_t)((double)s_TscClock.rate * (1.0 + adjust));
+    tscClockPublish(&p);
+}
+
+static void *tscClockRun(void *pArg)
+{
+    struct tscclock_params p;
+    uint64_t tsc, ns, next;
+    (void)pArg;
+
+    pcheckerHelperSetup("pchk-tscclock", PCHECKER_SCHED_OTHER);
+
+    /* initial calibration */
+    tscClockSample(&s_TscClock.tsc0, &s_TscClock.ns0);
+    pcheckerHelperSleepUntil(s_TscClock.ns0 + 50000000u);
+    tscClockSample(&tsc, &ns);
+    s_TscClock.rate = tscClockRate(ns - s_TscClock.ns0, tsc - s_TscClock.tsc0);
+    p.tscBase = tsc;
+    p.nsBase = ns;
+    p.mult = s_TscClock.rate;
+    p.realOffset = tscClockRealOffset();
+    tscClockPublish(&p);
+    /* not behind what the kernel served until now */
+    __atomic_store_n(&s_TscClock.last, tscClockKernelNs(PCHECKER_CLOCK_MONOTONIC), __ATOMIC_RELAXED);
+    __atomic_store_n(&s_TscClock.clockMask, s_TscClock.wantMask, __ATOMIC_RELEASE);
+
+    for (next = ns;;) {
+        next += s_TscClock.periodNs;
+        pcheckerHelperSleepUntil(next);
+        tscClockSync();
+        /* starved, don't catch up */
+        if (next < tscClockKernelNs(PCHECKER_CLOCK_MONOTONIC))
+            next = tscClockKernelNs(PCHECKER_CLOCK_MONOTONIC);
+    }
+    return NULL;
+}
+
+static FUN_INLINE void tscClockWarn(const char *what)
+{
+    struct pchecker_out o;
+    outInit(&o, 2);
+    outStr(&o, "pchecker(" PCHECKER_NAME "): ");
+    outStr(&o, what);
+    outStr(&o, ", CLOCK_MONOTONIC from the kernel\n");
+    outFlush(&o);
+}
+
+/* the kernel checked the TSCs of all CPUs against each other */
+static FUN_INLINE int tscClockKernelUsesTsc()
+{
+    char buf[256];
+    unsigned i;
+    long n;
+    int fd = sysOpen("/sys/devices/system/clocksource/clocksource0/available_clocksource", O_RDONLY | O_CLOEXEC, 0);
+
+    if (fd < 0)
+        return 0;
+    n = sysRead(fd, buf, sizeof(buf) - 1);
+    sysClose(fd);
+    for (i = 0; n > 0 && i + 3 <= (unsigned)n; ++i) {
+        if (buf[i] == 't' && buf[i + 1] == 's' && buf[i + 2] == 'c' && (i == 0 || buf[i - 1] == ' ') &&
+            (i + 3 == (unsigned)n || buf[i + 3] == ' ' || buf[i + 3] == '\n'))
+            return 1;
+    }
+    return 0;
+}
+
+/* call from the constructor */
+static FUN_INLINE void tscClockInit()
+{
+    uint64_t mode = pcheckerEnvUnsigned("PCHECKER_GETTIME_TSC", 0);
+
+    if (!mode)
+        return;
+#if defined(__x86_64__) || defined(__i386__)
+    {
+        unsigned a, b, c, d;
+        /* CPUID.80000007H:EDX[8] invariant TSC */
+        if (!__get_cpuid(0x80000007u, &a, &b, &c, &d) || !(d & (1u << 8))) {
+            tscClockWarn("TSC is not invariant");
+            return;
+        }
+    }
+#else
+    tscClockWarn("no TSC clock on this architecture");
+    return;
+#endif
+    if (!tscClockKernelUsesTsc()) {
+        tscClockWarn("TSC is no usable clocksource for the kernel");
+        return;
+    }
+
+    s_TscClock.periodNs = pcheckerEnvUnsigned("PCHECKER_GETTIME_TSC_SYNC", 1000) * 1000000u;
+    if (s_TscClock.periodNs < 10000000u)
+        s_TscClock.periodNs = 10000000u;
+    s_TscClock.wantMask = 1u << PCHECKER_CLOCK_MONOTONIC;
+    if (mode > 1)
+        s_TscClock.wantMask |= 1u << PCHECKER_CLOCK_REALTIME;
+    if (pcheckerStartHelper(&tscClockRun, NULL) != 0)
+        tscClockWarn("cannot start the TSC clock thread");
+}
+
+/* call from the destructor */
+static FUN_INLINE void tscClockFinish()
+{
+    struct pchecker_out o;
+
+    if (!__atomic_load_n(&s_TscClock.clockMask, __ATOMIC_ACQUIRE))
+        return;
+    outInit(&o, 2);
+    outStr(&o, "pchecker(" PCHECKER_NAME "): TSC clock at ");
+    outUDec(&o, (uint64_t)(4294967296000.0 / (double)s_TscClock.rate), 0);
+    outStr(&o, " MHz, ");
+    outUDec(&o, s_TscClock.syncs, 0);
+    outStr(&o, " syncs, largest difference to the kernel ");
+    outUDec(&o, s_TscClock.maxErrorNs, 0);
+    outStr(&o, " ns, ");
+    outUDec(&o, s_TscClock.steps, 0);
+    outStr(&o, " steps\n");
+    outFlush(&o);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,801 @@
+/*
+ * allocation-free capture of the call stack, usable from within malloc.
+ *
+ * glibc backtrace() may allocate and dlopen libgcc_s on first use,
+ * so the checkers walk the stack on their own:
+ *
+ * -   by following frame pointers (default). Every frame is checked against
+ *     the bounds of the thread stack and every return address against the
+ *     executable segments of the loaded objects, so a bogus chain stops the
+ *     walk instead of faulting.
+ *
+ * -   on x86_64 optionally with the .eh_frame call frame information
+ *     (PCHECKER_STACK_UNWIND=eh), for code built without frame pointers.
+ *     The rules found for a pc are kept in a small cache.
+ *
+ * PCHECKER_STACK_DEPTH sets the number of frames (default 1, the callsite
+ * only), at most PCHECKER_STACK_MAX.
+ *
+ * The tables of objects are taken in the constructor of the checker,
+ * objects loaded later end the walk. unwindFirstOutside finds the first
+ * frame outside the runtime libraries a call came through, with the CFI
+ * where available, since those are mostly built without frame pointers.
+ */
+
+#ifndef PCHECKER_UNWIND_H
+#define PCHECKER_UNWIND_H
+
+#include "pchecker_util.h"
+#include <link.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PCHECKER_STACK_MAX
+#define PCHECKER_STACK_MAX 16
+#endif
+
+#ifndef PCHECKER_UNWIND_MODULES
+#define PCHECKER_UNWIND_MODULES 256
+#endif
+
+#if defined(__x86_64__) && !defined(PCHECKER_UNWIND_EHFRAME)
+#define PCHECKER_UNWIND_EHFRAME 1
+#endif
+
+/* frames of the checker itself that may be above the interposed function */
+#define PCHECKER_UNWIND_SKIP 4
+
+/* executable segment of a loaded object */
+struct unwind_module {
+    uintptr_t lo;
+    uintptr_t hi;
+    const unsigned char *pEhFrameHdr;
+};
+
+static struct unwind_state {
+    unsigned depth;
+    int useEhFrame;
+    unsigned moduleCount;
+    struct unwind_module modules[PCHECKER_UNWIND_MODULES];
+} s_Unwind = {1, 0, 0, {{0, 0, NULL}}};
+
+/* stack of the current thread, found once per thread */
+struct unwind_stack {
+    uintptr_t lo;
+    uintptr_t hi;
+};
+
+/* parse "lo-hi" from a line of /proc/self/maps */
+static FUN_INLINE int parseHexRange(const char *p, uintptr_t *pLo, uintptr_t *pHi)
+{
+    uintptr_t v[2] = {0, 0};
+    unsigned i;
+
+    for (i = 0; i < 2; ++i) {
+        for (; (*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f'); ++p)
+            v[i] = v[i] * 16 + (uintptr_t)(*p <= '9' ? *p - '0' : *p - 'a' + 10);
+        if (i == 0 && *p++ != '-')
+            return 0;
+    }
+    *pLo = v[0];
+    *pHi = v[1];
+    return 1;
+}
+
+struct stack_search {
+    uintptr_t sp;
+    struct unwind_stack *pStack;
+};
+
+static FUN_INLINE int matchStackMapping(char *line, void *pCtx)
+{
+    struct stack_search *pSearch = (struct stack_search *)pCtx;
+    uintptr_t lo, hi;
+
+    if (!parseHexRange(line, &lo, &hi) || pSearch->sp < lo || pSearch->sp >= hi)
+        return 0;
+    pSearch->pStack->lo = lo;
+    pSearch->pStack->hi = hi;
+    return 1;
+}
+
+/* find the mapping containing sp in /proc/self/maps */
+static FUN_INLINE int findStackMapping(uintptr_t sp, struct unwind_stack *pStack)
+{
+    struct stack_search search;
+
+    search.sp = sp;
+    search.pStack = pStack;
+    return pcheckerForEachLine("/proc/self/maps", &matchStackMapping, &search) > 0;
+}
+
+static FUN_INLINE const struct unwind_stack *getThreadStack(uintptr_t sp)
+{
+    static VAR_TLS struct unwind_stack s_Stack;
+
+    if (unlikely(sp < s_Stack.lo || sp >= s_Stack.hi)) {
+        if (!findStackMapping(sp, &s_Stack)) {
+            /* stay on the safe side, only walk the current page */
+            s_Stack.lo = sp;
+            s_Stack.hi = (sp | 4095) + 1;
+        }
+    }
+    return &s_Stack;
+}
+
+static FUN_INLINE const struct unwind_module *findModule(uintptr_t pc)
+{
+    unsigned lo = 0, hi = s_Unwind.moduleCount;
+
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (pc < s_Unwind.modules[mid].lo)
+            hi = mid;
+        else if (pc >= s_Unwind.modules[mid].hi)
+            lo = mid + 1;
+        else
+            return &s_Unwind.modules[mid];
+    }
+    return NULL;
+}
+
+static FUN_INLINE int collectModule(struct dl_phdr_info *pInfo, size_t size, void *pData)
+{
+    const unsigned char *pHdr = NULL;
+    unsigned i;
+
+    (void)size;
+    (void)pData;
+
+    for (i = 0; i < pInfo->dlpi_phnum; ++i) {
+        if (pInfo->dlpi_phdr[i].p_type == PT_GNU_EH_FRAME)
+            pHdr = (const unsigned char *)(pInfo->dlpi_addr + pInfo->dlpi_phdr[i].p_vaddr);
+    }
+    for (i = 0; i < pInfo->dlpi_phnum; ++i) {
+        const ElfW(Phdr) *pPhdr = &pInfo->dlpi_phdr[i];
+        struct unwind_module *pMod;
+        unsigned k;
+
+        if (pPhdr->p_type != PT_LOAD || !(pPhdr->p_flags & PF_X))
+            continue;
+        if (s_Unwind.moduleCount == PCHECKER_UNWIND_MODULES)
+            return 1;
+
+        /* insertion sort, the list is short and built once */
+        k = s_Unwind.moduleCount++;
+        while (k && s_Unwind.modules[k - 1].lo > pInfo->dlpi_addr + pPhdr->p_vaddr) {
+            s_Unwind.modules[k] = s_Unwind.modules[k - 1];
+            --k;
+        }
+        pMod = &s_Unwind.modules[k];
+        pMod->lo = pInfo->dlpi_addr + pPhdr->p_vaddr;
+        pMod->hi = pMod->lo + pPhdr->p_memsz;
+        pMod->pEhFrameHdr = pHdr;
+    }
+    return 0;
+}
+
+/* the table of objects, for checkers that walk the stack whatever the
+ * depth. Called from the constructor, takes the loader lock */
+static FUN_INLINE void unwindModules()
+{
+    if (!s_Unwind.moduleCount)
+        dl_iterate_phdr(&collectModule, NULL);
+}
+
+/* called from the constructor, takes the loader lock */
+static FUN_INLINE void unwindInit()
+{
+    const char *mode = pcheckerEnv("PCHECKER_STACK_UNWIND");
+    uint64_t depth = pcheckerEnvUnsigned("PCHECKER_STACK_DEPTH", 1);
+
+    s_Unwind.depth = depth < 1 ? 1 : depth > PCHECKER_STACK_MAX ? PCHECKER_STACK_MAX : (unsigned)depth;
+#if PCHECKER_UNWIND_EHFRAME
+    s_Unwind.useEhFrame = mode && pcheckerStrEq(mode, "eh");
+#else
+    (void)mode;
+#endif
+    if (s_Unwind.depth > 1)
+        unwindModules();
+}
+
+static FUN_INLINE int validStackSlot(const struct unwind_stack *pStack, uintptr_t addr)
+{
+    return addr >= pStack->lo && addr <= pStack->hi - sizeof(uintptr_t) && !(addr & (sizeof(uintptr_t) - 1));
+}
+
+#if PCHECKER_UNWIND_EHFRAME
+
+/* x86_64 DWARF register numbers */
+enum {
+    eDwarfRbp = 6,
+    eDwarfRsp = 7,
+    eDwarfRa = 16
+};
+
+enum EFrameRule {
+    eRuleSame = 0,  /* register unchanged */
+    eRuleOffset = 1 /* saved at cfa + offset */
+};
+
+/* the rules needed to step one frame */
+struct frame_rules {
+    int cfaReg; /* eDwarfRsp or eDwarfRbp */
+    int32_t cfaOffset;
+    int rbpRule;
+    int32_t rbpOffset;
+    int32_t raOffset;
+};
+
+static FUN_INLINE uint64_t readULEB(const unsigned char **pp)
+{
+    const unsigned char *p = *pp;
+    uint64_t v = 0;
+    unsigned shift = 0;
+    unsigned char b;
+
+    do {
+        b = *p++;
+        if (shift < 64)
+            v |= (uint64_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    *pp = p;
+    return v;
+}
+
+static FUN_INLINE int64_t readSLEB(const unsigned char **pp)
+{
+    const unsigned char *p = *pp;
+    int64_t v = 0;
+    unsigned shift = 0;
+    unsigned char b;
+
+    do {
+        b = *p++;
+        if (shift < 64)
+            v |= (int64_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    if (shift < 64 && (b & 0x40))
+        v |= -((int64_t)1 << shift);
+    *pp = p;
+    return v;
+}
+
+/* read a pointer in DW_EH_PE_* encoding, returns 0 if unsupported */
+static FUN_INLINE int readEncoded(const unsigned char **pp, unsigned char enc, uintptr_t dataRel, uintptr_t *pValue)
+{
+    const unsigned char *p = *pp;
+    uintptr_t base = 0;
+    uint64_t v;
+
+    if (enc == 0xff)
+        return 0;
+
+    switch (enc & 0x70) {
+    case 0x00:
+        break;
+    case 0x10:
+        base = (uintptr_t)p;
+        break;
+    case 0x30:
+        base = dataRel;
+        break;
+    default:
+        return 0;
+    }
+
+    switch (enc & 0x0f) {
+    case 0x00:
+        FUN_MEMCPY(&v, p, sizeof(uintptr_t) == 8 ? 8 : 4);
+        p += sizeof(uintptr_t);
+        break;
+    case 0x01:
+        v = readULEB(&p);
+        break;
+    case 0x02: {
+        uint16_t t;
+        FUN_MEMCPY(&t, p, 2);
+        v = t;
+        p += 2;
+    } break;
+    case 0x03: {
+        uint32_t t;
+        FUN_MEMCPY(&t, p, 4);
+        v = t;
+        p += 4;
+    } break;
+    case 0x04:
+    case 0x0c:
+        FUN_MEMCPY(&v, p, 8);
+        p += 8;
+        break;
+    case 0x09:
+        v = (uint64_t)readSLEB(&p);
+        break;
+    case 0x0a: {
+        int16_t t;
+        FUN_MEMCPY(&t, p, 2);
+        v = (uint64_t)(int64_t)t;
+        p += 2;
+    } break;
+    case 0x0b: {
+        int32_t t;
+        FUN_MEMCPY(&t, p, 4);
+        v = (uint64_t)(int64_t)t;
+        p += 4;
+    } break;
+    default:
+        return 0;
+    }
+
+    v += base;
+    if (enc & 0x80)
+        FUN_MEMCPY(&v, (const void *)(uintptr_t)v, sizeof(uintptr_t));
+    *pValue = (uintptr_t)v;
+    *pp = p;
+    return 1;
+}
+
+/* binary search in the table of .eh_frame_hdr */
+static FUN_INLINE const unsigned char *findFDE(const unsigned char *pHdr, uintptr_t pc)
+{
+    const unsigned char *p = pHdr + 4;
+    uintptr_t ehFrame, count;
+    const int32_t *table;
+    uintptr_t lo = 0, hi;
+
+    if (pHdr[0] != 1 || pHdr[3] != 0x3b /* datarel | sdata4 */)
+        return NULL;
+    if (!readEncoded(&p, pHdr[1], (uintptr_t)pHdr, &ehFrame) || !readEncoded(&p, pHdr[2], (uintptr_t)pHdr, &count))
+        return NULL;
+    if (!count)
+        return NULL;
+
+    table = (const int32_t *)p;
+    hi = count;
+    while (hi - lo > 1) {
+        uintptr_t mid = (lo + hi) / 2;
+        if (pc < (uintptr_t)pHdr + (intptr_t)table[2 * mid])
+            hi = mid;
+        else
+            lo = mid;
+    }
+    if (pc < (uintptr_t)pHdr + (intptr_t)table[2 * lo])
+        return NULL;
+    return (const unsigned char *)pHdr + table[2 * lo + 1];
+}
+
+struct cfi_state {
+    int cfaReg;
+    int64_t cfaOffset;
+    int rbpRule;
+    int64_t rbpOffset;
+    int raRule;
+    int64_t raOffset;
+};
+
+/* run call frame instructions until loc passes pc,
+ * returns 0 for anything not supported */
+static FUN_INLINE int runCFI(const unsigned char *p, const unsigned char *end, uint64_t codeAlign, int64_t dataAlign,
+    uintptr_t loc, uintptr_t pc, struct cfi_state *pState, const struct cfi_state *pInitial)
+{
+    struct cfi_state stack[4];
+    unsigned depth = 0;
+
+    while (p < end && loc <= pc) {
+        unsigned char op = *p++;
+        uint64_t reg;
+        int64_t off;
+
+        switch (op >> 6) {
+        case 1: /* advance_loc */
+            loc += (op & 0x3f) * codeAlign;
+            continue;
+        case 2: /* offset */
+            reg = op & 0x3f;
+            off = (int64_t)readULEB(&p) * dataAlign;
+            goto set_offset;
+        case 3: /* restore */
+            reg = op & 0x3f;
+            goto restore;
+        default:
+            break;
+        }
+
+        switch (op) {
+        case 0x00: /* nop */
+            break;
+        case 0x01: /* set_loc */
+            if (!readEncoded(&p, 0x00, 0, &loc))
+                return 0;
+            break;
+        case 0x02: /* advance_loc1 */
+            loc += *p++ * codeAlign;
+            break;
+        case 0x03: { /* advance_loc2 */
+            uint16_t d;
+            FUN_MEMCPY(&d, p, 2);
+            p += 2;
+            loc += d * codeAlign;
+        } break;
+        case 0x04: { /* advance_loc4 */
+            uint32_t d;
+            FUN_MEMCPY(&d, p, 4);
+            p += 4;
+            loc += d * codeAlign;
+        } break;
+        case 0x05: /* offset_extended */
+            reg = readULEB(&p);
+            off = (int64_t)readULEB(&p) * dataAlign;
+            goto set_offset;
+        case 0x06: /* restore_extended */
+            reg = readULEB(&p);
+            goto restore;
+        case 0x07: /* undefined */
+        case 0x08: /* same_value */
+            reg = readULEB(&p);
+            if (reg == eDwarfRbp)
+                pState->rbpRule = eRuleSame;
+            else if (reg == eDwarfRa)
+                return 0;
+            break;
+        case 0x09: /* register */
+            reg = readULEB(&p);
+            readULEB(&p);
+            if (reg == eDwarfRbp || reg == eDwarfRa)
+                return 0;
+            break;
+        case 0x0a: /* remember_state */
+            if (depth == sizeof(stack) / sizeof(stack[0]))
+                return 0;
+            stack[depth++] = *pState;
+            break;
+        case 0x0b: /* restore_state */
+            if (!depth)
+                return 0;
+            *pState = stack[--depth];
+            break;
+        case 0x0c: /* def_cfa */
+            pState->cfaReg = (int)readULEB(&p);
+            pState->cfaOffset = (int64_t)readULEB(&p);
+            break;
+        case 0x0d: /* def_cfa_register */
+            pState->cfaReg = (int)readULEB(&p);
+            break;
+        case 0x0e: /* def_cfa_offset */
+            pState->cfaOffset = (int64_t)readULEB(&p);
+            break;
+        case 0x11: /* offset_extended_sf */
+            reg = readULEB(&p);
+            off = readSLEB(&p) * dataAlign;
+            goto set_offset;
+        case 0x12: /* def_cfa_sf */
+            pState->cfaReg = (int)readULEB(&p);
+            pState->cfaOffset = readSLEB(&p) * dataAlign;
+            break;
+        case 0x13: /* def_cfa_offset_sf */
+            pState->cfaOffset = readSLEB(&p) * dataAlign;
+            break;
+        case 0x2e: /* GNU_args_size */
+            readULEB(&p);
+            break;
+        case 0x0f: /* def_cfa_expression */
+        case 0x10: /* expression */
+        case 0x16: /* val_expression */
+            /* the expressions are only used in signal frames and
+             * hand-written assembly, give up on those */
+            if (op == 0x0f)
+                return 0;
+            reg = readULEB(&p);
+            p += readULEB(&p);
+            if (reg == eDwarfRbp || reg == eDwarfRa)
+                return 0;
+            break;
+        default:
+            return 0;
+        }
+        continue;
+
+    set_offset:
+        if (reg == eDwarfRbp) {
+            pState->rbpRule = eRuleOffset;
+            pState->rbpOffset = off;
+        }
+        else if (reg == eDwarfRa) {
+            pState->raRule = eRuleOffset;
+            pState->raOffset = off;
+        }
+        continue;
+
+    restore:
+        if (!pInitial)
+            return 0;
+        if (reg == eDwarfRbp) {
+            pState->rbpRule = pInitial->rbpRule;
+            pState->rbpOffset = pInitial->rbpOffset;
+        }
+        else if (reg == eDwarfRa) {
+            pState->raRule = pInitial->raRule;
+            pState->raOffset = pInitial->raOffset;
+        }
+    }
+    return 1;
+}
+
+/* parse CIE and FDE at pFDE and compute the rules valid at pc */
+static FUN_INLINE int computeRules(const unsigned char *pFDE, uintptr_t pc, struct frame_rules *pRules)
+{
+    const unsigned char *p = pFDE, *pCIE, *cieEnd, *fdeEnd, *aug;
+    uint32_t len, cieOffset;
+    uint64_t codeAlign;
+    int64_t dataAlign;
+    unsigned char fdeEnc = 0x00;
+    int hasAugData = 0;
+    uintptr_t pcBegin, pcRange;
+    struct cfi_state state, initial;
+
+    FUN_MEMCPY(&len, p, 4);
+    if (len == 0 || len == 0xffffffffu)
+        return 0;
+    fdeEnd = p + 4 + len;
+    p += 4;
+    FUN_MEMCPY(&cieOffset, p, 4);
+    pCIE = p - cieOffset;
+
+    /* CIE */
+    FUN_MEMCPY(&len, pCIE, 4);
+    if (len == 0 || len == 0xffffffffu)
+        return 0;
+    cieEnd = pCIE + 4 + len;
+    aug = pCIE + 9; /* length, id, version */
+    if (pCIE[8] != 1 && pCIE[8] != 3)
+        return 0;
+    {
+        const unsigned char *q = aug;
+        while (*q)
+            ++q;
+        ++q;
+        codeAlign = readULEB(&q);
+        dataAlign = readSLEB(&q);
+        if (pCIE[8] == 1)
+            ++q;
+        else
+            readULEB(&q);
+        if (*aug == 'z') {
+            const unsigned char *a;
+            uint64_t augLen = readULEB(&q);
+            const unsigned char *augEnd = q + augLen;
+            hasAugData = 1;
+            for (a = aug + 1; *a; ++a) {
+                if (*a == 'R')
+                    fdeEnc = *q++;
+                else if (*a == 'L')
+                    ++q;
+                else if (*a == 'P') {
+                    uintptr_t dummy;
+                    unsigned char penc = *q++;
+                    if (!readEncoded(&q, (unsigned char)(penc & 0x7f), 0, &dummy))
+                        return 0;
+                }
+                else if (*a == 'S')
+                    return 0; /* signal frame */
+            }
+            q = augEnd;
+        }
+        else if (*aug)
+            return 0;
+
+        initial.cfaReg = eDwarfRsp;
+        initial.cfaOffset = 0;
+        initial.rbpRule = eRuleSame;
+        initial.rbpOffset = 0;
+        initial.raRule = eRuleSame;
+        initial.raOffset = 0;
+        if (!runCFI(q, cieEnd, codeAlign, dataAlign, 0, (uintptr_t)-1, &initial, NULL))
+            return 0;
+    }
+
+    /* FDE */
+    p += 4;
+    if (!readEncoded(&p, fdeEnc, 0, &pcBegin) || !readEncoded(&p, (unsigned char)(fdeEnc & 0x0f), 0, &pcRange))
+        return 0;
+    if (pc < pcBegin || pc >= pcBegin + pcRange)
+        return 0;
+    if (hasAugData)
+        p += readULEB(&p);
+
+    state = initial;
+    if (!runCFI(p, fdeEnd, codeAlign, dataAlign, pcBegin, pc, &state, &initial))
+        return 0;
+    if ((state.cfaReg != eDwarfRsp && state.cfaReg != eDwarfRbp) || state.raRule != eRuleOffset)
+        return 0;
+
+    pRules->cfaReg = state.cfaReg;
+    pRules->cfaOffset = (int32_t)state.cfaOffset;
+    pRules->rbpRule = state.rbpRule;
+    pRules->rbpOffset = (int32_t)state.rbpOffset;
+    pRules->raOffset = (int32_t)state.raOffset;
+    return 1;
+}
+
+/* cache of computed rules, entries are validated by reading the key
+ * before and after the value. Racing writers only cause misses. */
+#define PCHECKER_UNWIND_CACHE 1024
+
+struct unwind_cache_entry {
+    VAR_ATOMIC(uintptr_t) pc;
+    struct frame_rules rules;
+};
+
+static struct unwind_cache_entry s_UnwindCache[PCHECKER_UNWIND_CACHE];
+
+static FUN_INLINE int getRules(uintptr_t pc, struct frame_rules *pRules)
+{
+    struct unwind_cache_entry *pEntry = &s_UnwindCache[(pc ^ (pc >> 10)) & (PCHECKER_UNWIND_CACHE - 1)];
+    const struct unwind_module *pMod;
+    const unsigned char *pFDE;
+
+    if (VAR_ATOMIC_LOAD(pEntry->pc) == pc) {
+        *pRules = pEntry->rules;
+        MEM_BARRIER();
+        if (VAR_ATOMIC_LOAD(pEntry->pc) == pc)
+            return 1;
+    }
+
+    pMod = findModule(pc);
+    if (!pMod || !pMod->pEhFrameHdr)
+        return 0;
+    pFDE = findFDE(pMod->pEhFrameHdr, pc);
+    if (!pFDE || !computeRules(pFDE, pc, pRules))
+        return 0;
+
+    VAR_ATOMIC_STORE(pEntry->pc, (uintptr_t)0);
+    pEntry->rules = *pRules;
+    VAR_ATOMIC_STORE(pEntry->pc, pc);
+    return 1;
+}
+
+/* step one frame with the CFI, falls back to the frame pointer
+ * for code without unwind information */
+static FUN_INLINE int stepEhFrame(const struct unwind_stack *pStack, uintptr_t *pPc, uintptr_t *pSp, uintptr_t *pFp)
+{
+    struct frame_rules rules;
+    uintptr_t cfa, ra;
+
+    /* pc is a return address, look up the call instruction */
+    if (!getRules(*pPc - 1, &rules)) {
+        if (!validStackSlot(pStack, *pFp) || !validStackSlot(pStack, *pFp + sizeof(uintptr_t)) || *pFp < *pSp)
+            return 0;
+        ra = ((const uintptr_t *)*pFp)[1];
+        *pSp = *pFp + 2 * sizeof(uintptr_t);
+        *pFp = ((const uintptr_t *)*pFp)[0];
+        *pPc = ra;
+        return 1;
+    }
+
+    cfa = (rules.cfaReg == eDwarfRsp ? *pSp : *pFp) + (intptr_t)rules.cfaOffset;
+    if (!validStackSlot(pStack, cfa + (intptr_t)rules.raOffset) || cfa <= *pSp)
+        return 0;
+    ra = *(const uintptr_t *)(cfa + (intptr_t)rules.raOffset);
+    if (rules.rbpRule == eRuleOffset) {
+        if (!validStackSlot(pStack, cfa + (intptr_t)rules.rbpOffset))
+            return 0;
+        *pFp = *(const uintptr_t *)(cfa + (intptr_t)rules.rbpOffset);
+    }
+    *pSp = cfa;
+    *pPc = ra;
+    return 1;
+}
+
+#endif /* PCHECKER_UNWIND_EHFRAME */
+
+/*
+ * capture the stack of the interposed function, frames[0] is the callsite.
+ * The walk starts in this function and skips the frames of the checker,
+ * until it reaches the return address to the callsite. useEhFrame is
+ * ignored where the CFI is not supported.
+ * Returns the number of frames stored.
+ */
+#if __GNUC__
+__attribute__((__noinline__, __optimize__("no-omit-frame-pointer")))
+#endif
+static unsigned captureStack(uintptr_t *frames, unsigned max, const void *callsite, int useEhFrame)
+{
+    uintptr_t fp = (uintptr_t)__builtin_frame_address(0);
+    uintptr_t target = (uintptr_t)callsite;
+    const struct unwind_stack *pStack;
+    unsigned n = 0, skip = 0;
+    int found = 0;
+
+    if (!max)
+        return 0;
+    frames[n++] = target;
+    if (max == 1 || !s_Unwind.moduleCount)
+        return n;
+
+    pStack = getThreadStack(fp);
+
+#if PCHECKER_UNWIND_EHFRAME
+    if (useEhFrame) {
+        /* this function has a frame pointer, so the state of the caller
+         * is known: cfa = fp + 16 */
+        uintptr_t pc = ((const uintptr_t *)fp)[1];
+        uintptr_t sp = fp + 2 * sizeof(uintptr_t);
+        uintptr_t rbp = ((const uintptr_t *)fp)[0];
+
+        while (n < max) {
+            if (!stepEhFrame(pStack, &pc, &sp, &rbp) || !findModule(pc))
+                break;
+            if (found)
+                frames[n++] = pc;
+            else if (pc == target)
+                found = 1;
+            else if (++skip > PCHECKER_UNWIND_SKIP)
+                break;
+        }
+        return n;
+    }
+#endif
+
+    while (n < max) {
+        uintptr_t next, ra;
+
+        if (!validStackSlot(pStack, fp) || !validStackSlot(pStack, fp + sizeof(uintptr_t)))
+            break;
+        next = ((const uintptr_t *)fp)[0];
+        ra = ((const uintptr_t *)fp)[1];
+        if (!findModule(ra))
+            break;
+
+        if (found)
+            frames[n++] = ra;
+        else if (ra == target)
+            found = 1;
+        else if (++skip > PCHECKER_UNWIND_SKIP)
+            break;
+
+        /* frames grow down, the chain has to go up */
+        if (next <= fp)
+            break;
+        fp = next;
+    }
+    (void)useEhFrame;
+    return n;
+}
+
+/*
+ * the first frame from the callsite up that is in none of the objects
+ * containing pcs[0..count-1] (NULL entries are ignored), for calls that
+ * reach the checker through a runtime library. Returns the callsite if
+ * no such frame is found within PCHECKER_STACK_MAX.
+ */
+static FUN_INLINE const void *unwindFirstOutside(const void *callsite, const void *const *pcs, unsigned count)
+{
+    uintptr_t frames[PCHECKER_STACK_MAX];
+    unsigned i, k, n;
+
+    if (!s_Unwind.moduleCount)
+        return callsite;
+    n = captureStack(frames, PCHECKER_STACK_MAX, callsite, 1);
+    for (i = 0; i < n; ++i) {
+        const struct unwind_module *pMod = findModule(frames[i]);
+
+        for (k = 0; k < count; ++k) {
+            if (pcs[k] && pMod && pMod == findModule((uintptr_t)pcs[k]))
+                break;
+        }
+        if (k == count)
+            return (const void *)frames[i];
+    }
+    return callsite;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,493 @@
+/*
+ * helpers shared by the checkers that need more than forwarding calls:
+ * raw system calls, timestamps, configuration from the environment and
+ * allocation-free formatting of reports.
+ *
+ * Everything here avoids the C library functions that a checker might
+ * interpose itself (open, read, mmap, clock_gettime, ...), so it is safe
+ * to use from within any interposed function. Include after pchecker.h.
+ */
+
+#ifndef PCHECKER_UTIL_H
+#define PCHECKER_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <link.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* minimal versions of the constants, to avoid pulling in more headers
+ * that declare functions some checker might interpose */
+enum {
+    PCHECKER_PROT_READ = 1,
+    PCHECKER_PROT_WRITE = 2,
+    PCHECKER_MAP_SHARED = 1,
+    PCHECKER_MAP_PRIVATE = 2,
+    PCHECKER_MAP_ANONYMOUS = 0x20,
+    PCHECKER_CLOCK_MONOTONIC = 1,
+    PCHECKER_LOCK_SH = 1
+};
+
+#define PCHECKER_MAP_FAILED ((void *)-1)
+
+struct pchecker_timespec {
+    long tv_sec;
+    long tv_nsec;
+};
+
+/* raw system calls */
+
+static FUN_INLINE int sysOpen(const char *path, int flags, int mode)
+{
+    return (int)syscall(SYS_openat, AT_FDCWD, path, flags, mode);
+}
+
+static FUN_INLINE int sysClose(int fd)
+{
+    return (int)syscall(SYS_close, fd);
+}
+
+static FUN_INLINE long sysRead(int fd, void *buf, size_t len)
+{
+    return syscall(SYS_read, fd, buf, len);
+}
+
+static FUN_INLINE long sysWrite(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    size_t done = 0;
+
+    while (done < len) {
+        long r = syscall(SYS_write, fd, p + done, len - done);
+        if (r <= 0)
+            return done ? (long)done : r;
+        done += (size_t)r;
+    }
+    return (long)done;
+}
+
+static FUN_INLINE int sysFtruncate(int fd, long size)
+{
+    return (int)syscall(SYS_ftruncate, fd, size);
+}
+
+static FUN_INLINE void *sysMmap(void *addr, size_t len, int prot, int flags, int fd, long off)
+{
+#ifdef SYS_mmap2
+    return (void *)syscall(SYS_mmap2, addr, len, prot, flags, fd, off >> 12);
+#else
+    return (void *)syscall(SYS_mmap, addr, len, prot, flags, fd, off);
+#endif
+}
+
+static FUN_INLINE int sysMunmap(void *addr, size_t len)
+{
+    return (int)syscall(SYS_munmap, addr, len);
+}
+
+static FUN_INLINE int sysGetPid()
+{
+    return (int)syscall(SYS_getpid);
+}
+
+static FUN_INLINE uint64_t sysMonotonicNs()
+{
+    struct pchecker_timespec ts;
+
+    if (syscall(SYS_clock_gettime, PCHECKER_CLOCK_MONOTONIC, &ts) != 0)
+        return 0;
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* the thread id, cached as the syscall is not cheap */
+static VAR_TLS int s_CachedTid;
+
+static FUN_INLINE int pcheckerGetTid()
+{
+    int tid = s_CachedTid;
+    if (unlikely(!tid)) {
+        tid = (int)syscall(SYS_gettid);
+        s_CachedTid = tid;
+    }
+    return tid;
+}
+
+/* the forking thread is the only one in the child, call from a fork handler */
+static FUN_INLINE void pcheckerResetTid()
+{
+    s_CachedTid = 0;
+}
+
+/* a cheap, monotonic timestamp, in ticks of an unspecified frequency */
+static FUN_INLINE uint64_t pcheckerTicks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    return sysMonotonicNs();
+#endif
+}
+
+/* relation between ticks and nanoseconds, measured once (takes 2 ms) */
+static FUN_INLINE uint64_t pcheckerTicksPerSec()
+{
+    static uint64_t s_TicksPerSec;
+    uint64_t t0, n0, t1, n1;
+
+    if (s_TicksPerSec)
+        return s_TicksPerSec;
+
+    t0 = pcheckerTicks();
+    n0 = sysMonotonicNs();
+    do {
+        t1 = pcheckerTicks();
+        n1 = sysMonotonicNs();
+    } while (n1 - n0 < 2000000u);
+
+    s_TicksPerSec = (uint64_t)((double)(t1 - t0) * 1e9 / (double)(n1 - n0));
+    if (!s_TicksPerSec)
+        s_TicksPerSec = 1;
+    return s_TicksPerSec;
+}
+
+static FUN_INLINE uint64_t pcheckerTicksToNs(uint64_t ticks)
+{
+    return (uint64_t)((double)ticks * 1e9 / (double)pcheckerTicksPerSec());
+}
+
+/* configuration */
+
+static FUN_INLINE const char *pcheckerEnv(const char *name)
+{
+    const char *v = getenv(name);
+    return (v && *v) ? v : NULL;
+}
+
+/* parse a decimal or 0x-hex number with an optional k/M/G suffix,
+ * returns the number of characters consumed */
+static FUN_INLINE unsigned pcheckerParseUnsigned(const char *s, uint64_t *pValue)
+{
+    const char *p = s;
+    uint64_t v = 0;
+    unsigned base = 10;
+
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        p += 2;
+    }
+    for (;; ++p) {
+        unsigned d;
+        if (*p >= '0' && *p <= '9')
+            d = (unsigned)(*p - '0');
+        else if (base == 16 && *p >= 'a' && *p <= 'f')
+            d = (unsigned)(*p - 'a' + 10);
+        else if (base == 16 && *p >= 'A' && *p <= 'F')
+            d = (unsigned)(*p - 'A' + 10);
+        else
+            break;
+        v = v * base + d;
+    }
+    if (p == s)
+        return 0;
+    switch (*p) {
+    case 'k':
+    case 'K':
+        v <<= 10;
+        ++p;
+        break;
+    case 'M':
+        v <<= 20;
+        ++p;
+        break;
+    case 'G':
+        v <<= 30;
+        ++p;
+        break;
+    default:
+        break;
+    }
+    *pValue = v;
+    return (unsigned)(p - s);
+}
+
+static FUN_INLINE uint64_t pcheckerEnvUnsigned(const char *name, uint64_t def)
+{
+    const char *v = pcheckerEnv(name);
+    uint64_t r;
+
+    if (v && pcheckerParseUnsigned(v, &r))
+        return r;
+    return def;
+}
+
+static FUN_INLINE unsigned pcheckerStrLen(const char *s)
+{
+    const char *p = s;
+    while (*p)
+        ++p;
+    return (unsigned)(p - s);
+}
+
+static FUN_INLINE int pcheckerStrEq(const char *a, const char *b)
+{
+    while (*a && *a == *b) {
+        ++a;
+        ++b;
+    }
+    return *a == *b;
+}
+
+/* size of the string list s_FunctionNames, including the final '\0' */
+static FUN_INLINE unsigned pcheckerNamesSize(const char *names)
+{
+    const char *p = names;
+    while (*p) {
+        while (*p++ != '\0')
+            ;
+    }
+    return (unsigned)(p - names) + 1;
+}
+
+static FUN_INLINE const char *pcheckerNameAt(const char *names, unsigned index)
+{
+    const char *p = names;
+    for (; *p != '\0' && index; --index) {
+        while (*p++ != '\0')
+            ;
+    }
+    return *p ? p : "?";
+}
+
+/* the definition of a function in the C library itself.
+ * dlsym(RTLD_NEXT) would find other checkers preloaded after this one,
+ * use this for functions a checker needs internally, not as delegate.
+ * Falls back to RTLD_NEXT if the symbol is not in the C library. */
+static FUN_INLINE void *pcheckerLibcSymbol(const char *name)
+{
+    long (*pfInLibc)(long, ...) = &syscall;
+    void *addr, *handle, *pf = NULL;
+    Dl_info info;
+
+    FUN_MEMCPY(&addr, &pfInLibc, sizeof(addr));
+    if (dladdr(addr, &info) && info.dli_fname) {
+        handle = dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD);
+        if (handle) {
+            pf = dlsym(handle, name);
+            dlclose(handle);
+        }
+    }
+    return pf ? pf : dlsym(RTLD_NEXT, name);
+}
+
+/* call pfLine for each line of a file, until it returns non-zero.
+ * Lines are limited to 1023 characters, longer ones are skipped.
+ * Returns the last result of pfLine, or -1 if the file cannot be read */
+static FUN_INLINE int pcheckerForEachLine(const char *path, int (*pfLine)(char *line, void *pCtx), void *pCtx)
+{
+    char buf[1024];
+    unsigned used = 0;
+    int result = 0, skip = 0;
+    int fd = sysOpen(path, O_RDONLY | O_CLOEXEC, 0);
+
+    if (fd < 0)
+        return -1;
+
+    while (!result) {
+        long r = sysRead(fd, buf + used, sizeof(buf) - 1 - used);
+        unsigned start = 0, i;
+
+        if (r <= 0) {
+            /* last line without newline */
+            if (used && !skip) {
+                buf[used] = '\0';
+                result = (*pfLine)(buf, pCtx);
+            }
+            break;
+        }
+        used += (unsigned)r;
+
+        for (i = 0; i < used && !result; ++i) {
+            if (buf[i] != '\n')
+                continue;
+            buf[i] = '\0';
+            if (!skip)
+                result = (*pfLine)(buf + start, pCtx);
+            skip = 0;
+            start = i + 1;
+        }
+        if (start < used) {
+            unsigned k;
+            for (k = 0; start + k < used; ++k)
+                buf[k] = buf[start + k];
+            used = k;
+            if (used == sizeof(buf) - 1) {
+                /* overlong line */
+                skip = 1;
+                used = 0;
+            }
+        }
+        else
+            used = 0;
+    }
+    sysClose(fd);
+    return result;
+}
+
+/* allocation-free report output, used on exit and from helper threads */
+
+struct pchecker_out {
+    int fd;
+    unsigned len;
+    char buf[512];
+};
+
+static FUN_INLINE void outInit(struct pchecker_out *o, int fd)
+{
+    o->fd = fd;
+    o->len = 0;
+}
+
+static FUN_INLINE void outFlush(struct pchecker_out *o)
+{
+    if (o->len)
+        sysWrite(o->fd, o->buf, o->len);
+    o->len = 0;
+}
+
+static FUN_INLINE void outChar(struct pchecker_out *o, char c)
+{
+    if (o->len == sizeof(o->buf))
+        outFlush(o);
+    o->buf[o->len++] = c;
+}
+
+static FUN_INLINE void outStr(struct pchecker_out *o, const char *s)
+{
+    while (*s)
+        outChar(o, *s++);
+}
+
+static FUN_INLINE void outPad(struct pchecker_out *o, unsigned used, unsigned width)
+{
+    for (; used < width; ++used)
+        outChar(o, ' ');
+}
+
+/* string, left aligned in a column */
+static FUN_INLINE void outStrCol(struct pchecker_out *o, const char *s, unsigned width)
+{
+    unsigned l = pcheckerStrLen(s);
+    outStr(o, s);
+    outPad(o, l, width);
+}
+
+/* unsigned decimal, right aligned in a column */
+static FUN_INLINE void outUDec(struct pchecker_out *o, uint64_t v, unsigned width)
+{
+    char tmp[24];
+    unsigned n = 0;
+
+    do {
+        tmp[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    outPad(o, n, width);
+    while (n)
+        outChar(o, tmp[--n]);
+}
+
+static FUN_INLINE void outSDec(struct pchecker_out *o, int64_t v, unsigned width)
+{
+    if (v < 0) {
+        outPad(o, 1, width);
+        outChar(o, '-');
+        outUDec(o, (uint64_t)-v, 0);
+    }
+    else
+        outUDec(o, (uint64_t)v, width);
+}
+
+static FUN_INLINE void outHex(struct pchecker_out *o, uint64_t v)
+{
+    char tmp[16];
+    unsigned n = 0;
+
+    do {
+        tmp[n++] = "0123456789abcdef"[v & 15];
+        v >>= 4;
+    } while (v);
+    outStr(o, "0x");
+    while (n)
+        outChar(o, tmp[--n]);
+}
+
+static FUN_INLINE void outPtr(struct pchecker_out *o, const void *p)
+{
+    outHex(o, (uint64_t)(uintptr_t)p);
+}
+
+/* symbolic name of a code address, using the dynamic symbol tables.
+ * Offsets into a module are relative to its load bias, like the
+ * suppression entries and pchecker_analyze.
+ * this takes the loader lock, only use it on error paths. */
+static FUN_INLINE void outSymbol(struct pchecker_out *o, const void *addr)
+{
+    Dl_info info;
+    const char *module;
+    const char *base;
+
+#ifdef __GLIBC__
+    struct link_map *pMap = NULL;
+    if (!addr || !dladdr1(addr, &info, (void **)&pMap, RTLD_DL_LINKMAP)) {
+        outPtr(o, addr);
+        return;
+    }
+    base = pMap ? (const char *)pMap->l_addr : (const char *)info.dli_fbase;
+#else
+    if (!addr || !dladdr(addr, &info)) {
+        outPtr(o, addr);
+        return;
+    }
+    base = (const char *)info.dli_fbase;
+#endif
+
+    module = info.dli_fname ? info.dli_fname : "";
+    {
+        const char *p;
+        for (p = module; *p; ++p) {
+            if (*p == '/')
+                module = p + 1;
+        }
+    }
+
+    if (info.dli_sname) {
+        outStr(o, info.dli_sname);
+        outChar(o, '+');
+        outHex(o, (uint64_t)((const char *)addr - (const char *)info.dli_saddr));
+        outStr(o, " (");
+        outStr(o, module);
+        outChar(o, ')');
+    }
+    else {
+        outStr(o, module);
+        outChar(o, '+');
+        outHex(o, (uint64_t)((const char *)addr - base));
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
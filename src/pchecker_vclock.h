@@ -0,0 +1,108 @@
+/*
+ * layout of the virtual clock page, shared between the gettime checker
+ * and the control tool pchecker_vclock.
+ *
+ * The virtual monotonic time is
+ *
+ *     anchorVirtual + (CLOCK_MONOTONIC - anchorReal) * rate
+ *
+ * and every other virtualized clock keeps the distance to CLOCK_MONOTONIC
+ * it had when the page was created. Changing the rate re-anchors at the
+ * current virtual time and offsets only move forward, so the clocks stay
+ * monotonic. Updates are published with a sequence counter.
+ *
+ * Readers do not wait for an update in progress, a writer might have been
+ * preempted or killed in the middle. They go on with the parameters they
+ * loaded before.
+ * Processes using the page hold a shared flock on it, pchecker_vclock
+ * refuses to initialise a page that is locked.
+ */
+
+#ifndef PCHECKER_VCLOCK_H
+#define PCHECKER_VCLOCK_H
+
+#include <stdint.h>
+
+#define PCHECKER_VCLOCK_MAGIC "PCHKVCL1"
+#define PCHECKER_VCLOCK_VERSION 1
+
+/* clock ids 0..PCHECKER_VCLOCK_CLOCKS-1 can be virtualized */
+#define PCHECKER_VCLOCK_CLOCKS 12
+
+/* the rate is a fixed point number with 32 fractional bits */
+#define PCHECKER_VCLOCK_RATE_ONE ((uint64_t)1 << 32)
+
+struct pchecker_vclock_page {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;
+
+    uint32_t seq; /* odd while an update is in progress */
+    uint32_t clockMask; /* bit n set: clock id n is virtualized */
+
+    uint64_t anchorReal; /* CLOCK_MONOTONIC in ns */
+    uint64_t anchorVirtual;
+    uint64_t rate;
+
+    /* distance of each clock to CLOCK_MONOTONIC in ns */
+    int64_t clockOffset[PCHECKER_VCLOCK_CLOCKS];
+};
+
+struct pchecker_vclock_params {
+    uint64_t anchorReal;
+    uint64_t anchorVirtual;
+    uint64_t rate;
+};
+
+/* d * rate >> 32 without 128 bit arithmetic,
+ * exact for d below 2^54 ns (208 days) and rates below 1024 */
+static __inline__ uint64_t vclockScale(uint64_t d, uint64_t rate)
+{
+    uint64_t dHi = d >> 32, dLo = d & 0xffffffffu;
+    uint64_t rHi = rate >> 32, rLo = rate & 0xffffffffu;
+
+    return dHi * rate + dLo * rHi + ((dLo * rLo) >> 32);
+}
+
+static __inline__ uint64_t vclockVirtual(const struct pchecker_vclock_params *pParams, uint64_t realNs)
+{
+    uint64_t d = realNs > pParams->anchorReal ? realNs - pParams->anchorReal : 0;
+    return pParams->anchorVirtual + vclockScale(d, pParams->rate);
+}
+
+/* consistent copy of the parameters, returns 0 if there was none after a
+ * few tries or an update is in progress (the copy might be torn then) */
+static __inline__ int vclockLoad(const struct pchecker_vclock_page *pPage, struct pchecker_vclock_params *pParams)
+{
+    uint32_t seq;
+    unsigned tries;
+
+    for (tries = 0; tries < 4; ++tries) {
+        seq = __atomic_load_n(&pPage->seq, __ATOMIC_ACQUIRE);
+        pParams->anchorReal = __atomic_load_n(&pPage->anchorReal, __ATOMIC_RELAXED);
+        pParams->anchorVirtual = __atomic_load_n(&pPage->anchorVirtual, __ATOMIC_RELAXED);
+        pParams->rate = __atomic_load_n(&pPage->rate, __ATOMIC_RELAXED);
+        if (seq & 1)
+            return 0;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&pPage->seq, __ATOMIC_RELAXED) == seq)
+            return 1;
+    }
+    return 0;
+}
+
+/* only one writer (the control tool) is expected,
+ * an odd counter left by a killed writer is rounded up */
+static __inline__ void vclockStore(struct pchecker_vclock_page *pPage, const struct pchecker_vclock_params *pParams)
+{
+    uint32_t seq = (__atomic_load_n(&pPage->seq, __ATOMIC_RELAXED) + 1) & ~1u;
+
+    __atomic_store_n(&pPage->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&pPage->anchorReal, pParams->anchorReal, __ATOMIC_RELAXED);
+    __atomic_store_n(&pPage->anchorVirtual, pParams->anchorVirtual, __ATOMIC_RELAXED);
+    __atomic_store_n(&pPage->rate, pParams->rate, __ATOMIC_RELAXED);
+    __atomic_store_n(&pPage->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+#endif
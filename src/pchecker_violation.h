@@ -0,0 +1,350 @@
+/*
+ * the violation path: what happens when an interposed function is
+ * called and the checks are active.
+ *
+ * Known-benign callsites can be listed in a file named by PCHECKER_SUPPRESS,
+ * one per line:
+ *
+ *     # comment
+ *     symbol_name
+ *     libvendor.so+0x1a40-0x1b00
+ *     myprogram+0x4711
+ *
+ * Symbols are looked up with dlsym, ranges are relative to the load address
+ * of the object (as printed by pchecker_analyze). All entries are resolved
+ * in the constructor into a sorted array of address ranges, so the check on
+ * each call is a binary search. With PCHECKER_STACK_DEPTH > 1 every captured
+ * frame is compared, not only the callsite.
+ *
+ * Objects loaded after the constructor ran cannot be suppressed.
+ *
+ * Calls inside sections marked with pchecker_rt_enter() are reported on
+ * stderr in addition to the assert hook, PCHECKER_RT_ABORT=1 traps after
+ * the report.
+ *
+ * If there is no assert hook, calls from threads with a realtime scheduling
+ * policy are reported the same way (see pchecker_sched.h),
+ * PCHECKER_RT_POLICY=0 disables this.
+ *
+ * Functions disabled through the control socket (see pchecker_control.h)
+ * are not checked at all, neither reported nor passed to the assert hook.
+ */
+
+#ifndef PCHECKER_VIOLATION_H
+#define PCHECKER_VIOLATION_H
+
+#include "pchecker_util.h"
+#include "pchecker_unwind.h"
+#include "pchecker_sched.h"
+#include "pchecker_control.h"
+#include <link.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PCHECKER_SUPPRESS_MAX
+#define PCHECKER_SUPPRESS_MAX 1024
+#endif
+
+struct suppress_range {
+    uintptr_t lo;
+    uintptr_t hi;
+};
+
+static struct suppress_table {
+    unsigned count; /* published once the table is sorted */
+    unsigned pending;
+    struct suppress_range ranges[PCHECKER_SUPPRESS_MAX];
+} s_Suppressions;
+
+static struct violation_state {
+    int abortInSection;
+    int checkPolicy;
+} s_Violation;
+
+/* lookup of a module by name, for the "module+offset" entries */
+struct module_search {
+    const char *name;
+    unsigned nameLen;
+    const char *exeName;
+    uintptr_t base;
+    int found;
+};
+
+static FUN_INLINE const char *baseName(const char *path)
+{
+    const char *p, *base = path;
+    for (p = path; *p; ++p) {
+        if (*p == '/')
+            base = p + 1;
+    }
+    return base;
+}
+
+static FUN_INLINE int matchName(const char *full, const char *name, unsigned len)
+{
+    const char *candidates[2];
+    unsigned i;
+
+    candidates[0] = full;
+    candidates[1] = baseName(full);
+    for (i = 0; i < 2; ++i) {
+        const char *c = candidates[i];
+        unsigned k = 0;
+        while (k < len && c[k] == name[k])
+            ++k;
+        if (k == len && c[k] == '\0')
+            return 1;
+    }
+    return 0;
+}
+
+static FUN_INLINE int findModuleBase(struct dl_phdr_info *pInfo, size_t size, void *pData)
+{
+    struct module_search *pSearch = (struct module_search *)pData;
+    const char *name = pInfo->dlpi_name;
+
+    (void)size;
+    /* the main program has no name */
+    if (!name || !*name)
+        name = pSearch->exeName;
+    if (name && matchName(name, pSearch->name, pSearch->nameLen)) {
+        pSearch->base = pInfo->dlpi_addr;
+        pSearch->found = 1;
+        return 1;
+    }
+    return 0;
+}
+
+static FUN_INLINE void suppressAdd(uintptr_t lo, uintptr_t hi)
+{
+    if (s_Suppressions.pending < PCHECKER_SUPPRESS_MAX && lo < hi) {
+        s_Suppressions.ranges[s_Suppressions.pending].lo = lo;
+        s_Suppressions.ranges[s_Suppressions.pending].hi = hi;
+        ++s_Suppressions.pending;
+    }
+}
+
+static FUN_INLINE void suppressWarn(const char *what, const char *entry)
+{
+    struct pchecker_out o;
+    outInit(&o, 2);
+    outStr(&o, "pchecker(" PCHECKER_NAME "): ");
+    outStr(&o, what);
+    outStr(&o, " '");
+    outStr(&o, entry);
+    outStr(&o, "'\n");
+    outFlush(&o);
+}
+
+static FUN_INLINE int parseSuppression(char *line, void *pCtx)
+{
+    const char *exeName = (const char *)pCtx;
+    char *p, *end, *plus = NULL;
+
+    /* trim */
+    while (*line == ' ' || *line == '\t')
+        ++line;
+    for (end = line; *end && *end != '#'; ++end)
+        ;
+    while (end > line && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+        --end;
+    *end = '\0';
+    if (!*line)
+        return 0;
+
+    for (p = line; *p; ++p) {
+        if (*p == '+')
+            plus = p;
+    }
+
+    if (plus) {
+        struct module_search search;
+        uint64_t lo, hi;
+        unsigned n;
+
+        search.name = line;
+        search.nameLen = (unsigned)(plus - line);
+        search.exeName = exeName;
+        search.base = 0;
+        search.found = 0;
+
+        n = pcheckerParseUnsigned(plus + 1, &lo);
+        if (!n) {
+            suppressWarn("invalid suppression", line);
+            return 0;
+        }
+        hi = lo + 1;
+        if (plus[1 + n] == '-' && !pcheckerParseUnsigned(plus + 2 + n, &hi)) {
+            suppressWarn("invalid suppression", line);
+            return 0;
+        }
+
+        dl_iterate_phdr(&findModuleBase, &search);
+        if (!search.found) {
+            suppressWarn("module not loaded for suppression", line);
+            return 0;
+        }
+        suppressAdd(search.base + (uintptr_t)lo, search.base + (uintptr_t)hi);
+    }
+    else {
+        void *addr = dlsym(RTLD_DEFAULT, line);
+        uintptr_t size = 0;
+
+        if (!addr) {
+            suppressWarn("symbol not found for suppression", line);
+            return 0;
+        }
+#ifdef __GLIBC__
+        {
+            Dl_info info;
+            const ElfW(Sym) *pSym = NULL;
+            if (dladdr1(addr, &info, (void **)&pSym, RTLD_DL_SYMENT) && pSym)
+                size = (uintptr_t)pSym->st_size;
+        }
+#endif
+        if (!size) {
+            suppressWarn("size unknown, use module+range instead of", line);
+            size = 1;
+        }
+        suppressAdd((uintptr_t)addr, (uintptr_t)addr + size);
+    }
+    return 0;
+}
+
+/* read the suppression file */
+static FUN_INLINE void suppressInit()
+{
+    const char *path = pcheckerEnv("PCHECKER_SUPPRESS");
+    char exeName[512];
+    unsigned i, n;
+    long len;
+
+    if (!path || s_Suppressions.pending)
+        return;
+
+    len = syscall(SYS_readlinkat, AT_FDCWD, "/proc/self/exe", exeName, sizeof(exeName) - 1);
+    exeName[len > 0 ? len : 0] = '\0';
+
+    if (pcheckerForEachLine(path, &parseSuppression, exeName) < 0) {
+        suppressWarn("cannot read suppression file", path);
+        return;
+    }
+
+    /* sort and merge overlapping ranges */
+    for (i = 1; i < s_Suppressions.pending; ++i) {
+        struct suppress_range r = s_Suppressions.ranges[i];
+        unsigned k = i;
+        while (k && s_Suppressions.ranges[k - 1].lo > r.lo) {
+            s_Suppressions.ranges[k] = s_Suppressions.ranges[k - 1];
+            --k;
+        }
+        s_Suppressions.ranges[k] = r;
+    }
+    for (i = 1, n = s_Suppressions.pending ? 1 : 0; i < s_Suppressions.pending; ++i) {
+        struct suppress_range *pLast = &s_Suppressions.ranges[n - 1];
+        if (s_Suppressions.ranges[i].lo <= pLast->hi) {
+            if (s_Suppressions.ranges[i].hi > pLast->hi)
+                pLast->hi = s_Suppressions.ranges[i].hi;
+        }
+        else
+            s_Suppressions.ranges[n++] = s_Suppressions.ranges[i];
+    }
+    MEM_BARRIER();
+    s_Suppressions.count = n;
+}
+
+static FUN_INLINE int isSuppressedAddr(uintptr_t addr)
+{
+    unsigned lo = 0, hi = s_Suppressions.count;
+
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (addr < s_Suppressions.ranges[mid].lo)
+            hi = mid;
+        else if (addr >= s_Suppressions.ranges[mid].hi)
+            lo = mid + 1;
+        else
+            return 1;
+    }
+    return 0;
+}
+
+static FUN_INLINE int isSuppressed(const void *callsite)
+{
+    uintptr_t frames[PCHECKER_STACK_MAX];
+    unsigned i, n = 1;
+
+    frames[0] = (uintptr_t)callsite;
+    if (s_Unwind.depth > 1)
+        n = captureStack(frames, s_Unwind.depth, callsite, s_Unwind.useEhFrame);
+    for (i = 0; i < n; ++i) {
+        if (isSuppressedAddr(frames[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/* called from the constructor */
+static FUN_INLINE void violationInit()
+{
+    s_Violation.abortInSection = pcheckerEnvUnsigned("PCHECKER_RT_ABORT", 0) != 0;
+    /* no cobalt_assert_nrt, use the built-in provider */
+    if (!pchecker_assert_hook.found)
+        s_Violation.checkPolicy = pcheckerEnvUnsigned("PCHECKER_RT_POLICY", 1) != 0;
+    suppressInit();
+}
+
+static void reportViolation(const char *what, const void *callsite)
+{
+    struct pchecker_out o;
+
+    threadsViolation();
+    outInit(&o, 2);
+    outStr(&o, "pchecker(" PCHECKER_NAME "): call in ");
+    outStr(&o, what);
+    outStr(&o, " from ");
+    outSymbol(&o, callsite);
+    outChar(&o, '\n');
+    outFlush(&o);
+
+    if (s_Violation.abortInSection)
+        FUN_TRAP();
+}
+
+/* whether a call of function func counts as one from an RT thread or
+ * critical section, with the filters of checkCall: the policy only without
+ * assert hook and not with PCHECKER_RT_POLICY=0, not suppressed, not disabled on the
+ * control socket. For the checkers that log or redirect those calls. */
+static FUN_INLINE int isCheckedRt(unsigned func, const void *callsite)
+{
+    if (!pchecker_rt_depth && !(unlikely(s_Violation.checkPolicy) && isRtScheduled()))
+        return 0;
+    if (unlikely(s_Suppressions.count) && isSuppressed(callsite))
+        return 0;
+    return !controlIsUnchecked(func);
+}
+
+/* check an interposed call of function func, returns 0 if the callsite
+ * is suppressed or the function disabled and nothing was checked */
+static FUN_INLINE int checkCall(int check, unsigned func, const void *callsite)
+{
+    threadsCount(func);
+    if (unlikely(s_Suppressions.count) && isSuppressed(callsite))
+        return 0;
+    if (unlikely(controlIsUnchecked(func)))
+        return 0;
+
+    if (unlikely(callAssertFunction(check)))
+        reportViolation("critical section", callsite);
+    else if (unlikely(s_Violation.checkPolicy) && isRtScheduled())
+        reportViolation("RT thread", callsite);
+    return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
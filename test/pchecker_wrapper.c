@@ -1,5 +1,6 @@
 #include "pchecker_wrapper.h"
 #include <signal.h>
+#include <stdlib.h>
 
 #if __GNUC__ >= 4
 #define DSO_PUBLIC __attribute__((visibility("default")))
@@ -56,6 +57,16 @@ void *get_cobalt_assert_nrt_arg()
     return s_AssertArg;
 }
 
+static void *volatile s_LastMalloc;
+
+void *wrapper_malloc(size_t size)
+{
+    void *p = malloc(size);
+    /* no tail call, the callsite of malloc has to be in here */
+    s_LastMalloc = p;
+    return p;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,3 +1,5 @@
+#include <stddef.h>
+
 #if __GNUC__ >= 4
 #define DSO_PUBLIC __attribute__((visibility("default")))
 #else
@@ -15,6 +17,9 @@ DSO_PUBLIC pf_assert_callback_t set_cobalt_assert_nrt(pf_assert_callback_t pf);
 DSO_PUBLIC int enable_cobalt_assert_nrt_arg(int enable, int setArg, void *pArg);
 DSO_PUBLIC void *get_cobalt_assert_nrt_arg();
 
+/* calls malloc from a callsite in testpchecker.supp */
+DSO_PUBLIC void *wrapper_malloc(size_t size);
+
 #define enable_cobalt_assert_nrt(e) enable_cobalt_assert_nrt_arg(e, 0, NULL)
 
 #ifdef __cplusplus
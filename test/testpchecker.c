@@ -3,6 +3,8 @@
 #endif
 
 #include "pchecker_wrapper.h"
+#include "pchecker_rt.h"
+#include "pchecker_vclock.h"
 #include <stdlib.h>
 
 #include <stdio.h>
@@ -11,6 +13,15 @@
 
 #include <time.h>
 #include <sys/time.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <dlfcn.h>
 
 static void callback(void *p)
 {
@@ -39,10 +50,249 @@ static void callback(void *p)
 
 #pragma GCC diagnostic pop
 
+/* the checkers report calls in critical sections on stderr,
+ * count those reports by capturing it in a pipe */
+static int s_Pipe[2] = {-1, -1};
+static int s_Stderr = -1;
 
-int main()
+static void beginCapture(void)
+{
+    fflush(stderr);
+    if (pipe(s_Pipe) != 0)
+        return;
+    s_Stderr = dup(2);
+    dup2(s_Pipe[1], 2);
+    close(s_Pipe[1]);
+}
+
+static int endCapture(void)
+{
+    char buf[4096];
+    const char *p;
+    int reports = 0;
+    ssize_t n;
+
+    if (s_Stderr < 0)
+        return -1;
+    dup2(s_Stderr, 2);
+    close(s_Stderr);
+    s_Stderr = -1;
+    n = read(s_Pipe[0], buf, sizeof(buf) - 1);
+    close(s_Pipe[0]);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+    for (p = buf; (p = strstr(p, "pchecker(")) != NULL; ++p)
+        ++reports;
+    return reports;
+}
+
+/* CLOCK_MONOTONIC without the gettime checker */
+static uint64_t realNs(void)
+{
+    struct timespec ts;
+
+    syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t clockNs(clockid_t id)
+{
+    struct timespec ts;
+
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* readers on several threads, a time below one returned before
+ * on any thread is a fault */
+#define CLOCK_THREADS 4
+
+static struct clock_test {
+    clockid_t id;
+    uint64_t endNs;
+    /* if set, a time above anchorNs + (real - anchorNs) / 2 is a fault too */
+    uint64_t anchorNs;
+    uint64_t max;
+    int faults;
+} s_ClockTest;
+
+static void *clockReader(void *pArg)
+{
+    unsigned i = 0;
+
+    while ((++i & 1023) || realNs() < s_ClockTest.endNs) {
+        uint64_t before = __atomic_load_n(&s_ClockTest.max, __ATOMIC_ACQUIRE);
+        uint64_t v = clockNs(s_ClockTest.id);
+
+        if (v < before || (s_ClockTest.anchorNs && v > s_ClockTest.anchorNs + (realNs() - s_ClockTest.anchorNs) / 2))
+            __atomic_fetch_add(&s_ClockTest.faults, 1, __ATOMIC_RELAXED);
+        while (v > before && !__atomic_compare_exchange_n(&s_ClockTest.max, &before, v, 1, __ATOMIC_RELEASE,
+                                                          __ATOMIC_ACQUIRE))
+            ;
+    }
+    return pArg;
+}
+
+static unsigned clockStart(clockid_t id, unsigned ms, uint64_t anchorNs, pthread_t *pThreads)
+{
+    unsigned i, n = 0;
+
+    s_ClockTest.id = id;
+    s_ClockTest.endNs = realNs() + ms * 1000000ull;
+    s_ClockTest.anchorNs = anchorNs;
+    s_ClockTest.max = 0;
+    s_ClockTest.faults = 0;
+    for (i = 0; i < CLOCK_THREADS; ++i) {
+        if (pthread_create(&pThreads[n], NULL, &clockReader, NULL) == 0)
+            ++n;
+    }
+    return n;
+}
+
+static int clockJoin(pthread_t *pThreads, unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; ++i)
+        pthread_join(pThreads[i], NULL);
+    return s_ClockTest.faults;
+}
+
+static int clockMonotonic(clockid_t id, unsigned ms)
+{
+    pthread_t threads[CLOCK_THREADS];
+
+    return clockJoin(threads, clockStart(id, ms, 0, threads));
+}
+
+/* CLOCK_BOOTTIME runs at half the real rate on the page setEnvironment
+ * wrote. While the readers run, the rate drops to a quarter and the page
+ * is then left in an update for a while, as by a killed pchecker_vclock */
+static int clockVirtual(void)
+{
+    pthread_t threads[CLOCK_THREADS];
+    struct pchecker_vclock_page *pPage;
+    struct pchecker_vclock_params params;
+    struct timespec ts = {0, 50000000};
+    const char *path = getenv("PCHECKER_VCLOCK");
+    unsigned n;
+    int fd;
+
+    if (!path || (fd = open(path, O_RDWR | O_CLOEXEC)) < 0)
+        return 0;
+    pPage = (struct pchecker_vclock_page *)mmap(NULL, sizeof(*pPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (pPage == MAP_FAILED)
+        return 0;
+    /* not virtualized without the gettime checker */
+    if (!vclockLoad(pPage, &params) ||
+        clockNs(CLOCK_BOOTTIME) > params.anchorReal + (realNs() - params.anchorReal) / 2) {
+        munmap(pPage, sizeof(*pPage));
+        return 0;
+    }
+
+    n = clockStart(CLOCK_BOOTTIME, 250, params.anchorReal, threads);
+    nanosleep(&ts, NULL);
+    params.anchorVirtual = vclockVirtual(&params, realNs());
+    params.anchorReal = realNs();
+    params.rate = PCHECKER_VCLOCK_RATE_ONE / 4;
+    vclockStore(pPage, &params);
+    nanosleep(&ts, NULL);
+    __atomic_fetch_add(&pPage->seq, 1, __ATOMIC_RELEASE);
+    ts.tv_nsec = 60000000;
+    nanosleep(&ts, NULL);
+    vclockStore(pPage, &params);
+
+    munmap(pPage, sizeof(*pPage));
+    return clockJoin(threads, n);
+}
+
+/* send a command to the control sockets of the heap checkers,
+ * returns the number of them that replied "ok" */
+static int controlSend(const char *cmd)
+{
+    static const char *const s_Checkers[] = {"heap", "heap-glibc", "heap-musl"};
+    const char *prefix = getenv("PCHECKER_CONTROL");
+    unsigned i;
+    int ok = 0;
+
+    for (i = 0; prefix && i < sizeof(s_Checkers) / sizeof(s_Checkers[0]); ++i) {
+        struct sockaddr_un addr;
+        char reply[256];
+        size_t len = 0;
+        ssize_t n;
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (fd < 0)
+            continue;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s.%s.%d", prefix, s_Checkers[i], (int)getpid());
+        if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+            write(fd, cmd, strlen(cmd)) == (ssize_t)strlen(cmd)) {
+            shutdown(fd, SHUT_WR);
+            while (len < sizeof(reply) - 1 && (n = read(fd, reply + len, sizeof(reply) - 1 - len)) > 0)
+                len += (size_t)n;
+            reply[len] = '\0';
+            ok += strstr(reply, "ok\n") != NULL;
+        }
+        close(fd);
+    }
+    return ok;
+}
+
+/* the checkers read their settings in the constructors, restart with
+ * PCHECKER_SUPPRESS set to testpchecker.supp next to the executable,
+ * PCHECKER_CONTROL to testpchecker.ctl there, the TSC clock of the
+ * gettime checker re-synced often, a virtual CLOCK_BOOTTIME at half
+ * the real rate in testpchecker.vclock and frees in RT code deferred
+ * for longer than the tests run */
+static void setEnvironment(char **argv)
+{
+    struct pchecker_vclock_page page;
+    char path[1024];
+    ssize_t n;
+    int fd;
+
+    if (getenv("PCHECKER_SUPPRESS"))
+        return;
+    n = readlink("/proc/self/exe", path, sizeof(path) - sizeof("testpchecker.supp"));
+    if (n <= 0)
+        return;
+    while (n > 0 && path[n - 1] != '/')
+        --n;
+    strcpy(path + n, "testpchecker.supp");
+    setenv("PCHECKER_SUPPRESS", path, 1);
+    strcpy(path + n, "testpchecker.ctl");
+    setenv("PCHECKER_CONTROL", path, 1);
+    setenv("PCHECKER_GETTIME_TSC", "1", 1);
+    setenv("PCHECKER_GETTIME_TSC_SYNC", "10", 1);
+    setenv("PCHECKER_HEAP_DEFER", "60000", 1);
+    setenv("PCHECKER_HEAP_DEFER_REPORT", "/dev/null", 1);
+
+    memset(&page, 0, sizeof(page));
+    memcpy(page.magic, PCHECKER_VCLOCK_MAGIC, sizeof(page.magic));
+    page.version = PCHECKER_VCLOCK_VERSION;
+    page.size = sizeof(page);
+    page.clockMask = 1u << CLOCK_BOOTTIME;
+    page.anchorReal = page.anchorVirtual = realNs();
+    page.rate = PCHECKER_VCLOCK_RATE_ONE / 2;
+    strcpy(path + n, "testpchecker.vclock");
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        if (write(fd, &page, sizeof(page)) == (ssize_t)sizeof(page))
+            setenv("PCHECKER_VCLOCK", path, 1);
+        close(fd);
+    }
+    execv("/proc/self/exe", argv);
+}
+
+
+int main(int argc, char **argv)
 {
     static volatile uintptr_t s_Sink;
+    uint64_t (*pfDeferDepth)(void);
     int count = 0;
     void *pMem;
     void *pToFree;
@@ -52,6 +302,8 @@ int main()
     const unsigned alignment = 16;
     const unsigned size = 16;
 
+    (void)argc;
+    setEnvironment(argv);
     randomvar = 0;
 
     /* this initialises the streams subsystem,
@@ -113,11 +365,89 @@ int main()
 
         SIMPLE_TEST(time, NULL);
 
+        /* served from the TSC where it is usable, across many syncs */
+        printf("test " "monotonic" ": %d faults\n", clockMonotonic(CLOCK_MONOTONIC, 300));
+
+        /* never above the virtual rate, also while the page is inconsistent */
+        printf("test " "vclock" ": %d faults\n", clockVirtual());
+
 
 
         enable_cobalt_assert_nrt(0);
         s_Sink = randomvar;
     }
+
+    /* without the assert hook, calls in the section are reported on stderr */
+    printf("\ncritical section tests\n");
+    fflush(stdout);
+
+    printf("test " "pchecker_rt_enter" ": ");
+    beginCapture();
+    pcheckerRtEnter();
+    pToFree = malloc(size);
+    pcheckerRtLeave();
+    free(pToFree);
+    printf("%d faults\n", endCapture());
+
+    /* the call in the wrapper is listed in testpchecker.supp */
+    printf("test " "suppression" ": ");
+    beginCapture();
+    pcheckerRtEnter();
+    pToFree = malloc(size);
+    pMem = wrapper_malloc(size);
+    pcheckerRtLeave();
+    free(pToFree);
+    free(pMem);
+    printf("%d faults\n", endCapture());
+
+    /* malloc disabled on the control socket: neither the assert hook
+     * nor a report, without a heap checker nothing is disabled */
+    printf("test " "disable" ": ");
+    if (controlSend("disable malloc\n")) {
+        enable_cobalt_assert_nrt_arg(1, 1, &count);
+        count = 0;
+        pToFree = malloc(size);
+        enable_cobalt_assert_nrt(0);
+        beginCapture();
+        pcheckerRtEnter();
+        pMem = malloc(size);
+        pcheckerRtLeave();
+        count += endCapture();
+        controlSend("enable malloc\n");
+        free(pToFree);
+        free(pMem);
+    }
+    else
+        count = 0;
+    printf("%d faults\n", count);
+
+    /* a free in the section is deferred, one disabled on the control
+     * socket is not, without a heap checker nothing is deferred */
+    printf("test " "defer" ": ");
+    count = 0;
+    pfDeferDepth = (uint64_t(*)(void))(uintptr_t)dlsym(RTLD_DEFAULT, "pchecker_heap_defer_depth");
+    if (pfDeferDepth && controlSend("enable free\n")) {
+        uint64_t depth = (*pfDeferDepth)();
+
+        pToFree = malloc(size);
+        pMem = malloc(size);
+        beginCapture();
+        pcheckerRtEnter();
+        free(pToFree);
+        pcheckerRtLeave();
+        endCapture();
+        count += (*pfDeferDepth)() != depth + 1;
+        controlSend("disable free\n");
+        beginCapture();
+        pcheckerRtEnter();
+        free(pMem);
+        pcheckerRtLeave();
+        endCapture();
+        controlSend("enable free\n");
+        count += (*pfDeferDepth)() != depth + 1;
+    }
+    printf("%d faults\n", count);
+
     (void)s_Sink;
     return 0;
 }
@@ -0,0 +1,647 @@
+/*
+ * offline analyzer for the binary traces written by the checkers
+ * (see PCHECKER_TRACE).
+ *
+ * Addresses are symbolized against the copy of /proc/self/maps in the
+ * trace and the symbol tables of the mapped files, so the analysis can
+ * run after the process is gone, as long as the binaries are unchanged.
+ *
+ * usage: pchecker_analyze [-d] [-n count] tracefile...
+ *   -d        dump all records in order
+ *   -n count  number of callsites to list (default 20)
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "pchecker_traceformat.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if UINTPTR_MAX > 0xffffffffu
+typedef Elf64_Ehdr elf_ehdr_t;
+typedef Elf64_Phdr elf_phdr_t;
+typedef Elf64_Shdr elf_shdr_t;
+typedef Elf64_Sym elf_sym_t;
+#define ELF_ST_TYPE ELF64_ST_TYPE
+#else
+typedef Elf32_Ehdr elf_ehdr_t;
+typedef Elf32_Phdr elf_phdr_t;
+typedef Elf32_Shdr elf_shdr_t;
+typedef Elf32_Sym elf_sym_t;
+#define ELF_ST_TYPE ELF32_ST_TYPE
+#endif
+
+/* one line of /proc/self/maps */
+struct mapping {
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;
+    const char *path;
+    struct elf_file *pElf;
+};
+
+struct elf_file {
+    char *path;
+    const unsigned char *pData;
+    size_t size;
+    int failed;
+    struct elf_file *pNext;
+};
+
+/* record, independent of the frame count of the writer */
+struct record {
+    uint64_t ticks;
+    uint64_t args[3];
+    uint64_t result;
+    uint32_t tid;
+    unsigned func;
+    unsigned flags;
+    const uint64_t *frames;
+};
+
+struct trace {
+    const char *path;
+    const unsigned char *pData;
+    size_t size;
+    const struct pchecker_trace_header *pHeader;
+
+    const char **names;
+    unsigned nameCount;
+
+    struct mapping *maps;
+    unsigned mapCount;
+
+    uint64_t first;
+    uint64_t count;
+};
+
+static struct elf_file *s_ElfFiles;
+
+static double ticksToSec(const struct trace *t, uint64_t ticks)
+{
+    return (double)(ticks - t->pHeader->startTicks) / (double)t->pHeader->ticksPerSec;
+}
+
+/* ELF symbol lookup */
+
+static struct elf_file *openElf(const char *path)
+{
+    struct elf_file *pElf;
+    struct stat st;
+    int fd;
+
+    for (pElf = s_ElfFiles; pElf; pElf = pElf->pNext) {
+        if (strcmp(pElf->path, path) == 0)
+            return pElf->failed ? NULL : pElf;
+    }
+
+    pElf = (struct elf_file *)calloc(1, sizeof(*pElf));
+    if (!pElf)
+        return NULL;
+    pElf->path = strdup(path);
+    pElf->pNext = s_ElfFiles;
+    s_ElfFiles = pElf;
+    pElf->failed = 1;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(elf_ehdr_t)) {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            pElf->pData = (const unsigned char *)p;
+            pElf->size = (size_t)st.st_size;
+            if (memcmp(pElf->pData, ELFMAG, SELFMAG) == 0)
+                pElf->failed = 0;
+        }
+    }
+    close(fd);
+    return pElf->failed ? NULL : pElf;
+}
+
+/* translate a file offset to the virtual address used by the symbols */
+static int fileOffsetToVaddr(const struct elf_file *pElf, uint64_t off, uint64_t *pVaddr)
+{
+    const elf_ehdr_t *pEhdr = (const elf_ehdr_t *)pElf->pData;
+    unsigned i;
+
+    if (pEhdr->e_phoff + (uint64_t)pEhdr->e_phnum * sizeof(elf_phdr_t) > pElf->size)
+        return 0;
+    for (i = 0; i < pEhdr->e_phnum; ++i) {
+        const elf_phdr_t *pPhdr = (const elf_phdr_t *)(pElf->pData + pEhdr->e_phoff) + i;
+        if (pPhdr->p_type != PT_LOAD)
+            continue;
+        if (off >= pPhdr->p_offset && off < pPhdr->p_offset + pPhdr->p_filesz) {
+            *pVaddr = off - pPhdr->p_offset + pPhdr->p_vaddr;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const char *findSymbolIn(const struct elf_file *pElf, unsigned type, uint64_t vaddr, uint64_t *pOffset)
+{
+    const elf_ehdr_t *pEhdr = (const elf_ehdr_t *)pElf->pData;
+    const elf_shdr_t *pShdrs;
+    unsigned i;
+
+    if (pEhdr->e_shoff == 0 || pEhdr->e_shoff + (uint64_t)pEhdr->e_shnum * sizeof(elf_shdr_t) > pElf->size)
+        return NULL;
+    pShdrs = (const elf_shdr_t *)(pElf->pData + pEhdr->e_shoff);
+
+    for (i = 0; i < pEhdr->e_shnum; ++i) {
+        const elf_shdr_t *pSym = &pShdrs[i];
+        const elf_shdr_t *pStr;
+        const elf_sym_t *syms;
+        size_t n, k;
+
+        if (pSym->sh_type != type || pSym->sh_link >= pEhdr->e_shnum)
+            continue;
+        pStr = &pShdrs[pSym->sh_link];
+        if (pSym->sh_offset + pSym->sh_size > pElf->size || pStr->sh_offset + pStr->sh_size > pElf->size)
+            continue;
+        syms = (const elf_sym_t *)(pElf->pData + pSym->sh_offset);
+        n = pSym->sh_size / sizeof(elf_sym_t);
+
+        for (k = 0; k < n; ++k) {
+            const elf_sym_t *s = &syms[k];
+            unsigned st = ELF_ST_TYPE(s->st_info);
+            if ((st != STT_FUNC && st != STT_GNU_IFUNC) || s->st_shndx == SHN_UNDEF || s->st_name >= pStr->sh_size)
+                continue;
+            if (vaddr >= s->st_value && vaddr < s->st_value + (s->st_size ? s->st_size : 1)) {
+                *pOffset = vaddr - s->st_value;
+                return (const char *)(pElf->pData + pStr->sh_offset + s->st_name);
+            }
+        }
+    }
+    return NULL;
+}
+
+static const char *baseName(const char *path)
+{
+    const char *p = strrchr(path, '/');
+    return p ? p + 1 : path;
+}
+
+static const struct mapping *findMapping(const struct trace *t, uint64_t addr)
+{
+    unsigned lo = 0, hi = t->mapCount;
+
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (addr < t->maps[mid].start)
+            hi = mid;
+        else if (addr >= t->maps[mid].end)
+            lo = mid + 1;
+        else
+            return &t->maps[mid];
+    }
+    return NULL;
+}
+
+static void printSymbol(FILE *f, struct trace *t, uint64_t addr)
+{
+    struct mapping *pMap = (struct mapping *)findMapping(t, addr);
+    uint64_t off, vaddr;
+    const char *name;
+
+    if (!pMap || !pMap->path || pMap->path[0] != '/') {
+        fprintf(f, "0x%llx", (unsigned long long)addr);
+        return;
+    }
+
+    off = addr - pMap->start + pMap->offset;
+    if (!pMap->pElf)
+        pMap->pElf = openElf(pMap->path);
+    if (!pMap->pElf || !fileOffsetToVaddr(pMap->pElf, off, &vaddr)) {
+        fprintf(f, "%s@0x%llx", baseName(pMap->path), (unsigned long long)off);
+        return;
+    }
+
+    name = findSymbolIn(pMap->pElf, SHT_SYMTAB, vaddr, &off);
+    if (!name)
+        name = findSymbolIn(pMap->pElf, SHT_DYNSYM, vaddr, &off);
+    if (name)
+        fprintf(f, "%s+0x%llx (%s)", name, (unsigned long long)off, baseName(pMap->path));
+    else
+        fprintf(f, "%s+0x%llx", baseName(pMap->path), (unsigned long long)vaddr);
+}
+
+/* trace file */
+
+static int parseMaps(struct trace *t)
+{
+    const struct pchecker_trace_header *pHeader = t->pHeader;
+    char *text, *line, *save = NULL;
+    unsigned cap = 64;
+
+    text = (char *)malloc(pHeader->mapsSize + 1);
+    t->maps = (struct mapping *)malloc(cap * sizeof(*t->maps));
+    if (!text || !t->maps)
+        return 0;
+    memcpy(text, t->pData + pHeader->mapsOffset, pHeader->mapsSize);
+    text[pHeader->mapsSize] = '\0';
+
+    for (line = strtok_r(text, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        unsigned long long start, end, offset;
+        int pathPos = 0;
+        struct mapping *pMap;
+
+        if (sscanf(line, "%llx-%llx %*s %llx %*s %*s %n", &start, &end, &offset, &pathPos) < 3)
+            continue;
+        if (t->mapCount == cap) {
+            cap *= 2;
+            t->maps = (struct mapping *)realloc(t->maps, cap * sizeof(*t->maps));
+            if (!t->maps)
+                return 0;
+        }
+        pMap = &t->maps[t->mapCount++];
+        pMap->start = start;
+        pMap->end = end;
+        pMap->offset = offset;
+        pMap->path = pathPos ? line + pathPos : "";
+        pMap->pElf = NULL;
+    }
+    return 1;
+}
+
+static int openTrace(struct trace *t, const char *path)
+{
+    const struct pchecker_trace_header *pHeader;
+    struct stat st;
+    const char *p, *end;
+    unsigned i;
+    int fd;
+
+    memset(t, 0, sizeof(*t));
+    t->path = path;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        return 0;
+    }
+    t->size = (size_t)st.st_size;
+    t->pData = (const unsigned char *)mmap(NULL, t->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ((void *)t->pData == MAP_FAILED || t->size < sizeof(*pHeader)) {
+        fprintf(stderr, "%s: unable to map\n", path);
+        return 0;
+    }
+
+    pHeader = t->pHeader = (const struct pchecker_trace_header *)t->pData;
+    if (memcmp(pHeader->magic, PCHECKER_TRACE_MAGIC, sizeof(pHeader->magic)) != 0 ||
+        pHeader->version != PCHECKER_TRACE_VERSION) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        return 0;
+    }
+    if (pHeader->recordSize < offsetof(struct pchecker_trace_record, frames) + pHeader->frameCount * 8u ||
+        pHeader->recordOffset + pHeader->recordCapacity * pHeader->recordSize > t->size ||
+        pHeader->namesOffset + pHeader->namesSize > t->size ||
+        pHeader->mapsOffset + pHeader->mapsSize > t->size) {
+        fprintf(stderr, "%s: truncated trace file\n", path);
+        return 0;
+    }
+
+    /* function names */
+    p = (const char *)t->pData + pHeader->namesOffset;
+    end = p + pHeader->namesSize;
+    t->names = (const char **)calloc(pHeader->namesSize, sizeof(*t->names));
+    for (i = 0; p < end && *p; ++i) {
+        t->names[i] = p;
+        p += strlen(p) + 1;
+    }
+    t->nameCount = i;
+
+    if (!parseMaps(t))
+        return 0;
+
+    if (pHeader->writeIndex > pHeader->recordCapacity) {
+        t->first = pHeader->writeIndex - pHeader->recordCapacity;
+        t->count = pHeader->recordCapacity;
+    }
+    else {
+        t->first = 0;
+        t->count = pHeader->writeIndex;
+    }
+    return 1;
+}
+
+static int getRecord(const struct trace *t, uint64_t n, struct record *pRec)
+{
+    const struct pchecker_trace_header *pHeader = t->pHeader;
+    const unsigned char *p;
+    const struct pchecker_trace_record *pRaw;
+
+    p = t->pData + pHeader->recordOffset + ((t->first + n) & (pHeader->recordCapacity - 1)) * pHeader->recordSize;
+    pRaw = (const struct pchecker_trace_record *)p;
+
+    if (!pRaw->ticks)
+        return 0;
+    pRec->ticks = pRaw->ticks;
+    memcpy(pRec->args, pRaw->args, sizeof(pRec->args));
+    pRec->result = pRaw->result;
+    pRec->tid = pRaw->tid;
+    pRec->func = pRaw->func;
+    pRec->flags = pRaw->flags;
+    pRec->frames = (const uint64_t *)(p + offsetof(struct pchecker_trace_record, frames));
+    return 1;
+}
+
+static const char *funcName(const struct trace *t, unsigned func)
+{
+    return func < t->nameCount ? t->names[func] : "?";
+}
+
+/* summaries */
+
+/* table entries start with a 64 bit key and an unsigned sub key */
+struct callsite {
+    uint64_t addr;
+    unsigned func;
+    uint64_t count;
+    uint64_t firstTicks;
+    uint64_t lastTicks;
+};
+
+struct thread {
+    uint64_t tid;
+    unsigned unused;
+    uint64_t count;
+    uint64_t firstTicks;
+    uint64_t lastTicks;
+    uint64_t *perFunc;
+};
+
+struct table {
+    void *pEntries;
+    size_t entrySize;
+    size_t count;
+    size_t cap;
+};
+
+static uint64_t hashKey(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    return k;
+}
+
+/* open addressing, entries with a zero key are free */
+static void *tableFind(struct table *pTable, uint64_t key, unsigned sub, int (*match)(const void *, uint64_t, unsigned))
+{
+    size_t i;
+    char *pEntries;
+
+    if (pTable->count * 2 >= pTable->cap) {
+        struct table grown;
+        size_t k;
+        grown.entrySize = pTable->entrySize;
+        grown.cap = pTable->cap ? pTable->cap * 2 : 1024;
+        grown.count = 0;
+        grown.pEntries = calloc(grown.cap, grown.entrySize);
+        if (!grown.pEntries) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        for (k = 0; k < pTable->cap; ++k) {
+            const char *pOld = (const char *)pTable->pEntries + k * pTable->entrySize;
+            uint64_t oldKey;
+            memcpy(&oldKey, pOld, sizeof(oldKey));
+            if (oldKey) {
+                size_t j = hashKey(oldKey ^ *(const unsigned *)(pOld + sizeof(uint64_t))) & (grown.cap - 1);
+                while (*(const uint64_t *)((char *)grown.pEntries + j * grown.entrySize))
+                    j = (j + 1) & (grown.cap - 1);
+                memcpy((char *)grown.pEntries + j * grown.entrySize, pOld, grown.entrySize);
+                ++grown.count;
+            }
+        }
+        free(pTable->pEntries);
+        *pTable = grown;
+    }
+
+    pEntries = (char *)pTable->pEntries;
+    for (i = hashKey(key ^ sub) & (pTable->cap - 1);; i = (i + 1) & (pTable->cap - 1)) {
+        char *pEntry = pEntries + i * pTable->entrySize;
+        uint64_t k;
+        memcpy(&k, pEntry, sizeof(k));
+        if (!k) {
+            memcpy(pEntry, &key, sizeof(key));
+            ++pTable->count;
+            return pEntry;
+        }
+        if (match(pEntry, key, sub))
+            return pEntry;
+    }
+}
+
+static int matchCallsite(const void *p, uint64_t key, unsigned func)
+{
+    const struct callsite *pSite = (const struct callsite *)p;
+    return pSite->addr == key && pSite->func == func;
+}
+
+static int matchThread(const void *p, uint64_t key, unsigned unused)
+{
+    const struct thread *pThread = (const struct thread *)p;
+    (void)unused;
+    return pThread->tid == key;
+}
+
+static int compareCallsites(const void *a, const void *b)
+{
+    const struct callsite *pA = (const struct callsite *)a;
+    const struct callsite *pB = (const struct callsite *)b;
+    if (pA->count != pB->count)
+        return pA->count < pB->count ? 1 : -1;
+    return 0;
+}
+
+static int compareThreads(const void *a, const void *b)
+{
+    const struct thread *pA = (const struct thread *)a;
+    const struct thread *pB = (const struct thread *)b;
+    if (pA->count != pB->count)
+        return pA->count < pB->count ? 1 : -1;
+    return pA->tid < pB->tid ? -1 : 1;
+}
+
+static size_t compact(struct table *pTable)
+{
+    size_t i, n = 0;
+    char *pEntries = (char *)pTable->pEntries;
+
+    for (i = 0; i < pTable->cap; ++i) {
+        if (*(const uint64_t *)(pEntries + i * pTable->entrySize)) {
+            if (n != i)
+                memcpy(pEntries + n * pTable->entrySize, pEntries + i * pTable->entrySize, pTable->entrySize);
+            ++n;
+        }
+    }
+    return n;
+}
+
+static void dumpRecords(struct trace *t)
+{
+    uint64_t n;
+    struct record rec;
+
+    for (n = 0; n < t->count; ++n) {
+        unsigned f;
+        if (!getRecord(t, n, &rec))
+            continue;
+        printf("%12.6f %7u %s(0x%llx, 0x%llx, 0x%llx)", ticksToSec(t, rec.ticks), rec.tid, funcName(t, rec.func),
+            (unsigned long long)rec.args[0], (unsigned long long)rec.args[1], (unsigned long long)rec.args[2]);
+        if (rec.flags & eTraceDone)
+            printf(" = 0x%llx", (unsigned long long)rec.result);
+        else
+            printf(" = <no return>");
+        printf("\n");
+        for (f = 0; f < t->pHeader->frameCount && rec.frames[f]; ++f) {
+            printf("        #%u ", f);
+            printSymbol(stdout, t, rec.frames[f]);
+            printf("\n");
+        }
+    }
+}
+
+static void summarize(struct trace *t, unsigned top)
+{
+    struct table sites = {NULL, sizeof(struct callsite), 0, 0};
+    struct table threads = {NULL, sizeof(struct thread), 0, 0};
+    uint64_t *perFunc = (uint64_t *)calloc(t->nameCount + 1, sizeof(uint64_t));
+    uint64_t n, valid = 0, minTicks = UINT64_MAX, maxTicks = 0;
+    struct record rec;
+    size_t count, i;
+    double duration;
+
+    for (n = 0; n < t->count; ++n) {
+        struct callsite *pSite;
+        struct thread *pThread;
+        unsigned func;
+
+        if (!getRecord(t, n, &rec))
+            continue;
+        ++valid;
+        func = rec.func < t->nameCount ? rec.func : t->nameCount;
+        ++perFunc[func];
+        if (rec.ticks < minTicks)
+            minTicks = rec.ticks;
+        if (rec.ticks > maxTicks)
+            maxTicks = rec.ticks;
+
+        pSite = (struct callsite *)tableFind(&sites, rec.frames[0] ? rec.frames[0] : 1, func, &matchCallsite);
+        if (!pSite->count) {
+            pSite->func = func;
+            pSite->firstTicks = rec.ticks;
+        }
+        ++pSite->count;
+        pSite->lastTicks = rec.ticks;
+
+        pThread = (struct thread *)tableFind(&threads, rec.tid ? rec.tid : UINT32_MAX, 0, &matchThread);
+        if (!pThread->count) {
+            pThread->tid = rec.tid;
+            pThread->firstTicks = rec.ticks;
+            pThread->perFunc = (uint64_t *)calloc(t->nameCount + 1, sizeof(uint64_t));
+        }
+        ++pThread->count;
+        ++pThread->perFunc[func];
+        pThread->lastTicks = rec.ticks;
+    }
+
+    duration = valid ? (double)(maxTicks - minTicks) / (double)t->pHeader->ticksPerSec : 0.0;
+
+    printf("trace %s: checker %s, pid %d\n", t->path, t->pHeader->checker, t->pHeader->pid);
+    printf("  %llu calls recorded, %llu in file, over %.3f s\n", (unsigned long long)t->pHeader->writeIndex,
+        (unsigned long long)valid, duration);
+    if (t->pHeader->writeIndex > t->count)
+        printf("  ring overflowed, only the last %llu calls are available\n", (unsigned long long)t->count);
+
+    printf("\nper function:\n");
+    for (i = 0; i <= t->nameCount; ++i) {
+        if (perFunc[i])
+            printf("  %-20s %12llu\n", i < t->nameCount ? t->names[i] : "?", (unsigned long long)perFunc[i]);
+    }
+
+    count = compact(&threads);
+    qsort(threads.pEntries, count, sizeof(struct thread), &compareThreads);
+    printf("\nper thread:\n  %7s %12s %10s %10s  calls per function\n", "tid", "calls", "first[s]", "last[s]");
+    for (i = 0; i < count; ++i) {
+        struct thread *pThread = (struct thread *)threads.pEntries + i;
+        unsigned f;
+        printf("  %7u %12llu %10.3f %10.3f ", (unsigned)pThread->tid, (unsigned long long)pThread->count,
+            ticksToSec(t, pThread->firstTicks), ticksToSec(t, pThread->lastTicks));
+        for (f = 0; f <= t->nameCount; ++f) {
+            if (pThread->perFunc[f])
+                printf(" %s:%llu", funcName(t, f), (unsigned long long)pThread->perFunc[f]);
+        }
+        printf("\n");
+        free(pThread->perFunc);
+    }
+
+    count = compact(&sites);
+    qsort(sites.pEntries, count, sizeof(struct callsite), &compareCallsites);
+    printf("\nper callsite (top %u of %zu):\n  %12s %12s  %-14s callsite\n", top, count, "calls", "calls/s", "function");
+    for (i = 0; i < count && i < top; ++i) {
+        struct callsite *pSite = (struct callsite *)sites.pEntries + i;
+        double span = (double)(pSite->lastTicks - pSite->firstTicks) / (double)t->pHeader->ticksPerSec;
+        printf("  %12llu %12.0f  %-14s ", (unsigned long long)pSite->count,
+            span > 0.0 ? (double)pSite->count / span : 0.0, funcName(t, pSite->func));
+        printSymbol(stdout, t, pSite->addr);
+        printf("\n");
+    }
+    printf("\n");
+
+    free(sites.pEntries);
+    free(threads.pEntries);
+    free(perFunc);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned top = 20;
+    int dump = 0;
+    int opt, ret = 0;
+
+    while ((opt = getopt(argc, argv, "dn:")) != -1) {
+        switch (opt) {
+        case 'd':
+            dump = 1;
+            break;
+        case 'n':
+            top = (unsigned)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-d] [-n count] tracefile...\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-d] [-n count] tracefile...\n", argv[0]);
+        return 2;
+    }
+
+    for (; optind < argc; ++optind) {
+        struct trace t;
+        if (!openTrace(&t, argv[optind])) {
+            ret = 1;
+            continue;
+        }
+        if (dump)
+            dumpRecords(&t);
+        summarize(&t, top);
+    }
+    return ret;
+}
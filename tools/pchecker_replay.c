@@ -0,0 +1,997 @@
+/*
+ * replays a heap recording of the heap checkers (see PCHECKER_HEAP_RECORD)
+ * against different allocators, to pick one for the RT parts from the
+ * real workload instead of synthetic benchmarks.
+ *
+ * The recorded pointers are turned into block ids first, then the
+ * operations are replayed in recorded order in a single thread, as fast
+ * as possible, timing each one. Latencies are reported as percentiles,
+ * the footprint as the peak of memory taken from the system compared to
+ * the peak of the requested bytes.
+ *
+ * usage: pchecker_replay [-a allocator] [-t tid] [-m MiB] recording...
+ *   -a allocator  malloc, tlsf, pool or all (default)
+ *   -t tid        time only the operations of this thread
+ *   -m MiB        arena of tlsf and pool (default 4 times the peak plus 64)
+ *
+ * malloc is the allocator of the C library the tool is linked against,
+ * its footprint is sampled with mallinfo2 where available.
+ * tlsf is a two-level segregated fit allocator in a fixed arena, O(1)
+ * for all operations, standing in for the usual RT allocators.
+ * pool has size classes up to 32 KiB carved from 64 KiB chunks, which
+ * are never given back, larger blocks go to a tlsf arena.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "pchecker_traceformat.h"
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#define REPLAY_HAS_MALLINFO2 1
+#endif
+
+#define NO_ID UINT32_MAX
+
+/* an operation with the pointers replaced by block ids */
+struct op {
+    uint64_t size;
+    uint32_t id;
+    uint32_t oldId; /* realloc */
+    uint8_t kind;   /* EPcheckerHeapRecOp */
+    uint8_t alignLog2;
+    uint8_t timed;
+};
+
+struct recording {
+    const char *path;
+    struct op *pOps;
+    uint64_t opCapacity;
+    uint64_t opCount;
+    uint32_t idCount;
+    uint64_t lost;     /* records beyond the capacity or incomplete */
+    uint64_t unknown;  /* frees of blocks allocated before recording */
+    uint64_t repaired; /* allocations of an address still live */
+    uint64_t peakLive;
+    uint64_t peakBlocks;
+    unsigned threads;
+    double seconds;
+};
+
+enum EOpClass {
+    eClassAlloc,
+    eClassFree,
+    eClassRealloc,
+    eClassCount
+};
+
+static const char *const s_ClassNames[eClassCount] = {"alloc", "free", "realloc"};
+
+/* memory of the tool itself is mapped, it must not show in the footprint
+ * of malloc */
+static void *mapArray(size_t size)
+{
+    void *p = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+}
+
+static uint64_t clockNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* ---- pointer to id table, linear probing with backward shift deletion */
+
+struct id_entry {
+    uint64_t ptr; /* 0 if empty */
+    uint32_t id;
+};
+
+struct id_table {
+    struct id_entry *pEntries;
+    uint64_t mask;
+};
+
+static uint64_t hashPtr(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdull;
+    k ^= k >> 33;
+    return k;
+}
+
+static struct id_entry *idFind(struct id_table *pTable, uint64_t ptr)
+{
+    uint64_t i;
+
+    for (i = hashPtr(ptr) & pTable->mask;; i = (i + 1) & pTable->mask) {
+        struct id_entry *p = &pTable->pEntries[i];
+        if (p->ptr == ptr || !p->ptr)
+            return p;
+    }
+}
+
+static void idRemove(struct id_table *pTable, struct id_entry *pEntry)
+{
+    uint64_t hole = (uint64_t)(pEntry - pTable->pEntries), i = hole;
+
+    for (;;) {
+        uint64_t home;
+        i = (i + 1) & pTable->mask;
+        if (!pTable->pEntries[i].ptr)
+            break;
+        home = hashPtr(pTable->pEntries[i].ptr) & pTable->mask;
+        /* move back unless its home lies cyclically in (hole, i] */
+        if (((i - home) & pTable->mask) >= ((i - hole) & pTable->mask)) {
+            pTable->pEntries[hole] = pTable->pEntries[i];
+            hole = i;
+        }
+    }
+    pTable->pEntries[hole].ptr = 0;
+}
+
+/* blocks of a moving realloc whose address was handed out again before the
+ * realloc was recorded, they wait for the realloc, oldest first */
+struct pending_list {
+    struct id_entry *pEntries;
+    uint64_t count;
+};
+
+static uint32_t pendingTake(struct pending_list *pList, uint64_t ptr)
+{
+    uint64_t i;
+    uint32_t id;
+
+    for (i = 0; i < pList->count && pList->pEntries[i].ptr != ptr; ++i)
+        ;
+    if (i == pList->count)
+        return NO_ID;
+    id = pList->pEntries[i].id;
+    memmove(&pList->pEntries[i], &pList->pEntries[i + 1], (size_t)(pList->count - i - 1) * sizeof(*pList->pEntries));
+    --pList->count;
+    return id;
+}
+
+/* ---- loading */
+
+static int loadRecording(struct recording *r, const char *path, uint32_t timedTid)
+{
+    const struct pchecker_heaprec_header *pHeader;
+    const unsigned char *pData;
+    struct id_table ids;
+    struct pending_list pending;
+    uint64_t *pSizes, count, capacity, i, live = 0, liveBlocks = 0, firstTicks = 0, lastTicks = 0;
+    uint32_t tids[256];
+    struct stat st;
+    int fd;
+
+    memset(r, 0, sizeof(*r));
+    r->path = path;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        return 0;
+    }
+    pData = (const unsigned char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if ((void *)pData == MAP_FAILED || (size_t)st.st_size < sizeof(*pHeader)) {
+        fprintf(stderr, "%s: unable to map\n", path);
+        return 0;
+    }
+    pHeader = (const struct pchecker_heaprec_header *)pData;
+    if (memcmp(pHeader->magic, PCHECKER_HEAPREC_MAGIC, sizeof(pHeader->magic)) != 0 ||
+        pHeader->version != PCHECKER_HEAPREC_VERSION) {
+        fprintf(stderr, "%s: not a heap recording\n", path);
+        return 0;
+    }
+    if (pHeader->recordSize < sizeof(struct pchecker_heaprec_record) ||
+        pHeader->recordOffset + pHeader->recordCapacity * pHeader->recordSize > (uint64_t)st.st_size) {
+        fprintf(stderr, "%s: truncated heap recording\n", path);
+        return 0;
+    }
+
+    count = pHeader->writeIndex < pHeader->recordCapacity ? pHeader->writeIndex : pHeader->recordCapacity;
+    r->lost = pHeader->writeIndex - count;
+    for (capacity = 1024; capacity < count * 2; capacity <<= 1)
+        ;
+    ids.pEntries = (struct id_entry *)mapArray(capacity * sizeof(*ids.pEntries));
+    ids.mask = capacity - 1;
+    /* at most one new id per record */
+    pSizes = (uint64_t *)mapArray(count * sizeof(*pSizes));
+    pending.pEntries = (struct id_entry *)mapArray(count * sizeof(*pending.pEntries));
+    pending.count = 0;
+    r->opCapacity = count;
+    r->pOps = (struct op *)mapArray(r->opCapacity * sizeof(*r->pOps));
+
+    for (i = 0; i < count; ++i) {
+        const struct pchecker_heaprec_record *pRec =
+            (const struct pchecker_heaprec_record *)(pData + pHeader->recordOffset + i * pHeader->recordSize);
+        struct op *pOp = &r->pOps[r->opCount];
+        struct id_entry *pEntry;
+        unsigned t;
+
+        if (!pRec->ticks) {
+            ++r->lost;
+            continue;
+        }
+        if (!firstTicks)
+            firstTicks = pRec->ticks;
+        lastTicks = pRec->ticks;
+        for (t = 0; t < r->threads && tids[t] != pRec->tid; ++t)
+            ;
+        if (t == r->threads && t < sizeof(tids) / sizeof(tids[0]))
+            tids[r->threads++] = pRec->tid;
+
+        pOp->kind = pRec->op;
+        pOp->alignLog2 = pRec->alignLog2;
+        pOp->timed = timedTid == 0 || pRec->tid == timedTid;
+        pOp->size = pRec->size;
+        pOp->id = NO_ID;
+        pOp->oldId = NO_ID;
+
+        if (pRec->op == eHeapRecFree || pRec->op == eHeapRecRealloc) {
+            uint64_t old = pRec->op == eHeapRecFree ? pRec->ptr : pRec->oldPtr;
+            if (old && pRec->op == eHeapRecRealloc && (pOp->oldId = pendingTake(&pending, old)) != NO_ID) {
+                live -= pSizes[pOp->oldId];
+                --liveBlocks;
+            }
+            else if (old) {
+                pEntry = idFind(&ids, old);
+                if (pEntry->ptr) {
+                    pOp->oldId = pEntry->id;
+                    live -= pSizes[pEntry->id];
+                    --liveBlocks;
+                    idRemove(&ids, pEntry);
+                }
+                else
+                    ++r->unknown;
+            }
+            if (pRec->op == eHeapRecFree) {
+                pOp->id = pOp->oldId;
+                pOp->oldId = NO_ID;
+                if (pOp->id != NO_ID)
+                    ++r->opCount;
+                continue;
+            }
+            if (!pRec->ptr) {
+                /* realloc to size 0 */
+                if (pOp->oldId != NO_ID) {
+                    pOp->kind = eHeapRecFree;
+                    pOp->id = pOp->oldId;
+                    pOp->oldId = NO_ID;
+                    ++r->opCount;
+                }
+                continue;
+            }
+            if (pOp->oldId == NO_ID)
+                pOp->kind = eHeapRecMalloc;
+        }
+        else if (pRec->op != eHeapRecMalloc && pRec->op != eHeapRecCalloc) {
+            ++r->lost;
+            continue;
+        }
+
+        pEntry = idFind(&ids, pRec->ptr);
+        if (pEntry->ptr) {
+            /* the old block of a moving realloc, released before the
+             * realloc was recorded. It stays live until that record,
+             * which must not take the block allocated here */
+            pending.pEntries[pending.count].ptr = pEntry->ptr;
+            pending.pEntries[pending.count++].id = pEntry->id;
+            ++r->repaired;
+        }
+        pEntry->ptr = pRec->ptr;
+        pEntry->id = r->idCount;
+        pOp->id = r->idCount;
+        pSizes[r->idCount++] = pRec->size;
+        ++r->opCount;
+        live += pRec->size;
+        ++liveBlocks;
+        if (live > r->peakLive)
+            r->peakLive = live;
+        if (liveBlocks > r->peakBlocks)
+            r->peakBlocks = liveBlocks;
+    }
+
+    if (pHeader->ticksPerSec)
+        r->seconds = (double)(lastTicks - firstTicks) / (double)pHeader->ticksPerSec;
+    munmap(ids.pEntries, capacity * sizeof(*ids.pEntries));
+    munmap(pSizes, count * sizeof(*pSizes));
+    munmap(pending.pEntries, count * sizeof(*pending.pEntries));
+    munmap((void *)pData, (size_t)st.st_size);
+    return 1;
+}
+
+/* ---- tlsf, two-level segregated fit in a fixed arena */
+
+#define TLSF_SL_LOG2 4
+#define TLSF_SL_COUNT (1u << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + 4) /* below 256 bytes steps of 16 */
+#define TLSF_FL_COUNT 32
+#define TLSF_HEADER 16u
+#define TLSF_MIN 16u
+#define TLSF_FREE 1u
+#define TLSF_PREV_FREE 2u
+
+struct tlsf_block {
+    struct tlsf_block *prevPhys; /* valid if TLSF_PREV_FREE */
+    size_t size;                 /* of the payload, with the flags */
+    /* payload, in free blocks the list links */
+    struct tlsf_block *nextFree;
+    struct tlsf_block *prevFree;
+};
+
+struct tlsf {
+    char *base;
+    size_t capacity;
+    size_t highWater;
+    uint32_t flBitmap;
+    uint32_t slBitmap[TLSF_FL_COUNT];
+    struct tlsf_block *pFree[TLSF_FL_COUNT][TLSF_SL_COUNT];
+};
+
+static size_t tlsfSize(const struct tlsf_block *b)
+{
+    return b->size & ~(size_t)(TLSF_FREE | TLSF_PREV_FREE);
+}
+
+static struct tlsf_block *tlsfNext(const struct tlsf_block *b)
+{
+    return (struct tlsf_block *)((char *)b + TLSF_HEADER + tlsfSize(b));
+}
+
+static void tlsfMapping(size_t size, unsigned *pFl, unsigned *pSl)
+{
+    if (size < ((size_t)1 << TLSF_FL_SHIFT)) {
+        *pFl = 0;
+        *pSl = (unsigned)(size >> 4);
+    }
+    else {
+        unsigned f = 63u - (unsigned)__builtin_clzll(size);
+        *pSl = (unsigned)(size >> (f - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+        *pFl = f - (TLSF_FL_SHIFT - 1);
+    }
+}
+
+static void tlsfInsert(struct tlsf *t, struct tlsf_block *b)
+{
+    struct tlsf_block *pNext = tlsfNext(b);
+    unsigned fl, sl;
+
+    tlsfMapping(tlsfSize(b), &fl, &sl);
+    b->prevFree = NULL;
+    b->nextFree = t->pFree[fl][sl];
+    if (b->nextFree)
+        b->nextFree->prevFree = b;
+    t->pFree[fl][sl] = b;
+    t->flBitmap |= 1u << fl;
+    t->slBitmap[fl] |= 1u << sl;
+    b->size |= TLSF_FREE;
+    pNext->size |= TLSF_PREV_FREE;
+    pNext->prevPhys = b;
+}
+
+static void tlsfRemove(struct tlsf *t, struct tlsf_block *b)
+{
+    unsigned fl, sl;
+
+    tlsfMapping(tlsfSize(b), &fl, &sl);
+    if (b->prevFree)
+        b->prevFree->nextFree = b->nextFree;
+    else {
+        t->pFree[fl][sl] = b->nextFree;
+        if (!b->nextFree) {
+            t->slBitmap[fl] &= ~(1u << sl);
+            if (!t->slBitmap[fl])
+                t->flBitmap &= ~(1u << fl);
+        }
+    }
+    if (b->nextFree)
+        b->nextFree->prevFree = b->prevFree;
+    b->size &= ~(size_t)TLSF_FREE;
+    tlsfNext(b)->size &= ~(size_t)TLSF_PREV_FREE;
+}
+
+/* a free block of at least size, NULL if there is none */
+static struct tlsf_block *tlsfFind(struct tlsf *t, size_t size)
+{
+    unsigned fl, sl;
+    uint32_t slMap;
+
+    if (size >= ((size_t)1 << TLSF_FL_SHIFT))
+        size += ((size_t)1 << (63u - (unsigned)__builtin_clzll(size) - TLSF_SL_LOG2)) - 1;
+    tlsfMapping(size, &fl, &sl);
+    if (fl >= TLSF_FL_COUNT)
+        return NULL;
+    slMap = t->slBitmap[fl] & (~0u << sl);
+    if (!slMap) {
+        uint32_t flMap = fl + 1 < TLSF_FL_COUNT ? t->flBitmap & (~0u << (fl + 1)) : 0;
+        if (!flMap)
+            return NULL;
+        fl = (unsigned)__builtin_ctz(flMap);
+        slMap = t->slBitmap[fl];
+    }
+    return t->pFree[fl][__builtin_ctz(slMap)];
+}
+
+/* give the end of a used block beyond size back */
+static void tlsfTrim(struct tlsf *t, struct tlsf_block *b, size_t size)
+{
+    size_t have = tlsfSize(b);
+    struct tlsf_block *pRest, *pNext;
+
+    if (have < size + TLSF_HEADER + TLSF_MIN)
+        return;
+    pRest = (struct tlsf_block *)((char *)b + TLSF_HEADER + size);
+    pRest->size = have - size - TLSF_HEADER;
+    b->size = size | (b->size & TLSF_PREV_FREE);
+    pNext = tlsfNext(pRest);
+    if (pNext->size & TLSF_FREE) {
+        tlsfRemove(t, pNext);
+        pRest->size += TLSF_HEADER + tlsfSize(pNext);
+    }
+    tlsfInsert(t, pRest);
+}
+
+static void *tlsfUse(struct tlsf *t, struct tlsf_block *b, size_t size)
+{
+    size_t end;
+
+    tlsfTrim(t, b, size);
+    end = (size_t)((char *)tlsfNext(b) - t->base);
+    if (end > t->highWater)
+        t->highWater = end;
+    return (char *)b + TLSF_HEADER;
+}
+
+static size_t tlsfRound(size_t size)
+{
+    return size < TLSF_MIN ? TLSF_MIN : (size + 15) & ~(size_t)15;
+}
+
+static int tlsfInit(struct tlsf *t, size_t capacity)
+{
+    struct tlsf_block *b, *pEnd;
+
+    memset(t, 0, sizeof(*t));
+    t->capacity = capacity & ~(size_t)15;
+    t->base = (char *)mmap(NULL, t->capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (t->base == MAP_FAILED)
+        return 0;
+    /* one free block and a used sentinel at the end */
+    b = (struct tlsf_block *)t->base;
+    b->prevPhys = NULL;
+    b->size = t->capacity - 2 * TLSF_HEADER;
+    pEnd = tlsfNext(b);
+    pEnd->size = 0;
+    tlsfInsert(t, b);
+    return 1;
+}
+
+static void tlsfClose(struct tlsf *t)
+{
+    munmap(t->base, t->capacity);
+}
+
+static void *tlsfMalloc(struct tlsf *t, size_t size, size_t align)
+{
+    struct tlsf_block *b;
+    uintptr_t p, aligned;
+
+    size = tlsfRound(size);
+    if (align <= 16) {
+        b = tlsfFind(t, size);
+        if (!b)
+            return NULL;
+        tlsfRemove(t, b);
+        return tlsfUse(t, b, size);
+    }
+
+    /* room for a free block in front of the aligned one */
+    b = tlsfFind(t, size + 2 * align + TLSF_HEADER + TLSF_MIN);
+    if (!b)
+        return NULL;
+    tlsfRemove(t, b);
+    p = (uintptr_t)b + TLSF_HEADER;
+    aligned = (p + align - 1) & ~(uintptr_t)(align - 1);
+    if (aligned != p) {
+        struct tlsf_block *pAligned;
+        if (aligned - p < TLSF_HEADER + TLSF_MIN)
+            aligned += align;
+        pAligned = (struct tlsf_block *)(aligned - TLSF_HEADER);
+        pAligned->size = tlsfSize(b) - (aligned - p);
+        b->size = (aligned - p - TLSF_HEADER) | (b->size & TLSF_PREV_FREE);
+        tlsfInsert(t, b);
+        b = pAligned;
+    }
+    return tlsfUse(t, b, size);
+}
+
+static void tlsfFree(struct tlsf *t, void *p)
+{
+    struct tlsf_block *b = (struct tlsf_block *)((char *)p - TLSF_HEADER), *pNext;
+
+    if (b->size & TLSF_PREV_FREE) {
+        struct tlsf_block *pPrev = b->prevPhys;
+        tlsfRemove(t, pPrev);
+        pPrev->size += TLSF_HEADER + tlsfSize(b);
+        b = pPrev;
+    }
+    pNext = tlsfNext(b);
+    if (pNext->size & TLSF_FREE) {
+        tlsfRemove(t, pNext);
+        b->size += TLSF_HEADER + tlsfSize(pNext);
+    }
+    tlsfInsert(t, b);
+}
+
+static void *tlsfRealloc(struct tlsf *t, void *p, size_t oldSize, size_t size)
+{
+    struct tlsf_block *b = (struct tlsf_block *)((char *)p - TLSF_HEADER), *pNext = tlsfNext(b);
+    void *pNew;
+
+    size = tlsfRound(size);
+    if (size <= tlsfSize(b))
+        return tlsfUse(t, b, size);
+    if ((pNext->size & TLSF_FREE) && tlsfSize(b) + TLSF_HEADER + tlsfSize(pNext) >= size) {
+        tlsfRemove(t, pNext);
+        b->size += TLSF_HEADER + tlsfSize(pNext);
+        return tlsfUse(t, b, size);
+    }
+    pNew = tlsfMalloc(t, size, 0);
+    if (!pNew)
+        return NULL;
+    memcpy(pNew, p, oldSize < size ? oldSize : size);
+    tlsfFree(t, p);
+    return pNew;
+}
+
+/* ---- pool, size classes in 64 KiB chunks, tlsf for the rest */
+
+#define POOL_CHUNK_LOG2 16
+#define POOL_CHUNK ((size_t)1 << POOL_CHUNK_LOG2)
+
+static const uint32_t s_PoolClasses[] = {16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192, 10240, 12288, 14336,
+    16384, 20480, 24576, 28672, 32768};
+
+#define POOL_CLASSES (sizeof(s_PoolClasses) / sizeof(s_PoolClasses[0]))
+
+struct pool {
+    char *base; /* chunk aligned */
+    size_t capacity;
+    size_t used; /* chunks handed out, never returned */
+    uint8_t *pChunkClass;
+    void *pFree[POOL_CLASSES];
+    char *pCarve[POOL_CLASSES];
+    char *pCarveEnd[POOL_CLASSES];
+    struct tlsf large;
+    uint64_t largeCount;
+};
+
+static int poolInit(struct pool *pPool, size_t capacity)
+{
+    char *p;
+
+    memset(pPool, 0, sizeof(*pPool));
+    pPool->capacity = (capacity / 2) & ~(POOL_CHUNK - 1);
+    p = (char *)mapArray(pPool->capacity + POOL_CHUNK);
+    pPool->base = (char *)(((uintptr_t)p + POOL_CHUNK - 1) & ~(uintptr_t)(POOL_CHUNK - 1));
+    pPool->pChunkClass = (uint8_t *)mapArray(pPool->capacity >> POOL_CHUNK_LOG2);
+    return tlsfInit(&pPool->large, capacity / 2);
+}
+
+static void poolClose(struct pool *pPool)
+{
+    tlsfClose(&pPool->large);
+}
+
+/* smallest class that fits and keeps the alignment, POOL_CLASSES if none */
+static unsigned poolClass(size_t size, size_t align)
+{
+    unsigned lo = 0, hi = POOL_CLASSES;
+
+    while (lo < hi) {
+        unsigned mid = (lo + hi) / 2;
+        if (s_PoolClasses[mid] < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    while (align > 16 && lo < POOL_CLASSES && s_PoolClasses[lo] % align)
+        ++lo;
+    return lo;
+}
+
+static int poolOwns(const struct pool *pPool, const void *p)
+{
+    return (size_t)((const char *)p - pPool->base) < pPool->capacity;
+}
+
+static void *poolMalloc(struct pool *pPool, size_t size, size_t align)
+{
+    unsigned c = poolClass(size, align);
+    void *p;
+
+    if (c == POOL_CLASSES) {
+        ++pPool->largeCount;
+        return tlsfMalloc(&pPool->large, size, align);
+    }
+    p = pPool->pFree[c];
+    if (p) {
+        memcpy(&pPool->pFree[c], p, sizeof(void *));
+        return p;
+    }
+    if ((size_t)(pPool->pCarveEnd[c] - pPool->pCarve[c]) < s_PoolClasses[c]) {
+        if (pPool->used + POOL_CHUNK > pPool->capacity)
+            return NULL;
+        pPool->pChunkClass[pPool->used >> POOL_CHUNK_LOG2] = (uint8_t)c;
+        pPool->pCarve[c] = pPool->base + pPool->used;
+        pPool->pCarveEnd[c] = pPool->pCarve[c] + POOL_CHUNK;
+        pPool->used += POOL_CHUNK;
+    }
+    p = pPool->pCarve[c];
+    pPool->pCarve[c] += s_PoolClasses[c];
+    return p;
+}
+
+static void poolFree(struct pool *pPool, void *p)
+{
+    unsigned c;
+
+    if (!poolOwns(pPool, p)) {
+        tlsfFree(&pPool->large, p);
+        return;
+    }
+    c = pPool->pChunkClass[(size_t)((char *)p - pPool->base) >> POOL_CHUNK_LOG2];
+    memcpy(p, &pPool->pFree[c], sizeof(void *));
+    pPool->pFree[c] = p;
+}
+
+static void *poolRealloc(struct pool *pPool, void *p, size_t oldSize, size_t size)
+{
+    void *pNew;
+
+    if (!poolOwns(pPool, p)) {
+        if (poolClass(size, 0) == POOL_CLASSES)
+            return tlsfRealloc(&pPool->large, p, oldSize, size);
+    }
+    else if (size <= s_PoolClasses[pPool->pChunkClass[(size_t)((char *)p - pPool->base) >> POOL_CHUNK_LOG2]])
+        return p;
+    pNew = poolMalloc(pPool, size, 0);
+    if (!pNew)
+        return NULL;
+    memcpy(pNew, p, oldSize < size ? oldSize : size);
+    poolFree(pPool, p);
+    return pNew;
+}
+
+/* ---- the allocators behind one interface */
+
+struct allocator {
+    const char *name;
+    union {
+        struct tlsf tlsf;
+        struct pool pool;
+    } u;
+    size_t baseline;
+};
+
+static size_t mallocFootprint()
+{
+#ifdef REPLAY_HAS_MALLINFO2
+    struct mallinfo2 mi = mallinfo2();
+    return mi.arena + mi.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+static int allocInit(struct allocator *a, size_t arena)
+{
+    if (!strcmp(a->name, "tlsf"))
+        return tlsfInit(&a->u.tlsf, arena);
+    if (!strcmp(a->name, "pool"))
+        return poolInit(&a->u.pool, arena);
+    a->baseline = mallocFootprint();
+    return 1;
+}
+
+static void allocClose(struct allocator *a)
+{
+    if (!strcmp(a->name, "tlsf"))
+        tlsfClose(&a->u.tlsf);
+    else if (!strcmp(a->name, "pool"))
+        poolClose(&a->u.pool);
+}
+
+static void *allocMalloc(struct allocator *a, size_t size, size_t align, int zero)
+{
+    void *p = NULL;
+
+    switch (a->name[0]) {
+    case 't':
+        p = tlsfMalloc(&a->u.tlsf, size, align);
+        break;
+    case 'p':
+        p = poolMalloc(&a->u.pool, size, align);
+        break;
+    default:
+        if (align > 16)
+            return posix_memalign(&p, align, size) == 0 ? p : NULL;
+        return zero ? calloc(1, size) : malloc(size);
+    }
+    if (p && zero)
+        memset(p, 0, size);
+    return p;
+}
+
+static void allocFree(struct allocator *a, void *p)
+{
+    switch (a->name[0]) {
+    case 't':
+        tlsfFree(&a->u.tlsf, p);
+        break;
+    case 'p':
+        poolFree(&a->u.pool, p);
+        break;
+    default:
+        free(p);
+    }
+}
+
+static void *allocRealloc(struct allocator *a, void *p, size_t oldSize, size_t size)
+{
+    switch (a->name[0]) {
+    case 't':
+        return tlsfRealloc(&a->u.tlsf, p, oldSize, size);
+    case 'p':
+        return poolRealloc(&a->u.pool, p, oldSize, size);
+    default:
+        return realloc(p, size);
+    }
+}
+
+/* memory taken from the system, 0 if unknown */
+static size_t allocFootprint(struct allocator *a)
+{
+    size_t f;
+
+    switch (a->name[0]) {
+    case 't':
+        return a->u.tlsf.highWater;
+    case 'p':
+        return a->u.pool.used + a->u.pool.large.highWater;
+    default:
+        f = mallocFootprint();
+        return f > a->baseline ? f - a->baseline : 0;
+    }
+}
+
+/* ---- replay */
+
+static int compareU32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t timerOverhead()
+{
+    uint64_t best = UINT64_MAX;
+    unsigned i;
+
+    for (i = 0; i < 1000; ++i) {
+        uint64_t t0 = clockNs(), t1 = clockNs();
+        if (t1 - t0 < best)
+            best = t1 - t0;
+    }
+    return best;
+}
+
+static void printPercentiles(const char *name, const char *what, uint32_t *pNs, uint64_t n)
+{
+    uint64_t sum = 0, i;
+
+    if (!n)
+        return;
+    qsort(pNs, (size_t)n, sizeof(*pNs), &compareU32);
+    for (i = 0; i < n; ++i)
+        sum += pNs[i];
+    printf("  %-8s %-8s %10llu %8llu %8u %8u %8u %8u %8u\n", name, what, (unsigned long long)n,
+        (unsigned long long)(sum / n), pNs[n / 2], pNs[n * 90 / 100], pNs[n * 99 / 100], pNs[n * 999 / 1000],
+        pNs[n - 1]);
+}
+
+static void replay(const struct recording *r, const char *name, size_t arena)
+{
+    struct allocator a;
+    void **pBlocks;
+    uint64_t *pSizes;
+    uint32_t *pNs[eClassCount];
+    uint64_t counts[eClassCount] = {0}, overhead = timerOverhead(), i, failed = 0, live = 0, sampledLive = 0;
+    size_t footprint = 0;
+    unsigned c;
+
+    memset(&a, 0, sizeof(a));
+    a.name = name;
+    if (!allocInit(&a, arena)) {
+        fprintf(stderr, "%s: cannot create an arena of %zu MiB\n", name, arena >> 20);
+        return;
+    }
+    pBlocks = (void **)mapArray(r->idCount * sizeof(void *));
+    pSizes = (uint64_t *)mapArray(r->idCount * sizeof(uint64_t));
+    for (c = 0; c < eClassCount; ++c)
+        pNs[c] = (uint32_t *)mapArray(r->opCount * sizeof(uint32_t));
+
+    for (i = 0; i < r->opCount; ++i) {
+        const struct op *pOp = &r->pOps[i];
+        uint64_t t0 = 0, t1 = 0;
+        void *p;
+
+        switch (pOp->kind) {
+        case eHeapRecMalloc:
+        case eHeapRecCalloc:
+            c = eClassAlloc;
+            t0 = clockNs();
+            p = allocMalloc(&a, pOp->size, pOp->alignLog2 ? (size_t)1 << pOp->alignLog2 : 0,
+                pOp->kind == eHeapRecCalloc);
+            t1 = clockNs();
+            pBlocks[pOp->id] = p;
+            pSizes[pOp->id] = pOp->size;
+            if (p)
+                live += pOp->size;
+            else
+                ++failed;
+            break;
+        case eHeapRecFree:
+            c = eClassFree;
+            p = pBlocks[pOp->id];
+            if (!p)
+                continue;
+            t0 = clockNs();
+            allocFree(&a, p);
+            t1 = clockNs();
+            pBlocks[pOp->id] = NULL;
+            live -= pSizes[pOp->id];
+            break;
+        default:
+            c = eClassRealloc;
+            p = pBlocks[pOp->oldId];
+            t0 = clockNs();
+            p = p ? allocRealloc(&a, p, pSizes[pOp->oldId], pOp->size)
+                  : allocMalloc(&a, pOp->size, 0, 0);
+            t1 = clockNs();
+            if (pBlocks[pOp->oldId])
+                live -= pSizes[pOp->oldId];
+            if (!p) {
+                /* the old block is kept, free it later with the new id */
+                ++failed;
+                p = pBlocks[pOp->oldId];
+                pSizes[pOp->id] = pSizes[pOp->oldId];
+            }
+            else
+                pSizes[pOp->id] = pOp->size;
+            live += p ? pSizes[pOp->id] : 0;
+            pBlocks[pOp->oldId] = NULL;
+            pBlocks[pOp->id] = p;
+            break;
+        }
+        if (pOp->timed) {
+            uint64_t ns = t1 - t0 > overhead ? t1 - t0 - overhead : 0;
+            pNs[c][counts[c]++] = ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+        }
+        /* the allocators with an arena have a high water mark, malloc is
+         * sampled, at least at every 64 KiB of new peak */
+        if (a.name[0] == 'm' && (live > sampledLive + 65536 || (i & 255) == 0)) {
+            size_t f = allocFootprint(&a);
+            if (f > footprint)
+                footprint = f;
+            if (live > sampledLive)
+                sampledLive = live;
+        }
+    }
+    if (a.name[0] != 'm')
+        footprint = allocFootprint(&a);
+
+    for (c = 0; c < eClassCount; ++c)
+        printPercentiles(name, s_ClassNames[c], pNs[c], counts[c]);
+    printf("  %-8s footprint ", name);
+    if (footprint)
+        printf("%llu KiB, %.2f of the peak requested", (unsigned long long)(footprint >> 10),
+            r->peakLive ? (double)footprint / (double)r->peakLive : 0.0);
+    else
+        printf("unknown");
+    if (failed)
+        printf(", %llu failed", (unsigned long long)failed);
+    if (a.name[0] == 'p' && a.u.pool.largeCount)
+        printf(", %llu large to tlsf", (unsigned long long)a.u.pool.largeCount);
+    printf("\n");
+
+    /* free what is left, the footprint of malloc is measured from a baseline */
+    for (i = 0; i < r->idCount; ++i) {
+        if (pBlocks[i])
+            allocFree(&a, pBlocks[i]);
+    }
+    allocClose(&a);
+    for (c = 0; c < eClassCount; ++c)
+        munmap(pNs[c], r->opCount * sizeof(uint32_t));
+    munmap(pBlocks, r->idCount * sizeof(void *));
+    munmap(pSizes, r->idCount * sizeof(uint64_t));
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *const allocators[] = {"malloc", "tlsf", "pool"};
+    const char *which = "all";
+    uint32_t tid = 0;
+    size_t arenaMiB = 0;
+    int opt, ret = 0;
+    unsigned i;
+
+    while ((opt = getopt(argc, argv, "a:t:m:")) != -1) {
+        switch (opt) {
+        case 'a':
+            which = optarg;
+            break;
+        case 't':
+            tid = (uint32_t)strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            arenaMiB = (size_t)strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-a malloc|tlsf|pool|all] [-t tid] [-m MiB] recording...\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-a malloc|tlsf|pool|all] [-t tid] [-m MiB] recording...\n", argv[0]);
+        return 2;
+    }
+
+    for (; optind < argc; ++optind) {
+        struct recording r;
+        size_t arena;
+
+        if (!loadRecording(&r, argv[optind], tid)) {
+            ret = 1;
+            continue;
+        }
+        arena = arenaMiB ? arenaMiB << 20 : ((size_t)r.peakLive * 4 + ((size_t)64 << 20));
+        printf("%s: %llu operations in %.3f s, %u threads, peak %llu KiB in %llu blocks\n", r.path,
+            (unsigned long long)r.opCount, r.seconds, r.threads, (unsigned long long)(r.peakLive >> 10),
+            (unsigned long long)r.peakBlocks);
+        if (r.lost || r.unknown || r.repaired)
+            printf("  %llu records lost, %llu frees of unknown blocks, %llu reordered\n",
+                (unsigned long long)r.lost, (unsigned long long)r.unknown, (unsigned long long)r.repaired);
+        printf("  %-8s %-8s %10s %8s %8s %8s %8s %8s %8s  ns\n", "", "", "count", "mean", "p50", "p90", "p99",
+            "p99.9", "max");
+        for (i = 0; i < sizeof(allocators) / sizeof(allocators[0]); ++i) {
+            if (!strcmp(which, "all") || !strcmp(which, allocators[i]))
+                replay(&r, allocators[i], arena);
+        }
+        munmap(r.pOps, r.opCapacity * sizeof(*r.pOps));
+    }
+    return ret;
+}
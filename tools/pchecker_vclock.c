@@ -0,0 +1,218 @@
+/*
+ * control tool for the virtual clock of the gettime checker
+ * (see PCHECKER_VCLOCK).
+ *
+ * usage: pchecker_vclock page command [argument]
+ *   init            create the page, virtual time equals real time,
+ *                   refused while processes use it
+ *   rate factor     let the virtual clocks run factor times as fast
+ *   advance time    jump forward, time in ns or with suffix s, m, h, d
+ *   status          print the current parameters
+ *
+ * Processes started with PCHECKER_VCLOCK=page pick up changes immediately.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "pchecker_vclock.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t clockNs(clockid_t clock_id)
+{
+    struct timespec ts;
+    clock_gettime(clock_id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static struct pchecker_vclock_page *mapPage(const char *path, int create)
+{
+    struct pchecker_vclock_page *pPage;
+    int fd = open(path, create ? O_RDWR | O_CREAT : O_RDWR, 0644);
+
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    /* the checkers hold a shared lock, initialising would move their time
+     * backwards. The exclusive lock is released when the tool exits. */
+    if (create && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "%s: in use by running processes, not initialised\n", path);
+        close(fd);
+        return NULL;
+    }
+    if (create && ftruncate(fd, (off_t)sizeof(*pPage)) != 0) {
+        perror(path);
+        close(fd);
+        return NULL;
+    }
+    pPage = (struct pchecker_vclock_page *)mmap(NULL, sizeof(*pPage), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (!create)
+        close(fd);
+    if (pPage == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+    if (!create && (memcmp(pPage->magic, PCHECKER_VCLOCK_MAGIC, sizeof(pPage->magic)) != 0 ||
+                       pPage->version != PCHECKER_VCLOCK_VERSION)) {
+        fprintf(stderr, "%s: not a virtual clock page\n", path);
+        return NULL;
+    }
+    return pPage;
+}
+
+static void initPage(struct pchecker_vclock_page *pPage)
+{
+    struct pchecker_vclock_params params;
+    uint64_t mono;
+    unsigned i;
+
+    memset(pPage, 0, sizeof(*pPage));
+    pPage->version = PCHECKER_VCLOCK_VERSION;
+    pPage->size = sizeof(*pPage);
+
+    mono = clockNs(CLOCK_MONOTONIC);
+    for (i = 0; i < PCHECKER_VCLOCK_CLOCKS; ++i) {
+        struct timespec ts;
+        /* cpu time clocks stay real */
+        if (i == CLOCK_PROCESS_CPUTIME_ID || i == CLOCK_THREAD_CPUTIME_ID)
+            continue;
+        if (clock_gettime((clockid_t)i, &ts) != 0)
+            continue;
+        pPage->clockOffset[i] = (int64_t)((uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec - mono);
+        pPage->clockMask |= 1u << i;
+    }
+
+    params.anchorReal = mono;
+    params.anchorVirtual = mono;
+    params.rate = PCHECKER_VCLOCK_RATE_ONE;
+    vclockStore(pPage, &params);
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(pPage->magic, PCHECKER_VCLOCK_MAGIC, sizeof(pPage->magic));
+}
+
+/* re-anchor at the current virtual time, so the clocks stay continuous */
+static void update(struct pchecker_vclock_page *pPage, uint64_t rate, uint64_t advance)
+{
+    struct pchecker_vclock_params params;
+    uint64_t now = clockNs(CLOCK_MONOTONIC);
+
+    if (!vclockLoad(pPage, &params))
+        fprintf(stderr, "warning: the page was left in the middle of an update, overwriting it\n");
+    params.anchorVirtual = vclockVirtual(&params, now) + advance;
+    params.anchorReal = now;
+    if (rate != UINT64_MAX)
+        params.rate = rate;
+    vclockStore(pPage, &params);
+}
+
+static int parseDuration(const char *s, uint64_t *pNs)
+{
+    char *end;
+    double v = strtod(s, &end);
+    double scale = 1;
+
+    if (end == s || v < 0)
+        return 0;
+    switch (*end) {
+    case '\0':
+        break;
+    case 's':
+        scale = 1e9;
+        break;
+    case 'm':
+        scale = 60e9;
+        break;
+    case 'h':
+        scale = 3600e9;
+        break;
+    case 'd':
+        scale = 86400e9;
+        break;
+    default:
+        return 0;
+    }
+    if (*end && end[1])
+        return 0;
+    *pNs = (uint64_t)(v * scale);
+    return 1;
+}
+
+static void printStatus(const struct pchecker_vclock_page *pPage)
+{
+    struct pchecker_vclock_params params;
+    uint64_t now = clockNs(CLOCK_MONOTONIC);
+    uint64_t v;
+
+    if (!vclockLoad(pPage, &params))
+        printf("update in progress or interrupted, the checkers use the real clocks\n");
+    v = vclockVirtual(&params, now);
+    printf("rate      %.6f\n", (double)params.rate / (double)PCHECKER_VCLOCK_RATE_ONE);
+    printf("real      %.3f s\n", (double)now * 1e-9);
+    printf("virtual   %.3f s\n", (double)v * 1e-9);
+    printf("ahead     %.3f s\n", ((double)v - (double)now) * 1e-9);
+    printf("clocks    0x%x\n", pPage->clockMask);
+}
+
+static int usage(const char *name)
+{
+    fprintf(stderr, "usage: %s page init|status|rate factor|advance time\n", name);
+    return 2;
+}
+
+int main(int argc, char *argv[])
+{
+    struct pchecker_vclock_page *pPage;
+    const char *cmd;
+
+    if (argc < 3)
+        return usage(argv[0]);
+    cmd = argv[2];
+
+    if (strcmp(cmd, "init") == 0) {
+        pPage = mapPage(argv[1], 1);
+        if (!pPage)
+            return 1;
+        initPage(pPage);
+        return 0;
+    }
+
+    pPage = mapPage(argv[1], 0);
+    if (!pPage)
+        return 1;
+
+    if (strcmp(cmd, "status") == 0) {
+        printStatus(pPage);
+    }
+    else if (strcmp(cmd, "rate") == 0 && argc == 4) {
+        char *end;
+        double factor = strtod(argv[3], &end);
+        if (end == argv[3] || *end || factor < 0 || factor >= 1024) {
+            fprintf(stderr, "rate must be between 0 and 1024\n");
+            return 1;
+        }
+        update(pPage, (uint64_t)(factor * (double)PCHECKER_VCLOCK_RATE_ONE), 0);
+    }
+    else if (strcmp(cmd, "advance") == 0 && argc == 4) {
+        uint64_t ns;
+        if (!parseDuration(argv[3], &ns)) {
+            fprintf(stderr, "invalid time '%s'\n", argv[3]);
+            return 1;
+        }
+        update(pPage, UINT64_MAX, ns);
+    }
+    else
+        return usage(argv[0]);
+    return 0;
+}